@@ -0,0 +1,420 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <glob.h>
+#include <math.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define MB_AUTO_DEFAULT_INTERVAL	500
+#define MB_AUTO_DEFAULT_SMOOTHING	0.3
+#define MB_AUTO_DEFAULT_HYSTERESIS	0.1
+#define MB_AUTO_DEFAULT_MIN_STEP	0.02
+
+// below this the hysteresis band stays 1 lux wide, so sensor noise in a dark room does not move the backlight
+#define MB_AUTO_LUX_FLOOR			1.0
+
+static const MB_AUTO_POINT g_auto_default_curve[] =
+{
+	{ 0.0, 0.05 },
+	{ 10.0, 0.15 },
+	{ 50.0, 0.30 },
+	{ 200.0, 0.50 },
+	{ 1000.0, 0.80 },
+	{ 5000.0, 1.00 },
+};
+
+struct MBAuto
+{
+	MBBaseStruct* h;
+	MB_AUTO_CONFIG config;
+	std::vector<MB_AUTO_POINT> curve;
+
+	// lux = (raw + offset) * scale
+	int sensor_fd;
+	double scale;
+	double offset;
+
+	int timer_fd;
+	int stop_fd;
+	std::thread worker;
+
+	// moving average of the readings, the level the monitors currently follow, and what was last written per monitor
+	double filtered;
+	double accepted;
+	bool primed;
+	std::vector<double> written;
+
+	MBAuto()
+	{
+		h = nullptr;
+		memset(&config, 0, sizeof(config));
+		sensor_fd = timer_fd = stop_fd = -1;
+		scale = 1.0;
+		offset = 0.0;
+		filtered = accepted = 0.0;
+		primed = false;
+	}
+
+	~MBAuto()
+	{
+		for (int fd : { sensor_fd, timer_fd, stop_fd })
+		{
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+		}
+	}
+};
+
+static bool mb_auto_read_double(int fd, double* value)
+{
+	char buffer[64];
+	ssize_t size = pread(fd, buffer, sizeof(buffer) - 1, 0);
+	if (size <= 0)
+	{
+		mb_error_system(size < 0 ? errno : EIO);
+		return false;
+	}
+	buffer[size] = '\0';
+
+	char* end;
+	*value = strtod(buffer, &end);
+	if (end == buffer)
+	{
+		mb_error(MB_ERROR_DEVICE, L"illuminance sensor returned invalid data");
+		return false;
+	}
+	return true;
+}
+
+// an optional attribute next to the sensor file, e.g. in_illuminance_scale for in_illuminance_raw
+static bool mb_auto_read_sibling(const std::string& path, const char* suffix, double* value)
+{
+	std::string sibling = path.substr(0, path.size() - strlen("raw")) + suffix;
+	int fd = open(sibling.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return false;
+	}
+	bool ok = mb_auto_read_double(fd, value);
+	::close(fd);
+	return ok;
+}
+
+static std::string mb_auto_find_sensor()
+{
+	// a processed reading is already in lux, prefer it over a raw one
+	for (const char* pattern : { "/sys/bus/iio/devices/iio:device*/in_illuminance_input", "/sys/bus/iio/devices/iio:device*/in_illuminance_raw" })
+	{
+		glob_t found;
+		if (glob(pattern, 0, nullptr, &found) == 0 && found.gl_pathc > 0)
+		{
+			std::string path = found.gl_pathv[0];
+			globfree(&found);
+			return path;
+		}
+		globfree(&found);
+	}
+	return std::string();
+}
+
+static double mb_auto_curve(const std::vector<MB_AUTO_POINT>& curve, double lux)
+{
+	if (lux <= curve.front().lux)
+	{
+		return curve.front().percent;
+	}
+	for (size_t i = 1; i < curve.size(); i++)
+	{
+		if (lux < curve[i].lux)
+		{
+			const MB_AUTO_POINT& a = curve[i - 1];
+			const MB_AUTO_POINT& b = curve[i];
+			return a.percent + (b.percent - a.percent) * (lux - a.lux) / (b.lux - a.lux);
+		}
+	}
+	return curve.back().percent;
+}
+
+static void mb_auto_step(MBAuto* a)
+{
+	double raw;
+	if (!mb_auto_read_double(a->sensor_fd, &raw))
+	{
+		// a sensor that failed once is read again on the next tick
+		return;
+	}
+	double lux = (raw + a->offset) * a->scale;
+	lux = lux > 0.0 ? lux : 0.0;
+
+	if (!a->primed)
+	{
+		a->filtered = a->accepted = lux;
+		a->primed = true;
+	}
+	else
+	{
+		a->filtered += a->config.smoothing * (lux - a->filtered);
+
+		// the backlight only follows a change that leaves the band around the level it follows now
+		double band = a->config.hysteresis * (a->accepted > MB_AUTO_LUX_FLOOR ? a->accepted : MB_AUTO_LUX_FLOOR);
+		if (fabs(a->filtered - a->accepted) <= band)
+		{
+			return;
+		}
+		a->accepted = a->filtered;
+	}
+
+	double percent = mb_auto_curve(a->curve, a->accepted);
+	unsigned long count = a->h->count();
+	a->written.resize(count, -1.0);
+	for (unsigned long i = 0; i < count; i++)
+	{
+		// small changes are not worth a device write, a monitor seen for the first time always gets one
+		if (a->written[i] >= 0.0 && fabs(percent - a->written[i]) < a->config.min_step)
+		{
+			continue;
+		}
+		if (a->h->monitors[i]->state != MB_MONITOR_READY)
+		{
+			continue;
+		}
+
+		if (a->config.ramp > 0)
+		{
+			if (!mb_ramp_start(a->h, i, percent, a->config.ramp, MB_EASE_IN_OUT))
+			{
+				continue;
+			}
+		}
+		else
+		{
+			if (a->h->monitors[i]->ramping)
+			{
+				mb_ramp_cancel(a->h, i);
+			}
+			mb_monitor_submit(a->h, i, percent);
+		}
+		a->written[i] = percent;
+	}
+}
+
+static void mb_auto_run(MBAuto* a)
+{
+	for (;;)
+	{
+		// the thread sleeps in poll() between ticks, there is no busy wait
+		struct pollfd fds[2] = { { a->stop_fd, POLLIN, 0 }, { a->timer_fd, POLLIN, 0 } };
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if (fds[0].revents != 0)
+		{
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			// missed ticks are not made up, only the current light level matters
+			uint64_t expirations;
+			if (read(a->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			{
+				mb_auto_step(a);
+			}
+		}
+	}
+}
+
+static MBAuto* mb_auto_create(MBBaseStruct* h, const MB_AUTO_CONFIG* config)
+{
+	std::unique_ptr<MBAuto> a = std::make_unique<MBAuto>();
+	a->h = h;
+	a->config = *config;
+	if (a->config.interval == 0)
+	{
+		a->config.interval = MB_AUTO_DEFAULT_INTERVAL;
+	}
+	if (a->config.smoothing == 0.0)
+	{
+		a->config.smoothing = MB_AUTO_DEFAULT_SMOOTHING;
+	}
+	if (a->config.hysteresis == 0.0)
+	{
+		a->config.hysteresis = MB_AUTO_DEFAULT_HYSTERESIS;
+	}
+	if (a->config.min_step == 0.0)
+	{
+		a->config.min_step = MB_AUTO_DEFAULT_MIN_STEP;
+	}
+	if (a->config.smoothing < 0.0 || a->config.smoothing > 1.0 || a->config.hysteresis < 0.0 || a->config.min_step < 0.0 || a->config.min_step > 1.0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"smoothing, hysteresis or min_step out of range");
+		return nullptr;
+	}
+
+	if (config->curve != nullptr)
+	{
+		a->curve.assign(config->curve, config->curve + config->curve_length);
+	}
+	else
+	{
+		a->curve.assign(std::begin(g_auto_default_curve), std::end(g_auto_default_curve));
+	}
+	if (a->curve.empty())
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"curve is empty");
+		return nullptr;
+	}
+	for (size_t i = 0; i < a->curve.size(); i++)
+	{
+		if (a->curve[i].percent < 0.0 || a->curve[i].percent > 1.0 || (i > 0 && a->curve[i].lux <= a->curve[i - 1].lux))
+		{
+			mb_error(MB_ERROR_INVALID_ARGUMENT, L"curve must be sorted by lux with percent in 0 .. 1");
+			return nullptr;
+		}
+	}
+
+	std::string path = config->sensor != nullptr ? config->sensor : mb_auto_find_sensor();
+	if (path.empty())
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"no illuminance sensor found");
+		return nullptr;
+	}
+	a->sensor_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (a->sensor_fd < 0)
+	{
+		mb_error_system(errno);
+		return nullptr;
+	}
+
+	// a raw IIO channel comes with its scale and offset, a processed one or a plain file is taken as lux
+	a->scale = config->scale;
+	if (a->scale == 0.0)
+	{
+		bool raw = path.size() >= 3 && path.compare(path.size() - 3, 3, "raw") == 0;
+		if (!raw || !mb_auto_read_sibling(path, "scale", &a->scale))
+		{
+			a->scale = 1.0;
+		}
+		if (raw)
+		{
+			mb_auto_read_sibling(path, "offset", &a->offset);
+		}
+	}
+
+	// fail now rather than on the loop thread if the sensor can't be read
+	double value;
+	if (!mb_auto_read_double(a->sensor_fd, &value))
+	{
+		return nullptr;
+	}
+
+	a->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	a->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (a->timer_fd < 0 || a->stop_fd < 0)
+	{
+		mb_error_system(errno);
+		return nullptr;
+	}
+
+	// the first tick fires at once, so the monitors follow the room right after start
+	struct itimerspec timer;
+	timer.it_interval.tv_sec = a->config.interval / 1000;
+	timer.it_interval.tv_nsec = (long)(a->config.interval % 1000) * 1000000;
+	timer.it_value.tv_sec = 0;
+	timer.it_value.tv_nsec = 1;
+	if (timerfd_settime(a->timer_fd, 0, &timer, nullptr) != 0)
+	{
+		mb_error_system(errno);
+		return nullptr;
+	}
+
+	a->worker = std::thread(mb_auto_run, a.get());
+	return a.release();
+}
+
+void mb_auto_release(MBBaseStruct* h)
+{
+	MBAuto* a;
+	{
+		std::lock_guard<std::mutex> auto_guard(h->auto_lock);
+		a = h->auto_loop;
+		h->auto_loop = nullptr;
+	}
+	if (a == nullptr)
+	{
+		return;
+	}
+
+	uint64_t one = 1;
+	if (write(a->stop_fd, &one, sizeof(one)) != sizeof(one))
+	{
+		mb_error_system(errno);
+	}
+	a->worker.join();
+	delete a;
+}
+
+MB_FUNCTION long MB_CONV mb_auto_start(void* handle, const MB_AUTO_CONFIG* config)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	if (config == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"config is nullptr");
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> auto_guard(h->auto_lock);
+	if (h->auto_loop != nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"auto brightness already running");
+		return 0;
+	}
+	h->auto_loop = mb_auto_create(h, config);
+	return h->auto_loop != nullptr ? 1 : 0;
+}
+
+MB_FUNCTION long MB_CONV mb_auto_stop(void* handle)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	mb_auto_release(h);
+	return 1;
+}
+#else
+void mb_auto_release(MBBaseStruct* h)
+{
+}
+#endif
@@ -0,0 +1,723 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#ifdef __linux__
+#include <math.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MB_BROKER_VERSION			1
+
+// every request is one fixed size frame and gets one reply, in host byte order since both ends share the machine
+#define MB_BROKER_OP_HELLO			1
+#define MB_BROKER_OP_NAME			2
+#define MB_BROKER_OP_GET			3
+#define MB_BROKER_OP_SET			4
+
+// the raw range a client monitor presents to its common layer, percent travels as a double on the wire
+#define MB_BROKER_RANGE				65535
+
+#define MB_BROKER_MAX_NAME			256
+#define MB_BROKER_MAX_CONNECTIONS	256
+
+struct MBBrokerRequest
+{
+	uint8_t op;
+	uint8_t reserved[3];
+	uint32_t index;
+	double percent;
+};
+
+// a NAME reply is followed by count characters as uint32_t
+struct MBBrokerReply
+{
+	uint8_t op;
+	uint8_t reserved[3];
+	int32_t code;
+	int32_t system;
+	uint32_t count;
+	double percent;
+};
+
+static_assert(sizeof(MBBrokerRequest) == 16, "broker request frame changed");
+static_assert(sizeof(MBBrokerReply) == 24, "broker reply frame changed");
+
+static bool mb_broker_send(int fd, const void* data, size_t length)
+{
+	const char* bytes = (const char*)data;
+	while (length > 0)
+	{
+		ssize_t size = send(fd, bytes, length, MSG_NOSIGNAL);
+		if (size < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (size <= 0)
+		{
+			return false;
+		}
+		bytes += size;
+		length -= (size_t)size;
+	}
+	return true;
+}
+
+// false with errno 0 when the other end closed the connection
+static bool mb_broker_receive(int fd, void* data, size_t length)
+{
+	char* bytes = (char*)data;
+	while (length > 0)
+	{
+		ssize_t size = recv(fd, bytes, length, MSG_WAITALL);
+		if (size < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (size <= 0)
+		{
+			if (size == 0)
+			{
+				errno = 0;
+			}
+			return false;
+		}
+		bytes += size;
+		length -= (size_t)size;
+	}
+	return true;
+}
+
+// the default socket lives in a directory only its user can enter, so nobody else can serve on it first.
+// $XDG_RUNTIME_DIR is one, without it the directory in /tmp is only used when it is ours and closed to others
+static bool mb_broker_path(const char* path, std::string* result)
+{
+	if (path != nullptr)
+	{
+		*result = path;
+		return true;
+	}
+	const char* runtime = getenv("XDG_RUNTIME_DIR");
+	if (runtime != nullptr && runtime[0] != '\0')
+	{
+		*result = std::string(runtime) + "/mon_brightness.sock";
+		return true;
+	}
+
+	std::string directory = "/tmp/mon_brightness-" + std::to_string(getuid());
+	struct stat info;
+	if ((mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) || lstat(directory.c_str(), &info) != 0 ||
+		!S_ISDIR(info.st_mode) || info.st_uid != getuid() || (info.st_mode & 077) != 0)
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"no private directory for the broker socket");
+		return false;
+	}
+	*result = directory + "/broker.sock";
+	return true;
+}
+
+static bool mb_broker_address(const std::string& path, struct sockaddr_un* address)
+{
+	if (path.size() >= sizeof(address->sun_path))
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"socket path too long");
+		return false;
+	}
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	memcpy(address->sun_path, path.c_str(), path.size());
+	return true;
+}
+
+static int mb_broker_dial(const std::string& path)
+{
+	struct sockaddr_un address;
+	if (!mb_broker_address(path, &address))
+	{
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		mb_error_system(errno);
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+	{
+		mb_error_system(errno);
+		::close(fd);
+		return -1;
+	}
+
+	// a client takes the daemon's word for its monitors, so the daemon has to be running as the same user
+	struct ucred peer;
+	socklen_t length = sizeof(peer);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 || peer.uid != getuid())
+	{
+		mb_error_system(EACCES);
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// ---- daemon side ----
+
+// combines the writes clients send to one monitor: whoever finds no write running writes the newest value,
+// everyone who asked meanwhile is answered by that write, so a burst from several clients costs one bus transaction
+struct MBBrokerSlot
+{
+	std::mutex lock;
+	std::condition_variable cv;
+	uint64_t requested;
+	uint64_t done;
+	double value;
+	bool busy;
+	long result;
+	MBError error;
+
+	MBBrokerSlot()
+	{
+		requested = done = 0;
+		value = 0.0;
+		busy = false;
+		result = 0;
+		error = MBError{ MB_ERROR_NONE, 0, nullptr };
+	}
+};
+
+struct MBBrokerConnection
+{
+	int fd;
+	std::thread worker;
+	std::atomic<bool> finished;
+};
+
+struct MBBroker
+{
+	MBBrokerSlot slots[MB_MAX_MONITORS];
+
+	MBBaseStruct* h;
+	std::string path;
+	int listen_fd;
+	int stop_fd;
+	std::thread acceptor;
+
+	// connections are reaped by the acceptor once their client is gone, the rest are shut down on stop
+	std::mutex connection_lock;
+	std::vector<std::unique_ptr<MBBrokerConnection>> connections;
+
+	MBBroker()
+	{
+		h = nullptr;
+		listen_fd = stop_fd = -1;
+	}
+
+	~MBBroker()
+	{
+		for (int fd : { listen_fd, stop_fd })
+		{
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+		}
+	}
+};
+
+static long mb_broker_set(MBBroker* b, unsigned long index, double percent)
+{
+	if (index >= b->h->count() || index >= MB_MAX_MONITORS)
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBBrokerSlot& slot = b->slots[index];
+
+	std::unique_lock<std::mutex> slot_guard(slot.lock);
+	uint64_t ticket = ++slot.requested;
+	slot.value = percent;
+	while (slot.done < ticket)
+	{
+		if (slot.busy)
+		{
+			slot.cv.wait(slot_guard);
+			continue;
+		}
+
+		slot.busy = true;
+		uint64_t upto = slot.requested;
+		uint64_t skipped = upto - slot.done - 1;
+		double value = slot.value;
+		slot_guard.unlock();
+
+		if (skipped > 0)
+		{
+			mb_stats_add(b->h->monitors[index]->stats.dropped, skipped);
+		}
+		bool written;
+		long result = mb_driver_set_changed(b->h, index, value, &written);
+		MBError error = mb_error_save();
+
+		slot_guard.lock();
+		slot.busy = false;
+		slot.done = upto;
+		slot.result = result;
+		slot.error = error;
+		slot.cv.notify_all();
+	}
+
+	// a request that was folded into a later write reports how that write went
+	if (!slot.result)
+	{
+		mb_error_restore(slot.error);
+	}
+	return slot.result;
+}
+
+static bool mb_broker_serve_one(MBBroker* b, int fd, const MBBrokerRequest& request)
+{
+	MBBrokerReply reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.op = request.op;
+	std::vector<uint32_t> name;
+
+	long ok = 1;
+	switch (request.op)
+	{
+	case MB_BROKER_OP_HELLO:
+		if (request.index != MB_BROKER_VERSION)
+		{
+			mb_error(MB_ERROR_NOT_SUPPORTED, L"broker protocol version mismatch");
+			ok = 0;
+			break;
+		}
+		reply.count = b->h->count();
+		break;
+
+	case MB_BROKER_OP_NAME:
+	{
+		if (request.index >= b->h->count())
+		{
+			mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+			ok = 0;
+			break;
+		}
+		WCHAR buffer[MB_BROKER_MAX_NAME];
+		long length = mb_driver_get_name(b->h, request.index, buffer, MB_BROKER_MAX_NAME);
+		length = length < MB_BROKER_MAX_NAME ? length : MB_BROKER_MAX_NAME;
+		name.assign(buffer, buffer + (length > 0 ? length : 0));
+		reply.count = (uint32_t)name.size();
+		break;
+	}
+
+	case MB_BROKER_OP_GET:
+		// answered from the daemon's shadow while it is fresh, so clients polling a monitor never reach the bus
+		ok = mb_driver_get(b->h, request.index, &reply.percent);
+		break;
+
+	case MB_BROKER_OP_SET:
+		ok = mb_broker_set(b, request.index, request.percent);
+		break;
+
+	default:
+		mb_error(MB_ERROR_NOT_SUPPORTED, L"unknown broker request");
+		ok = 0;
+		break;
+	}
+
+	if (!ok)
+	{
+		MBError error = mb_error_save();
+		reply.code = (int32_t)error.code;
+		reply.system = (int32_t)error.system;
+	}
+	return mb_broker_send(fd, &reply, sizeof(reply)) && (name.empty() || mb_broker_send(fd, name.data(), name.size() * sizeof(uint32_t)));
+}
+
+static void mb_broker_connection_run(MBBroker* b, MBBrokerConnection* connection)
+{
+	// a client talks to one monitor per connection, so this thread waits on at most one strand at a time
+	MBBrokerRequest request;
+	while (mb_broker_receive(connection->fd, &request, sizeof(request)))
+	{
+		if (!mb_broker_serve_one(b, connection->fd, request))
+		{
+			break;
+		}
+	}
+	connection->finished = true;
+}
+
+static void mb_broker_reap(MBBroker* b, bool all)
+{
+	std::vector<std::unique_ptr<MBBrokerConnection>> gone;
+	{
+		std::lock_guard<std::mutex> connection_guard(b->connection_lock);
+		for (size_t i = 0; i < b->connections.size();)
+		{
+			if (all || b->connections[i]->finished)
+			{
+				gone.push_back(std::move(b->connections[i]));
+				b->connections.erase(b->connections.begin() + i);
+				continue;
+			}
+			i++;
+		}
+	}
+
+	// shutdown wakes a thread blocked in recv, one waiting on a monitor finishes its request first
+	for (auto& connection : gone)
+	{
+		shutdown(connection->fd, SHUT_RDWR);
+		connection->worker.join();
+		::close(connection->fd);
+	}
+}
+
+static void mb_broker_accept_run(MBBroker* b)
+{
+	for (;;)
+	{
+		struct pollfd fds[2] = { { b->stop_fd, POLLIN, 0 }, { b->listen_fd, POLLIN, 0 } };
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if (fds[0].revents != 0)
+		{
+			break;
+		}
+		if ((fds[1].revents & POLLIN) == 0)
+		{
+			continue;
+		}
+
+		int fd = accept4(b->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			continue;
+		}
+		mb_broker_reap(b, false);
+
+		std::lock_guard<std::mutex> connection_guard(b->connection_lock);
+		if (b->connections.size() >= MB_BROKER_MAX_CONNECTIONS)
+		{
+			::close(fd);
+			continue;
+		}
+		std::unique_ptr<MBBrokerConnection> connection = std::make_unique<MBBrokerConnection>();
+		connection->fd = fd;
+		connection->finished = false;
+		connection->worker = std::thread(mb_broker_connection_run, b, connection.get());
+		b->connections.push_back(std::move(connection));
+	}
+}
+
+static MBBroker* mb_broker_create(MBBaseStruct* h, const char* socket_path)
+{
+	std::unique_ptr<MBBroker> b = std::make_unique<MBBroker>();
+	b->h = h;
+
+	struct sockaddr_un address;
+	if (!mb_broker_path(socket_path, &b->path) || !mb_broker_address(b->path, &address))
+	{
+		return nullptr;
+	}
+
+	// a socket file nobody answers on is left over from a daemon that died, one that answers belongs to a live one
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe >= 0)
+	{
+		bool live = connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0;
+		::close(probe);
+		if (live)
+		{
+			mb_error(MB_ERROR_IN_USE, L"another broker is serving this socket");
+			return nullptr;
+		}
+	}
+	unlink(b->path.c_str());
+
+	b->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	b->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (b->listen_fd < 0 || b->stop_fd < 0 ||
+		bind(b->listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+		listen(b->listen_fd, SOMAXCONN) != 0)
+	{
+		mb_error_system(errno);
+		return nullptr;
+	}
+
+	b->acceptor = std::thread(mb_broker_accept_run, b.get());
+	return b.release();
+}
+
+void mb_broker_release(MBBaseStruct* h)
+{
+	MBBroker* b;
+	{
+		std::lock_guard<std::mutex> broker_guard(h->broker_lock);
+		b = h->broker;
+		h->broker = nullptr;
+	}
+	if (b == nullptr)
+	{
+		return;
+	}
+
+	uint64_t one = 1;
+	if (write(b->stop_fd, &one, sizeof(one)) != sizeof(one))
+	{
+		mb_error_system(errno);
+	}
+	b->acceptor.join();
+	mb_broker_reap(b, true);
+	unlink(b->path.c_str());
+	delete b;
+}
+
+MB_FUNCTION long MB_CONV mb_broker_serve(void* handle, const char* socket_path)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> broker_guard(h->broker_lock);
+	if (h->broker != nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"handle is already served");
+		return 0;
+	}
+	h->broker = mb_broker_create(h, socket_path);
+	return h->broker != nullptr ? 1 : 0;
+}
+
+MB_FUNCTION long MB_CONV mb_broker_stop(void* handle)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	mb_broker_release(h);
+	return 1;
+}
+
+// ---- client side ----
+
+// a handle whose monitors live in a broker daemon, every common function works on it
+struct MBBrokerStruct : public MBBaseStruct
+{
+public:
+	std::string path;
+	std::vector<std::wstring> names;
+
+	// one connection per monitor, opened on first use and only used on that monitor's strand,
+	// so calls on different monitors run side by side in the daemon too
+	std::vector<int> connections;
+
+	MBBrokerStruct()
+	{
+		type = MB_TYPE_BROKER;
+	}
+
+	unsigned long enumerate() override
+	{
+		return (unsigned long)names.size();
+	}
+
+	bool get_range(unsigned long index, unsigned long* min, unsigned long* max) override
+	{
+		*min = 0;
+		*max = MB_BROKER_RANGE;
+		return true;
+	}
+
+	bool call(unsigned long index, uint8_t op, double percent, MBBrokerReply* reply)
+	{
+		int& fd = connections[index];
+		if (fd < 0)
+		{
+			fd = mb_broker_dial(path);
+			if (fd < 0)
+			{
+				return false;
+			}
+		}
+
+		MBBrokerRequest request;
+		memset(&request, 0, sizeof(request));
+		request.op = op;
+		request.index = (uint32_t)index;
+		request.percent = percent;
+		if (!mb_broker_send(fd, &request, sizeof(request)) || !mb_broker_receive(fd, reply, sizeof(*reply)))
+		{
+			// the daemon went away, the next call dials again
+			mb_error_system(errno != 0 ? errno : ECONNRESET);
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+		MBStats& stats = monitors[index]->stats;
+		mb_stats_add(stats.bytes_sent, sizeof(request));
+		mb_stats_add(stats.bytes_received, sizeof(*reply));
+
+		if (reply->code == MB_ERROR_SYSTEM)
+		{
+			mb_error_system(reply->system);
+			return false;
+		}
+		if (reply->code != MB_ERROR_NONE)
+		{
+			mb_error(reply->code, nullptr);
+			return false;
+		}
+		return true;
+	}
+
+	bool get(unsigned long index, unsigned long* value) override
+	{
+		MBBrokerReply reply;
+		if (!call(index, MB_BROKER_OP_GET, 0.0, &reply))
+		{
+			return false;
+		}
+		*value = (unsigned long)lround(reply.percent * MB_BROKER_RANGE);
+		return true;
+	}
+
+	bool set(unsigned long index, unsigned long value) override
+	{
+		MBBrokerReply reply;
+		return call(index, MB_BROKER_OP_SET, (double)value / MB_BROKER_RANGE, &reply);
+	}
+
+	long name(unsigned long index, WCHAR* monitor_name, unsigned long max_length) override
+	{
+		const std::wstring& name = names[index];
+		if (monitor_name != nullptr)
+		{
+			for (size_t i = 0; i < name.length() && i < max_length; i++)
+			{
+				monitor_name[i] = name[i];
+			}
+		}
+		return (long)name.length();
+	}
+
+	void close() override
+	{
+		for (int fd : connections)
+		{
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+		}
+	}
+};
+
+// the monitor list is read once over a control connection, names never change while the daemon runs
+static bool mb_broker_handshake(int fd, std::vector<std::wstring>& names)
+{
+	MBBrokerRequest request;
+	MBBrokerReply reply;
+	memset(&request, 0, sizeof(request));
+	request.op = MB_BROKER_OP_HELLO;
+	request.index = MB_BROKER_VERSION;
+	if (!mb_broker_send(fd, &request, sizeof(request)) || !mb_broker_receive(fd, &reply, sizeof(reply)))
+	{
+		mb_error_system(errno != 0 ? errno : ECONNRESET);
+		return false;
+	}
+	if (reply.code != MB_ERROR_NONE)
+	{
+		mb_error(reply.code, nullptr);
+		return false;
+	}
+
+	unsigned long count = reply.count < MB_MAX_MONITORS ? reply.count : MB_MAX_MONITORS;
+	for (unsigned long i = 0; i < count; i++)
+	{
+		request.op = MB_BROKER_OP_NAME;
+		request.index = (uint32_t)i;
+		if (!mb_broker_send(fd, &request, sizeof(request)) || !mb_broker_receive(fd, &reply, sizeof(reply)))
+		{
+			mb_error_system(errno != 0 ? errno : ECONNRESET);
+			return false;
+		}
+		uint32_t name[MB_BROKER_MAX_NAME];
+		uint32_t length = reply.code == MB_ERROR_NONE && reply.count <= MB_BROKER_MAX_NAME ? reply.count : 0;
+		if (!mb_broker_receive(fd, name, length * sizeof(uint32_t)))
+		{
+			mb_error_system(errno != 0 ? errno : ECONNRESET);
+			return false;
+		}
+		names.push_back(std::wstring(name, name + length));
+	}
+	return true;
+}
+
+MB_FUNCTION long MB_CONV mb_broker_init(void** handle, const char* socket_path)
+{
+	std::string path;
+	int fd = mb_broker_path(socket_path, &path) ? mb_broker_dial(path) : -1;
+	if (fd < 0)
+	{
+		return 0;
+	}
+	std::vector<std::wstring> names;
+	bool ok = mb_broker_handshake(fd, names);
+	::close(fd);
+	if (!ok)
+	{
+		return 0;
+	}
+
+	if (names.size() == 0)
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"broker has no monitors");
+	}
+
+	if (handle != nullptr)
+	{
+		MBBrokerStruct* h = new MBBrokerStruct();
+		h->path = path;
+		h->names = std::move(names);
+		h->connections.assign(h->names.size(), -1);
+		if (!mb_driver_attach(h, handle))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+#else
+void mb_broker_release(MBBaseStruct* h)
+{
+}
+#endif
@@ -0,0 +1,338 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MB_CACHE_MAGIC		0x4343424Du	// "MBCC"
+#define MB_CACHE_VERSION	2
+
+// file layout: the header, then count records sorted by id, mapped and searched in place. Everything is in host byte
+// order, a file from a machine of the other order fails the magic check and is rebuilt
+struct MBCacheHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t count;
+	uint32_t checksum;
+};
+
+static std::mutex g_cache_lock;
+static std::string g_cache_path;
+
+// serializes the stores of this process, they share one temporary file name. MBCacheFileLock does the same between
+// processes, each store must merge what the one before it renamed into place
+static std::mutex g_cache_store_lock;
+
+uint64_t mb_hash64(const void* data, size_t length, uint64_t hash)
+{
+	// FNV-1a
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+static uint32_t mb_cache_checksum(const MBCacheRecord* records, uint32_t count)
+{
+	uint64_t hash = mb_hash64(records, sizeof(MBCacheRecord) * count, MB_HASH64_INIT);
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static std::string mb_cache_path()
+{
+	std::lock_guard<std::mutex> guard(g_cache_lock);
+	return g_cache_path;
+}
+
+MBCacheView::MBCacheView()
+{
+	records = nullptr;
+	count = 0;
+	data = nullptr;
+	size = 0;
+#ifdef _WIN32
+	mapping = nullptr;
+#endif
+}
+
+MBCacheView::~MBCacheView()
+{
+	if (data == nullptr)
+	{
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+#else
+	munmap(data, size);
+#endif
+}
+
+bool MBCacheView::open()
+{
+	std::string path = mb_cache_path();
+	if (path.empty())
+	{
+		return false;
+	}
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < (LONGLONG)sizeof(MBCacheHeader))
+	{
+		CloseHandle(file);
+		return false;
+	}
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr)
+	{
+		return false;
+	}
+	data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr)
+	{
+		CloseHandle(mapping);
+		mapping = nullptr;
+		return false;
+	}
+	size = (size_t)file_size.QuadPart;
+#else
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(MBCacheHeader))
+	{
+		::close(fd);
+		return false;
+	}
+	void* mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		return false;
+	}
+	data = mapped;
+	size = (size_t)st.st_size;
+#endif
+
+	// a file from another version, a torn write or a foreign file is ignored and rewritten after probing
+	const MBCacheHeader* header = (const MBCacheHeader*)data;
+	const MBCacheRecord* file_records = (const MBCacheRecord*)(header + 1);
+	if (header->magic != MB_CACHE_MAGIC || header->version != MB_CACHE_VERSION || header->record_size != sizeof(MBCacheRecord) ||
+		size != sizeof(MBCacheHeader) + (size_t)header->count * sizeof(MBCacheRecord) ||
+		header->checksum != mb_cache_checksum(file_records, header->count))
+	{
+		return false;
+	}
+	for (uint32_t i = 1; i < header->count; i++)
+	{
+		if (file_records[i - 1].id >= file_records[i].id)
+		{
+			return false;
+		}
+	}
+
+	records = file_records;
+	count = header->count;
+	return true;
+}
+
+const MBCacheRecord* MBCacheView::find(uint64_t id) const
+{
+	const MBCacheRecord* end = records + count;
+	const MBCacheRecord* record = std::lower_bound(records, end, id, [](const MBCacheRecord& r, uint64_t value) { return r.id < value; });
+	if (record == end || record->id != id)
+	{
+		return nullptr;
+	}
+	return record;
+}
+
+// an exclusive lock on <path>.lock for as long as it lives. The cache file itself is replaced by every store, so it
+// can not carry the lock. Without a lock file the store goes ahead unlocked, the cache only saves time
+struct MBCacheFileLock
+{
+#ifdef _WIN32
+	HANDLE file;
+
+	explicit MBCacheFileLock(const std::string& path)
+	{
+		file = CreateFileA((path + ".lock").c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		OVERLAPPED overlapped = {};
+		if (file != INVALID_HANDLE_VALUE && !LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped))
+		{
+			CloseHandle(file);
+			file = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	~MBCacheFileLock()
+	{
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			OVERLAPPED overlapped = {};
+			UnlockFileEx(file, 0, 1, 0, &overlapped);
+			CloseHandle(file);
+		}
+	}
+#else
+	int fd;
+
+	explicit MBCacheFileLock(const std::string& path)
+	{
+		fd = ::open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		while (fd >= 0 && flock(fd, LOCK_EX) != 0)
+		{
+			if (errno != EINTR)
+			{
+				::close(fd);
+				fd = -1;
+			}
+		}
+	}
+
+	// closing the file releases the lock, the file stays so every store locks the same one
+	~MBCacheFileLock()
+	{
+		if (fd >= 0)
+		{
+			::close(fd);
+		}
+	}
+#endif
+
+	MBCacheFileLock(const MBCacheFileLock&) = delete;
+	MBCacheFileLock& operator=(const MBCacheFileLock&) = delete;
+};
+
+// fill in what the newer record does not know from an older one
+static void mb_cache_merge(MBCacheRecord& newer, const MBCacheRecord& older)
+{
+	const uint32_t brightness = MB_CACHE_RANGE | MB_CACHE_NO_BRIGHTNESS;
+	if (!(newer.flags & brightness) && (older.flags & brightness))
+	{
+		newer.min = older.min;
+		newer.max = older.max;
+		newer.flags |= older.flags & brightness;
+	}
+	if (!(newer.flags & MB_CACHE_TIMING) && (older.flags & MB_CACHE_TIMING))
+	{
+		newer.reply_delay_us = older.reply_delay_us;
+		newer.reply_failed_us = older.reply_failed_us;
+		newer.command_delay_us = older.command_delay_us;
+		newer.command_failed_us = older.command_failed_us;
+		newer.flags |= MB_CACHE_TIMING;
+	}
+}
+
+void mb_cache_store(const std::vector<MBCacheRecord>& updates)
+{
+	if (updates.empty())
+	{
+		return;
+	}
+	std::string path = mb_cache_path();
+	if (path.empty())
+	{
+		return;
+	}
+
+	// merge with what other processes stored meanwhile, newer records win for the parts they carry
+	std::lock_guard<std::mutex> store_guard(g_cache_store_lock);
+	MBCacheFileLock file_lock(path);
+	std::vector<MBCacheRecord> records(updates);
+	{
+		MBCacheView view;
+		if (view.open())
+		{
+			records.insert(records.end(), view.records, view.records + view.count);
+		}
+	}
+	std::stable_sort(records.begin(), records.end(), [](const MBCacheRecord& a, const MBCacheRecord& b) { return a.id < b.id; });
+	size_t kept = 0;
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		if (kept == 0 || records[kept - 1].id != records[i].id)
+		{
+			records[kept++] = records[i];
+			continue;
+		}
+		mb_cache_merge(records[kept - 1], records[i]);
+	}
+	records.resize(kept);
+
+	MBCacheHeader header;
+	header.magic = MB_CACHE_MAGIC;
+	header.version = MB_CACHE_VERSION;
+	header.record_size = sizeof(MBCacheRecord);
+	header.count = (uint32_t)records.size();
+	header.checksum = mb_cache_checksum(records.data(), header.count);
+
+	// write a private file and rename it over the cache, so readers never see a partial file
+#ifdef _WIN32
+	std::string temp_path = path + "." + std::to_string(GetCurrentProcessId()) + ".tmp";
+#else
+	std::string temp_path = path + "." + std::to_string(getpid()) + ".tmp";
+#endif
+	FILE* file = fopen(temp_path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		return;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(records.data(), sizeof(MBCacheRecord), records.size(), file) == records.size();
+	ok = fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+	ok = ok && MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+	ok = ok && rename(temp_path.c_str(), path.c_str()) == 0;
+#endif
+	if (!ok)
+	{
+		remove(temp_path.c_str());
+	}
+}
+
+MB_FUNCTION long MB_CONV mb_set_capability_cache(const char* path)
+{
+	std::lock_guard<std::mutex> guard(g_cache_lock);
+	g_cache_path = path != nullptr ? path : "";
+	return 1;
+}
@@ -0,0 +1,169 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <algorithm>
+
+#include <math.h>
+
+// percent in 1/65536 steps: the high bits pick the table entry, the low bits interpolate to the next one
+#define MB_LUT_FRACTION_BITS	(16 - MB_LUT_BITS)
+
+// fraction of the raw range at percent, before it is scaled to the monitor
+static double mb_calibration_level(long curve, const std::vector<MB_CALIBRATION_POINT>& points, double percent)
+{
+	switch (curve)
+	{
+	case MB_CURVE_PERCEPTUAL:
+	{
+		// percent is CIE L* / 100, the level is relative luminance, assuming the panel's output is linear in its raw value
+		double lightness = percent * 100.0;
+		if (lightness <= 8.0)
+		{
+			return lightness / 903.3;
+		}
+		double root = (lightness + 16.0) / 116.0;
+		return root * root * root;
+	}
+	case MB_CURVE_POINTS:
+	{
+		if (percent <= points.front().percent)
+		{
+			return points.front().level;
+		}
+		for (size_t i = 1; i < points.size(); i++)
+		{
+			if (percent < points[i].percent)
+			{
+				const MB_CALIBRATION_POINT& a = points[i - 1];
+				const MB_CALIBRATION_POINT& b = points[i];
+				return a.level + (b.level - a.level) * (percent - a.percent) / (b.percent - a.percent);
+			}
+		}
+		return points.back().level;
+	}
+	default:
+		return percent;
+	}
+}
+
+void mb_monitor_calibrate(MBMonitor& monitor)
+{
+	monitor.lut.resize(MB_LUT_SIZE + 1);
+	double span = monitor.max > monitor.min ? (double)(monitor.max - monitor.min) : 0.0;
+	for (unsigned int i = 0; i <= MB_LUT_SIZE; i++)
+	{
+		double level = mb_calibration_level(monitor.curve, monitor.curve_points, (double)i / MB_LUT_SIZE);
+		level = level < 0.0 ? 0.0 : (level > 1.0 ? 1.0 : level);
+		monitor.lut[i] = (uint32_t)lround(monitor.min + level * span);
+	}
+}
+
+unsigned long mb_monitor_value(const MBMonitor& monitor, double percent)
+{
+	uint32_t position = (uint32_t)lround(percent * 65536.0);
+	uint32_t i = position >> MB_LUT_FRACTION_BITS;
+	if (i >= MB_LUT_SIZE)
+	{
+		return monitor.lut[MB_LUT_SIZE];
+	}
+
+	// entries never decrease, so the step to the next one is non negative
+	uint32_t fraction = position & ((1u << MB_LUT_FRACTION_BITS) - 1);
+	uint64_t step = (uint64_t)(monitor.lut[i + 1] - monitor.lut[i]) * fraction;
+	return monitor.lut[i] + (unsigned long)((step + (1u << (MB_LUT_FRACTION_BITS - 1))) >> MB_LUT_FRACTION_BITS);
+}
+
+double mb_monitor_percent(const MBMonitor& monitor, unsigned long value)
+{
+	const uint32_t* begin = monitor.lut.data();
+	const uint32_t* end = begin + monitor.lut.size();
+	auto range = std::equal_range(begin, end, (uint32_t)value);
+
+	// a value the table hits answers with the middle of the percents that produce it, except that the ends of the
+	// range read back as exactly 0 and 1, which map onto them again
+	if (range.first != range.second)
+	{
+		if (range.first == begin)
+		{
+			return 0.0;
+		}
+		if (range.second == end)
+		{
+			return 1.0;
+		}
+		return ((range.first - begin) + (range.second - begin) - 1) / (2.0 * MB_LUT_SIZE);
+	}
+	if (range.first == begin)
+	{
+		return 0.0;
+	}
+	if (range.first == end)
+	{
+		return 1.0;
+	}
+
+	// between two entries, e.g. a value set by another program, interpolate
+	size_t i = range.first - begin;
+	double fraction = (double)(value - begin[i - 1]) / (double)(begin[i] - begin[i - 1]);
+	return ((double)(i - 1) + fraction) / MB_LUT_SIZE;
+}
+
+MB_FUNCTION long MB_CONV mb_set_calibration(void* handle, unsigned long index, long curve, const MB_CALIBRATION_POINT* points, unsigned long count)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	if (curve < MB_CURVE_LINEAR || curve > MB_CURVE_POINTS)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"unknown curve");
+		return 0;
+	}
+	std::vector<MB_CALIBRATION_POINT> curve_points;
+	if (curve == MB_CURVE_POINTS)
+	{
+		if (points == nullptr || count == 0)
+		{
+			mb_error(MB_ERROR_INVALID_ARGUMENT, L"MB_CURVE_POINTS needs points");
+			return 0;
+		}
+		curve_points.assign(points, points + count);
+		for (unsigned long i = 0; i < count; i++)
+		{
+			// the table must be monotonic to be inverted for reads
+			if (points[i].level < 0.0 || points[i].level > 1.0 ||
+				(i > 0 && (points[i].percent <= points[i - 1].percent || points[i].level < points[i - 1].level)))
+			{
+				mb_error(MB_ERROR_INVALID_ARGUMENT, L"points must be sorted by percent with level rising in 0 .. 1");
+				return 0;
+			}
+		}
+	}
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+
+	std::lock_guard<MBStrand> guard(monitor.strand);
+	monitor.curve = curve;
+	monitor.curve_points = std::move(curve_points);
+	if (monitor.range_known)
+	{
+		mb_monitor_calibrate(monitor);
+	}
+	return 1;
+}
@@ -0,0 +1,961 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#ifdef __linux__
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+
+#define MB_DDC_SLAVE_ADDRESS	0x37
+#define MB_DDC_DEST_ADDRESS		0x6E
+#define MB_DDC_HOST_ADDRESS		0x51
+#define MB_DDC_REPLY_XOR		0x50
+
+#define MB_DDC_GET_VCP			0x01
+#define MB_DDC_GET_VCP_REPLY	0x02
+#define MB_DDC_SET_VCP			0x03
+#define MB_DDC_VCP_BRIGHTNESS	0x10
+#define MB_DDC_CAPABILITIES		0xF3
+#define MB_DDC_CAPABILITIES_REPLY	0xE3
+
+// a capabilities reply carries at most 32 bytes of the string
+#define MB_DDC_CAPS_FRAGMENT	32
+
+// MCCS timing: wait between a request and reading its reply, and between the end of one transaction and the next.
+// Every display starts there and learns its own, see MBDdcDelay
+#define MB_DDC_REPLY_DELAY_US	40000
+#define MB_DDC_COMMAND_DELAY_US	50000
+
+// learned delays stay between a floor and twice the MCCS value
+#define MB_DDC_DELAY_MIN_US		2000
+#define MB_DDC_DELAY_STEP_US	1000
+
+// successes in a row before a delay is tightened, and before the delay that last failed may be tried again.
+// Every failure doubles the second one, so a display at its edge is not probed over and over
+#define MB_DDC_TIGHTEN_STREAK	8
+#define MB_DDC_FORGET_STREAK	64
+#define MB_DDC_FORGET_MAX		4096
+
+// a garbled transaction is sent again up to this often, after the raised delay and a backoff doubling from 5 ms
+#define MB_DDC_RETRIES			3
+#define MB_DDC_BACKOFF_US		5000
+#define MB_DDC_BACKOFF_MAX_US	80000
+
+#define MB_DDC_DEFAULT_ROOT		"/dev"
+
+// one learned delay: doubled on a failure, and after a streak of successes moved a quarter of the way towards the
+// longest delay seen failing (a quarter of itself while none did), so it closes in on the display's edge from above
+struct MBDdcDelay
+{
+	uint32_t us;
+	uint32_t limit_us;
+
+	// the longest delay seen failing, tightening stops above it, 0 when none did
+	uint32_t failed_us;
+	uint32_t streak;
+	uint32_t stable;
+	uint32_t forget;
+
+	// what the capability cache holds, so only a change is stored again
+	uint32_t stored_us;
+	uint32_t stored_failed_us;
+
+	void reset(uint32_t initial_us, uint32_t initial_failed_us, uint32_t mccs_us)
+	{
+		limit_us = 2 * mccs_us;
+		us = initial_us < MB_DDC_DELAY_MIN_US ? MB_DDC_DELAY_MIN_US : (initial_us > limit_us ? limit_us : initial_us);
+		failed_us = initial_failed_us < us ? initial_failed_us : 0;
+		streak = 0;
+		stable = 0;
+		forget = MB_DDC_FORGET_STREAK;
+		stored_us = us;
+		stored_failed_us = failed_us;
+	}
+
+	bool changed() const
+	{
+		return us != stored_us || failed_us != stored_failed_us;
+	}
+
+	void success()
+	{
+		// the edge may have moved, e.g. the display warmed up, so the failed delay is let go of a step at a time
+		if (failed_us > 0 && ++stable >= forget)
+		{
+			failed_us = failed_us > MB_DDC_DELAY_STEP_US ? failed_us - MB_DDC_DELAY_STEP_US : 0;
+			stable = 0;
+		}
+		if (++streak < MB_DDC_TIGHTEN_STREAK)
+		{
+			return;
+		}
+		streak = 0;
+
+		uint32_t step = (us - failed_us) / 4 > MB_DDC_DELAY_STEP_US ? (us - failed_us) / 4 : MB_DDC_DELAY_STEP_US;
+		uint32_t next = us > MB_DDC_DELAY_MIN_US + step ? us - step : MB_DDC_DELAY_MIN_US;
+		if (next > failed_us)
+		{
+			us = next;
+		}
+	}
+
+	void failure()
+	{
+		failed_us = us > failed_us ? us : failed_us;
+		us = 2 * us < limit_us ? 2 * us : limit_us;
+		streak = 0;
+		stable = 0;
+		forget = 2 * forget < MB_DDC_FORGET_MAX ? 2 * forget : MB_DDC_FORGET_MAX;
+	}
+};
+
+struct MBDdcDevice
+{
+	std::unique_ptr<MBDdcTransport> transport;
+	std::string name;
+
+	uint16_t max;
+
+	// earliest time the display accepts the next command, only the remainder is slept
+	std::chrono::steady_clock::time_point ready_at;
+
+	// the timing this display tolerates
+	MBDdcDelay reply_delay;
+	MBDdcDelay command_delay;
+
+	// the monitor's counters once the handle is attached, nullptr while probing
+	MBStats* stats;
+
+	// from the DRM connector the bus belongs to, identity is 0 without one
+	MB_EDID_INFO edid;
+	uint64_t identity;
+
+	MBDdcDevice()
+	{
+		max = 0;
+		reply_delay.reset(MB_DDC_REPLY_DELAY_US, 0, MB_DDC_REPLY_DELAY_US);
+		command_delay.reset(MB_DDC_COMMAND_DELAY_US, 0, MB_DDC_COMMAND_DELAY_US);
+		stats = nullptr;
+		memset(&edid, 0, sizeof(edid));
+		identity = 0;
+	}
+};
+
+static uint8_t mb_ddc_checksum(uint8_t seed, const uint8_t* data, size_t length)
+{
+	uint8_t checksum = seed;
+	for (size_t i = 0; i < length; i++)
+	{
+		checksum ^= data[i];
+	}
+	return checksum;
+}
+
+// whether the last failure is one a slower retry may fix, as opposed to e.g. an unsupported feature or a closed bus
+static bool mb_ddc_garbled()
+{
+	long code = mb_error_save().code;
+	return code == MB_ERROR_DDC_NAK || code == MB_ERROR_DDC_CHECKSUM || code == MB_ERROR_DDC_PROTOCOL;
+}
+
+static void mb_ddc_publish(MBDdcDevice& device)
+{
+	if (device.stats != nullptr)
+	{
+		device.stats->reply_delay_us.store(device.reply_delay.us, std::memory_order_relaxed);
+		device.stats->command_delay_us.store(device.command_delay.us, std::memory_order_relaxed);
+	}
+}
+
+// credit the delay a transfer waited out with its result
+static void mb_ddc_learn(MBDdcDevice& device, MBDdcDelay& delay, bool ok)
+{
+	if (ok)
+	{
+		delay.success();
+	}
+	else if (mb_ddc_garbled())
+	{
+		delay.failure();
+	}
+	else
+	{
+		return;
+	}
+	mb_ddc_publish(device);
+}
+
+// protocol helpers record the failure with mb_error*(), transactions on one device must not interleave
+static bool mb_ddc_transfer(MBDdcDevice& device, bool write, uint8_t* data, size_t length, uint32_t delay_us)
+{
+	std::this_thread::sleep_until(device.ready_at);
+
+	errno = 0;
+	bool ok = write ? device.transport->write(data, length) : device.transport->read(data, length);
+	device.ready_at = std::chrono::steady_clock::now() + std::chrono::microseconds(delay_us);
+	if (ok && device.stats != nullptr)
+	{
+		mb_stats_add(write ? device.stats->bytes_sent : device.stats->bytes_received, length);
+	}
+	if (!ok)
+	{
+		// i2c-dev reports a missing acknowledge as ENXIO or EREMOTEIO
+		if (errno == 0 || errno == ENXIO || errno == EREMOTEIO)
+		{
+			mb_error(MB_ERROR_DDC_NAK, nullptr);
+		}
+		else
+		{
+			mb_error_system(errno);
+		}
+	}
+	return ok;
+}
+
+static bool mb_ddc_send(MBDdcDevice& device, const uint8_t* payload, uint8_t length, uint32_t delay_us)
+{
+	uint8_t packet[16];
+	packet[0] = MB_DDC_HOST_ADDRESS;
+	packet[1] = 0x80 | length;
+	memcpy(packet + 2, payload, length);
+	packet[2 + length] = mb_ddc_checksum(MB_DDC_DEST_ADDRESS, packet, 2 + length);
+
+	return mb_ddc_transfer(device, true, packet, 3 + length, delay_us);
+}
+
+// a request waits out the command delay and its reply the reply delay, each learns from how its transfer went
+static bool mb_ddc_request(MBDdcDevice& device, const uint8_t* payload, uint8_t length, bool expect_reply)
+{
+	bool ok = mb_ddc_send(device, payload, length, expect_reply ? device.reply_delay.us : device.command_delay.us);
+	mb_ddc_learn(device, device.command_delay, ok);
+	return ok;
+}
+
+static bool mb_ddc_reply(MBDdcDevice& device, uint8_t* reply, size_t length, const std::function<bool()>& check)
+{
+	bool ok = mb_ddc_transfer(device, false, reply, length, device.command_delay.us) && check();
+	mb_ddc_learn(device, device.reply_delay, ok);
+	return ok;
+}
+
+// run a transaction until it gets through, a retry waits out the delay the failure raised plus an exponential backoff
+static bool mb_ddc_retry(MBDdcDevice& device, const std::function<bool()>& transaction)
+{
+	for (unsigned int attempt = 0;; attempt++)
+	{
+		if (transaction())
+		{
+			return true;
+		}
+		if (attempt == MB_DDC_RETRIES || !mb_ddc_garbled())
+		{
+			return false;
+		}
+		if (device.stats != nullptr)
+		{
+			mb_stats_add(device.stats->retries, 1);
+		}
+
+		uint32_t backoff = MB_DDC_BACKOFF_US << attempt;
+		backoff = backoff < MB_DDC_BACKOFF_MAX_US ? backoff : MB_DDC_BACKOFF_MAX_US;
+		device.ready_at = std::chrono::steady_clock::now() + std::chrono::microseconds(device.command_delay.us + backoff);
+	}
+}
+
+static bool mb_ddc_get_vcp(MBDdcDevice& device, uint8_t code, uint16_t* current, uint16_t* max)
+{
+	return mb_ddc_retry(device, [&]()
+	{
+		const uint8_t request[] = { MB_DDC_GET_VCP, code };
+		if (!mb_ddc_request(device, request, sizeof(request), true))
+		{
+			return false;
+		}
+
+		uint8_t reply[11];
+		bool ok = mb_ddc_reply(device, reply, sizeof(reply), [&]()
+		{
+			if (mb_ddc_checksum(MB_DDC_REPLY_XOR, reply, sizeof(reply) - 1) != reply[sizeof(reply) - 1])
+			{
+				mb_error(MB_ERROR_DDC_CHECKSUM, nullptr);
+				return false;
+			}
+			if ((reply[1] & 0x7F) != 8 || reply[2] != MB_DDC_GET_VCP_REPLY || reply[4] != code)
+			{
+				mb_error(MB_ERROR_DDC_PROTOCOL, nullptr);
+				return false;
+			}
+			return true;
+		});
+		if (!ok)
+		{
+			return false;
+		}
+		if (reply[3] != 0)
+		{
+			mb_error(MB_ERROR_NOT_SUPPORTED, L"VCP code not supported by monitor");
+			return false;
+		}
+
+		*max = (uint16_t)((reply[6] << 8) | reply[7]);
+		*current = (uint16_t)((reply[8] << 8) | reply[9]);
+		return true;
+	});
+}
+
+static bool mb_ddc_set_vcp(MBDdcDevice& device, uint8_t code, uint16_t value)
+{
+	return mb_ddc_retry(device, [&]()
+	{
+		const uint8_t request[] = { MB_DDC_SET_VCP, code, (uint8_t)(value >> 8), (uint8_t)(value & 0xFF) };
+		return mb_ddc_request(device, request, sizeof(request), false);
+	});
+}
+
+// the string comes in fragments, each asked for by its offset, until the display answers with an empty one
+static bool mb_ddc_capabilities(MBDdcDevice& device, char* caps, size_t max_length, size_t* length)
+{
+	size_t offset = 0;
+	for (;;)
+	{
+		// source, length, opcode, offset, the fragment and the checksum
+		uint8_t reply[6 + MB_DDC_CAPS_FRAGMENT];
+		size_t reply_length = 0;
+		bool ok = mb_ddc_retry(device, [&]()
+		{
+			const uint8_t request[] = { MB_DDC_CAPABILITIES, (uint8_t)(offset >> 8), (uint8_t)(offset & 0xFF) };
+			if (!mb_ddc_request(device, request, sizeof(request), true))
+			{
+				return false;
+			}
+			return mb_ddc_reply(device, reply, sizeof(reply), [&]()
+			{
+				reply_length = reply[1] & 0x7F;
+				if (reply_length < 3 || reply_length > 3 + MB_DDC_CAPS_FRAGMENT ||
+					reply[2] != MB_DDC_CAPABILITIES_REPLY || (size_t)((reply[3] << 8) | reply[4]) != offset)
+				{
+					mb_error(MB_ERROR_DDC_PROTOCOL, nullptr);
+					return false;
+				}
+				if (mb_ddc_checksum(MB_DDC_REPLY_XOR, reply, 2 + reply_length) != reply[2 + reply_length])
+				{
+					mb_error(MB_ERROR_DDC_CHECKSUM, nullptr);
+					return false;
+				}
+				return true;
+			});
+		});
+		if (!ok)
+		{
+			return false;
+		}
+
+		size_t fragment = reply_length - 3;
+		if (fragment == 0)
+		{
+			*length = offset;
+			return true;
+		}
+		if (offset + fragment > max_length)
+		{
+			mb_error(MB_ERROR_DDC_PROTOCOL, L"capabilities string too long");
+			return false;
+		}
+		memcpy(caps + offset, reply + 5, fragment);
+		offset += fragment;
+	}
+}
+
+// connect to a bus and ask the display on it for its brightness, nullptr when nothing there answers
+static std::unique_ptr<MBDdcDevice> mb_ddc_probe(const std::string& name, const MBDdcConnect& connect, const MBCacheView& cache)
+{
+	std::unique_ptr<MBDdcDevice> device = std::make_unique<MBDdcDevice>();
+	device->transport = connect(name);
+	if (!device->transport)
+	{
+		return nullptr;
+	}
+	device->name = name;
+
+	// a display seen before starts from the timing it had learned, already for the probe
+	mb_edid_find(device->name.c_str(), &device->edid, &device->identity);
+	const MBCacheRecord* record = device->identity != 0 ? cache.find(device->identity) : nullptr;
+	if (record != nullptr && (record->flags & MB_CACHE_TIMING))
+	{
+		device->reply_delay.reset(record->reply_delay_us, record->reply_failed_us, MB_DDC_REPLY_DELAY_US);
+		device->command_delay.reset(record->command_delay_us, record->command_failed_us, MB_DDC_COMMAND_DELAY_US);
+	}
+
+	uint16_t current;
+	if (!mb_ddc_get_vcp(*device, MB_DDC_VCP_BRIGHTNESS, &current, &device->max) || device->max == 0)
+	{
+		return nullptr;
+	}
+	return device;
+}
+
+// the i2c-N nodes in root, in bus order
+static bool mb_ddc_buses(const std::string& root, std::vector<std::string>& names)
+{
+	DIR* dir = opendir(root.c_str());
+	if (dir == nullptr)
+	{
+		return false;
+	}
+
+	std::vector<unsigned long> buses;
+	for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+	{
+		if (strncmp(entry->d_name, "i2c-", 4) == 0)
+		{
+			buses.push_back(strtoul(entry->d_name + 4, nullptr, 10));
+		}
+	}
+	closedir(dir);
+	std::sort(buses.begin(), buses.end());
+
+	for (auto bus : buses)
+	{
+		names.push_back("i2c-" + std::to_string(bus));
+	}
+	return true;
+}
+
+struct MBDdcciStruct : public MBBaseStruct
+{
+public:
+	// reserved like monitors, a hotplug append never moves a device a running call uses
+	std::vector<std::unique_ptr<MBDdcDevice>> devices;
+
+	// the directory holding the bus nodes and how a display on one is reached
+	std::string root;
+	MBDdcConnect connect;
+	std::thread watcher;
+	int watch_stop_fd;
+
+	MBDdcciStruct()
+	{
+		type = MB_TYPE_DDCCI;
+		devices.reserve(MB_MAX_MONITORS);
+		watch_stop_fd = -1;
+	}
+
+	unsigned long enumerate() override
+	{
+		return (unsigned long)devices.size();
+	}
+
+	// runs again for every hotplugged monitor, the devices already counting keep going untouched
+	void attached() override
+	{
+		for (size_t i = 0; i < monitors.size(); i++)
+		{
+			if (devices[i]->stats == nullptr)
+			{
+				devices[i]->stats = &monitors[i]->stats;
+				mb_ddc_publish(*devices[i]);
+			}
+		}
+	}
+
+	bool get_range(unsigned long index, unsigned long* min, unsigned long* max) override
+	{
+		*min = 0;
+		*max = devices[index]->max;
+		return true;
+	}
+
+	bool get(unsigned long index, unsigned long* value) override
+	{
+		uint16_t current, max;
+		if (!mb_ddc_get_vcp(*devices[index], MB_DDC_VCP_BRIGHTNESS, &current, &max))
+		{
+			return false;
+		}
+		*value = current;
+		return true;
+	}
+
+	bool set(unsigned long index, unsigned long value) override
+	{
+		return mb_ddc_set_vcp(*devices[index], MB_DDC_VCP_BRIGHTNESS, (uint16_t)value);
+	}
+
+	bool capabilities(unsigned long index, char* caps, size_t max_length, size_t* length) override
+	{
+		return mb_ddc_capabilities(*devices[index], caps, max_length, length);
+	}
+
+	bool get_vcp(unsigned long index, uint8_t code, unsigned long* current, unsigned long* max) override
+	{
+		uint16_t current_value, max_value;
+		if (!mb_ddc_get_vcp(*devices[index], code, &current_value, &max_value))
+		{
+			return false;
+		}
+		*current = current_value;
+		*max = max_value;
+		return true;
+	}
+
+	// the device waits out its own learned delays, a fixed interval on top would only add latency
+	unsigned long min_interval(unsigned long index) override
+	{
+		return 0;
+	}
+
+	bool identity(unsigned long index, uint64_t* id) override
+	{
+		*id = devices[index]->identity;
+		return *id != 0;
+	}
+
+	bool edid(unsigned long index, MB_EDID_INFO* info) override
+	{
+		if (devices[index]->identity == 0)
+		{
+			mb_error(MB_ERROR_NOT_FOUND, L"no EDID for this bus");
+			return false;
+		}
+		*info = devices[index]->edid;
+		return true;
+	}
+
+	// a display that comes back on another bus is renamed on the strand
+	long name(unsigned long index, WCHAR* monitor_name, unsigned long max_length) override
+	{
+		std::lock_guard<MBStrand> guard(monitors[index]->strand);
+		const std::string& name = devices[index]->name;
+		if (monitor_name != nullptr)
+		{
+			for (size_t i = 0; i < name.length() && i < max_length; i++)
+			{
+				monitor_name[i] = (WCHAR)(unsigned char)name[i];
+			}
+		}
+		return (long)name.length();
+	}
+
+	void close() override
+	{
+		std::vector<MBCacheRecord> records;
+		for (auto& device : devices)
+		{
+			const MBDdcDelay& reply = device->reply_delay;
+			const MBDdcDelay& command = device->command_delay;
+			if (device->identity != 0 && (reply.changed() || command.changed()))
+			{
+				records.push_back({ device->identity, 0, 0, MB_CACHE_TIMING, 0, reply.us, reply.failed_us, command.us, command.failed_us });
+			}
+		}
+		mb_cache_store(records);
+		devices.clear();
+	}
+
+	// the index of the monitor attached on bus name, only the watcher changes which one that is
+	bool find_bus(const std::string& name, unsigned long* index)
+	{
+		for (unsigned long i = 0; i < count(); i++)
+		{
+			if (devices[i]->name == name && monitors[i]->state != MB_MONITOR_DETACHED)
+			{
+				*index = i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// a bus named name appeared, a display seen before gets its old index back
+	void plugged(const std::string& name)
+	{
+		unsigned long index;
+		if (find_bus(name, &index))
+		{
+			return;
+		}
+
+		// probed off the strand, a bus without a display costs the watcher its retries and nothing else
+		MBCacheView cache;
+		cache.open();
+		std::unique_ptr<MBDdcDevice> fresh = mb_ddc_probe(name, connect, cache);
+		if (!fresh)
+		{
+			return;
+		}
+
+		// a dock may hand the display another bus, so it is known by its EDID and only without one by its bus
+		for (unsigned long i = 0; i < count(); i++)
+		{
+			MBDdcDevice& device = *devices[i];
+			bool same = fresh->identity != 0 ? device.identity == fresh->identity : device.identity == 0 && device.name == name;
+			if (same && monitors[i]->state == MB_MONITOR_DETACHED)
+			{
+				// the learned delays stay, they belong to the display rather than the bus
+				mb_driver_hotplug_reattach(this, i, [&device, &fresh]()
+				{
+					device.transport = std::move(fresh->transport);
+					device.name = fresh->name;
+					device.max = fresh->max;
+					device.ready_at = fresh->ready_at;
+					device.edid = fresh->edid;
+					device.identity = fresh->identity;
+					return true;
+				});
+				return;
+			}
+		}
+		mb_driver_hotplug_add(this, [this, &fresh](unsigned long index)
+		{
+			devices.push_back(std::move(fresh));
+			return true;
+		});
+	}
+
+	void unplugged(const std::string& name)
+	{
+		unsigned long index;
+		if (find_bus(name, &index))
+		{
+			MBDdcDevice& device = *devices[index];
+			mb_driver_hotplug_detach(this, index, [&device]()
+			{
+				device.transport.reset();
+			});
+		}
+	}
+
+	// a display came or went on a connector whose bus stays, e.g. HDMI. A bus whose connector changed EDID lets go
+	// of its display, one whose connector has an EDID is probed. Displays without a connector are left alone
+	void connectors_changed()
+	{
+		std::vector<std::string> names;
+		if (!mb_ddc_buses(root, names))
+		{
+			return;
+		}
+		for (const std::string& name : names)
+		{
+			MB_EDID_INFO info;
+			uint64_t id = 0;
+			if (!mb_edid_find(name.c_str(), &info, &id))
+			{
+				id = 0;
+			}
+
+			unsigned long index;
+			bool attached = find_bus(name, &index);
+			if (attached && devices[index]->identity != 0 && devices[index]->identity != id)
+			{
+				unplugged(name);
+				attached = false;
+			}
+			if (!attached && id != 0)
+			{
+				plugged(name);
+			}
+		}
+	}
+
+	void watch_run(int inotify_fd, int uevent_fd)
+	{
+		char buffer[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+		for (;;)
+		{
+			struct pollfd fds[3] = { { watch_stop_fd, POLLIN, 0 }, { inotify_fd, POLLIN, 0 }, { uevent_fd, POLLIN, 0 } };
+			if (poll(fds, uevent_fd >= 0 ? 3 : 2, -1) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				break;
+			}
+			if (fds[0].revents != 0)
+			{
+				break;
+			}
+
+			// the event names the bus, so only the display on it is probed or let go of. udev may only make a new
+			// node accessible after it was created, so a change of its attributes is another chance to open it
+			if (fds[1].revents & POLLIN)
+			{
+				ssize_t size = read(inotify_fd, buffer, sizeof(buffer));
+				for (char* p = buffer; size > 0 && p < buffer + size;)
+				{
+					struct inotify_event* event = (struct inotify_event*)p;
+					if (event->len > 0 && strncmp(event->name, "i2c-", 4) == 0)
+					{
+						if (event->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB))
+						{
+							plugged(event->name);
+						}
+						else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+						{
+							unplugged(event->name);
+						}
+					}
+					p += sizeof(struct inotify_event) + event->len;
+				}
+			}
+
+			// sysfs does not raise inotify events, the kernel announces connector changes as drm uevents
+			if (uevent_fd >= 0 && (fds[2].revents & POLLIN))
+			{
+				MBUevent event;
+				if (!mb_uevent_read(uevent_fd, buffer, sizeof(buffer), &event))
+				{
+					continue;
+				}
+				if (strcmp(event.subsystem, "i2c-dev") == 0 && strcmp(event.action, "add") == 0)
+				{
+					plugged(event.name);
+				}
+				else if (strcmp(event.subsystem, "i2c-dev") == 0 && strcmp(event.action, "remove") == 0)
+				{
+					unplugged(event.name);
+				}
+				else if (strcmp(event.subsystem, "drm") == 0 && strcmp(event.action, "change") == 0)
+				{
+					connectors_changed();
+				}
+			}
+		}
+
+		::close(inotify_fd);
+		if (uevent_fd >= 0)
+		{
+			::close(uevent_fd);
+		}
+	}
+
+	bool watch(bool enable) override
+	{
+		if (!enable)
+		{
+			uint64_t one = 1;
+			if (write(watch_stop_fd, &one, sizeof(one)) != sizeof(one))
+			{
+				mb_error_system(errno);
+			}
+			watcher.join();
+			::close(watch_stop_fd);
+			watch_stop_fd = -1;
+			return true;
+		}
+
+		if (root.empty())
+		{
+			mb_error(MB_ERROR_NOT_SUPPORTED, L"no bus directory to watch");
+			return false;
+		}
+		int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotify_fd < 0)
+		{
+			mb_error_system(errno);
+			return false;
+		}
+		if (inotify_add_watch(inotify_fd, root.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ATTRIB | IN_ONLYDIR) < 0)
+		{
+			mb_error_system(errno);
+			::close(inotify_fd);
+			return false;
+		}
+
+		// uevents only describe the real device tree, a caller supplied root is watched with inotify alone
+		int uevent_fd = root == MB_DDC_DEFAULT_ROOT ? mb_uevent_open() : -1;
+
+		watch_stop_fd = eventfd(0, EFD_CLOEXEC);
+		if (watch_stop_fd < 0)
+		{
+			mb_error_system(errno);
+			::close(inotify_fd);
+			if (uevent_fd >= 0)
+			{
+				::close(uevent_fd);
+			}
+			return false;
+		}
+		watcher = std::thread(&MBDdcciStruct::watch_run, this, inotify_fd, uevent_fd);
+		return true;
+	}
+};
+
+struct MBI2cDevTransport : public MBDdcTransport
+{
+	int fd;
+
+	MBI2cDevTransport(int fd) : fd(fd)
+	{
+	}
+
+	~MBI2cDevTransport()
+	{
+		close(fd);
+	}
+
+	bool write(const uint8_t* data, size_t length) override
+	{
+		return ::write(fd, data, length) == (ssize_t)length;
+	}
+
+	bool read(uint8_t* data, size_t length) override
+	{
+		return ::read(fd, data, length) == (ssize_t)length;
+	}
+};
+
+// open a bus node and address the display on it
+static std::unique_ptr<MBDdcTransport> mb_ddc_connect(const std::string& root, const std::string& name)
+{
+	int fd = open((root + "/" + name).c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return nullptr;
+	}
+	if (ioctl(fd, I2C_SLAVE, MB_DDC_SLAVE_ADDRESS) < 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+	return std::make_unique<MBI2cDevTransport>(fd);
+}
+
+MBBaseStruct* mb_ddcci_open(const std::string& root, std::vector<std::string> names, MBDdcConnect connect)
+{
+	std::vector<std::unique_ptr<MBDdcDevice>> probed(names.size());
+	MBCacheView cache;
+	cache.open();
+
+	// every probe costs a full request/reply round trip, so buses are probed in parallel
+	mb_parallel_for(names.size(), MB_MAX_WORKERS, [&](size_t i)
+	{
+		probed[i] = mb_ddc_probe(names[i], connect, cache);
+	});
+
+	MBDdcciStruct* h = new MBDdcciStruct();
+	h->root = root;
+	h->connect = std::move(connect);
+	for (auto& device : probed)
+	{
+		if (device && h->devices.size() < MB_MAX_MONITORS)
+		{
+			h->devices.push_back(std::move(device));
+		}
+	}
+	return h;
+}
+
+MB_FUNCTION long MB_CONV mb_ddcci_init(void** handle, const char* root)
+{
+	if (root == nullptr)
+	{
+		root = MB_DDC_DEFAULT_ROOT;
+	}
+
+	std::vector<std::string> names;
+	if (!mb_ddc_buses(root, names))
+	{
+		mb_error_system(errno);
+		return 0;
+	}
+
+	std::string path = root;
+	MBBaseStruct* h = mb_ddcci_open(path, std::move(names), [path](const std::string& name)
+	{
+		return mb_ddc_connect(path, name);
+	});
+	if (h->enumerate() == 0)
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"no DDC/CI monitors found");
+	}
+
+	if (handle != nullptr)
+	{
+		if (!mb_driver_attach(h, handle))
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		h->close();
+		delete h;
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_ddcci_get_count(void* handle, unsigned long* count)
+{
+	MBHandle h(handle, MB_TYPE_DDCCI);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_count(h, count);
+}
+
+MB_FUNCTION long MB_CONV mb_ddcci_set_brightness(void* handle, unsigned long index, double percent)
+{
+	MBHandle h(handle, MB_TYPE_DDCCI);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_set(h, index, percent);
+}
+
+MB_FUNCTION long MB_CONV mb_ddcci_get_brightness(void* handle, unsigned long index, double* percent)
+{
+	MBHandle h(handle, MB_TYPE_DDCCI);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get(h, index, percent);
+}
+
+MB_FUNCTION long MB_CONV mb_ddcci_get_name(void* handle, unsigned long index, WCHAR* monitor_name, unsigned long max_length)
+{
+	MBHandle h(handle, MB_TYPE_DDCCI);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_name(h, index, monitor_name, max_length);
+}
+
+MB_FUNCTION long MB_CONV mb_ddcci_cleanup(void* handle)
+{
+	MBHandle h(handle, MB_TYPE_DDCCI);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_cleanup(h);
+}
+#endif
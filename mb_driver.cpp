@@ -0,0 +1,1266 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <chrono>
+
+#include <math.h>
+#include <string.h>
+
+static uint64_t mb_tick()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+MBMonitor::MBMonitor() : pending(MB_NO_PENDING), state(MB_MONITOR_READY), ramping(false)
+{
+	range_known = false;
+	min = max = current = 0;
+	current_tick = 0;
+	min_interval = 0;
+	async_busy = false;
+	async_stop = false;
+	async_error.code = MB_ERROR_NONE;
+	async_error.system = 0;
+	async_error.message = nullptr;
+	probe_error = async_error;
+	vcp_read = false;
+	vcp_known = false;
+	memset(&vcp, 0, sizeof(vcp));
+	vcp_error = async_error;
+	identity = 0;
+	curve = MB_CURVE_LINEAR;
+}
+
+MBStrand::MBStrand() : next_ticket(0), now_serving(0)
+{
+}
+
+void MBStrand::lock()
+{
+	std::unique_lock<std::mutex> guard(mutex);
+	uint64_t ticket = next_ticket++;
+	cv.wait(guard, [this, ticket]() { return now_serving == ticket; });
+}
+
+void MBStrand::unlock()
+{
+	bool waiting;
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		now_serving++;
+		waiting = next_ticket != now_serving;
+	}
+	if (waiting)
+	{
+		cv.notify_all();
+	}
+}
+
+void mb_parallel_for(size_t count, size_t max_workers, const std::function<void(size_t)>& fn)
+{
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < count; i = next++)
+		{
+			fn(i);
+		}
+	};
+
+	size_t workers = MB_MIN(count, max_workers);
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < workers; i++)
+	{
+		threads.emplace_back(worker);
+	}
+	worker();
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+// the range was just read, the calibration table follows it
+static void mb_monitor_range_ready(MBMonitor& monitor)
+{
+	monitor.range_known = true;
+	mb_monitor_calibrate(monitor);
+}
+
+static std::unique_ptr<MBMonitor> mb_monitor_create(MBBaseStruct* h, unsigned long index)
+{
+	std::unique_ptr<MBMonitor> monitor = std::make_unique<MBMonitor>();
+	monitor->min_interval = h->min_interval(index);
+	uint64_t id;
+	monitor->identity = h->identity(index, &id) ? id : 0;
+	return monitor;
+}
+
+// monitors past MB_MAX_MONITORS stay unused, the per monitor tables of the broker and the snapshot end there
+static unsigned long mb_driver_enumerate(MBBaseStruct* h)
+{
+	unsigned long count = h->enumerate();
+	return count < MB_MAX_MONITORS ? count : MB_MAX_MONITORS;
+}
+
+static size_t mb_id_slot(uint64_t id)
+{
+	return (size_t)((id * 0x9E3779B97F4A7C15ull) >> (64 - MB_ID_BITS));
+}
+
+// make a published monitor findable by its identity, callers never add two monitors at once.
+// A removed slot is reused once the id is known to be absent further on, an id already there
+// is pointed at index. A full table leaves the monitor out, mb_driver_find then reports it as not found
+static void mb_driver_index_id(MBBaseStruct* h, unsigned long index)
+{
+	uint64_t id = h->monitors[index]->identity;
+	if (id == 0 || id == MB_ID_REMOVED)
+	{
+		return;
+	}
+	size_t slot = mb_id_slot(id);
+	size_t removed = MB_ID_SLOTS;
+	for (unsigned int probe = 0; probe < MB_ID_SLOTS; probe++, slot = (slot + 1) & (MB_ID_SLOTS - 1))
+	{
+		uint64_t key = h->id_keys[slot].load(std::memory_order_relaxed);
+		if (key == id)
+		{
+			h->id_values[slot].store(index, std::memory_order_release);
+			return;
+		}
+		if (key == MB_ID_REMOVED && removed == MB_ID_SLOTS)
+		{
+			removed = slot;
+		}
+		if (key == 0)
+		{
+			break;
+		}
+	}
+	if (removed == MB_ID_SLOTS)
+	{
+		if (h->id_keys[slot].load(std::memory_order_relaxed) != 0)
+		{
+			return;
+		}
+		removed = slot;
+	}
+	h->id_values[removed].store(index, std::memory_order_relaxed);
+	h->id_keys[removed].store(id, std::memory_order_release);
+}
+
+// drop the slot of id if it still points at index, lookups of id then end at a later free slot
+static void mb_driver_unindex_id(MBBaseStruct* h, uint64_t id, unsigned long index)
+{
+	if (id == 0 || id == MB_ID_REMOVED)
+	{
+		return;
+	}
+	size_t slot = mb_id_slot(id);
+	for (unsigned int probe = 0; probe < MB_ID_SLOTS; probe++, slot = (slot + 1) & (MB_ID_SLOTS - 1))
+	{
+		uint64_t key = h->id_keys[slot].load(std::memory_order_relaxed);
+		if (key == id)
+		{
+			if (h->id_values[slot].load(std::memory_order_relaxed) == index)
+			{
+				h->id_keys[slot].store(MB_ID_REMOVED, std::memory_order_release);
+			}
+			return;
+		}
+		if (key == 0)
+		{
+			return;
+		}
+	}
+}
+
+bool mb_driver_attach(MBBaseStruct* h, void** handle)
+{
+	if (!mb_handle_register(h))
+	{
+		h->close();
+		delete h;
+		return false;
+	}
+
+	unsigned long count = mb_driver_enumerate(h);
+	for (unsigned long i = 0; i < count; i++)
+	{
+		h->monitors.push_back(mb_monitor_create(h, i));
+		mb_driver_index_id(h, i);
+	}
+	h->monitor_count = count;
+	h->attached();
+	*handle = h->handle;
+	return true;
+}
+
+static void mb_driver_probe_run(MBBaseStruct* h, std::vector<unsigned long> indices)
+{
+	mb_parallel_for(indices.size(), MB_MAX_WORKERS, [h, &indices](size_t i)
+	{
+		MBMonitor& monitor = *h->monitors[indices[i]];
+		{
+			std::lock_guard<MBStrand> guard(monitor.strand);
+			// a caller that reached a pending monitor first has already read the range
+			if (!monitor.range_known)
+			{
+				uint64_t trace = mb_trace_begin(h);
+				bool ok = h->probe(indices[i], &monitor.min, &monitor.max);
+				mb_trace_end(h, indices[i], monitor, MB_TRACE_RANGE, ok, monitor.max, monitor.min, trace);
+				if (ok)
+				{
+					mb_monitor_range_ready(monitor);
+				}
+				else
+				{
+					monitor.probe_error = mb_error_save();
+				}
+			}
+			monitor.state = monitor.range_known ? MB_MONITOR_READY : MB_MONITOR_FAILED;
+			mb_snapshot_update(h, indices[i], monitor);
+		}
+
+		std::lock_guard<std::mutex> probe_guard(h->probe_lock);
+		h->probe_remaining--;
+		h->probe_cv.notify_all();
+	});
+
+	// only definite answers are cached, a probe that failed for any other reason runs again next time
+	std::vector<MBCacheRecord> records;
+	for (auto index : indices)
+	{
+		MBMonitor& monitor = *h->monitors[index];
+		std::lock_guard<MBStrand> guard(monitor.strand);
+		if (monitor.identity == 0)
+		{
+			continue;
+		}
+
+		MBCacheRecord record = { monitor.identity, 0, 0, 0, 0, 0, 0, 0, 0 };
+		if (monitor.range_known)
+		{
+			record.min = (uint32_t)monitor.min;
+			record.max = (uint32_t)monitor.max;
+			record.flags = MB_CACHE_RANGE;
+		}
+		else if (monitor.probe_error.code == MB_ERROR_NOT_SUPPORTED)
+		{
+			record.flags = MB_CACHE_NO_BRIGHTNESS;
+		}
+		else
+		{
+			continue;
+		}
+		records.push_back(record);
+	}
+	mb_cache_store(records);
+}
+
+bool mb_driver_attach_probed(MBBaseStruct* h, void** handle, unsigned long deadline)
+{
+	if (!mb_handle_register(h))
+	{
+		h->close();
+		delete h;
+		return false;
+	}
+
+	unsigned long count = mb_driver_enumerate(h);
+	std::vector<unsigned long> pending;
+	{
+		// monitors found in the capability cache skip the probe entirely
+		MBCacheView cache;
+		bool cached = cache.open();
+		for (unsigned long i = 0; i < count; i++)
+		{
+			std::unique_ptr<MBMonitor> monitor = mb_monitor_create(h, i);
+			const MBCacheRecord* record = cached && monitor->identity != 0 ? cache.find(monitor->identity) : nullptr;
+			if (record == nullptr || !(record->flags & (MB_CACHE_RANGE | MB_CACHE_NO_BRIGHTNESS)))
+			{
+				monitor->state = MB_MONITOR_PENDING;
+				pending.push_back(i);
+			}
+			else if (record->flags & MB_CACHE_NO_BRIGHTNESS)
+			{
+				monitor->state = MB_MONITOR_FAILED;
+				monitor->probe_error = MBError{ MB_ERROR_NOT_SUPPORTED, 0, L"monitor does not support brightness" };
+			}
+			else
+			{
+				monitor->min = record->min;
+				monitor->max = record->max;
+				mb_monitor_range_ready(*monitor);
+			}
+			h->monitors.push_back(std::move(monitor));
+		}
+	}
+
+	// probes run on a pool owned by the handle, so the ones still running at the deadline finish after init returns
+	bool finished = true;
+	if (!pending.empty())
+	{
+		h->probe_remaining = (unsigned long)pending.size();
+		h->probe_worker = std::thread(mb_driver_probe_run, h, std::move(pending));
+
+		std::unique_lock<std::mutex> probe_guard(h->probe_lock);
+		auto done = [h]() { return h->probe_remaining == 0; };
+		if (deadline == MB_INFINITE)
+		{
+			h->probe_cv.wait(probe_guard, done);
+		}
+		else
+		{
+			finished = h->probe_cv.wait_for(probe_guard, std::chrono::milliseconds(deadline), done);
+		}
+	}
+
+	// indices only move while nobody else holds them, i.e. when every probe has finished before the handle is returned
+	if (finished)
+	{
+		if (h->probe_worker.joinable())
+		{
+			h->probe_worker.join();
+		}
+		for (unsigned long i = count; i-- > 0;)
+		{
+			if (h->monitors[i]->state == MB_MONITOR_FAILED && h->remove(i))
+			{
+				h->monitors.erase(h->monitors.begin() + i);
+			}
+		}
+	}
+	for (unsigned long i = 0; i < (unsigned long)h->monitors.size(); i++)
+	{
+		mb_driver_index_id(h, i);
+	}
+	h->monitor_count = (unsigned long)h->monitors.size();
+	h->attached();
+	*handle = h->handle;
+	return true;
+}
+
+long mb_driver_get_state(MBBaseStruct* h, unsigned long index)
+{
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+
+	long state = monitor.state;
+	if (state == MB_MONITOR_FAILED)
+	{
+		std::lock_guard<MBStrand> guard(monitor.strand);
+		mb_error_restore(monitor.probe_error);
+	}
+	return state;
+}
+
+// the device calls below must run on monitor.strand
+
+// whether the shadow still answers for the device, see mb_set_cache_timeout
+static bool mb_monitor_fresh(MBBaseStruct* h, const MBMonitor& monitor)
+{
+	unsigned long cache_timeout = h->cache_timeout;
+	return monitor.range_known && cache_timeout > 0 && mb_tick() - monitor.current_tick <= cache_timeout;
+}
+
+static bool mb_monitor_range(MBBaseStruct* h, unsigned long index, MBMonitor& monitor)
+{
+	if (monitor.range_known)
+	{
+		return true;
+	}
+
+	uint64_t trace = mb_trace_begin(h);
+	bool ok = h->get_range(index, &monitor.min, &monitor.max);
+	mb_trace_end(h, index, monitor, MB_TRACE_RANGE, ok, monitor.max, monitor.min, trace);
+	if (!ok)
+	{
+		return false;
+	}
+	mb_monitor_range_ready(monitor);
+	monitor.state = MB_MONITOR_READY;
+	return true;
+}
+
+static bool mb_monitor_sync(MBBaseStruct* h, unsigned long index, MBMonitor& monitor)
+{
+	if (monitor.state == MB_MONITOR_DETACHED)
+	{
+		mb_error(MB_ERROR_DETACHED, nullptr);
+		return false;
+	}
+
+	if (!mb_monitor_range(h, index, monitor))
+	{
+		return false;
+	}
+
+	uint64_t begin = mb_stats_begin(h);
+	uint64_t trace = mb_trace_begin(h);
+	bool ok = h->get(index, &monitor.current);
+	mb_trace_end(h, index, monitor, MB_TRACE_GET, ok, monitor.current, 0, trace);
+	mb_stats_end(monitor.stats.get_latency, begin);
+	if (!ok)
+	{
+		mb_stats_add(monitor.stats.get_failed, 1);
+		return false;
+	}
+	mb_stats_add(monitor.stats.get_ok, 1);
+	monitor.current_tick = mb_tick();
+	mb_snapshot_update(h, index, monitor);
+	return true;
+}
+
+static bool mb_monitor_set(MBBaseStruct* h, unsigned long index, MBMonitor& monitor, double percent)
+{
+	if (monitor.state == MB_MONITOR_DETACHED)
+	{
+		mb_error(MB_ERROR_DETACHED, nullptr);
+		return false;
+	}
+
+	if (!mb_monitor_range(h, index, monitor))
+	{
+		return false;
+	}
+
+	unsigned long value = mb_monitor_value(monitor, percent);
+
+	// the interval counts from the start of a command, a slow driver call already covers part of it
+	std::this_thread::sleep_until(monitor.next_write);
+	monitor.next_write = std::chrono::steady_clock::now() + std::chrono::milliseconds(monitor.min_interval);
+	uint64_t begin = mb_stats_begin(h);
+	uint64_t trace = mb_trace_begin(h);
+	bool ok = h->set(index, value);
+	mb_trace_end(h, index, monitor, MB_TRACE_SET, ok, value, 0, trace);
+	mb_stats_end(monitor.stats.set_latency, begin);
+	if (!ok)
+	{
+		mb_stats_add(monitor.stats.set_failed, 1);
+		return false;
+	}
+	mb_stats_add(monitor.stats.set_ok, 1);
+
+	monitor.current = value;
+	monitor.current_tick = mb_tick();
+	mb_snapshot_update(h, index, monitor);
+	return true;
+}
+
+static void mb_monitor_async_run(MBBaseStruct* h, unsigned long index)
+{
+	MBMonitor* monitor = h->monitors[index].get();
+
+	std::unique_lock<std::mutex> async_guard(monitor->async_lock);
+	for (;;)
+	{
+		monitor->async_cv.wait(async_guard, [monitor]() { return monitor->async_stop || monitor->pending.load() != MB_NO_PENDING; });
+
+		// wait out the command interval before taking the value, so everything submitted meanwhile is dropped
+		async_guard.unlock();
+		std::chrono::steady_clock::time_point next_write;
+		{
+			std::lock_guard<MBStrand> guard(monitor->strand);
+			next_write = monitor->next_write;
+		}
+		async_guard.lock();
+		monitor->async_cv.wait_until(async_guard, next_write, [monitor]() { return monitor->async_stop; });
+
+		// only the newest value is sent, everything submitted meanwhile was superseded
+		// a direct write may have taken the value back meanwhile, see mb_monitor_supersede
+		uint64_t bits = monitor->pending.exchange(MB_NO_PENDING);
+		if (bits == MB_NO_PENDING)
+		{
+			if (monitor->async_stop)
+			{
+				break;
+			}
+			continue;
+		}
+		monitor->async_busy = true;
+		async_guard.unlock();
+
+		double percent;
+		memcpy(&percent, &bits, sizeof(percent));
+
+		bool ok;
+		{
+			std::lock_guard<MBStrand> guard(monitor->strand);
+			ok = mb_monitor_set(h, index, *monitor, percent);
+		}
+
+		async_guard.lock();
+		monitor->async_busy = false;
+		if (!ok)
+		{
+			monitor->async_error = mb_error_save();
+		}
+		monitor->idle_cv.notify_all();
+	}
+}
+
+// a direct write replaces the fade and everything submitted before it: the ramp stops, the pending value is dropped
+// and a write the async worker already took finishes first, so none of them can land after the direct one
+static void mb_monitor_supersede(MBBaseStruct* h, unsigned long index, MBMonitor& monitor)
+{
+	if (monitor.ramping)
+	{
+		mb_ramp_cancel(h, index);
+	}
+
+	std::unique_lock<std::mutex> async_guard(monitor.async_lock);
+	if (monitor.pending.exchange(MB_NO_PENDING) != MB_NO_PENDING)
+	{
+		mb_stats_add(monitor.stats.dropped, 1);
+	}
+	monitor.idle_cv.wait(async_guard, [&monitor]() { return !monitor.async_busy; });
+}
+
+static void mb_monitor_async_stop(MBMonitor& monitor)
+{
+	{
+		std::lock_guard<std::mutex> async_guard(monitor.async_lock);
+		monitor.async_stop = true;
+	}
+	monitor.async_cv.notify_one();
+
+	if (monitor.async_worker.joinable())
+	{
+		monitor.async_worker.join();
+	}
+}
+
+long mb_driver_get_count(MBBaseStruct* h, unsigned long* count)
+{
+	unsigned long monitor_count = h->count();
+	if (count != nullptr)
+	{
+		*count = monitor_count;
+	}
+	return (long)monitor_count;
+}
+
+long mb_driver_set(MBBaseStruct* h, unsigned long index, double percent)
+{
+	if (percent < 0.0 || percent > 1.0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"percent out of range 0 .. 1");
+		return 0;
+	}
+
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+	mb_monitor_supersede(h, index, monitor);
+
+	std::lock_guard<MBStrand> guard(monitor.strand);
+	if (!mb_monitor_set(h, index, monitor, percent))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+long mb_driver_set_changed(MBBaseStruct* h, unsigned long index, double percent, bool* written)
+{
+	*written = false;
+	if (percent < 0.0 || percent > 1.0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"percent out of range 0 .. 1");
+		return 0;
+	}
+
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+	mb_monitor_supersede(h, index, monitor);
+
+	std::lock_guard<MBStrand> guard(monitor.strand);
+	if (monitor.state != MB_MONITOR_DETACHED && mb_monitor_fresh(h, monitor) && monitor.current == mb_monitor_value(monitor, percent))
+	{
+		return 1;
+	}
+	if (!mb_monitor_set(h, index, monitor, percent))
+	{
+		return 0;
+	}
+	*written = true;
+	return 1;
+}
+
+long mb_driver_set_batch(MBBaseStruct* h, const MB_BRIGHTNESS* requests, unsigned long count, long* results)
+{
+	if (requests == nullptr && count > 0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"requests is nullptr");
+		return 0;
+	}
+
+	long ok = 1;
+	std::vector<MBError> errors(count, MBError{ MB_ERROR_NONE, 0, nullptr });
+
+	// group the requests by monitor, so writes to one monitor stay in order on one worker
+	unsigned long monitor_count = h->count();
+	std::vector<std::vector<unsigned long>> per_monitor(monitor_count);
+	std::vector<unsigned long> busy;
+	for (unsigned long i = 0; i < count; i++)
+	{
+		const MB_BRIGHTNESS& request = requests[i];
+		if (results != nullptr)
+		{
+			results[i] = 0;
+		}
+
+		if (request.percent < 0.0 || request.percent > 1.0)
+		{
+			mb_error(MB_ERROR_INVALID_ARGUMENT, L"percent out of range 0 .. 1");
+			ok = 0;
+			continue;
+		}
+		if (request.index >= monitor_count)
+		{
+			mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+			ok = 0;
+			continue;
+		}
+
+		if (per_monitor[request.index].empty())
+		{
+			busy.push_back(request.index);
+			mb_monitor_supersede(h, request.index, *h->monitors[request.index]);
+		}
+		per_monitor[request.index].push_back(i);
+	}
+
+	mb_parallel_for(busy.size(), MB_MAX_WORKERS, [&](size_t i)
+	{
+		MBMonitor& monitor = *h->monitors[busy[i]];
+		std::lock_guard<MBStrand> guard(monitor.strand);
+		for (auto request_index : per_monitor[busy[i]])
+		{
+			if (mb_monitor_set(h, busy[i], monitor, requests[request_index].percent))
+			{
+				if (results != nullptr)
+				{
+					results[request_index] = 1;
+				}
+			}
+			else
+			{
+				errors[request_index] = mb_error_save();
+			}
+		}
+	});
+
+	for (unsigned long i = 0; i < count; i++)
+	{
+		if (errors[i].code != MB_ERROR_NONE)
+		{
+			mb_error_restore(errors[i]);
+			ok = 0;
+			break;
+		}
+	}
+	return ok;
+}
+
+long mb_driver_submit(MBBaseStruct* h, unsigned long index, double percent)
+{
+	if (percent < 0.0 || percent > 1.0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"percent out of range 0 .. 1");
+		return 0;
+	}
+
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	if (h->monitors[index]->ramping)
+	{
+		mb_ramp_cancel(h, index);
+	}
+	mb_monitor_submit(h, index, percent);
+	return 1;
+}
+
+void mb_monitor_submit(MBBaseStruct* h, unsigned long index, double percent)
+{
+	MBMonitor& monitor = *h->monitors[index];
+
+	uint64_t bits;
+	memcpy(&bits, &percent, sizeof(bits));
+	if (monitor.pending.exchange(bits) != MB_NO_PENDING)
+	{
+		mb_stats_add(monitor.stats.dropped, 1);
+	}
+
+	{
+		// taking the lock orders the store before the worker's wait, so the wakeup cannot be lost
+		std::lock_guard<std::mutex> async_guard(monitor.async_lock);
+		if (!monitor.async_worker.joinable())
+		{
+			monitor.async_worker = std::thread(mb_monitor_async_run, h, index);
+		}
+	}
+	monitor.async_cv.notify_one();
+}
+
+long mb_driver_flush(MBBaseStruct* h, unsigned long timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	if (!mb_ramp_wait(h, deadline, timeout == MB_INFINITE))
+	{
+		mb_error(MB_ERROR_TIMEOUT, L"flush timed out");
+		return 0;
+	}
+
+	long ret = 1;
+	unsigned long count = h->count();
+	for (unsigned long i = 0; i < count; i++)
+	{
+		MBMonitor* monitor = h->monitors[i].get();
+		std::unique_lock<std::mutex> async_guard(monitor->async_lock);
+		auto idle = [monitor]() { return !monitor->async_busy && monitor->pending.load() == MB_NO_PENDING; };
+		if (timeout == MB_INFINITE)
+		{
+			monitor->idle_cv.wait(async_guard, idle);
+		}
+		else if (!monitor->idle_cv.wait_until(async_guard, deadline, idle))
+		{
+			mb_error(MB_ERROR_TIMEOUT, L"flush timed out");
+			return 0;
+		}
+
+		if (monitor->async_error.code != MB_ERROR_NONE)
+		{
+			mb_error_restore(monitor->async_error);
+			monitor->async_error.code = MB_ERROR_NONE;
+			ret = 0;
+		}
+	}
+	return ret;
+}
+
+long mb_driver_get(MBBaseStruct* h, unsigned long index, double* percent)
+{
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+
+	std::lock_guard<MBStrand> guard(monitor.strand);
+	if (!mb_monitor_fresh(h, monitor) && !mb_monitor_sync(h, index, monitor))
+	{
+		return 0;
+	}
+
+	if (percent != nullptr)
+	{
+		*percent = monitor.max > monitor.min ? mb_monitor_percent(monitor, monitor.current) : 0.0;
+	}
+	return 1;
+}
+
+// reads and parses the capabilities string once, a failure is kept so a monitor without one is not asked again
+static bool mb_monitor_features(MBBaseStruct* h, unsigned long index, MBMonitor& monitor)
+{
+	if (!monitor.vcp_read)
+	{
+		char caps[MB_CAPS_MAX_LENGTH];
+		size_t length = 0;
+		uint64_t trace = mb_trace_begin(h);
+		bool ok = h->capabilities(index, caps, sizeof(caps), &length);
+		mb_trace_end(h, index, monitor, MB_TRACE_CAPS, ok, (unsigned long)length, 0, trace);
+		monitor.vcp_known = ok && mb_caps_parse(caps, length, &monitor.vcp);
+		monitor.vcp_error = mb_error_save();
+		monitor.vcp_read = true;
+	}
+	if (!monitor.vcp_known)
+	{
+		mb_error_restore(monitor.vcp_error);
+	}
+	return monitor.vcp_known;
+}
+
+long mb_driver_get_features(MBBaseStruct* h, unsigned long index, MB_VCP_FEATURES* features)
+{
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+
+	std::lock_guard<MBStrand> guard(monitor.strand);
+	if (monitor.state == MB_MONITOR_DETACHED)
+	{
+		mb_error(MB_ERROR_DETACHED, nullptr);
+		return 0;
+	}
+	if (!mb_monitor_features(h, index, monitor))
+	{
+		return 0;
+	}
+	if (features != nullptr)
+	{
+		*features = monitor.vcp;
+	}
+	return 1;
+}
+
+long mb_driver_get_vcp(MBBaseStruct* h, unsigned long index, MB_VCP_VALUE* values, unsigned long count)
+{
+	if (values == nullptr && count > 0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"values is nullptr");
+		return 0;
+	}
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+
+	// one turn on the strand for all codes, so the reads go out back to back and nothing is queued in between
+	std::lock_guard<MBStrand> guard(monitor.strand);
+	if (monitor.state == MB_MONITOR_DETACHED)
+	{
+		mb_error(MB_ERROR_DETACHED, nullptr);
+		return 0;
+	}
+
+	// without a capabilities string every code goes to the monitor, which answers for itself
+	bool filter = mb_monitor_features(h, index, monitor);
+
+	MBError first = { MB_ERROR_NONE, 0, nullptr };
+	for (unsigned long i = 0; i < count; i++)
+	{
+		MB_VCP_VALUE& value = values[i];
+		value.current = value.max = 0;
+
+		bool ok;
+		if (value.code > 0xFF)
+		{
+			mb_error(MB_ERROR_INVALID_ARGUMENT, L"VCP code out of range 0 .. 0xFF");
+			ok = false;
+		}
+		else if (filter && (monitor.vcp.bits[value.code / 64] & (1ull << (value.code % 64))) == 0)
+		{
+			mb_error(MB_ERROR_NOT_SUPPORTED, L"VCP code not in the monitor's capabilities");
+			ok = false;
+		}
+		else
+		{
+			uint64_t begin = mb_stats_begin(h);
+			uint64_t trace = mb_trace_begin(h);
+			ok = h->get_vcp(index, (uint8_t)value.code, &value.current, &value.max);
+			mb_trace_end(h, index, monitor, MB_TRACE_VCP, ok, ok ? value.current : 0, value.code, trace);
+			mb_stats_end(monitor.stats.get_latency, begin);
+			mb_stats_add(ok ? monitor.stats.get_ok : monitor.stats.get_failed, 1);
+		}
+
+		if (!ok)
+		{
+			value.result = mb_error_save().code;
+			first = first.code == MB_ERROR_NONE ? mb_error_save() : first;
+			continue;
+		}
+		value.result = MB_ERROR_NONE;
+
+		// the brightness feature is the raw value get() reads, so the read is as good as a sync
+		if (value.code == MB_VCP_BRIGHTNESS && mb_monitor_range(h, index, monitor))
+		{
+			monitor.current = value.current;
+			monitor.current_tick = mb_tick();
+			mb_snapshot_update(h, index, monitor);
+		}
+	}
+
+	if (first.code != MB_ERROR_NONE)
+	{
+		mb_error_restore(first);
+		return 0;
+	}
+	return 1;
+}
+
+long mb_driver_get_edid(MBBaseStruct* h, unsigned long index, MB_EDID_INFO* info)
+{
+	if (info == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"info is nullptr");
+		return 0;
+	}
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+
+	// a reattach replaces the EDID on the strand
+	MBMonitor& monitor = *h->monitors[index];
+	std::lock_guard<MBStrand> guard(monitor.strand);
+	return h->edid(index, info) ? 1 : 0;
+}
+
+long mb_driver_get_id(MBBaseStruct* h, unsigned long index, uint64_t* id)
+{
+	if (id == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"id is nullptr");
+		return 0;
+	}
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	*id = h->monitors[index]->identity;
+	return 1;
+}
+
+long mb_driver_find(MBBaseStruct* h, uint64_t id, unsigned long* index)
+{
+	if (id == 0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"0 is not a monitor id");
+		return 0;
+	}
+	size_t slot = mb_id_slot(id);
+	for (unsigned int probe = 0; probe < MB_ID_SLOTS && id != MB_ID_REMOVED; probe++, slot = (slot + 1) & (MB_ID_SLOTS - 1))
+	{
+		uint64_t key = h->id_keys[slot].load(std::memory_order_acquire);
+		if (key == id)
+		{
+			if (index != nullptr)
+			{
+				*index = h->id_values[slot].load(std::memory_order_relaxed);
+			}
+			return 1;
+		}
+		if (key == 0)
+		{
+			break;
+		}
+	}
+	mb_error(MB_ERROR_NOT_FOUND, L"no monitor with this id");
+	return 0;
+}
+
+long mb_driver_get_name(MBBaseStruct* h, unsigned long index, WCHAR* name, unsigned long max_length)
+{
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	return h->name(index, name, max_length);
+}
+
+static void mb_driver_hotplug_notify(MBBaseStruct* h, unsigned long index, long state)
+{
+	if (h->hotplug_callback != nullptr)
+	{
+		h->hotplug_callback(h->hotplug_context, h->handle, index, state);
+	}
+}
+
+bool mb_driver_hotplug_add(MBBaseStruct* h, const std::function<bool(unsigned long)>& add_device)
+{
+	unsigned long index;
+	{
+		std::lock_guard<std::mutex> hotplug_guard(h->hotplug_lock);
+		index = (unsigned long)h->monitors.size();
+		// past the reserved capacity an append would move the monitors under running calls
+		if (index >= MB_MAX_MONITORS || !add_device(index))
+		{
+			return false;
+		}
+
+		h->monitors.push_back(mb_monitor_create(h, index));
+		mb_driver_index_id(h, index);
+		h->monitor_count.store(index + 1, std::memory_order_release);
+		h->attached();
+	}
+	{
+		MBMonitor& monitor = *h->monitors[index];
+		std::lock_guard<MBStrand> guard(monitor.strand);
+		mb_snapshot_update(h, index, monitor);
+	}
+	mb_driver_hotplug_notify(h, index, MB_MONITOR_READY);
+	return true;
+}
+
+void mb_driver_hotplug_detach(MBBaseStruct* h, unsigned long index, const std::function<void()>& release)
+{
+	MBMonitor& monitor = *h->monitors[index];
+	if (monitor.ramping)
+	{
+		mb_ramp_cancel(h, index);
+	}
+	{
+		std::lock_guard<MBStrand> guard(monitor.strand);
+		release();
+		monitor.state = MB_MONITOR_DETACHED;
+		monitor.range_known = false;
+		mb_snapshot_update(h, index, monitor);
+	}
+	mb_driver_hotplug_notify(h, index, MB_MONITOR_DETACHED);
+}
+
+bool mb_driver_hotplug_reattach(MBBaseStruct* h, unsigned long index, const std::function<bool()>& acquire)
+{
+	MBMonitor& monitor = *h->monitors[index];
+	{
+		std::lock_guard<MBStrand> guard(monitor.strand);
+		if (!acquire())
+		{
+			return false;
+		}
+		// another display may have been plugged into the port, it is found by its own id from here on
+		uint64_t id;
+		uint64_t identity = h->identity(index, &id) ? id : 0;
+		uint64_t previous = monitor.identity.load(std::memory_order_relaxed);
+		if (identity != previous)
+		{
+			std::lock_guard<std::mutex> hotplug_guard(h->hotplug_lock);
+			mb_driver_unindex_id(h, previous, index);
+			monitor.identity.store(identity, std::memory_order_relaxed);
+			mb_driver_index_id(h, index);
+		}
+		// the display may have come back with other capabilities, the range is read again on first use
+		monitor.state = MB_MONITOR_READY;
+		monitor.range_known = false;
+		monitor.current_tick = 0;
+		mb_snapshot_update(h, index, monitor);
+	}
+	mb_driver_hotplug_notify(h, index, MB_MONITOR_READY);
+	return true;
+}
+
+long mb_driver_cleanup(MBBaseStruct* h)
+{
+	// lookups of the handle fail from here on, calls already running on other threads finish first
+	if (!mb_handle_retire(h))
+	{
+		return 0;
+	}
+
+	// stop the watcher, the auto brightness loop, the broker, the snapshot and the trace, then drain the ramps, probe and async workers before the driver goes away under them
+	{
+		std::lock_guard<std::mutex> watch_guard(h->watch_lock);
+		if (h->watching)
+		{
+			h->watch(false);
+			h->watching = false;
+		}
+	}
+	mb_auto_release(h);
+	mb_broker_release(h);
+	mb_snapshot_release(h);
+	mb_trace_release(h);
+	mb_ramp_cancel(h, MB_RAMP_ALL);
+	if (h->probe_worker.joinable())
+	{
+		h->probe_worker.join();
+	}
+	unsigned long count = h->count();
+	for (unsigned long i = 0; i < count; i++)
+	{
+		mb_monitor_async_stop(*h->monitors[i]);
+	}
+	h->close();
+	delete h;
+
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_get_count(void* handle, unsigned long* count)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_count(h, count);
+}
+
+MB_FUNCTION long MB_CONV mb_get_monitor_state(void* handle, unsigned long index)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_state(h, index);
+}
+
+MB_FUNCTION long MB_CONV mb_set_brightness(void* handle, unsigned long index, double percent)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_set(h, index, percent);
+}
+
+MB_FUNCTION long MB_CONV mb_set_brightness_batch(void* handle, const MB_BRIGHTNESS* requests, unsigned long count, long* results)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_set_batch(h, requests, count, results);
+}
+
+MB_FUNCTION long MB_CONV mb_submit_brightness(void* handle, unsigned long index, double percent)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_submit(h, index, percent);
+}
+
+MB_FUNCTION long MB_CONV mb_flush(void* handle, unsigned long timeout)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_flush(h, timeout);
+}
+
+MB_FUNCTION long MB_CONV mb_set_min_interval(void* handle, unsigned long index, unsigned long milliseconds)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+
+	std::lock_guard<MBStrand> guard(monitor.strand);
+	monitor.min_interval = milliseconds;
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_get_brightness(void* handle, unsigned long index, double* percent)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get(h, index, percent);
+}
+
+MB_FUNCTION long MB_CONV mb_set_cache_timeout(void* handle, unsigned long milliseconds)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	h->cache_timeout = milliseconds;
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_hotplug_start(void* handle, MB_HOTPLUG_CALLBACK callback, void* context)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> watch_guard(h->watch_lock);
+	if (h->watching)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"hotplug watcher already running");
+		return 0;
+	}
+	h->hotplug_callback = callback;
+	h->hotplug_context = context;
+	if (!h->watch(true))
+	{
+		return 0;
+	}
+	h->watching = true;
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_hotplug_stop(void* handle)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> watch_guard(h->watch_lock);
+	if (h->watching)
+	{
+		h->watch(false);
+		h->watching = false;
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_get_name(void* handle, unsigned long index, WCHAR* name, unsigned long max_length)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_name(h, index, name, max_length);
+}
+
+MB_FUNCTION long MB_CONV mb_cleanup(void* handle)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_cleanup(h);
+}
@@ -0,0 +1,243 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <string.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define MB_EDID_BLOCK			128
+#define MB_EDID_DESCRIPTORS		54
+#define MB_EDID_DESCRIPTOR_SIZE	18
+#define MB_EDID_NAME			0xFC
+#define MB_EDID_SERIAL_TEXT		0xFF
+
+#define MB_EDID_DEFAULT_ROOT	"/sys/class/drm"
+
+static const uint8_t mb_edid_header[] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+
+// descriptor text is up to 13 bytes, ended by a line feed and padded with spaces
+static void mb_edid_text(const uint8_t* text, char* out)
+{
+	size_t length = 0;
+	while (length < 13 && text[length] != 0x0A && text[length] != 0)
+	{
+		out[length] = text[length] >= 0x20 && text[length] < 0x7F ? (char)text[length] : '?';
+		length++;
+	}
+	while (length > 0 && out[length - 1] == ' ')
+	{
+		length--;
+	}
+	out[length] = '\0';
+}
+
+bool mb_edid_parse(const uint8_t* edid, size_t length, MB_EDID_INFO* info)
+{
+	if (length < MB_EDID_BLOCK || memcmp(edid, mb_edid_header, sizeof(mb_edid_header)) != 0)
+	{
+		mb_error(MB_ERROR_DDC_PROTOCOL, L"not an EDID");
+		return false;
+	}
+	uint8_t sum = 0;
+	for (size_t i = 0; i < MB_EDID_BLOCK; i++)
+	{
+		sum += edid[i];
+	}
+	if (sum != 0)
+	{
+		mb_error(MB_ERROR_DDC_CHECKSUM, nullptr);
+		return false;
+	}
+
+	memset(info, 0, sizeof(*info));
+
+	// three 5 bit letters, 1 is 'A'
+	uint16_t vendor = (uint16_t)((edid[8] << 8) | edid[9]);
+	for (int i = 0; i < 3; i++)
+	{
+		uint8_t letter = (vendor >> (10 - 5 * i)) & 0x1F;
+		info->manufacturer[i] = letter >= 1 && letter <= 26 ? (char)('@' + letter) : '?';
+	}
+	info->product = (uint16_t)(edid[10] | (edid[11] << 8));
+	info->serial = (uint32_t)edid[12] | ((uint32_t)edid[13] << 8) | ((uint32_t)edid[14] << 16) | ((uint32_t)edid[15] << 24);
+	info->week = edid[16];
+	info->year = (uint16_t)(1990 + edid[17]);
+
+	// display descriptors start with a zero pixel clock, detailed timings don't
+	for (size_t offset = MB_EDID_DESCRIPTORS; offset + MB_EDID_DESCRIPTOR_SIZE < MB_EDID_BLOCK; offset += MB_EDID_DESCRIPTOR_SIZE)
+	{
+		const uint8_t* descriptor = edid + offset;
+		if (descriptor[0] != 0 || descriptor[1] != 0)
+		{
+			continue;
+		}
+		if (descriptor[3] == MB_EDID_NAME)
+		{
+			mb_edid_text(descriptor + 5, info->name);
+		}
+		else if (descriptor[3] == MB_EDID_SERIAL_TEXT)
+		{
+			mb_edid_text(descriptor + 5, info->serial_text);
+		}
+	}
+	return true;
+}
+
+// serial numbers panels ship in place of a real one, every unit of the model carries the same
+static bool mb_edid_placeholder_serial(uint32_t serial)
+{
+	return serial == 0 || serial == 1 || serial == 0x01010101 || serial == 0xFFFFFFFF;
+}
+
+uint64_t mb_edid_identity(const MB_EDID_INFO& info, const void* port, size_t port_length)
+{
+	uint64_t id = mb_hash64(info.manufacturer, 3, MB_HASH64_INIT);
+	id = mb_hash64(&info.product, sizeof(info.product), id);
+	id = mb_hash64(&info.serial, sizeof(info.serial), id);
+	id = mb_hash64(info.serial_text, strlen(info.serial_text), id);
+	id = mb_hash64(info.name, strlen(info.name), id);
+
+	// two monitors of one model without real serial numbers are told apart by where they are plugged in
+	if (mb_edid_placeholder_serial(info.serial) && info.serial_text[0] == '\0' && port != nullptr)
+	{
+		id = mb_hash64(port, port_length, id);
+	}
+	return id != 0 ? id : 1;
+}
+
+#ifdef __linux__
+static std::mutex g_edid_lock;
+static std::string g_edid_root = MB_EDID_DEFAULT_ROOT;
+
+static bool mb_edid_owns(int root_fd, const char* connector, const char* device)
+{
+	// a DP AUX channel or a backlight sits below its connector, a DVI or HDMI bus is linked as ddc
+	std::string path = std::string(connector) + "/" + device;
+	if (faccessat(root_fd, path.c_str(), F_OK, 0) == 0)
+	{
+		return true;
+	}
+
+	char target[256];
+	path = std::string(connector) + "/ddc";
+	ssize_t size = readlinkat(root_fd, path.c_str(), target, sizeof(target) - 1);
+	if (size <= 0)
+	{
+		return false;
+	}
+	target[size] = '\0';
+	const char* name = strrchr(target, '/');
+	return strcmp(name != nullptr ? name + 1 : target, device) == 0;
+}
+
+bool mb_edid_find(const char* device, MB_EDID_INFO* info, uint64_t* id)
+{
+	std::string root;
+	{
+		std::lock_guard<std::mutex> guard(g_edid_lock);
+		root = g_edid_root;
+	}
+
+	int root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd < 0)
+	{
+		return false;
+	}
+	DIR* dir = fdopendir(dup(root_fd));
+	if (dir == nullptr)
+	{
+		close(root_fd);
+		return false;
+	}
+
+	bool found = false;
+	for (struct dirent* entry = readdir(dir); entry != nullptr && !found; entry = readdir(dir))
+	{
+		if (entry->d_name[0] == '.' || !mb_edid_owns(root_fd, entry->d_name, device))
+		{
+			continue;
+		}
+
+		// a connector without a monitor has an empty edid file
+		std::string path = std::string(entry->d_name) + "/edid";
+		int fd = openat(root_fd, path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			continue;
+		}
+		uint8_t edid[MB_EDID_BLOCK];
+		ssize_t size = pread(fd, edid, sizeof(edid), 0);
+		close(fd);
+
+		if (size == (ssize_t)sizeof(edid) && mb_edid_parse(edid, sizeof(edid), info))
+		{
+			*id = mb_edid_identity(*info, entry->d_name, strlen(entry->d_name));
+			found = true;
+		}
+	}
+	closedir(dir);
+	close(root_fd);
+	return found;
+}
+
+MB_FUNCTION long MB_CONV mb_set_edid_root(const char* path)
+{
+	std::lock_guard<std::mutex> guard(g_edid_lock);
+	g_edid_root = path != nullptr ? path : MB_EDID_DEFAULT_ROOT;
+	return 1;
+}
+#endif
+
+MB_FUNCTION long MB_CONV mb_parse_edid(const unsigned char* edid, unsigned long length, MB_EDID_INFO* info)
+{
+	if (edid == nullptr || info == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"edid or info is nullptr");
+		return 0;
+	}
+	return mb_edid_parse(edid, length, info) ? 1 : 0;
+}
+
+MB_FUNCTION long MB_CONV mb_get_edid_info(void* handle, unsigned long index, MB_EDID_INFO* info)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_edid(h, index, info);
+}
+
+MB_FUNCTION long MB_CONV mb_get_monitor_id(void* handle, unsigned long index, uint64_t* id)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_id(h, index, id);
+}
+
+MB_FUNCTION long MB_CONV mb_find_monitor(void* handle, uint64_t id, unsigned long* index)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_find(h, id, index);
+}
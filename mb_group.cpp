@@ -0,0 +1,265 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <map>
+
+#include <string.h>
+
+struct MBGroup
+{
+	std::vector<MB_GROUP_MEMBER> members;
+
+	// one per member for a group created by id, the index of the member is looked up from it on every call
+	// and kept in members under lock
+	std::vector<uint64_t> ids;
+
+	// one group call at a time, so two concurrent calls can not leave the members at different values
+	std::mutex lock;
+};
+
+static std::mutex g_group_lock;
+static std::map<std::string, std::shared_ptr<MBGroup>> g_groups;
+
+static std::shared_ptr<MBGroup> mb_group_find(const char* name)
+{
+	if (name == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"name is nullptr");
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> group_guard(g_group_lock);
+	auto it = g_groups.find(name);
+	if (it == g_groups.end())
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"no group with this name");
+		return nullptr;
+	}
+	return it->second;
+}
+
+// runs fn on every member at once, since the members wait on their devices rather than the CPU every one gets a thread,
+// results[i] receives what fn returned for member i and the first failure is reported on the calling thread
+static long mb_group_fan_out(MBGroup& group, long* results, const std::function<long(MBBaseStruct*, unsigned long, size_t)>& fn)
+{
+	size_t count = group.members.size();
+	std::vector<long> codes(count, 0);
+	std::vector<MBError> errors(count, MBError{ MB_ERROR_NONE, 0, nullptr });
+
+	mb_parallel_for(count, MB_MAX_MONITORS, [&](size_t i)
+	{
+		// a member whose handle was cleaned up or whose monitor is gone fails on its own, the others still run
+		MBHandle h(group.members[i].handle, MB_TYPE_NONE);
+		bool found = h && (group.ids.empty() || mb_driver_find(h, group.ids[i], &group.members[i].index));
+		codes[i] = found ? fn(h, group.members[i].index, i) : 0;
+		if (codes[i] == 0)
+		{
+			errors[i] = mb_error_save();
+		}
+	});
+
+	long ok = 1;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (results != nullptr)
+		{
+			results[i] = codes[i];
+		}
+		if (codes[i] == 0 && ok)
+		{
+			mb_error_restore(errors[i]);
+			ok = 0;
+		}
+	}
+	return ok;
+}
+
+static long mb_group_add(const char* name, std::shared_ptr<MBGroup> group)
+{
+	std::lock_guard<std::mutex> group_guard(g_group_lock);
+	if (!g_groups.emplace(name, std::move(group)).second)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"group already exists");
+		return 0;
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_group_create(const char* name, const MB_GROUP_MEMBER* members, unsigned long count)
+{
+	if (name == nullptr || name[0] == '\0')
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"name is empty");
+		return 0;
+	}
+	if (members == nullptr || count == 0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"a group needs at least one member");
+		return 0;
+	}
+
+	std::shared_ptr<MBGroup> group = std::make_shared<MBGroup>();
+	for (unsigned long i = 0; i < count; i++)
+	{
+		MBHandle h(members[i].handle, MB_TYPE_NONE);
+		if (!h)
+		{
+			return 0;
+		}
+		if (members[i].index >= h->count())
+		{
+			mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+			return 0;
+		}
+		for (unsigned long j = 0; j < i; j++)
+		{
+			if (members[j].handle == members[i].handle && members[j].index == members[i].index)
+			{
+				mb_error(MB_ERROR_INVALID_ARGUMENT, L"monitor listed twice");
+				return 0;
+			}
+		}
+		group->members.push_back(members[i]);
+	}
+
+	return mb_group_add(name, std::move(group));
+}
+
+MB_FUNCTION long MB_CONV mb_group_create_by_id(const char* name, const MB_GROUP_MONITOR* members, unsigned long count)
+{
+	if (name == nullptr || name[0] == '\0')
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"name is empty");
+		return 0;
+	}
+	if (members == nullptr || count == 0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"a group needs at least one member");
+		return 0;
+	}
+
+	std::shared_ptr<MBGroup> group = std::make_shared<MBGroup>();
+	for (unsigned long i = 0; i < count; i++)
+	{
+		MBHandle h(members[i].handle, MB_TYPE_NONE);
+		unsigned long index;
+		if (!h || !mb_driver_find(h, members[i].id, &index))
+		{
+			return 0;
+		}
+		for (unsigned long j = 0; j < i; j++)
+		{
+			if (members[j].handle == members[i].handle && members[j].id == members[i].id)
+			{
+				mb_error(MB_ERROR_INVALID_ARGUMENT, L"monitor listed twice");
+				return 0;
+			}
+		}
+		group->members.push_back({ members[i].handle, index });
+		group->ids.push_back(members[i].id);
+	}
+
+	return mb_group_add(name, std::move(group));
+}
+
+MB_FUNCTION long MB_CONV mb_group_delete(const char* name)
+{
+	if (name == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"name is nullptr");
+		return 0;
+	}
+
+	// a call still running on the group keeps it alive until it returns
+	std::lock_guard<std::mutex> group_guard(g_group_lock);
+	if (g_groups.erase(name) == 0)
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"no group with this name");
+		return 0;
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_group_get_members(const char* name, MB_GROUP_MEMBER* members, unsigned long max_count)
+{
+	std::shared_ptr<MBGroup> group = mb_group_find(name);
+	if (!group)
+	{
+		return 0;
+	}
+
+	// the indices of a group created by id change during group calls
+	std::lock_guard<std::mutex> guard(group->lock);
+	if (members != nullptr)
+	{
+		size_t count = MB_MIN(group->members.size(), (size_t)max_count);
+		memcpy(members, group->members.data(), sizeof(MB_GROUP_MEMBER) * count);
+	}
+	return (long)group->members.size();
+}
+
+MB_FUNCTION long MB_CONV mb_group_set_brightness(const char* name, double percent, long* results)
+{
+	std::shared_ptr<MBGroup> group = mb_group_find(name);
+	if (!group)
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(group->lock);
+	return mb_group_fan_out(*group, results, [percent](MBBaseStruct* h, unsigned long index, size_t)
+	{
+		bool written;
+		if (!mb_driver_set_changed(h, index, percent, &written))
+		{
+			return 0L;
+		}
+		return written ? (long)MB_GROUP_WRITTEN : (long)MB_GROUP_UNCHANGED;
+	});
+}
+
+MB_FUNCTION long MB_CONV mb_group_get_brightness(const char* name, double* percents, long* results)
+{
+	std::shared_ptr<MBGroup> group = mb_group_find(name);
+	if (!group)
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(group->lock);
+	return mb_group_fan_out(*group, results, [percents](MBBaseStruct* h, unsigned long index, size_t i)
+	{
+		double percent = 0.0;
+		long ok = mb_driver_get(h, index, &percent);
+		if (percents != nullptr)
+		{
+			percents[i] = percent;
+		}
+		return ok;
+	});
+}
+
+MB_FUNCTION long MB_CONV mb_group_ramp_brightness(const char* name, double percent, unsigned long duration, long easing, long* results)
+{
+	std::shared_ptr<MBGroup> group = mb_group_find(name);
+	if (!group)
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(group->lock);
+	return mb_group_fan_out(*group, results, [percent, duration, easing](MBBaseStruct* h, unsigned long index, size_t)
+	{
+		return mb_ramp_start(h, index, percent, duration, easing);
+	});
+}
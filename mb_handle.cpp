@@ -0,0 +1,150 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+// a handle is (generation << MB_HANDLE_SLOT_BITS) | slot, the generation is never 0 so no handle is nullptr
+#define MB_HANDLE_SLOT_BITS			10
+#define MB_MAX_HANDLES				(1u << MB_HANDLE_SLOT_BITS)
+#define MB_HANDLE_GENERATION_MASK	((uint32_t)(UINTPTR_MAX >> MB_HANDLE_SLOT_BITS))
+
+// slot state: generation in the high 32 bits, the live bit, the bit of a cleanup waiting for the calls to leave,
+// then the count of references held by running calls
+#define MB_SLOT_LIVE				0x80000000ull
+#define MB_SLOT_WAITING				0x40000000ull
+#define MB_SLOT_REFS				0x3FFFFFFFull
+
+struct MBHandleSlot
+{
+	std::atomic<uint64_t> state;
+	std::atomic<MBBaseStruct*> object;
+};
+
+// zero initialized: generation 0, dead, no references, so every slot is free and no handle matches it
+static MBHandleSlot g_handles[MB_MAX_HANDLES];
+static std::atomic<uint32_t> g_handle_next(0);
+
+// shared by all slots, a cleanup waits on it only while calls on its handle are still running
+static std::mutex g_retire_lock;
+static std::condition_variable g_retire_cv;
+
+static uint32_t mb_slot_generation(uint64_t state)
+{
+	return (uint32_t)(state >> 32);
+}
+
+static void mb_handle_release(uint32_t slot)
+{
+	uint64_t state = g_handles[slot].state.fetch_sub(1, std::memory_order_acq_rel);
+	// the last call a cleanup waits for wakes it, the cleanup holds the other reference
+	if ((state & MB_SLOT_WAITING) && (state & MB_SLOT_REFS) == 2)
+	{
+		std::lock_guard<std::mutex> guard(g_retire_lock);
+		g_retire_cv.notify_all();
+	}
+}
+
+bool mb_handle_register(MBBaseStruct* h)
+{
+	// start after the last slot handed out, so a closed handle's slot is the last to be reused
+	uint32_t start = g_handle_next.fetch_add(1, std::memory_order_relaxed);
+	for (uint32_t i = 0; i < MB_MAX_HANDLES; i++)
+	{
+		uint32_t slot = (start + i) % MB_MAX_HANDLES;
+		MBHandleSlot& entry = g_handles[slot];
+
+		// claim a dead slot nobody references any more by taking a reference, lookups still fail on the dead bit
+		uint64_t state = entry.state.load(std::memory_order_relaxed);
+		if ((state & (MB_SLOT_LIVE | MB_SLOT_REFS)) != 0 || !entry.state.compare_exchange_strong(state, state + 1, std::memory_order_acquire))
+		{
+			continue;
+		}
+
+		uint32_t generation = (mb_slot_generation(state) + 1) & MB_HANDLE_GENERATION_MASK;
+		if (generation == 0)
+		{
+			generation = 1;
+		}
+		entry.object.store(h, std::memory_order_relaxed);
+		h->slot = slot;
+		h->handle = (void*)(((uintptr_t)generation << MB_HANDLE_SLOT_BITS) | slot);
+		entry.state.store(((uint64_t)generation << 32) | MB_SLOT_LIVE, std::memory_order_release);
+		return true;
+	}
+
+	mb_error(MB_ERROR_TOO_MANY_HANDLES, nullptr);
+	return false;
+}
+
+bool mb_handle_retire(MBBaseStruct* h)
+{
+	MBHandleSlot& entry = g_handles[h->slot];
+	uint64_t state = entry.state.load(std::memory_order_relaxed);
+	do
+	{
+		// a concurrent cleanup of the same handle got here first
+		if (!(state & MB_SLOT_LIVE))
+		{
+			mb_error(MB_ERROR_INVALID_HANDLE, nullptr);
+			return false;
+		}
+	} while (!entry.state.compare_exchange_weak(state, (state & ~MB_SLOT_LIVE) | MB_SLOT_WAITING, std::memory_order_acq_rel));
+
+	// no new references can be taken now, wait for the calls already inside to leave, except the cleanup call itself.
+	// The last of them signals under g_retire_lock after its release, so the wakeup can not fall between check and wait
+	if ((state & MB_SLOT_REFS) > 1)
+	{
+		std::unique_lock<std::mutex> guard(g_retire_lock);
+		g_retire_cv.wait(guard, [&entry]()
+		{
+			return (entry.state.load(std::memory_order_acquire) & MB_SLOT_REFS) <= 1;
+		});
+	}
+	return true;
+}
+
+MBHandle::MBHandle(void* handle, unsigned char type) : h(nullptr), slot(0)
+{
+	// only the bits of the value are used, the caller's pointer is never dereferenced
+	uintptr_t value = (uintptr_t)handle;
+	uint32_t index = (uint32_t)(value & (MB_MAX_HANDLES - 1));
+	uint32_t generation = (uint32_t)(value >> MB_HANDLE_SLOT_BITS);
+	MBHandleSlot& entry = g_handles[index];
+
+	uint64_t state = entry.state.load(std::memory_order_relaxed);
+	do
+	{
+		if (generation == 0 || (value >> MB_HANDLE_SLOT_BITS) > MB_HANDLE_GENERATION_MASK ||
+			!(state & MB_SLOT_LIVE) || mb_slot_generation(state) != generation)
+		{
+			mb_error(MB_ERROR_INVALID_HANDLE, L"Invalid handle");
+			return;
+		}
+	} while (!entry.state.compare_exchange_weak(state, state + 1, std::memory_order_acquire));
+
+	MBBaseStruct* base = entry.object.load(std::memory_order_relaxed);
+	if (type != MB_TYPE_NONE && base->type != type)
+	{
+		mb_handle_release(index);
+		mb_error(MB_ERROR_INVALID_HANDLE, L"Invalid handle");
+		return;
+	}
+	h = base;
+	slot = index;
+}
+
+MBHandle::~MBHandle()
+{
+	if (h != nullptr)
+	{
+		mb_handle_release(slot);
+	}
+}
@@ -0,0 +1,545 @@
+#pragma once
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "mon_brightness.h"
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdint.h>
+
+#define MB_MIN(a,b)		a<b?a:b
+#define MB_TYPE_NONE	0
+#define MB_TYPE_DXVA2	1
+#define MB_TYPE_WMI		2
+#define MB_TYPE_IOCTL	3
+#define MB_TYPE_SYSFS	4
+#define MB_TYPE_DDCCI	5
+#define MB_TYPE_MOCK	6
+#define MB_TYPE_BROKER	7
+
+#define MB_MAX_WORKERS			8
+#define MB_MAX_MONITORS			64
+#define MB_DEFAULT_CACHE_TIMEOUT	1000
+
+#define MB_ERROR_TEXT_LENGTH	512
+
+// slots of the identity table, at most half of them are ever used so a lookup ends after a probe or two
+#define MB_ID_BITS				7
+#define MB_ID_SLOTS				(1u << MB_ID_BITS)
+// key of a slot whose monitor came back with another identity, probes go past it
+#define MB_ID_REMOVED			(~0ull)
+
+#ifdef _WIN32
+typedef DWORD MBSystemError;
+#else
+typedef int MBSystemError;
+#endif
+
+// a failure as recorded on the failing thread, message is static text (or the failing call for MB_ERROR_COM)
+struct MBError
+{
+	long code;
+	long system;
+	const wchar_t* message;
+};
+
+void mb_error(long code, const wchar_t* message);
+void mb_error_system(MBSystemError error);
+#ifdef _WIN32
+void mb_error_com(const wchar_t* context, HRESULT hr);
+#endif
+
+// move a failure from a worker thread to the thread that reports it
+MBError mb_error_save();
+void mb_error_restore(const MBError& error);
+
+// latency histogram behind MB_LATENCY_HISTOGRAM, every field is updated with relaxed atomics
+struct MBLatency
+{
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> total_us;
+	std::atomic<uint64_t> max_us;
+	std::atomic<uint64_t> buckets[MB_STATS_BUCKETS];
+
+	MBLatency();
+	void record(uint64_t us);
+	void snapshot(MB_LATENCY_HISTOGRAM* out, bool reset);
+};
+
+// per monitor counters behind mb_stats_snapshot, cheap enough to update from any thread on every call
+struct MBStats
+{
+	std::atomic<uint64_t> get_ok;
+	std::atomic<uint64_t> get_failed;
+	std::atomic<uint64_t> set_ok;
+	std::atomic<uint64_t> set_failed;
+	std::atomic<uint64_t> retries;
+	std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> bytes_sent;
+	std::atomic<uint64_t> bytes_received;
+	std::atomic<uint32_t> reply_delay_us;
+	std::atomic<uint32_t> command_delay_us;
+	MBLatency get_latency;
+	MBLatency set_latency;
+
+	MBStats();
+	void snapshot(MB_STATS* out, bool reset);
+};
+
+inline void mb_stats_add(std::atomic<uint64_t>& counter, uint64_t value)
+{
+	counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+// a FIFO lock: callers get the monitor in the order they asked for it, so a busy thread can not starve the others
+class MBStrand
+{
+public:
+	MBStrand();
+	MBStrand(const MBStrand&) = delete;
+	MBStrand& operator=(const MBStrand&) = delete;
+
+	void lock();
+	void unlock();
+
+private:
+	std::mutex mutex;
+	std::condition_variable cv;
+	uint64_t next_ticket;
+	uint64_t now_serving;
+};
+
+// the empty async slot, no double has these bits
+#define MB_NO_PENDING			0xFFFFFFFFFFFFFFFFull
+
+// state the common layer keeps for every monitor, whatever the driver
+struct MBMonitor
+{
+	// serializes driver calls on this monitor, calls on other monitors never wait for it
+	MBStrand strand;
+
+	// shadow of the device state, so range lookups and fresh reads never reach the device
+	bool range_known;
+	unsigned long min;
+	unsigned long max;
+	unsigned long current;
+	uint64_t current_tick;
+
+	// the device's minimum spacing between commands in milliseconds, and when the next one may be sent
+	unsigned long min_interval;
+	std::chrono::steady_clock::time_point next_write;
+
+	// async writes: one pending slot holding the bits of the newest percent, MB_NO_PENDING when empty
+	std::atomic<uint64_t> pending;
+	std::mutex async_lock;
+	std::condition_variable async_cv;
+	std::condition_variable idle_cv;
+	std::thread async_worker;
+	bool async_busy;
+	bool async_stop;
+	MBError async_error;
+
+	// MB_MONITOR_*, written by the init probe and whenever the range becomes known, probe_error is guarded by strand
+	std::atomic<long> state;
+	MBError probe_error;
+
+	// calibration as set by mb_set_calibration, compiled into the raw value at every 1 / MB_LUT_SIZE of percent
+	// whenever the range becomes known, so conversions never evaluate the curve
+	long curve;
+	std::vector<MB_CALIBRATION_POINT> curve_points;
+	std::vector<uint32_t> lut;
+
+	// stable identity from the driver, 0 when the monitor can not be recognized across runs,
+	// written under strand when the monitor is reattached, read without it by mb_get_monitor_id
+	std::atomic<uint64_t> identity;
+
+	// VCP codes from the capabilities string, read on first use and kept, vcp_error is why the read failed,
+	// all guarded by strand
+	bool vcp_read;
+	bool vcp_known;
+	MB_VCP_FEATURES vcp;
+	MBError vcp_error;
+
+	// set while the ramp scheduler owns this monitor, a direct write cancels the ramp
+	std::atomic<bool> ramping;
+
+	MBStats stats;
+
+	MBMonitor();
+};
+
+// ambient light control loop, see mb_auto.cpp
+struct MBAuto;
+
+// socket server sharing a handle with other processes, see mb_broker.cpp
+struct MBBroker;
+
+// shared memory copy of the monitor shadows, see mb_snapshot.cpp
+struct MBSnapshot;
+
+// ring file of driver calls, see mb_trace.cpp
+struct MBTrace;
+
+// a backend driver, the common layer in mb_driver.cpp does handle validation, caching, batching and async writes on top
+struct MBBaseStruct
+{
+public:
+	unsigned char type;
+
+	// the slot in the handle table and the opaque value callers hold, see mb_handle.cpp
+	uint32_t slot;
+	void* handle;
+
+	// only ever appended, capacity is reserved so a hotplug append never moves the elements other threads use,
+	// monitor_count publishes how many of them are complete
+	std::vector<std::unique_ptr<MBMonitor>> monitors;
+	std::atomic<unsigned long> monitor_count;
+	std::atomic<unsigned long> cache_timeout;
+
+	// background capability probe started by mb_driver_attach_probed, may outlive init
+	std::thread probe_worker;
+	std::mutex probe_lock;
+	std::condition_variable probe_cv;
+	unsigned long probe_remaining;
+
+	// time the driver calls for the latency histograms, see mb_stats_enable
+	std::atomic<bool> stats_enabled;
+
+	// serializes hotplug updates, the callback runs on the driver's watcher thread
+	std::mutex hotplug_lock;
+	MB_HOTPLUG_CALLBACK hotplug_callback;
+	void* hotplug_context;
+
+	// serializes starting and stopping the watcher, never held by the watcher itself
+	std::mutex watch_lock;
+	bool watching;
+
+	// the auto brightness loop started by mb_auto_start, nullptr when it is off
+	std::mutex auto_lock;
+	MBAuto* auto_loop;
+
+	// the broker started by mb_broker_serve, nullptr when the handle is not served
+	std::mutex broker_lock;
+	MBBroker* broker;
+
+	// the region mb_snapshot_publish writes every shadow change into, nullptr when the handle is not published
+	std::mutex snapshot_lock;
+	MBSnapshot* snapshot;
+
+	// the ring started by mb_trace_start, nullptr when calls are not traced. The lock only serializes start and stop,
+	// traced calls count themselves in trace_users instead so stop waits for them before it unmaps the ring
+	std::mutex trace_lock;
+	std::atomic<MBTrace*> trace;
+	std::atomic<uint32_t> trace_users;
+
+	// identity -> index for mb_find_monitor, open addressing with linear probing, 0 marks a free slot.
+	// Filled as monitors are published, a reattach replaces the key of its monitor by MB_ID_REMOVED,
+	// the index is stored before its key is released. Writers hold hotplug_lock once the handle is out
+	std::atomic<uint64_t> id_keys[MB_ID_SLOTS];
+	std::atomic<uint32_t> id_values[MB_ID_SLOTS];
+
+	MBBaseStruct()
+	{
+		slot = 0;
+		handle = nullptr;
+		monitors.reserve(MB_MAX_MONITORS);
+		monitor_count = 0;
+		cache_timeout = MB_DEFAULT_CACHE_TIMEOUT;
+		probe_remaining = 0;
+		stats_enabled = true;
+		hotplug_callback = nullptr;
+		hotplug_context = nullptr;
+		watching = false;
+		auto_loop = nullptr;
+		broker = nullptr;
+		snapshot = nullptr;
+		trace = nullptr;
+		trace_users = 0;
+		for (unsigned int i = 0; i < MB_ID_SLOTS; i++)
+		{
+			id_keys[i] = 0;
+			id_values[i] = 0;
+		}
+	}
+
+	virtual ~MBBaseStruct()
+	{
+	}
+
+	// number of monitors other threads may use, including detached ones
+	unsigned long count() const
+	{
+		return monitor_count.load(std::memory_order_acquire);
+	}
+
+	// number of monitors, called once when the handle is created
+	virtual unsigned long enumerate() = 0;
+
+	// called once the monitors exist, e.g. to let the devices count into monitors[index]->stats
+	virtual void attached()
+	{
+	}
+
+	// index is always in range, a failure returns false after recording the reason with mb_error*()
+	virtual bool get_range(unsigned long index, unsigned long* min, unsigned long* max) = 0;
+	virtual bool get(unsigned long index, unsigned long* value) = 0;
+	virtual bool set(unsigned long index, unsigned long value) = 0;
+	virtual long name(unsigned long index, WCHAR* name, unsigned long max_length) = 0;
+
+	// the slow capability query run once per monitor by mb_driver_attach_probed, by default just the range
+	virtual bool probe(unsigned long index, unsigned long* min, unsigned long* max)
+	{
+		return get_range(index, min, max);
+	}
+
+	// minimum milliseconds between two commands to one monitor, the common layer spaces writes accordingly
+	virtual unsigned long min_interval(unsigned long index)
+	{
+		return 0;
+	}
+
+	// a hash that names the same physical monitor in every process, e.g. from its EDID, false if there is none
+	virtual bool identity(unsigned long index, uint64_t* id)
+	{
+		return false;
+	}
+
+	// the MCCS capabilities string without a terminator, length receives its size
+	virtual bool capabilities(unsigned long index, char* caps, size_t max_length, size_t* length)
+	{
+		mb_error(MB_ERROR_NOT_SUPPORTED, L"backend can not read monitor capabilities");
+		return false;
+	}
+
+	// read any VCP feature, unlike get() the value is not translated into the backend's brightness range
+	virtual bool get_vcp(unsigned long index, uint8_t code, unsigned long* current, unsigned long* max)
+	{
+		mb_error(MB_ERROR_NOT_SUPPORTED, L"backend can not read VCP features");
+		return false;
+	}
+
+	// the monitor's parsed EDID, false if the backend could not read it
+	virtual bool edid(unsigned long index, MB_EDID_INFO* info)
+	{
+		mb_error(MB_ERROR_NOT_SUPPORTED, L"backend can not read EDIDs");
+		return false;
+	}
+
+	// drop a monitor whose probe failed before the handle is returned, false keeps it listed as MB_MONITOR_FAILED
+	virtual bool remove(unsigned long index)
+	{
+		return false;
+	}
+
+	// start or stop watching for monitors being plugged and unplugged, see mb_driver_hotplug_*
+	virtual bool watch(bool enable)
+	{
+		mb_error(MB_ERROR_NOT_SUPPORTED, L"backend can not watch for hotplug");
+		return false;
+	}
+
+	// release the devices, no driver call is made afterwards
+	virtual void close() = 0;
+};
+
+// run fn(0) .. fn(count - 1) on at most max_workers threads, the calling thread is one of them
+void mb_parallel_for(size_t count, size_t max_workers, const std::function<void(size_t)>& fn);
+
+#define MB_HASH64_INIT			0xCBF29CE484222325ull
+
+uint64_t mb_hash64(const void* data, size_t length, uint64_t hash);
+
+// what a cache record knows, a store only replaces the parts its record carries
+#define MB_CACHE_NO_BRIGHTNESS	0x1
+#define MB_CACHE_RANGE			0x2
+#define MB_CACHE_TIMING			0x4
+
+// one monitor in the capability cache file, see mb_cache.cpp
+struct MBCacheRecord
+{
+	uint64_t id;
+	uint32_t min;
+	uint32_t max;
+	uint32_t flags;
+	uint32_t reserved;
+
+	// learned DDC/CI delays and the ones that last failed, in microseconds, see mb_ddcci.cpp
+	uint32_t reply_delay_us;
+	uint32_t reply_failed_us;
+	uint32_t command_delay_us;
+	uint32_t command_failed_us;
+};
+
+// read only mapping of the capability cache, empty if there is no valid cache file
+struct MBCacheView
+{
+	const MBCacheRecord* records;
+	uint32_t count;
+
+	MBCacheView();
+	~MBCacheView();
+	MBCacheView(const MBCacheView&) = delete;
+	MBCacheView& operator=(const MBCacheView&) = delete;
+
+	bool open();
+	const MBCacheRecord* find(uint64_t id) const;
+
+private:
+	void* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+};
+
+// merge records into the cache file, failures are ignored since the cache only saves time
+void mb_cache_store(const std::vector<MBCacheRecord>& records);
+
+// byte transport to a DDC/CI display (I2C slave 0x37), the protocol never touches the bus directly
+struct MBDdcTransport
+{
+	virtual ~MBDdcTransport() {}
+	virtual bool write(const uint8_t* data, size_t length) = 0;
+	virtual bool read(uint8_t* data, size_t length) = 0;
+};
+
+#ifdef __linux__
+// connect to the display on a bus, nullptr when the bus can not be opened
+typedef std::function<std::unique_ptr<MBDdcTransport>(const std::string& name)> MBDdcConnect;
+
+// build a DDC/CI handle over the named buses, displays that don't answer VCP 0x10 are dropped.
+// The watcher lists root for bus nodes coming and going, an empty root can not be watched
+MBBaseStruct* mb_ddcci_open(const std::string& root, std::vector<std::string> names, MBDdcConnect connect);
+#endif
+
+// handle table, see mb_handle.cpp
+bool mb_handle_register(MBBaseStruct* h);
+bool mb_handle_retire(MBBaseStruct* h);
+
+// a counted reference to the driver behind a caller's handle, mb_cleanup waits until every other one is gone
+class MBHandle
+{
+public:
+	MBHandle(void* handle, unsigned char type);
+	~MBHandle();
+	MBHandle(const MBHandle&) = delete;
+	MBHandle& operator=(const MBHandle&) = delete;
+
+	explicit operator bool() const { return h != nullptr; }
+	operator MBBaseStruct*() const { return h; }
+	MBBaseStruct* operator->() const { return h; }
+	MBBaseStruct* get() const { return h; }
+
+private:
+	MBBaseStruct* h;
+	uint32_t slot;
+};
+
+// common layer, see mb_driver.cpp
+bool mb_driver_attach(MBBaseStruct* h, void** handle);
+bool mb_driver_attach_probed(MBBaseStruct* h, void** handle, unsigned long deadline);
+long mb_driver_get_state(MBBaseStruct* h, unsigned long index);
+long mb_driver_get_count(MBBaseStruct* h, unsigned long* count);
+long mb_driver_set(MBBaseStruct* h, unsigned long index, double percent);
+long mb_driver_set_changed(MBBaseStruct* h, unsigned long index, double percent, bool* written);
+long mb_driver_set_batch(MBBaseStruct* h, const MB_BRIGHTNESS* requests, unsigned long count, long* results);
+long mb_driver_submit(MBBaseStruct* h, unsigned long index, double percent);
+void mb_monitor_submit(MBBaseStruct* h, unsigned long index, double percent);
+long mb_driver_flush(MBBaseStruct* h, unsigned long timeout);
+long mb_driver_get(MBBaseStruct* h, unsigned long index, double* percent);
+long mb_driver_get_features(MBBaseStruct* h, unsigned long index, MB_VCP_FEATURES* features);
+long mb_driver_get_vcp(MBBaseStruct* h, unsigned long index, MB_VCP_VALUE* values, unsigned long count);
+long mb_driver_get_edid(MBBaseStruct* h, unsigned long index, MB_EDID_INFO* info);
+long mb_driver_get_id(MBBaseStruct* h, unsigned long index, uint64_t* id);
+long mb_driver_find(MBBaseStruct* h, uint64_t id, unsigned long* index);
+long mb_driver_get_name(MBBaseStruct* h, unsigned long index, WCHAR* name, unsigned long max_length);
+long mb_driver_cleanup(MBBaseStruct* h);
+
+// hotplug updates from a driver's watcher, indices of other monitors never change
+bool mb_driver_hotplug_add(MBBaseStruct* h, const std::function<bool(unsigned long)>& add_device);
+void mb_driver_hotplug_detach(MBBaseStruct* h, unsigned long index, const std::function<void()>& release);
+bool mb_driver_hotplug_reattach(MBBaseStruct* h, unsigned long index, const std::function<bool()>& acquire);
+
+// latency measurement around driver calls, see mb_stats.cpp
+uint64_t mb_stats_begin(MBBaseStruct* h);
+void mb_stats_end(MBLatency& latency, uint64_t begin);
+
+// calibration tables, see mb_calibration.cpp, all of them run on the monitor's strand
+#define MB_LUT_BITS				10
+#define MB_LUT_SIZE				(1u << MB_LUT_BITS)
+
+void mb_monitor_calibrate(MBMonitor& monitor);
+unsigned long mb_monitor_value(const MBMonitor& monitor, double percent);
+double mb_monitor_percent(const MBMonitor& monitor, unsigned long value);
+
+// ramp scheduler, see mb_ramp.cpp
+#define MB_RAMP_ALL				0xFFFFFFFF
+
+long mb_ramp_start(MBBaseStruct* h, unsigned long index, double percent, unsigned long duration, long easing);
+void mb_ramp_cancel(MBBaseStruct* h, unsigned long index);
+bool mb_ramp_wait(MBBaseStruct* h, std::chrono::steady_clock::time_point deadline, bool infinite);
+
+// EDID parsing, see mb_edid.cpp
+bool mb_edid_parse(const uint8_t* edid, size_t length, MB_EDID_INFO* info);
+
+// the stable id of an EDID, port names the connector and is only mixed in when the EDID has no serial number
+uint64_t mb_edid_identity(const MB_EDID_INFO& info, const void* port, size_t port_length);
+
+#ifdef __linux__
+// the EDID and id of the DRM connector owning device, e.g. "i2c-3" or "intel_backlight", false when none does
+bool mb_edid_find(const char* device, MB_EDID_INFO* info, uint64_t* id);
+
+// a kernel uevent, the fields point into the buffer it was received into, see mb_sysfs.cpp
+struct MBUevent
+{
+	const char* action;
+	const char* subsystem;
+	const char* devpath;
+
+	// the last component of devpath, e.g. "i2c-3"
+	const char* name;
+};
+
+// the kernel's uevent socket, -1 when it can not be opened
+int mb_uevent_open();
+bool mb_uevent_read(int fd, char* buffer, size_t size, MBUevent* event);
+#endif
+
+// MCCS capabilities, see mb_vcp.cpp, strings longer than MB_CAPS_MAX_LENGTH are refused
+#define MB_CAPS_MAX_LENGTH		4096
+
+bool mb_caps_parse(const char* caps, size_t length, MB_VCP_FEATURES* features);
+
+// ambient light control loop, see mb_auto.cpp
+void mb_auto_release(MBBaseStruct* h);
+
+// broker daemon, see mb_broker.cpp
+void mb_broker_release(MBBaseStruct* h);
+
+// shared memory snapshot, see mb_snapshot.cpp, updates run on the monitor's strand
+void mb_snapshot_update(MBBaseStruct* h, unsigned long index, const MBMonitor& monitor);
+void mb_snapshot_release(MBBaseStruct* h);
+
+// one past the last MB_TRACE_* op
+#define MB_TRACE_OPS			6
+
+// driver call tracing, see mb_trace.cpp, begin returns 0 when the handle is not traced and end then does nothing
+uint64_t mb_trace_begin(MBBaseStruct* h);
+void mb_trace_end(MBBaseStruct* h, unsigned long index, const MBMonitor& monitor, unsigned char op, bool ok, unsigned long value, unsigned long min, uint64_t begin);
+void mb_trace_release(MBBaseStruct* h);
+bool mb_trace_load(const char* path, std::vector<MB_TRACE_RECORD>& records);
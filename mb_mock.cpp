@@ -0,0 +1,469 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <chrono>
+
+#include <string.h>
+
+#ifdef _WIN32
+#define MB_MOCK_FAILURE	ERROR_GEN_FAILURE
+#else
+#define MB_MOCK_FAILURE	EIO
+#endif
+
+// what a typical desktop monitor reports, brightness and contrast included
+#define MB_MOCK_CAPABILITIES	"(prot(monitor)type(lcd)model(mock)cmds(01 02 03 07 0C E3 F3)vcp(02 04 05 08 0B 0C 10 12 14(01 05 06 08 0B) " \
+								"16 18 1A 52 60(0F 11 12) 62 AC AE B2 B6 C6 C8 CA D6(01 04 05) DF)mccs_ver(2.1))"
+
+// one recorded call a replaying mock answers with, see mb_mock_init_replay
+struct MBMockStep
+{
+	uint32_t latency_us;
+	unsigned char result;
+};
+
+struct MBMockDevice
+{
+	unsigned long value;
+	unsigned long min;
+	unsigned long max;
+	uint64_t identity;
+	MB_EDID_INFO edid;
+
+	// recorded calls per MB_TRACE_* op, answered in order and from the start again when used up,
+	// an op without steps falls back to the configured latency and failure rate
+	std::vector<MBMockStep> steps[MB_TRACE_OPS];
+	size_t next_step[MB_TRACE_OPS];
+
+	// xorshift64 state, only touched on the monitor's strand so every device has its own reproducible sequence
+	uint64_t rng;
+
+	std::atomic<unsigned long> reads;
+	std::atomic<unsigned long> writes;
+
+	// set while a command is in flight
+	std::atomic<bool> busy;
+
+	MBMockDevice() : reads(0), writes(0), busy(false)
+	{
+		value = min = max = 0;
+		identity = 0;
+		memset(&edid, 0, sizeof(edid));
+		rng = 0;
+		for (auto& step : next_step)
+		{
+			step = 0;
+		}
+	}
+};
+
+struct MBMockStruct : public MBBaseStruct
+{
+public:
+	MB_MOCK_CONFIG config;
+	std::vector<std::unique_ptr<MBMockDevice>> devices;
+
+	// the codes in MB_MOCK_CAPABILITIES, a read of any other one fails like on a real monitor
+	MB_VCP_FEATURES features;
+
+	MBMockStruct()
+	{
+		type = MB_TYPE_MOCK;
+		mb_caps_parse(MB_MOCK_CAPABILITIES, sizeof(MB_MOCK_CAPABILITIES) - 1, &features);
+	}
+
+	uint64_t next_random(MBMockDevice& device)
+	{
+		device.rng ^= device.rng << 13;
+		device.rng ^= device.rng >> 7;
+		device.rng ^= device.rng << 17;
+		return device.rng;
+	}
+
+	// waits the configured latency, then decides whether the call fails
+	bool simulate(MBMockDevice& device, unsigned char op)
+	{
+		// a real display garbles overlapping commands, the mock fails them so a missing serialization shows in tests
+		if (device.busy.exchange(true))
+		{
+			mb_error(MB_ERROR_DEVICE, L"overlapping commands on one monitor");
+			return false;
+		}
+		bool ok = device.steps[op].empty() ? respond(device) : replay(device, op);
+		device.busy = false;
+		return ok;
+	}
+
+	bool replay(MBMockDevice& device, unsigned char op)
+	{
+		const MBMockStep& step = device.steps[op][device.next_step[op]];
+		device.next_step[op] = (device.next_step[op] + 1) % device.steps[op].size();
+		std::this_thread::sleep_for(std::chrono::microseconds(step.latency_us));
+
+		if (step.result == MB_ERROR_SYSTEM)
+		{
+			mb_error_system(MB_MOCK_FAILURE);
+			return false;
+		}
+		if (step.result != MB_ERROR_NONE)
+		{
+			mb_error(step.result, nullptr);
+			return false;
+		}
+		return true;
+	}
+
+	bool respond(MBMockDevice& device)
+	{
+		long long latency = config.latency_us;
+		if (config.jitter_us > 0)
+		{
+			latency += (long long)(next_random(device) % (2ull * config.jitter_us + 1)) - (long long)config.jitter_us;
+		}
+		if (latency > 0)
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(latency));
+		}
+
+		if (config.failure_rate > 0.0 && (double)(next_random(device) >> 11) / (double)(1ull << 53) < config.failure_rate)
+		{
+			mb_error_system(MB_MOCK_FAILURE);
+			return false;
+		}
+		return true;
+	}
+
+	unsigned long enumerate() override
+	{
+		return (unsigned long)devices.size();
+	}
+
+	bool get_range(unsigned long index, unsigned long* min, unsigned long* max) override
+	{
+		MBMockDevice& device = *devices[index];
+		device.reads++;
+		if (!simulate(device, MB_TRACE_RANGE))
+		{
+			return false;
+		}
+		*min = device.min;
+		*max = device.max;
+		return true;
+	}
+
+	bool get(unsigned long index, unsigned long* value) override
+	{
+		MBMockDevice& device = *devices[index];
+		device.reads++;
+		if (!simulate(device, MB_TRACE_GET))
+		{
+			return false;
+		}
+		*value = device.value;
+		return true;
+	}
+
+	bool set(unsigned long index, unsigned long value) override
+	{
+		MBMockDevice& device = *devices[index];
+		device.writes++;
+		if (!simulate(device, MB_TRACE_SET))
+		{
+			return false;
+		}
+		device.value = value;
+		return true;
+	}
+
+	bool capabilities(unsigned long index, char* caps, size_t max_length, size_t* length) override
+	{
+		MBMockDevice& device = *devices[index];
+		device.reads++;
+		if (!simulate(device, MB_TRACE_CAPS))
+		{
+			return false;
+		}
+		*length = MB_MIN(sizeof(MB_MOCK_CAPABILITIES) - 1, max_length);
+		memcpy(caps, MB_MOCK_CAPABILITIES, *length);
+		return true;
+	}
+
+	bool get_vcp(unsigned long index, uint8_t code, unsigned long* current, unsigned long* max) override
+	{
+		MBMockDevice& device = *devices[index];
+		device.reads++;
+		if (!simulate(device, MB_TRACE_VCP))
+		{
+			return false;
+		}
+		if ((features.bits[code / 64] & (1ull << (code % 64))) == 0)
+		{
+			mb_error(MB_ERROR_NOT_SUPPORTED, L"VCP code not supported by monitor");
+			return false;
+		}
+
+		// brightness is the value set() writes, every other feature sits in the middle of 0 .. 100
+		*current = code == MB_VCP_BRIGHTNESS ? device.value : 50;
+		*max = code == MB_VCP_BRIGHTNESS ? device.max : 100;
+		return true;
+	}
+
+	bool identity(unsigned long index, uint64_t* id) override
+	{
+		*id = devices[index]->identity;
+		return true;
+	}
+
+	bool edid(unsigned long index, MB_EDID_INFO* info) override
+	{
+		*info = devices[index]->edid;
+		return true;
+	}
+
+	long name(unsigned long index, WCHAR* monitor_name, unsigned long max_length) override
+	{
+		std::wstring name = L"Mock Monitor " + std::to_wstring(index);
+		if (monitor_name != nullptr)
+		{
+			memcpy(monitor_name, name.data(), MB_MIN(sizeof(WCHAR) * name.length(), sizeof(WCHAR) * max_length));
+		}
+		return (long)name.length();
+	}
+
+	void close() override
+	{
+	}
+};
+
+// a valid EDID base block, a mock monitor is the same one again when the seed and the range it reports are the same
+static void mb_mock_edid(const MB_MOCK_CONFIG* config, unsigned long index, uint8_t* edid)
+{
+	static const uint8_t header[] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+	memset(edid, 0, 128);
+	memcpy(edid, header, sizeof(header));
+
+	// "MCK", product code and serial little endian
+	uint16_t vendor = (13 << 10) | (3 << 5) | 11;
+	uint64_t key[] = { config->seed, index, config->min, config->max };
+	uint32_t serial = (uint32_t)mb_hash64(key, sizeof(key), MB_HASH64_INIT) | 1;
+	edid[8] = (uint8_t)(vendor >> 8);
+	edid[9] = (uint8_t)vendor;
+	edid[10] = (uint8_t)index;
+	edid[11] = (uint8_t)(index >> 8);
+	for (int i = 0; i < 4; i++)
+	{
+		edid[12 + i] = (uint8_t)(serial >> (8 * i));
+	}
+	edid[16] = 1;
+	edid[17] = 2018 - 1990;
+	edid[18] = 1;
+	edid[19] = 4;
+
+	// name descriptor, text ended by a line feed
+	const char name[] = "Mock Monitor\n";
+	edid[54 + 3] = 0xFC;
+	memcpy(edid + 54 + 5, name, sizeof(name) - 1);
+
+	uint8_t sum = 0;
+	for (int i = 0; i < 127; i++)
+	{
+		sum += edid[i];
+	}
+	edid[127] = (uint8_t)(0x100 - sum);
+}
+
+static MBMockStruct* mb_mock_create(const MB_MOCK_CONFIG* config)
+{
+	if (config == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"config is nullptr");
+		return nullptr;
+	}
+	if (config->max <= config->min)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"max must be greater than min");
+		return nullptr;
+	}
+	if (config->failure_rate < 0.0 || config->failure_rate > 1.0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"failure_rate out of range 0 .. 1");
+		return nullptr;
+	}
+
+	MBMockStruct* h = new MBMockStruct();
+	h->config = *config;
+	for (unsigned long i = 0; i < config->monitor_count; i++)
+	{
+		std::unique_ptr<MBMockDevice> device = std::make_unique<MBMockDevice>();
+		device->value = device->min = config->min;
+		device->max = config->max;
+		device->rng = ((uint64_t)config->seed << 16) ^ (0x9E3779B97F4A7C15ull * (i + 1));
+
+		uint8_t edid[128];
+		mb_mock_edid(config, i, edid);
+		mb_edid_parse(edid, sizeof(edid), &device->edid);
+		device->identity = mb_edid_identity(device->edid, nullptr, 0);
+		h->devices.push_back(std::move(device));
+	}
+	return h;
+}
+
+MB_FUNCTION long MB_CONV mb_mock_init(void** handle, const MB_MOCK_CONFIG* config)
+{
+	MBMockStruct* h = mb_mock_create(config);
+	if (h == nullptr)
+	{
+		return 0;
+	}
+
+	if (handle != nullptr)
+	{
+		if (!mb_driver_attach(h, handle))
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		delete h;
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_mock_init_ex(void** handle, const MB_MOCK_CONFIG* config, unsigned long deadline)
+{
+	MBMockStruct* h = mb_mock_create(config);
+	if (h == nullptr)
+	{
+		return 0;
+	}
+
+	if (handle != nullptr)
+	{
+		if (!mb_driver_attach_probed(h, handle, deadline))
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		delete h;
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_mock_init_replay(void** handle, const char* trace_path)
+{
+	std::vector<MB_TRACE_RECORD> records;
+	if (!mb_trace_load(trace_path, records))
+	{
+		return 0;
+	}
+	unsigned long count = 0;
+	for (auto& record : records)
+	{
+		count = record.index + 1ul > count ? record.index + 1ul : count;
+	}
+	if (count == 0 || count > MB_MAX_MONITORS)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"trace has no usable monitors");
+		return 0;
+	}
+
+	MB_MOCK_CONFIG config;
+	memset(&config, 0, sizeof(config));
+	config.monitor_count = count;
+	config.max = 100;
+	MBMockStruct* h = mb_mock_create(&config);
+	if (h == nullptr)
+	{
+		return 0;
+	}
+
+	// each monitor starts with the id, range and value the trace saw first, every call then takes its recorded time
+	std::vector<bool> ranged(count, false);
+	std::vector<bool> seeded(count, false);
+	std::vector<bool> named(count, false);
+	for (auto& record : records)
+	{
+		MBMockDevice& device = *h->devices[record.index];
+		if (record.op >= MB_TRACE_OPS)
+		{
+			continue;
+		}
+		device.steps[record.op].push_back(MBMockStep{ record.duration_us, record.result });
+		if (!named[record.index] && record.identity != 0)
+		{
+			device.identity = record.identity;
+			named[record.index] = true;
+		}
+		if (record.result != MB_ERROR_NONE)
+		{
+			continue;
+		}
+		if (record.op == MB_TRACE_RANGE)
+		{
+			if (!ranged[record.index] && record.value > record.min)
+			{
+				device.min = record.min;
+				device.max = record.value;
+				ranged[record.index] = true;
+			}
+		}
+		else if ((record.op == MB_TRACE_GET || record.op == MB_TRACE_SET || (record.op == MB_TRACE_VCP && record.min == MB_VCP_BRIGHTNESS)) &&
+			!seeded[record.index])
+		{
+			device.value = record.value;
+			seeded[record.index] = true;
+		}
+	}
+
+	if (handle != nullptr)
+	{
+		if (!mb_driver_attach(h, handle))
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		delete h;
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_mock_get_calls(void* handle, unsigned long index, unsigned long* reads, unsigned long* writes)
+{
+	MBHandle base(handle, MB_TYPE_MOCK);
+	if (!base)
+	{
+		return 0;
+	}
+	MBMockStruct* h = (MBMockStruct*)base.get();
+
+	if (index >= h->devices.size())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+
+	if (reads != nullptr)
+	{
+		*reads = h->devices[index]->reads;
+	}
+	if (writes != nullptr)
+	{
+		*writes = h->devices[index]->writes;
+	}
+	return 1;
+}
@@ -0,0 +1,258 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+// steps are never closer than this, even for a device without a command interval
+#define MB_RAMP_PERIOD		std::chrono::milliseconds(16)
+
+typedef std::chrono::steady_clock MBClock;
+
+struct MBRamp
+{
+	MBBaseStruct* h;
+	unsigned long index;
+
+	double from;
+	double to;
+	long easing;
+
+	MBClock::time_point start;
+	MBClock::time_point end;
+	MBClock::time_point next;
+	std::chrono::milliseconds period;
+};
+
+// one scheduler thread serves every ramp of every handle, it exits when the last ramp is done
+static std::mutex g_ramp_lock;
+static std::condition_variable g_ramp_cv;
+static std::condition_variable g_ramp_done_cv;
+static std::vector<MBRamp> g_ramps;
+static bool g_ramp_running = false;
+
+static double mb_ease(long easing, double t)
+{
+	switch (easing)
+	{
+	case MB_EASE_IN:
+		return t * t;
+	case MB_EASE_OUT:
+		return t * (2.0 - t);
+	case MB_EASE_IN_OUT:
+		return t * t * (3.0 - 2.0 * t);
+	default:
+		return t;
+	}
+}
+
+static double mb_ramp_value(const MBRamp& ramp, MBClock::time_point now)
+{
+	if (now >= ramp.end)
+	{
+		return ramp.to;
+	}
+	double t = std::chrono::duration<double>(now - ramp.start).count() / std::chrono::duration<double>(ramp.end - ramp.start).count();
+	return ramp.from + (ramp.to - ramp.from) * mb_ease(ramp.easing, t);
+}
+
+static MBRamp* mb_ramp_find(MBBaseStruct* h, unsigned long index)
+{
+	for (auto& ramp : g_ramps)
+	{
+		if (ramp.h == h && ramp.index == index)
+		{
+			return &ramp;
+		}
+	}
+	return nullptr;
+}
+
+static void mb_ramp_run()
+{
+	std::unique_lock<std::mutex> ramp_guard(g_ramp_lock);
+	while (!g_ramps.empty())
+	{
+		MBClock::time_point now = MBClock::now();
+		MBClock::time_point wake = MBClock::time_point::max();
+
+		for (size_t i = 0; i < g_ramps.size();)
+		{
+			MBRamp& ramp = g_ramps[i];
+			if (now >= ramp.next)
+			{
+				// the value is taken for the current time, so a step that comes late replaces the ones it missed,
+				// and the device's async slot drops whatever it could not write in time
+				mb_monitor_submit(ramp.h, ramp.index, mb_ramp_value(ramp, now));
+				if (now >= ramp.end)
+				{
+					ramp.h->monitors[ramp.index]->ramping = false;
+					g_ramps.erase(g_ramps.begin() + i);
+					g_ramp_done_cv.notify_all();
+					continue;
+				}
+
+				// the last step lands exactly on the end time
+				ramp.next = now + ramp.period < ramp.end ? now + ramp.period : ramp.end;
+			}
+			if (ramp.next < wake)
+			{
+				wake = ramp.next;
+			}
+			i++;
+		}
+
+		if (!g_ramps.empty())
+		{
+			g_ramp_cv.wait_until(ramp_guard, wake);
+		}
+	}
+	g_ramp_running = false;
+}
+
+void mb_ramp_cancel(MBBaseStruct* h, unsigned long index)
+{
+	std::lock_guard<std::mutex> ramp_guard(g_ramp_lock);
+	for (size_t i = 0; i < g_ramps.size();)
+	{
+		if (g_ramps[i].h == h && (index == MB_RAMP_ALL || g_ramps[i].index == index))
+		{
+			// a step still waiting in the async slot belongs to the fade, it must not land after whatever cancelled it
+			MBMonitor& monitor = *h->monitors[g_ramps[i].index];
+			if (monitor.pending.exchange(MB_NO_PENDING) != MB_NO_PENDING)
+			{
+				mb_stats_add(monitor.stats.dropped, 1);
+			}
+			monitor.ramping = false;
+			g_ramps.erase(g_ramps.begin() + i);
+			continue;
+		}
+		i++;
+	}
+	g_ramp_done_cv.notify_all();
+}
+
+bool mb_ramp_wait(MBBaseStruct* h, MBClock::time_point deadline, bool infinite)
+{
+	std::unique_lock<std::mutex> ramp_guard(g_ramp_lock);
+	auto done = [h]()
+	{
+		for (auto& ramp : g_ramps)
+		{
+			if (ramp.h == h)
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+
+	if (infinite)
+	{
+		g_ramp_done_cv.wait(ramp_guard, done);
+		return true;
+	}
+	return g_ramp_done_cv.wait_until(ramp_guard, deadline, done);
+}
+
+long mb_ramp_start(MBBaseStruct* h, unsigned long index, double percent, unsigned long duration, long easing)
+{
+	if (percent < 0.0 || percent > 1.0)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"percent out of range 0 .. 1");
+		return 0;
+	}
+	if (easing < MB_EASE_LINEAR || easing > MB_EASE_IN_OUT)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"unknown easing");
+		return 0;
+	}
+	if (index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+	MBMonitor& monitor = *h->monitors[index];
+
+	MBRamp ramp;
+	ramp.h = h;
+	ramp.index = index;
+	ramp.to = percent;
+	ramp.easing = easing;
+	{
+		std::lock_guard<MBStrand> guard(monitor.strand);
+		ramp.period = MB_RAMP_PERIOD > std::chrono::milliseconds(monitor.min_interval) ? MB_RAMP_PERIOD : std::chrono::milliseconds(monitor.min_interval);
+	}
+
+	// a new ramp on a monitor that is still fading continues from where the old one is now, otherwise from the monitor
+	std::unique_lock<std::mutex> ramp_guard(g_ramp_lock);
+	MBRamp* running = mb_ramp_find(h, index);
+	if (running != nullptr)
+	{
+		ramp.from = mb_ramp_value(*running, MBClock::now());
+	}
+	else
+	{
+		ramp_guard.unlock();
+		if (!mb_driver_get(h, index, &ramp.from))
+		{
+			// a device that can only be written (WMI) fades from the last value written to it, without one it is
+			// set to the target at once
+			MBError error = mb_error_save();
+			if (error.code != MB_ERROR_NOT_SUPPORTED)
+			{
+				return 0;
+			}
+			std::lock_guard<MBStrand> guard(monitor.strand);
+			if (monitor.range_known && monitor.current_tick != 0 && monitor.max > monitor.min)
+			{
+				ramp.from = mb_monitor_percent(monitor, monitor.current);
+			}
+			else
+			{
+				ramp.from = percent;
+				duration = 0;
+			}
+		}
+		ramp_guard.lock();
+		running = mb_ramp_find(h, index);
+	}
+
+	ramp.start = MBClock::now();
+	ramp.end = ramp.start + std::chrono::milliseconds(duration);
+	ramp.next = ramp.start;
+	if (running != nullptr)
+	{
+		*running = ramp;
+	}
+	else
+	{
+		monitor.ramping = true;
+		g_ramps.push_back(ramp);
+	}
+
+	if (!g_ramp_running)
+	{
+		g_ramp_running = true;
+		std::thread(mb_ramp_run).detach();
+	}
+	g_ramp_cv.notify_one();
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_ramp_brightness(void* handle, unsigned long index, double percent, unsigned long duration, long easing)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_ramp_start(h, index, percent, duration, easing);
+}
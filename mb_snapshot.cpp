@@ -0,0 +1,469 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MB_SNAPSHOT_MAGIC		0x5353424Du	// "MBSS"
+#define MB_SNAPSHOT_VERSION		2
+
+// a reader spins this many times on a record being written, then yields to a writer that may have been preempted
+// inside the write. A record still not readable after MB_SNAPSHOT_MAX_WAIT ms belongs to a publisher that died in one
+#define MB_SNAPSHOT_SPINS		1024
+#define MB_SNAPSHOT_MAX_WAIT	100
+
+// the region is a header and MB_MAX_MONITORS records, each on its own cache line so readers of one monitor never
+// share a line with the writer of another
+struct alignas(64) MBSnapshotHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t capacity;
+	std::atomic<uint32_t> count;
+	std::atomic<uint32_t> live;
+	// process id of the publisher, it stays after the publisher is gone and a dead one gives the region up
+	std::atomic<uint32_t> owner;
+};
+
+// a seqlock: the sequence is odd while the writer is inside, a reader retries when it saw an odd or changed sequence
+struct alignas(64) MBSnapshotRecord
+{
+	std::atomic<uint64_t> sequence;
+	std::atomic<uint64_t> percent;
+	std::atomic<uint64_t> identity;
+	std::atomic<uint64_t> updated_us;
+	std::atomic<uint32_t> state;
+	std::atomic<uint32_t> has_value;
+};
+
+struct MBSnapshotRegion
+{
+	MBSnapshotHeader header;
+	MBSnapshotRecord records[MB_MAX_MONITORS];
+};
+
+// other processes map the same bytes, so every field must be a plain lock free atomic
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free, "snapshot needs lock free atomics");
+static_assert(sizeof(MBSnapshotRecord) == 64, "snapshot record layout changed");
+
+struct MBSnapshot
+{
+	std::string name;
+	MBSnapshotRegion* region;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+	bool owner;
+
+	MBSnapshot()
+	{
+		region = nullptr;
+#ifdef _WIN32
+		mapping = nullptr;
+#endif
+		owner = false;
+	}
+
+	~MBSnapshot()
+	{
+		if (region == nullptr)
+		{
+			return;
+		}
+		if (owner)
+		{
+			// readers still mapping the region see it stop being live. The owner pid stays, so a publisher that
+			// opened the name just before the unlink is refused instead of publishing into the orphaned region
+			region->header.live.store(0, std::memory_order_release);
+		}
+#ifdef _WIN32
+		UnmapViewOfFile(region);
+		CloseHandle(mapping);
+#else
+		munmap(region, sizeof(MBSnapshotRegion));
+		if (owner)
+		{
+			// the name was claimed by this process, nobody takes it over while the process lives
+			shm_unlink(name.c_str());
+		}
+#endif
+	}
+};
+
+static std::string mb_snapshot_name(const char* name)
+{
+#ifdef _WIN32
+	return name != nullptr ? name : "Local\\mon_brightness";
+#else
+	// POSIX shared memory names are one path component starting with a slash
+	std::string result = name != nullptr ? name : "mon_brightness-" + std::to_string(getuid());
+	return result[0] == '/' ? result : "/" + result;
+#endif
+}
+
+static uint32_t mb_snapshot_pid()
+{
+#ifdef _WIN32
+	return (uint32_t)GetCurrentProcessId();
+#else
+	return (uint32_t)getpid();
+#endif
+}
+
+static bool mb_snapshot_alive(uint32_t pid)
+{
+	if (pid == 0)
+	{
+		return false;
+	}
+#ifdef _WIN32
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+	if (process == nullptr)
+	{
+		return GetLastError() == ERROR_ACCESS_DENIED;
+	}
+	bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+	return alive;
+#else
+	return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+static bool mb_snapshot_map(MBSnapshot* s, bool create)
+{
+#ifdef _WIN32
+	if (create)
+	{
+		s->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(MBSnapshotRegion), s->name.c_str());
+	}
+	else
+	{
+		s->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, s->name.c_str());
+	}
+	if (s->mapping == nullptr)
+	{
+		mb_error_system(GetLastError());
+		return false;
+	}
+	s->region = (MBSnapshotRegion*)MapViewOfFile(s->mapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, sizeof(MBSnapshotRegion));
+	if (s->region == nullptr)
+	{
+		mb_error_system(GetLastError());
+		return false;
+	}
+#else
+	// a publisher creates the name exclusively, an existing one is opened and claimed by mb_snapshot_claim
+	int fd = shm_open(s->name.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDONLY, 0644);
+	bool created = fd >= 0 && create;
+	if (fd < 0 && create && errno == EEXIST)
+	{
+		fd = shm_open(s->name.c_str(), O_RDWR, 0);
+	}
+	if (fd < 0)
+	{
+		mb_error_system(errno);
+		return false;
+	}
+	struct stat st;
+	if ((created && ftruncate(fd, sizeof(MBSnapshotRegion)) != 0) || fstat(fd, &st) != 0)
+	{
+		mb_error_system(errno);
+		::close(fd);
+		if (created)
+		{
+			shm_unlink(s->name.c_str());
+		}
+		return false;
+	}
+	if ((size_t)st.st_size < sizeof(MBSnapshotRegion))
+	{
+		// another publisher created the name and has not sized it yet
+		if (create)
+		{
+			mb_error(MB_ERROR_IN_USE, L"snapshot name is being published by another process");
+		}
+		else
+		{
+			mb_error(MB_ERROR_NOT_FOUND, L"snapshot region is not published");
+		}
+		::close(fd);
+		return false;
+	}
+	void* mapped = mmap(nullptr, sizeof(MBSnapshotRegion), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		mb_error_system(errno);
+		return false;
+	}
+	s->region = (MBSnapshotRegion*)mapped;
+#endif
+	return true;
+}
+
+// take the region for this process, it stays with a live owner, one in this process included
+static bool mb_snapshot_claim(MBSnapshot* s)
+{
+	MBSnapshotHeader& header = s->region->header;
+	if (header.magic != 0 && header.magic != MB_SNAPSHOT_MAGIC)
+	{
+		mb_error(MB_ERROR_IN_USE, L"snapshot name holds a region of another kind");
+		return false;
+	}
+	uint32_t pid = mb_snapshot_pid();
+	uint32_t owner = header.owner.load(std::memory_order_acquire);
+	do
+	{
+		if (mb_snapshot_alive(owner))
+		{
+			mb_error(MB_ERROR_IN_USE, L"snapshot name is published by another handle");
+			return false;
+		}
+	} while (!header.owner.compare_exchange_weak(owner, pid, std::memory_order_acq_rel));
+	s->owner = true;
+	return true;
+}
+
+void mb_snapshot_update(MBBaseStruct* h, unsigned long index, const MBMonitor& monitor)
+{
+	std::lock_guard<std::mutex> snapshot_guard(h->snapshot_lock);
+	MBSnapshot* s = h->snapshot;
+	if (s == nullptr || index >= MB_MAX_MONITORS)
+	{
+		return;
+	}
+
+	MBSnapshotRecord& record = s->region->records[index];
+	bool has_value = monitor.range_known && monitor.current_tick != 0 && monitor.max > monitor.min;
+	double percent = has_value ? mb_monitor_percent(monitor, monitor.current) : 0.0;
+	uint64_t percent_bits;
+	memcpy(&percent_bits, &percent, sizeof(percent_bits));
+	uint64_t now = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+	// writers are serialized by snapshot_lock, so the sequence has no other writer between the two stores
+	uint64_t sequence = record.sequence.load(std::memory_order_relaxed);
+	record.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	record.percent.store(percent_bits, std::memory_order_relaxed);
+	record.identity.store(monitor.identity, std::memory_order_relaxed);
+	record.updated_us.store(now, std::memory_order_relaxed);
+	record.state.store((uint32_t)monitor.state.load(), std::memory_order_relaxed);
+	record.has_value.store(has_value ? 1 : 0, std::memory_order_relaxed);
+	record.sequence.store(sequence + 2, std::memory_order_release);
+
+	if (index >= s->region->header.count.load(std::memory_order_relaxed))
+	{
+		s->region->header.count.store(index + 1, std::memory_order_release);
+	}
+}
+
+void mb_snapshot_release(MBBaseStruct* h)
+{
+	MBSnapshot* s;
+	{
+		std::lock_guard<std::mutex> snapshot_guard(h->snapshot_lock);
+		s = h->snapshot;
+		h->snapshot = nullptr;
+	}
+	delete s;
+}
+
+MB_FUNCTION long MB_CONV mb_snapshot_publish(void* handle, const char* name)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	{
+		std::lock_guard<std::mutex> snapshot_guard(h->snapshot_lock);
+		if (h->snapshot != nullptr)
+		{
+			mb_error(MB_ERROR_INVALID_ARGUMENT, L"handle is already published");
+			return 0;
+		}
+
+		std::unique_ptr<MBSnapshot> s = std::make_unique<MBSnapshot>();
+		s->name = mb_snapshot_name(name);
+		if (!mb_snapshot_map(s.get(), true) || !mb_snapshot_claim(s.get()))
+		{
+			return 0;
+		}
+
+		// whatever a publisher that died left behind is overwritten, readers that kept it mapped see the new values
+		MBSnapshotHeader& header = s->region->header;
+		header.live.store(0, std::memory_order_relaxed);
+		header.magic = MB_SNAPSHOT_MAGIC;
+		header.version = MB_SNAPSHOT_VERSION;
+		header.record_size = sizeof(MBSnapshotRecord);
+		header.capacity = MB_MAX_MONITORS;
+		header.count.store(0, std::memory_order_relaxed);
+		for (auto& record : s->region->records)
+		{
+			record.sequence.store(0, std::memory_order_relaxed);
+		}
+		h->snapshot = s.release();
+	}
+
+	// every monitor is written once now, afterwards each change of its shadow publishes it again
+	unsigned long count = h->count();
+	for (unsigned long i = 0; i < count; i++)
+	{
+		MBMonitor& monitor = *h->monitors[i];
+		std::lock_guard<MBStrand> guard(monitor.strand);
+		mb_snapshot_update(h, i, monitor);
+	}
+
+	std::lock_guard<std::mutex> snapshot_guard(h->snapshot_lock);
+	if (h->snapshot != nullptr)
+	{
+		h->snapshot->region->header.live.store(1, std::memory_order_release);
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_snapshot_unpublish(void* handle)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	mb_snapshot_release(h);
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_snapshot_open(void** reader, const char* name)
+{
+	if (reader == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"reader is nullptr");
+		return 0;
+	}
+
+	std::unique_ptr<MBSnapshot> s = std::make_unique<MBSnapshot>();
+	s->name = mb_snapshot_name(name);
+	if (!mb_snapshot_map(s.get(), false))
+	{
+		return 0;
+	}
+	const MBSnapshotHeader& header = s->region->header;
+	if (header.magic != MB_SNAPSHOT_MAGIC || header.version != MB_SNAPSHOT_VERSION || header.record_size != sizeof(MBSnapshotRecord))
+	{
+		mb_error(MB_ERROR_NOT_SUPPORTED, L"snapshot region from another library version");
+		return 0;
+	}
+
+	*reader = s.release();
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_snapshot_get_count(void* reader, unsigned long* count)
+{
+	MBSnapshot* s = (MBSnapshot*)reader;
+	if (s == nullptr || count == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"reader or count is nullptr");
+		return 0;
+	}
+
+	const MBSnapshotHeader& header = s->region->header;
+	if (!header.live.load(std::memory_order_acquire))
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"snapshot is not published");
+		return 0;
+	}
+	*count = header.count.load(std::memory_order_acquire);
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_snapshot_read(void* reader, unsigned long index, MB_SNAPSHOT_MONITOR* monitor)
+{
+	MBSnapshot* s = (MBSnapshot*)reader;
+	if (s == nullptr || monitor == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"reader or monitor is nullptr");
+		return 0;
+	}
+
+	const MBSnapshotHeader& header = s->region->header;
+	if (!header.live.load(std::memory_order_acquire))
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"snapshot is not published");
+		return 0;
+	}
+	if (index >= header.count.load(std::memory_order_acquire))
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+
+	const MBSnapshotRecord& record = s->region->records[index];
+	std::chrono::steady_clock::time_point deadline;
+	for (unsigned int spin = 0;; spin++)
+	{
+		if (spin >= MB_SNAPSHOT_SPINS)
+		{
+			if (spin == MB_SNAPSHOT_SPINS)
+			{
+				deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(MB_SNAPSHOT_MAX_WAIT);
+			}
+			else if (std::chrono::steady_clock::now() > deadline)
+			{
+				break;
+			}
+			std::this_thread::yield();
+		}
+		uint64_t before = record.sequence.load(std::memory_order_acquire);
+		if (before & 1)
+		{
+			continue;
+		}
+		uint64_t percent_bits = record.percent.load(std::memory_order_relaxed);
+		monitor->identity = record.identity.load(std::memory_order_relaxed);
+		monitor->updated_us = record.updated_us.load(std::memory_order_relaxed);
+		monitor->state = (long)record.state.load(std::memory_order_relaxed);
+		monitor->has_value = (long)record.has_value.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (record.sequence.load(std::memory_order_relaxed) == before)
+		{
+			memcpy(&monitor->percent, &percent_bits, sizeof(monitor->percent));
+			monitor->version = before / 2;
+			return 1;
+		}
+	}
+	mb_error(MB_ERROR_TIMEOUT, L"snapshot writer did not finish");
+	return 0;
+}
+
+MB_FUNCTION long MB_CONV mb_snapshot_close(void* reader)
+{
+	if (reader == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"reader is nullptr");
+		return 0;
+	}
+	delete (MBSnapshot*)reader;
+	return 1;
+}
@@ -0,0 +1,188 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static uint64_t mb_stats_read(std::atomic<uint64_t>& counter, bool reset)
+{
+	return reset ? counter.exchange(0, std::memory_order_relaxed) : counter.load(std::memory_order_relaxed);
+}
+
+static unsigned int mb_stats_bucket(uint64_t us)
+{
+	if (us < 2)
+	{
+		return 0;
+	}
+
+	unsigned int bucket;
+#ifdef _MSC_VER
+	// _BitScanReverse64 is missing on 32 bit targets, anything past 32 bits lands in the last bucket anyway
+	if (us > 0xFFFFFFFFull)
+	{
+		return MB_STATS_BUCKETS - 1;
+	}
+	unsigned long bit;
+	_BitScanReverse(&bit, (unsigned long)us);
+	bucket = (unsigned int)bit;
+#else
+	bucket = 63u - (unsigned int)__builtin_clzll(us);
+#endif
+	return bucket < MB_STATS_BUCKETS ? bucket : MB_STATS_BUCKETS - 1;
+}
+
+MBLatency::MBLatency() : count(0), total_us(0), max_us(0)
+{
+	for (auto& bucket : buckets)
+	{
+		bucket.store(0, std::memory_order_relaxed);
+	}
+}
+
+void MBLatency::record(uint64_t us)
+{
+	mb_stats_add(count, 1);
+	mb_stats_add(total_us, us);
+	mb_stats_add(buckets[mb_stats_bucket(us)], 1);
+
+	uint64_t max = max_us.load(std::memory_order_relaxed);
+	while (us > max && !max_us.compare_exchange_weak(max, us, std::memory_order_relaxed))
+	{
+	}
+}
+
+void MBLatency::snapshot(MB_LATENCY_HISTOGRAM* out, bool reset)
+{
+	out->count = mb_stats_read(count, reset);
+	out->total_us = mb_stats_read(total_us, reset);
+	out->max_us = mb_stats_read(max_us, reset);
+	for (unsigned int i = 0; i < MB_STATS_BUCKETS; i++)
+	{
+		out->buckets[i] = mb_stats_read(buckets[i], reset);
+	}
+}
+
+MBStats::MBStats() : get_ok(0), get_failed(0), set_ok(0), set_failed(0), retries(0), dropped(0), bytes_sent(0), bytes_received(0),
+	reply_delay_us(0), command_delay_us(0)
+{
+}
+
+void MBStats::snapshot(MB_STATS* out, bool reset)
+{
+	out->get_ok = mb_stats_read(get_ok, reset);
+	out->get_failed = mb_stats_read(get_failed, reset);
+	out->set_ok = mb_stats_read(set_ok, reset);
+	out->set_failed = mb_stats_read(set_failed, reset);
+	out->retries = mb_stats_read(retries, reset);
+	out->dropped = mb_stats_read(dropped, reset);
+	out->bytes_sent = mb_stats_read(bytes_sent, reset);
+	out->bytes_received = mb_stats_read(bytes_received, reset);
+	out->reply_delay_us = reply_delay_us.load(std::memory_order_relaxed);
+	out->command_delay_us = command_delay_us.load(std::memory_order_relaxed);
+	get_latency.snapshot(&out->get_latency, reset);
+	set_latency.snapshot(&out->set_latency, reset);
+}
+
+static void mb_latency_add(MB_LATENCY_HISTOGRAM* sum, const MB_LATENCY_HISTOGRAM& latency)
+{
+	sum->count += latency.count;
+	sum->total_us += latency.total_us;
+	sum->max_us = sum->max_us > latency.max_us ? sum->max_us : latency.max_us;
+	for (unsigned int i = 0; i < MB_STATS_BUCKETS; i++)
+	{
+		sum->buckets[i] += latency.buckets[i];
+	}
+}
+
+uint64_t mb_stats_begin(MBBaseStruct* h)
+{
+	if (!h->stats_enabled.load(std::memory_order_relaxed))
+	{
+		return 0;
+	}
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void mb_stats_end(MBLatency& latency, uint64_t begin)
+{
+	if (begin == 0)
+	{
+		return;
+	}
+	uint64_t end = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	latency.record((end - begin) / 1000);
+}
+
+MB_FUNCTION long MB_CONV mb_stats_snapshot(void* handle, unsigned long index, MB_STATS* stats, long reset)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	if (stats == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"stats is nullptr");
+		return 0;
+	}
+	if (index != MB_STATS_ALL && index >= h->count())
+	{
+		mb_error(MB_ERROR_INDEX_OUT_OF_RANGE, L"index out of range");
+		return 0;
+	}
+
+	if (index != MB_STATS_ALL)
+	{
+		h->monitors[index]->stats.snapshot(stats, reset != 0);
+		return 1;
+	}
+
+	memset(stats, 0, sizeof(MB_STATS));
+	unsigned long count = h->count();
+	for (unsigned long i = 0; i < count; i++)
+	{
+		MBMonitor* monitor = h->monitors[i].get();
+		MB_STATS one;
+		monitor->stats.snapshot(&one, reset != 0);
+		stats->get_ok += one.get_ok;
+		stats->get_failed += one.get_failed;
+		stats->set_ok += one.set_ok;
+		stats->set_failed += one.set_failed;
+		stats->retries += one.retries;
+		stats->dropped += one.dropped;
+		stats->bytes_sent += one.bytes_sent;
+		stats->bytes_received += one.bytes_received;
+		stats->reply_delay_us = stats->reply_delay_us > one.reply_delay_us ? stats->reply_delay_us : one.reply_delay_us;
+		stats->command_delay_us = stats->command_delay_us > one.command_delay_us ? stats->command_delay_us : one.command_delay_us;
+		mb_latency_add(&stats->get_latency, one.get_latency);
+		mb_latency_add(&stats->set_latency, one.set_latency);
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_stats_enable(void* handle, long enable)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	h->stats_enabled.store(enable != 0, std::memory_order_relaxed);
+	return 1;
+}
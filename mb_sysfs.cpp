@@ -0,0 +1,630 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#ifdef __linux__
+#include <algorithm>
+#include <map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#define MB_SYSFS_DEFAULT_ROOT	"/sys/class/backlight"
+
+struct MBSysfsDevice
+{
+	// never changes once the device is listed, read without the strand
+	std::string name;
+
+	// kept open for the lifetime of the handle, a write is a single pwrite()
+	int brightness_fd;
+	unsigned long max_brightness;
+
+	// from the panel's DRM connector, identity is 0 when no connector owns the backlight
+	MB_EDID_INFO edid;
+	uint64_t identity;
+};
+
+static bool mb_sysfs_read_ulong(int fd, unsigned long* value)
+{
+	char buffer[32];
+	ssize_t size = pread(fd, buffer, sizeof(buffer) - 1, 0);
+	if (size <= 0)
+	{
+		if (size == 0)
+		{
+			errno = EINVAL;
+		}
+		return false;
+	}
+	buffer[size] = '\0';
+
+	char* end = nullptr;
+	errno = 0;
+	*value = strtoul(buffer, &end, 10);
+	if (errno != 0 || end == buffer)
+	{
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+static bool mb_sysfs_write_ulong(int fd, unsigned long value)
+{
+	// formatted backwards into a stack buffer, no allocation on the write path
+	char buffer[24];
+	char* end = buffer + sizeof(buffer);
+	char* begin = end;
+	*--begin = '\n';
+	do
+	{
+		*--begin = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	ssize_t size = end - begin;
+	return pwrite(fd, begin, size, 0) == size;
+}
+
+int mb_uevent_open()
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	struct sockaddr_nl address;
+	memset(&address, 0, sizeof(address));
+	address.nl_family = AF_NETLINK;
+	address.nl_groups = 1;
+	if (fd >= 0 && bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+// a uevent is a run of KEY=value strings, false for one that lacks what a watcher needs
+bool mb_uevent_read(int fd, char* buffer, size_t size, MBUevent* event)
+{
+	ssize_t length = recv(fd, buffer, size - 1, 0);
+	if (length <= 0)
+	{
+		return false;
+	}
+	buffer[length] = '\0';
+
+	event->action = nullptr;
+	event->subsystem = nullptr;
+	event->devpath = nullptr;
+	for (char* p = buffer; p < buffer + length; p += strlen(p) + 1)
+	{
+		if (strncmp(p, "ACTION=", 7) == 0)
+		{
+			event->action = p + 7;
+		}
+		else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+		{
+			event->subsystem = p + 10;
+		}
+		else if (strncmp(p, "DEVPATH=", 8) == 0)
+		{
+			event->devpath = p + 8;
+		}
+	}
+	if (event->action == nullptr || event->subsystem == nullptr || event->devpath == nullptr)
+	{
+		return false;
+	}
+
+	const char* name = strrchr(event->devpath, '/');
+	event->name = name != nullptr ? name + 1 : event->devpath;
+	return true;
+}
+
+static bool mb_sysfs_open_device(int root_fd, const char* name, MBSysfsDevice& device)
+{
+	device.brightness_fd = -1;
+	int dir_fd = openat(root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0)
+	{
+		return false;
+	}
+
+	int max_fd = openat(dir_fd, "max_brightness", O_RDONLY | O_CLOEXEC);
+	if (max_fd < 0)
+	{
+		close(dir_fd);
+		return false;
+	}
+	bool ok = mb_sysfs_read_ulong(max_fd, &device.max_brightness) && device.max_brightness > 0;
+	close(max_fd);
+
+	if (ok)
+	{
+		// without write permission the device is still readable
+		device.brightness_fd = openat(dir_fd, "brightness", O_RDWR | O_CLOEXEC);
+		if (device.brightness_fd < 0 && errno == EACCES)
+		{
+			device.brightness_fd = openat(dir_fd, "brightness", O_RDONLY | O_CLOEXEC);
+		}
+		ok = device.brightness_fd >= 0;
+	}
+	close(dir_fd);
+
+	device.name = name;
+	device.identity = 0;
+	if (ok)
+	{
+		mb_edid_find(name, &device.edid, &device.identity);
+	}
+	return ok;
+}
+
+struct MBSysfsStruct : public MBBaseStruct
+{
+public:
+	// reserved like monitors, a hotplug append never moves a device a running call uses
+	std::vector<MBSysfsDevice> devices;
+
+	std::string root;
+	std::thread watcher;
+	int watch_stop_fd;
+
+	MBSysfsStruct()
+	{
+		type = MB_TYPE_SYSFS;
+		devices.reserve(MB_MAX_MONITORS);
+		watch_stop_fd = -1;
+	}
+
+	unsigned long enumerate() override
+	{
+		return (unsigned long)devices.size();
+	}
+
+	bool get_range(unsigned long index, unsigned long* min, unsigned long* max) override
+	{
+		*min = 0;
+		*max = devices[index].max_brightness;
+		return true;
+	}
+
+	bool get(unsigned long index, unsigned long* value) override
+	{
+		if (!mb_sysfs_read_ulong(devices[index].brightness_fd, value))
+		{
+			mb_error_system(errno);
+			return false;
+		}
+		return true;
+	}
+
+	bool set(unsigned long index, unsigned long value) override
+	{
+		if (!mb_sysfs_write_ulong(devices[index].brightness_fd, value))
+		{
+			mb_error_system(errno);
+			return false;
+		}
+		return true;
+	}
+
+	bool identity(unsigned long index, uint64_t* id) override
+	{
+		*id = devices[index].identity;
+		return *id != 0;
+	}
+
+	bool edid(unsigned long index, MB_EDID_INFO* info) override
+	{
+		if (devices[index].identity == 0)
+		{
+			mb_error(MB_ERROR_NOT_FOUND, L"no EDID for this backlight");
+			return false;
+		}
+		*info = devices[index].edid;
+		return true;
+	}
+
+	long name(unsigned long index, WCHAR* device_name, unsigned long max_length) override
+	{
+		const std::string& name = devices[index].name;
+		if (device_name != nullptr)
+		{
+			for (size_t i = 0; i < name.length() && i < max_length; i++)
+			{
+				device_name[i] = (WCHAR)(unsigned char)name[i];
+			}
+		}
+		return (long)name.length();
+	}
+
+	bool open_device(const std::string& name, MBSysfsDevice& device)
+	{
+		int root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (root_fd < 0)
+		{
+			return false;
+		}
+		bool ok = mb_sysfs_open_device(root_fd, name.c_str(), device);
+		::close(root_fd);
+		return ok;
+	}
+
+	// a backlight named name appeared, a known one gets its old index back. False while it can not be opened yet
+	bool plugged(const std::string& name)
+	{
+		for (unsigned long i = 0; i < count(); i++)
+		{
+			MBSysfsDevice& device = devices[i];
+			if (device.name == name)
+			{
+				if (monitors[i]->state != MB_MONITOR_DETACHED)
+				{
+					return true;
+				}
+
+				// opened off the strand, only the fd and what was read from the device are swapped in under it,
+				// the name stays as it is since other threads read it without the strand
+				MBSysfsDevice fresh;
+				if (!open_device(name, fresh))
+				{
+					if (fresh.brightness_fd >= 0)
+					{
+						::close(fresh.brightness_fd);
+					}
+					return false;
+				}
+				mb_driver_hotplug_reattach(this, i, [&device, &fresh]()
+				{
+					device.brightness_fd = fresh.brightness_fd;
+					device.max_brightness = fresh.max_brightness;
+					device.edid = fresh.edid;
+					device.identity = fresh.identity;
+					return true;
+				});
+				return true;
+			}
+		}
+
+		MBSysfsDevice device;
+		if (!open_device(name, device))
+		{
+			if (device.brightness_fd >= 0)
+			{
+				::close(device.brightness_fd);
+			}
+			return false;
+		}
+		if (!mb_driver_hotplug_add(this, [this, &device](unsigned long index)
+		{
+			devices.push_back(device);
+			return true;
+		}))
+		{
+			// the table is full, waiting for the device would not change that
+			::close(device.brightness_fd);
+		}
+		return true;
+	}
+
+	void unplugged(const std::string& name)
+	{
+		for (unsigned long i = 0; i < count(); i++)
+		{
+			MBSysfsDevice& device = devices[i];
+			if (device.name == name && monitors[i]->state != MB_MONITOR_DETACHED)
+			{
+				mb_driver_hotplug_detach(this, i, [&device]()
+				{
+					::close(device.brightness_fd);
+					device.brightness_fd = -1;
+				});
+				return;
+			}
+		}
+	}
+
+	// a directory created in the root has no attribute files yet, it is watched until the device opens
+	void wait_for(int inotify_fd, std::map<int, std::string>& waiting, const std::string& name)
+	{
+		int wd = inotify_add_watch(inotify_fd, (root + "/" + name).c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+		if (wd < 0)
+		{
+			return;
+		}
+		// the files may have been written before the watch existed
+		if (plugged(name))
+		{
+			inotify_rm_watch(inotify_fd, wd);
+			return;
+		}
+		waiting[wd] = name;
+	}
+
+	void watch_run(int inotify_fd, int root_wd, int uevent_fd)
+	{
+		char buffer[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+		std::map<int, std::string> waiting;
+		for (;;)
+		{
+			struct pollfd fds[3] = { { watch_stop_fd, POLLIN, 0 }, { inotify_fd, POLLIN, 0 }, { uevent_fd, POLLIN, 0 } };
+			if (poll(fds, uevent_fd >= 0 ? 3 : 2, -1) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				break;
+			}
+			if (fds[0].revents != 0)
+			{
+				break;
+			}
+
+			// the event names the device, so only that one is opened or closed
+			if (fds[1].revents & POLLIN)
+			{
+				ssize_t size = read(inotify_fd, buffer, sizeof(buffer));
+				for (char* p = buffer; size > 0 && p < buffer + size;)
+				{
+					struct inotify_event* event = (struct inotify_event*)p;
+					if (event->wd != root_wd)
+					{
+						// a file in a waiting directory changed, or the directory went away
+						auto entry = waiting.find(event->wd);
+						if (entry != waiting.end() && ((event->mask & IN_IGNORED) || plugged(entry->second)))
+						{
+							if (!(event->mask & IN_IGNORED))
+							{
+								inotify_rm_watch(inotify_fd, event->wd);
+							}
+							waiting.erase(entry);
+						}
+					}
+					else if (event->len > 0 && event->name[0] != '.')
+					{
+						if (event->mask & (IN_CREATE | IN_MOVED_TO))
+						{
+							if (!plugged(event->name))
+							{
+								wait_for(inotify_fd, waiting, event->name);
+							}
+						}
+						else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+						{
+							unplugged(event->name);
+						}
+					}
+					p += sizeof(struct inotify_event) + event->len;
+				}
+			}
+
+			// sysfs does not raise inotify events, the kernel announces backlight devices as uevents
+			if (uevent_fd >= 0 && (fds[2].revents & POLLIN))
+			{
+				MBUevent event;
+				if (!mb_uevent_read(uevent_fd, buffer, sizeof(buffer), &event) || strcmp(event.subsystem, "backlight") != 0)
+				{
+					continue;
+				}
+				if (strcmp(event.action, "add") == 0)
+				{
+					plugged(event.name);
+				}
+				else if (strcmp(event.action, "remove") == 0)
+				{
+					unplugged(event.name);
+				}
+			}
+		}
+
+		::close(inotify_fd);
+		if (uevent_fd >= 0)
+		{
+			::close(uevent_fd);
+		}
+	}
+
+	bool watch(bool enable) override
+	{
+		if (!enable)
+		{
+			uint64_t one = 1;
+			if (write(watch_stop_fd, &one, sizeof(one)) != sizeof(one))
+			{
+				mb_error_system(errno);
+			}
+			watcher.join();
+			::close(watch_stop_fd);
+			watch_stop_fd = -1;
+			return true;
+		}
+
+		int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotify_fd < 0)
+		{
+			mb_error_system(errno);
+			return false;
+		}
+		int root_wd = inotify_add_watch(inotify_fd, root.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ONLYDIR);
+		if (root_wd < 0)
+		{
+			mb_error_system(errno);
+			::close(inotify_fd);
+			return false;
+		}
+
+		// uevents only describe the real sysfs tree, a caller supplied root is watched with inotify alone
+		int uevent_fd = root == MB_SYSFS_DEFAULT_ROOT ? mb_uevent_open() : -1;
+
+		watch_stop_fd = eventfd(0, EFD_CLOEXEC);
+		if (watch_stop_fd < 0)
+		{
+			mb_error_system(errno);
+			::close(inotify_fd);
+			if (uevent_fd >= 0)
+			{
+				::close(uevent_fd);
+			}
+			return false;
+		}
+		watcher = std::thread(&MBSysfsStruct::watch_run, this, inotify_fd, root_wd, uevent_fd);
+		return true;
+	}
+
+	void close() override
+	{
+		for (auto& device : devices)
+		{
+			if (device.brightness_fd >= 0)
+			{
+				::close(device.brightness_fd);
+			}
+		}
+		devices.clear();
+	}
+};
+
+MB_FUNCTION long MB_CONV mb_sysfs_init(void** handle, const char* root)
+{
+	if (root == nullptr)
+	{
+		root = MB_SYSFS_DEFAULT_ROOT;
+	}
+
+	int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd < 0)
+	{
+		mb_error_system(errno);
+		return 0;
+	}
+
+	DIR* dir = fdopendir(dup(root_fd));
+	if (dir == nullptr)
+	{
+		mb_error_system(errno);
+		close(root_fd);
+		return 0;
+	}
+
+	std::vector<std::string> names;
+	for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+	{
+		if (entry->d_name[0] != '.')
+		{
+			names.push_back(entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	// readdir order is arbitrary, sort so indices are stable between runs
+	std::sort(names.begin(), names.end());
+
+	// the handle keeps at most MB_MAX_MONITORS, devices appended by hotplug must not move the ones in use
+	std::vector<MBSysfsDevice> devices;
+	for (auto& name : names)
+	{
+		if (devices.size() == MB_MAX_MONITORS)
+		{
+			break;
+		}
+		MBSysfsDevice device;
+		if (mb_sysfs_open_device(root_fd, name.c_str(), device))
+		{
+			devices.push_back(device);
+		}
+	}
+	close(root_fd);
+
+	if (devices.size() == 0)
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"no backlight devices found");
+	}
+
+	if (handle != nullptr)
+	{
+		MBSysfsStruct* h = new MBSysfsStruct();
+		h->devices.insert(h->devices.end(), devices.begin(), devices.end());
+		h->root = root;
+		if (!mb_driver_attach(h, handle))
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		for (auto& device : devices)
+		{
+			close(device.brightness_fd);
+		}
+	}
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_sysfs_get_count(void* handle, unsigned long* count)
+{
+	MBHandle h(handle, MB_TYPE_SYSFS);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_count(h, count);
+}
+
+MB_FUNCTION long MB_CONV mb_sysfs_set_brightness(void* handle, unsigned long index, double percent)
+{
+	MBHandle h(handle, MB_TYPE_SYSFS);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_set(h, index, percent);
+}
+
+MB_FUNCTION long MB_CONV mb_sysfs_get_brightness(void* handle, unsigned long index, double* percent)
+{
+	MBHandle h(handle, MB_TYPE_SYSFS);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get(h, index, percent);
+}
+
+MB_FUNCTION long MB_CONV mb_sysfs_get_name(void* handle, unsigned long index, WCHAR* device_name, unsigned long max_length)
+{
+	MBHandle h(handle, MB_TYPE_SYSFS);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_name(h, index, device_name, max_length);
+}
+
+MB_FUNCTION long MB_CONV mb_sysfs_cleanup(void* handle)
+{
+	MBHandle h(handle, MB_TYPE_SYSFS);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_cleanup(h);
+}
+#endif
@@ -0,0 +1,361 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define MB_TRACE_MAGIC				0x5254424Du	// "MBTR"
+#define MB_TRACE_VERSION			1
+#define MB_TRACE_DEFAULT_CAPACITY	65536
+
+// 16M records, a 640 MB file, so the size fits a 32 bit size_t and the capacity the header's uint32_t
+#define MB_TRACE_MAX_CAPACITY		(1ul << 24)
+
+// file layout: the header, then capacity slots used as a ring, the oldest record is overwritten when it is full
+struct MBTraceHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t capacity;
+	uint32_t reserved;
+	std::atomic<uint64_t> next;
+};
+
+// marks a slot a writer is in, it is set first and replaced by the sequence last, so a slot the writer died in is
+// skipped rather than read torn, and a second writer a lap behind leaves the slot alone
+#define MB_TRACE_BUSY				0xFFFFFFFFFFFFFFFFull
+
+struct MBTraceSlot
+{
+	std::atomic<uint64_t> sequence;
+	MB_TRACE_RECORD record;
+};
+
+// the file is the mapping, so the counters must be plain lock free atomics
+static_assert(std::atomic<uint64_t>::is_always_lock_free && sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "trace needs lock free atomics");
+static_assert(sizeof(MB_TRACE_RECORD) == 32, "trace record layout changed");
+static_assert(MB_TRACE_MAX_CAPACITY <= (0xFFFFFFFFu - sizeof(MBTraceHeader)) / sizeof(MBTraceSlot), "trace file size overflows");
+
+struct MBTrace
+{
+	MBTraceHeader* header;
+	MBTraceSlot* slots;
+	size_t size;
+	uint64_t start_ns;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+
+	MBTrace()
+	{
+		header = nullptr;
+		slots = nullptr;
+		size = 0;
+		start_ns = 0;
+#ifdef _WIN32
+		mapping = nullptr;
+#endif
+	}
+
+	~MBTrace()
+	{
+		if (header == nullptr)
+		{
+			return;
+		}
+#ifdef _WIN32
+		FlushViewOfFile(header, 0);
+		UnmapViewOfFile(header);
+		CloseHandle(mapping);
+#else
+		msync(header, size, MS_ASYNC);
+		munmap(header, size);
+#endif
+	}
+};
+
+static uint64_t mb_trace_now()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool mb_trace_map(MBTrace* t, const char* path, size_t size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		mb_error_system(GetLastError());
+		return false;
+	}
+	// the mapping grows the file to its size
+	t->mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, nullptr);
+	CloseHandle(file);
+	if (t->mapping == nullptr)
+	{
+		mb_error_system(GetLastError());
+		return false;
+	}
+	void* data = MapViewOfFile(t->mapping, FILE_MAP_WRITE, 0, 0, size);
+	if (data == nullptr)
+	{
+		mb_error_system(GetLastError());
+		return false;
+	}
+#else
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		mb_error_system(errno);
+		return false;
+	}
+	if (ftruncate(fd, (off_t)size) != 0)
+	{
+		mb_error_system(errno);
+		::close(fd);
+		return false;
+	}
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED)
+	{
+		mb_error_system(errno);
+		return false;
+	}
+#endif
+	t->header = (MBTraceHeader*)data;
+	t->slots = (MBTraceSlot*)(t->header + 1);
+	t->size = size;
+	return true;
+}
+
+uint64_t mb_trace_begin(MBBaseStruct* h)
+{
+	if (h->trace.load(std::memory_order_relaxed) == nullptr)
+	{
+		return 0;
+	}
+	return mb_trace_now();
+}
+
+void mb_trace_end(MBBaseStruct* h, unsigned long index, const MBMonitor& monitor, unsigned char op, bool ok, unsigned long value, unsigned long min, uint64_t begin)
+{
+	if (begin == 0)
+	{
+		return;
+	}
+	uint64_t end = mb_trace_now();
+	unsigned char result = ok ? MB_ERROR_NONE : (unsigned char)mb_error_save().code;
+
+	// counted in before the ring is looked at, so mb_trace_stop either hides it from this call or waits for it.
+	// Calls on other monitors claim their own slots meanwhile, nothing here waits for them
+	h->trace_users.fetch_add(1);
+	MBTrace* t = h->trace.load();
+	if (t != nullptr)
+	{
+		uint64_t sequence = t->header->next.fetch_add(1, std::memory_order_relaxed) + 1;
+		MBTraceSlot& slot = t->slots[(sequence - 1) % t->header->capacity];
+
+		// a writer still in the slot from a lap ago keeps it, this record is then lost like one the ring overwrote
+		uint64_t previous = slot.sequence.load(std::memory_order_relaxed);
+		if (previous != MB_TRACE_BUSY && slot.sequence.compare_exchange_strong(previous, MB_TRACE_BUSY, std::memory_order_acquire))
+		{
+			MB_TRACE_RECORD& record = slot.record;
+			record.start_ns = begin > t->start_ns ? begin - t->start_ns : 0;
+			record.identity = monitor.identity;
+			uint64_t duration = (end - begin) / 1000;
+			record.duration_us = duration < 0xFFFFFFFFull ? (uint32_t)duration : 0xFFFFFFFFu;
+			record.value = (uint32_t)value;
+			record.min = (uint32_t)min;
+			record.index = (unsigned short)index;
+			record.op = op;
+			record.result = result;
+			slot.sequence.store(sequence, std::memory_order_release);
+		}
+	}
+	h->trace_users.fetch_sub(1, std::memory_order_release);
+}
+
+void mb_trace_release(MBBaseStruct* h)
+{
+	std::lock_guard<std::mutex> trace_guard(h->trace_lock);
+	MBTrace* t = h->trace.exchange(nullptr);
+
+	// a call that saw the ring is a few stores from done, it is not unmapped under them
+	while (h->trace_users.load() != 0)
+	{
+		std::this_thread::yield();
+	}
+	delete t;
+}
+
+// the whole length, 0 if it can not be told
+static uint64_t mb_trace_file_size(FILE* file)
+{
+#ifdef _WIN32
+	if (_fseeki64(file, 0, SEEK_END) != 0)
+	{
+		return 0;
+	}
+	long long size = _ftelli64(file);
+#else
+	if (fseeko(file, 0, SEEK_END) != 0)
+	{
+		return 0;
+	}
+	off_t size = ftello(file);
+#endif
+	return size > 0 ? (uint64_t)size : 0;
+}
+
+bool mb_trace_load(const char* path, std::vector<MB_TRACE_RECORD>& records)
+{
+	if (path == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"path is nullptr");
+		return false;
+	}
+	FILE* file = fopen(path, "rb");
+	if (file == nullptr)
+	{
+		mb_error(MB_ERROR_NOT_FOUND, L"trace file not found");
+		return false;
+	}
+
+	// the capacity is only trusted once the file is really that long, a damaged header must not size the allocation
+	MBTraceHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == MB_TRACE_MAGIC &&
+		header.version == MB_TRACE_VERSION && header.record_size == sizeof(MBTraceSlot) &&
+		mb_trace_file_size(file) == sizeof(MBTraceHeader) + (uint64_t)header.capacity * sizeof(MBTraceSlot);
+	std::unique_ptr<MBTraceSlot[]> slots;
+	if (ok)
+	{
+		slots.reset(new MBTraceSlot[header.capacity]);
+		ok = fseek(file, (long)sizeof(MBTraceHeader), SEEK_SET) == 0 &&
+			fread(slots.get(), sizeof(MBTraceSlot), header.capacity, file) == header.capacity;
+	}
+	fclose(file);
+	if (!ok)
+	{
+		mb_error(MB_ERROR_INVALID_FILE, L"not a trace file of this version");
+		return false;
+	}
+
+	// the ring is unrolled into call order, empty and unfinished slots are left out
+	std::vector<std::pair<uint64_t, const MB_TRACE_RECORD*>> order;
+	for (uint32_t i = 0; i < header.capacity; i++)
+	{
+		uint64_t sequence = slots[i].sequence.load(std::memory_order_relaxed);
+		if (sequence != 0 && sequence != MB_TRACE_BUSY)
+		{
+			order.push_back({ sequence, &slots[i].record });
+		}
+	}
+	std::sort(order.begin(), order.end(), [](const std::pair<uint64_t, const MB_TRACE_RECORD*>& a, const std::pair<uint64_t, const MB_TRACE_RECORD*>& b)
+	{
+		return a.first < b.first;
+	});
+	records.clear();
+	records.reserve(order.size());
+	for (auto& entry : order)
+	{
+		records.push_back(*entry.second);
+	}
+	return true;
+}
+
+MB_FUNCTION long MB_CONV mb_trace_start(void* handle, const char* path, unsigned long capacity)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	if (path == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"path is nullptr");
+		return 0;
+	}
+	if (capacity == 0)
+	{
+		capacity = MB_TRACE_DEFAULT_CAPACITY;
+	}
+	if (capacity > MB_TRACE_MAX_CAPACITY)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"capacity is too large");
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> trace_guard(h->trace_lock);
+	if (h->trace.load(std::memory_order_relaxed) != nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"handle is already traced");
+		return 0;
+	}
+
+	std::unique_ptr<MBTrace> t = std::make_unique<MBTrace>();
+	if (!mb_trace_map(t.get(), path, sizeof(MBTraceHeader) + (size_t)capacity * sizeof(MBTraceSlot)))
+	{
+		return 0;
+	}
+	t->header->magic = MB_TRACE_MAGIC;
+	t->header->version = MB_TRACE_VERSION;
+	t->header->record_size = sizeof(MBTraceSlot);
+	t->header->capacity = (uint32_t)capacity;
+	t->header->next = 0;
+	t->start_ns = mb_trace_now();
+	h->trace.store(t.release(), std::memory_order_release);
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_trace_stop(void* handle)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+
+	mb_trace_release(h);
+	return 1;
+}
+
+MB_FUNCTION long MB_CONV mb_trace_read(const char* path, MB_TRACE_RECORD* records, unsigned long max_count, unsigned long* count)
+{
+	std::vector<MB_TRACE_RECORD> loaded;
+	if (!mb_trace_load(path, loaded))
+	{
+		return 0;
+	}
+	if (records != nullptr)
+	{
+		size_t copied = loaded.size() < max_count ? loaded.size() : max_count;
+		memcpy(records, loaded.data(), copied * sizeof(MB_TRACE_RECORD));
+	}
+	if (count != nullptr)
+	{
+		*count = (unsigned long)loaded.size();
+	}
+	return 1;
+}
@@ -0,0 +1,189 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define IN_MB_DLL
+#include "mb_internal.h"
+
+#include <string.h>
+
+static inline int mb_caps_hex(char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	if (c >= 'A' && c <= 'F')
+	{
+		return c - 'A' + 10;
+	}
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+static inline bool mb_caps_is_name(char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+}
+
+static inline bool mb_caps_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// a single pass over the string that never copies it, caps may stop early at a terminator
+bool mb_caps_parse(const char* caps, size_t length, MB_VCP_FEATURES* features)
+{
+	memset(features, 0, sizeof(*features));
+
+	size_t i = 0;
+	while (i < length && mb_caps_is_space(caps[i]))
+	{
+		i++;
+	}
+
+	// the sections sit inside one pair of parentheses, which some monitors leave out
+	size_t top = i < length && caps[i] == '(' ? 1 : 0;
+	size_t depth = 0;
+	size_t name = 0;
+	size_t name_length = 0;
+	bool found = false;
+	for (; i < length && caps[i] != 0 && !found; i++)
+	{
+		char c = caps[i];
+		if (c == '(')
+		{
+			found = depth == top && name_length == 3 &&
+				(caps[name] | 0x20) == 'v' && (caps[name + 1] | 0x20) == 'c' && (caps[name + 2] | 0x20) == 'p';
+			depth++;
+			name_length = 0;
+		}
+		else if (c == ')')
+		{
+			if (depth == 0)
+			{
+				break;
+			}
+			depth--;
+			name_length = 0;
+		}
+		else if (mb_caps_is_name(c))
+		{
+			if (i == 0 || !mb_caps_is_name(caps[i - 1]))
+			{
+				name = i;
+				name_length = 0;
+			}
+			name_length++;
+		}
+		else if (!mb_caps_is_space(c))
+		{
+			name_length = 0;
+		}
+	}
+	if (!found)
+	{
+		mb_error(MB_ERROR_DDC_PROTOCOL, L"capabilities string has no vcp section");
+		return false;
+	}
+
+	// codes are two hex digits apart from spaces, some monitors run them together as in "021012";
+	// a code may be followed by the values it takes in parentheses, which may nest
+	size_t level = 0;
+	size_t digits = 0;
+	unsigned int code = 0;
+	for (; i < length && caps[i] != 0; i++)
+	{
+		char c = caps[i];
+		if (level > 0)
+		{
+			if (c == '(')
+			{
+				level++;
+			}
+			else if (c == ')')
+			{
+				level--;
+			}
+			continue;
+		}
+
+		int hex = mb_caps_hex(c);
+		if (hex >= 0)
+		{
+			code = ((code << 4) | (unsigned int)hex) & 0xFF;
+			if (++digits % 2 == 0)
+			{
+				features->bits[code / 64] |= 1ull << (code % 64);
+			}
+			continue;
+		}
+
+		// a lone digit is a code of its own, any other odd run is garbage
+		if (digits == 1)
+		{
+			features->bits[code / 64] |= 1ull << (code % 64);
+		}
+		else if (digits % 2 != 0)
+		{
+			break;
+		}
+		digits = 0;
+
+		if (c == ')')
+		{
+			return true;
+		}
+		if (c == '(')
+		{
+			level = 1;
+		}
+		else if (!mb_caps_is_space(c))
+		{
+			break;
+		}
+	}
+
+	memset(features, 0, sizeof(*features));
+	mb_error(MB_ERROR_DDC_PROTOCOL, L"malformed vcp section in capabilities string");
+	return false;
+}
+
+MB_FUNCTION long MB_CONV mb_parse_capabilities(const char* caps, MB_VCP_FEATURES* features)
+{
+	if (caps == nullptr || features == nullptr)
+	{
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"caps or features is nullptr");
+		return 0;
+	}
+	return mb_caps_parse(caps, strlen(caps), features) ? 1 : 0;
+}
+
+MB_FUNCTION long MB_CONV mb_get_vcp_features(void* handle, unsigned long index, MB_VCP_FEATURES* features)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_features(h, index, features);
+}
+
+MB_FUNCTION long MB_CONV mb_get_vcp_values(void* handle, unsigned long index, MB_VCP_VALUE* values, unsigned long count)
+{
+	MBHandle h(handle, MB_TYPE_NONE);
+	if (!h)
+	{
+		return 0;
+	}
+	return mb_driver_get_vcp(h, index, values, count);
+}
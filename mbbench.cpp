@@ -0,0 +1,529 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// mbbench, measures the library against the mock backend and prints one line of JSON per result
+//
+//   mbbench [--iterations N] [--latency US] [--cache PATH] [--socket PATH] [--mbctl PATH] [section ...]
+//
+// The mock keeps real device latency out of the per call numbers, so they show what the library itself costs:
+// handle validation, the shadow cache, the strands and the bookkeeping around every driver call. The sections that
+// need a device to wait on give the mock --latency instead.
+//
+//   validate   mb_get_count on a live handle and on a cleaned up one, the cost of looking a handle up
+//   call       mb_set_brightness and mb_get_brightness with no device latency, reads cached and uncached, and sets
+//              again with the latency timing of mb_stats_enable turned off and through a perceptual curve
+//   init       mb_mock_init_ex on 1, 4 and 16 monitors, without the capability cache and warm from it
+//   coalesce   mb_submit_brightness as fast as it returns for a second, against a device taking --latency per write
+//   find       mb_find_monitor over the ids of 64 monitors and for an id no monitor has, next to mb_get_count on the
+//              same handle, which leaves the cost of the table lookup behind handle validation
+//   snapshot   mb_snapshot_read on an idle region, then from 1 and 4 threads while a writer publishes a mock in a
+//              tight loop, with the writer's publishes per second
+//   mbctl      200 sets on 4 mock monitors, one mbctl process per command against one mbctl --batch, at --latency
+//              and at no device latency. Needs --mbctl, the path of a built mbctl
+//   broker     (Linux) mb_broker_init plus the first set through a served mock, against mb_mock_init_ex plus the first
+//              set on 4 monitors taking --latency per device call
+//
+// Every section runs when none is named, mbctl is skipped without --mbctl. --iterations sets the calls per timed loop
+// (default 1000000), --latency the mock's microseconds per device call for init, coalesce, mbctl and broker (default
+// 20000), --cache the capability cache file the init section creates and removes (default mbbench.cache), --socket the
+// socket the broker section serves on (default mbbench.sock).
+
+#include "mon_brightness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock MBBenchClock;
+
+struct MBBenchOptions
+{
+	unsigned long iterations;
+	unsigned long latency_us;
+	const char* cache;
+	const char* socket;
+	const char* mbctl;
+};
+
+static double mbbench_ms(MBBenchClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(MBBenchClock::now() - start).count();
+}
+
+static double mbbench_ns(MBBenchClock::time_point start, unsigned long iterations)
+{
+	return std::chrono::duration<double, std::nano>(MBBenchClock::now() - start).count() / (double)iterations;
+}
+
+static void* mbbench_mock(unsigned long monitors, unsigned long latency_us)
+{
+	MB_MOCK_CONFIG config = { monitors, 0, 100, latency_us, 0, 0.0, 1 };
+	void* handle = nullptr;
+	if (!mb_mock_init(&handle, &config))
+	{
+		fprintf(stderr, "mbbench: mb_mock_init failed\n");
+		exit(1);
+	}
+	return handle;
+}
+
+static void mbbench_validate(const MBBenchOptions& options)
+{
+	void* handle = mbbench_mock(1, 0);
+	unsigned long count;
+	long ok = 0;
+	MBBenchClock::time_point start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		ok += mb_get_count(handle, &count);
+	}
+	double live_ns = mbbench_ns(start, options.iterations);
+
+	// a stale handle fails the generation check and records an error
+	mb_cleanup(handle);
+	long rejected = 0;
+	start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		rejected += !mb_get_count(handle, &count);
+	}
+	double stale_ns = mbbench_ns(start, options.iterations);
+
+	printf("{\"bench\":\"validate\",\"iterations\":%lu,\"live_ns\":%.1f,\"stale_ns\":%.1f,\"live_ok\":%ld,\"stale_rejected\":%ld}\n",
+		options.iterations, live_ns, stale_ns, ok, rejected);
+}
+
+static void mbbench_call(const MBBenchOptions& options)
+{
+	void* handle = mbbench_mock(1, 0);
+	double percent;
+	long failed = 0;
+
+	// alternate between two values so every set reaches the device
+	MBBenchClock::time_point start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		failed += !mb_set_brightness(handle, 0, (i & 1) ? 0.25 : 0.75);
+	}
+	double set_ns = mbbench_ns(start, options.iterations);
+
+	mb_stats_enable(handle, 0);
+	start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		failed += !mb_set_brightness(handle, 0, (i & 1) ? 0.25 : 0.75);
+	}
+	double set_untimed_ns = mbbench_ns(start, options.iterations);
+	mb_stats_enable(handle, 1);
+
+	mb_set_calibration(handle, 0, MB_CURVE_PERCEPTUAL, nullptr, 0);
+	start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		failed += !mb_set_brightness(handle, 0, (i & 1) ? 0.25 : 0.75);
+	}
+	double set_perceptual_ns = mbbench_ns(start, options.iterations);
+	mb_set_calibration(handle, 0, MB_CURVE_LINEAR, nullptr, 0);
+
+	start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		failed += !mb_get_brightness(handle, 0, &percent);
+	}
+	double get_cached_ns = mbbench_ns(start, options.iterations);
+
+	mb_set_cache_timeout(handle, 0);
+	start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		failed += !mb_get_brightness(handle, 0, &percent);
+	}
+	double get_uncached_ns = mbbench_ns(start, options.iterations);
+
+	unsigned long reads = 0;
+	unsigned long writes = 0;
+	mb_mock_get_calls(handle, 0, &reads, &writes);
+	mb_cleanup(handle);
+
+	printf("{\"bench\":\"call\",\"iterations\":%lu,\"set_ns\":%.1f,\"set_untimed_ns\":%.1f,\"set_perceptual_ns\":%.1f,\"get_cached_ns\":%.1f,\"get_uncached_ns\":%.1f,\"device_reads\":%lu,\"device_writes\":%lu,\"failed\":%ld}\n",
+		options.iterations, set_ns, set_untimed_ns, set_perceptual_ns, get_cached_ns, get_uncached_ns, reads, writes, failed);
+}
+
+static double mbbench_init_once(unsigned long monitors, unsigned long latency_us)
+{
+	MB_MOCK_CONFIG config = { monitors, 0, 100, latency_us, 0, 0.0, 1 };
+	void* handle;
+	MBBenchClock::time_point start = MBBenchClock::now();
+	if (!mb_mock_init_ex(&handle, &config, MB_INFINITE))
+	{
+		fprintf(stderr, "mbbench: mb_mock_init_ex failed\n");
+		exit(1);
+	}
+	double ms = mbbench_ms(start);
+	mb_cleanup(handle);
+	return ms;
+}
+
+static void mbbench_init(const MBBenchOptions& options)
+{
+	const unsigned long sizes[] = { 1, 4, 16 };
+	for (unsigned long monitors : sizes)
+	{
+		mb_set_capability_cache(nullptr);
+		double cold_ms = mbbench_init_once(monitors, options.latency_us);
+
+		// the first init with the cache fills it, the second one is the warm start
+		remove(options.cache);
+		mb_set_capability_cache(options.cache);
+		mbbench_init_once(monitors, options.latency_us);
+		double warm_ms = mbbench_init_once(monitors, options.latency_us);
+		mb_set_capability_cache(nullptr);
+		remove(options.cache);
+
+		printf("{\"bench\":\"init\",\"monitors\":%lu,\"latency_us\":%lu,\"cold_ms\":%.2f,\"warm_ms\":%.3f}\n",
+			monitors, options.latency_us, cold_ms, warm_ms);
+	}
+}
+
+static void mbbench_coalesce(const MBBenchOptions& options)
+{
+	void* handle = mbbench_mock(1, options.latency_us);
+	unsigned long submits = 0;
+	MBBenchClock::time_point start = MBBenchClock::now();
+	while (mbbench_ms(start) < 1000.0)
+	{
+		mb_submit_brightness(handle, 0, (double)(submits % 101) / 100.0);
+		submits++;
+	}
+	mb_flush(handle, MB_INFINITE);
+	double seconds = mbbench_ms(start) / 1000.0;
+
+	unsigned long reads = 0;
+	unsigned long writes = 0;
+	mb_mock_get_calls(handle, 0, &reads, &writes);
+	MB_STATS stats;
+	mb_stats_snapshot(handle, 0, &stats, 0);
+	mb_cleanup(handle);
+
+	printf("{\"bench\":\"coalesce\",\"latency_us\":%lu,\"submits_per_s\":%.0f,\"device_writes_per_s\":%.1f,\"device_writes\":%lu,\"coalesced\":%llu}\n",
+		options.latency_us, submits / seconds, writes / seconds, writes, (unsigned long long)stats.dropped);
+}
+
+static void mbbench_find(const MBBenchOptions& options)
+{
+	const unsigned long monitors = 64;
+	void* handle = mbbench_mock(monitors, 0);
+	std::vector<uint64_t> ids(monitors);
+	for (unsigned long i = 0; i < monitors; i++)
+	{
+		mb_get_monitor_id(handle, i, &ids[i]);
+	}
+
+	unsigned long index;
+	unsigned long count;
+	long found = 0;
+	MBBenchClock::time_point start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		found += mb_find_monitor(handle, ids[i % monitors], &index) && index == i % monitors;
+	}
+	double find_ns = mbbench_ns(start, options.iterations);
+
+	// a missing id probes until it meets an empty slot
+	long missing = 0;
+	start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		missing += !mb_find_monitor(handle, 0x5EED0000ull + i % monitors, &index);
+	}
+	double missing_ns = mbbench_ns(start, options.iterations);
+
+	start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		mb_get_count(handle, &count);
+	}
+	double validate_ns = mbbench_ns(start, options.iterations);
+	mb_cleanup(handle);
+
+	printf("{\"bench\":\"find\",\"monitors\":%lu,\"iterations\":%lu,\"find_ns\":%.1f,\"missing_ns\":%.1f,\"validate_ns\":%.1f,\"found\":%ld,\"missing\":%ld}\n",
+		monitors, options.iterations, find_ns, missing_ns, validate_ns, found, missing);
+}
+
+#ifdef _WIN32
+#define MBBENCH_SNAPSHOT_NAME	"Local\\mbbench_snapshot"
+#else
+#define MBBENCH_SNAPSHOT_NAME	"/mbbench_snapshot"
+#endif
+
+static void mbbench_snapshot(const MBBenchOptions& options)
+{
+	void* handle = mbbench_mock(1, 0);
+	void* reader = nullptr;
+	mb_set_brightness(handle, 0, 0.5);
+	if (!mb_snapshot_publish(handle, MBBENCH_SNAPSHOT_NAME) || !mb_snapshot_open(&reader, MBBENCH_SNAPSHOT_NAME))
+	{
+		fprintf(stderr, "mbbench: publishing the snapshot failed\n");
+		exit(1);
+	}
+	mb_set_brightness(handle, 0, 0.25);
+
+	MB_SNAPSHOT_MONITOR monitor;
+	long failed = 0;
+	MBBenchClock::time_point start = MBBenchClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		failed += !mb_snapshot_read(reader, 0, &monitor);
+	}
+	double idle_ns = mbbench_ns(start, options.iterations);
+	printf("{\"bench\":\"snapshot\",\"readers\":1,\"writer\":false,\"iterations\":%lu,\"read_ns\":%.1f,\"failed\":%ld}\n",
+		options.iterations, idle_ns, failed);
+
+	// a writer publishes in a tight loop while every reader thread makes --iterations reads
+	const unsigned long reader_counts[] = { 1, 4 };
+	for (unsigned long readers : reader_counts)
+	{
+		std::atomic<bool> stop(false);
+		std::thread writer([handle, &stop]()
+		{
+			for (unsigned long i = 0; !stop; i++)
+			{
+				mb_set_brightness(handle, 0, (i & 1) ? 0.75 : 0.25);
+			}
+		});
+		MB_SNAPSHOT_MONITOR before;
+		mb_snapshot_read(reader, 0, &before);
+		std::atomic<long> read_failed(0);
+		std::vector<std::thread> threads;
+		start = MBBenchClock::now();
+		for (unsigned long t = 0; t < readers; t++)
+		{
+			threads.emplace_back([reader, &options, &read_failed]()
+			{
+				MB_SNAPSHOT_MONITOR own;
+				long lost = 0;
+				for (unsigned long i = 0; i < options.iterations; i++)
+				{
+					lost += !mb_snapshot_read(reader, 0, &own);
+				}
+				read_failed += lost;
+			});
+		}
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+		double seconds = mbbench_ms(start) / 1000.0;
+		MB_SNAPSHOT_MONITOR after;
+		mb_snapshot_read(reader, 0, &after);
+		stop = true;
+		writer.join();
+
+		printf("{\"bench\":\"snapshot\",\"readers\":%lu,\"writer\":true,\"iterations\":%lu,\"reads_per_s\":%.0f,\"publishes_per_s\":%.0f,\"failed\":%ld}\n",
+			readers, options.iterations, readers * options.iterations / seconds, (after.version - before.version) / seconds, (long)read_failed);
+	}
+
+	mb_snapshot_close(reader);
+	mb_cleanup(handle);
+}
+
+#ifdef _WIN32
+#define MBBENCH_NULL			"NUL"
+#define popen					_popen
+#define pclose					_pclose
+#else
+#define MBBENCH_NULL			"/dev/null"
+#endif
+
+// one command per process against the same commands piped into one --batch process, 200 sets round robin on 4 mock
+// monitors whose probe stands in for enumeration
+static void mbbench_mbctl(const MBBenchOptions& options)
+{
+	if (options.mbctl == nullptr)
+	{
+		fprintf(stderr, "mbbench: the mbctl section needs --mbctl PATH\n");
+		return;
+	}
+	const unsigned long monitors = 4;
+	const unsigned long commands = 200;
+	const unsigned long latencies[] = { options.latency_us, 0 };
+	for (unsigned long latency_us : latencies)
+	{
+		std::string mbctl = std::string("\"") + options.mbctl + "\" --mock " + std::to_string(monitors) + ":" + std::to_string(latency_us);
+		long failed = 0;
+		MBBenchClock::time_point start = MBBenchClock::now();
+		for (unsigned long i = 0; i < commands; i++)
+		{
+			std::string command = mbctl + " set " + std::to_string(i % monitors) + ((i / monitors) & 1 ? " 25%" : " 75%") + " > " MBBENCH_NULL;
+			failed += system(command.c_str()) != 0;
+		}
+		double one_shot_s = mbbench_ms(start) / 1000.0;
+
+		start = MBBenchClock::now();
+		FILE* batch = popen((mbctl + " --batch > " MBBENCH_NULL).c_str(), "w");
+		if (batch == nullptr)
+		{
+			fprintf(stderr, "mbbench: starting %s failed\n", options.mbctl);
+			return;
+		}
+		for (unsigned long i = 0; i < commands; i++)
+		{
+			fprintf(batch, "set %lu %s\n", i % monitors, (i / monitors) & 1 ? "25%" : "75%");
+		}
+		failed += pclose(batch) != 0;
+		double batch_s = mbbench_ms(start) / 1000.0;
+
+		printf("{\"bench\":\"mbctl\",\"monitors\":%lu,\"latency_us\":%lu,\"commands\":%lu,\"one_shot_per_s\":%.1f,\"batch_per_s\":%.1f,\"failed\":%ld}\n",
+			monitors, latency_us, commands, commands / one_shot_s, commands / batch_s, failed);
+	}
+}
+
+#ifdef __linux__
+static void mbbench_broker(const MBBenchOptions& options)
+{
+	// a client that connects to a served handle skips the enumeration and probes a direct init pays for
+	const unsigned long monitors = 4;
+	const unsigned long runs = 10;
+	double direct_ms = 0.0;
+	for (unsigned long run = 0; run < runs; run++)
+	{
+		MB_MOCK_CONFIG config = { monitors, 0, 100, options.latency_us, 0, 0.0, 1 };
+		void* handle;
+		MBBenchClock::time_point start = MBBenchClock::now();
+		if (!mb_mock_init_ex(&handle, &config, MB_INFINITE) || !mb_set_brightness(handle, 0, 0.5))
+		{
+			fprintf(stderr, "mbbench: direct init and set failed\n");
+			exit(1);
+		}
+		direct_ms += mbbench_ms(start);
+		mb_cleanup(handle);
+	}
+
+	void* served = mbbench_mock(monitors, options.latency_us);
+	if (!mb_broker_serve(served, options.socket))
+	{
+		fprintf(stderr, "mbbench: mb_broker_serve failed\n");
+		exit(1);
+	}
+	double init_ms = 0.0;
+	double broker_ms = 0.0;
+	for (unsigned long run = 0; run < runs; run++)
+	{
+		void* client;
+		MBBenchClock::time_point start = MBBenchClock::now();
+		if (!mb_broker_init(&client, options.socket))
+		{
+			fprintf(stderr, "mbbench: mb_broker_init failed\n");
+			exit(1);
+		}
+		init_ms += mbbench_ms(start);
+
+		// every run writes another value, the daemon skips a write that changes nothing
+		if (!mb_set_brightness(client, 0, (run & 1) ? 0.25 : 0.75))
+		{
+			fprintf(stderr, "mbbench: set through the broker failed\n");
+			exit(1);
+		}
+		broker_ms += mbbench_ms(start);
+		mb_cleanup(client);
+	}
+	mb_cleanup(served);
+
+	printf("{\"bench\":\"broker\",\"monitors\":%lu,\"latency_us\":%lu,\"runs\":%lu,\"direct_init_set_ms\":%.2f,\"broker_init_ms\":%.3f,\"broker_init_set_ms\":%.2f}\n",
+		monitors, options.latency_us, runs, direct_ms / runs, init_ms / runs, broker_ms / runs);
+}
+#endif
+
+struct MBBenchSection
+{
+	const char* name;
+	void (*run)(const MBBenchOptions& options);
+};
+
+static const MBBenchSection g_sections[] =
+{
+	{ "validate", mbbench_validate },
+	{ "call", mbbench_call },
+	{ "init", mbbench_init },
+	{ "coalesce", mbbench_coalesce },
+	{ "find", mbbench_find },
+	{ "snapshot", mbbench_snapshot },
+	{ "mbctl", mbbench_mbctl },
+#ifdef __linux__
+	{ "broker", mbbench_broker },
+#endif
+};
+
+int main(int argc, char** argv)
+{
+	MBBenchOptions options = { 1000000, 20000, "mbbench.cache", "mbbench.sock", nullptr };
+	std::vector<const MBBenchSection*> selected;
+	bool usage = false;
+	for (int i = 1; i < argc && !usage; i++)
+	{
+		if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+		{
+			options.iterations = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc)
+		{
+			options.latency_us = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+		{
+			options.cache = argv[++i];
+		}
+		else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+		{
+			options.socket = argv[++i];
+		}
+		else if (strcmp(argv[i], "--mbctl") == 0 && i + 1 < argc)
+		{
+			options.mbctl = argv[++i];
+		}
+		else
+		{
+			usage = true;
+			for (const MBBenchSection& section : g_sections)
+			{
+				if (strcmp(argv[i], section.name) == 0)
+				{
+					selected.push_back(&section);
+					usage = false;
+				}
+			}
+		}
+	}
+	if (usage || options.iterations == 0)
+	{
+		fprintf(stderr, "usage: mbbench [--iterations N] [--latency US] [--cache PATH] [--socket PATH] [--mbctl PATH] [validate|call|init|coalesce|find|snapshot|mbctl|broker ...]\n");
+		return 2;
+	}
+	if (selected.empty())
+	{
+		for (const MBBenchSection& section : g_sections)
+		{
+			selected.push_back(&section);
+		}
+	}
+
+	for (const MBBenchSection* section : selected)
+	{
+		section->run(options);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,1699 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// mbcheck, checks the behaviour of the library against the mock backend and prints one line of JSON per check
+//
+//   mbcheck [--root DIR] [check ...]
+//
+// Each check drives the public API and compares what reached the mock with what should have. A failed expectation
+// is printed to stderr, the JSON line of its check then has "ok":false and the exit status is 1.
+//
+//   calls        device reads and writes behind set and get: the range is read once, a set writes without reading
+//                first, a get within the cache timeout stays off the device
+//   probe        mb_mock_init_ex probes monitors in parallel, and with a deadline returns the slow ones as pending
+//   stats        mb_stats_snapshot counts every call and failure and times each one, a reset clears what it returned
+//   calibration  every percent in 0.001 steps comes back close to itself and writing a reading back is a fixed
+//                point, for linear curves on three ranges and a perceptual one
+//   handles      stale and garbage handles are refused, a cleanup waits for the calls inside without spinning
+//   ramp         a fade on a slow device ends at its target on time, drops the steps the device has no time for and
+//                stops at a set made during it
+//   stress       many threads on one handle: monitors run side by side, commands on one monitor never overlap
+//   auto         (Linux) the ambient light loop follows a fake sensor file, ignores noise and idles without spinning
+//   edid         (Linux) sysfs backlights in a fake tree find the EDID of their connector through mb_set_edid_root,
+//                identical monitors without serials get distinct ids and mb_find_monitor finds each one
+//   hotplug      (Linux) devices added to, removed from and put back into a fake sysfs tree keep their indices, calls
+//                on a removed one fail with MB_ERROR_DETACHED and the count never changes. A DDC/CI display behind a
+//                fake dock does the same when its bus node comes and goes, and gets its index back on another bus
+//   group        (Linux) a group of mock and sysfs monitors skips members already at the target, a cleaned up handle
+//                fails its member alone, and a group by id follows a monitor replugged on another connector
+//   broker       (Linux) a client's gets are answered from the daemon's cache, sets several clients send at once are
+//                folded into fewer device writes, a second daemon is refused and a lost one fails calls until it is back
+//   cache        a warm capability cache skips every probe, a damaged file is rewritten, concurrent stores from threads
+//                and (Linux) processes keep every record
+//   trace        calls recorded with mb_trace_start read back in order, and making them again on a mock replaying the
+//                trace records the same calls and leaves the monitors at the same values. Monitors traced from
+//                several threads lose no call, and a stop while they run is safe
+//   snapshot     readers never see a torn record while a writer publishes, a second publisher of the name gets
+//                MB_ERROR_IN_USE and reads after unpublish fail with MB_ERROR_NOT_FOUND
+//
+// Every check runs when none is named. Files the checks need are created in --root, the current directory by default.
+//
+// The DDC/CI displays of hotplug sit behind the transport seam, so this program builds with the library sources
+// rather than against the library: g++ -std=c++17 mbcheck.cpp mon_brightness.cpp mb_*.cpp -lpthread
+
+#include "mb_internal.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <math.h>
+
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+typedef std::chrono::steady_clock MBCheckClock;
+
+struct MBCheck
+{
+	const char* name;
+	bool ok;
+
+	// directory for the files a check creates
+	std::string root;
+
+	// extra JSON fields for the report, each starting with a comma
+	std::string fields;
+};
+
+static void mbcheck_expect(MBCheck& check, bool condition, const char* what)
+{
+	if (!condition)
+	{
+		fprintf(stderr, "mbcheck: %s: %s\n", check.name, what);
+		check.ok = false;
+	}
+}
+
+static void mbcheck_field(MBCheck& check, const char* format, ...)
+{
+	char buffer[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	check.fields += ",";
+	check.fields += buffer;
+}
+
+static void* mbcheck_mock(MBCheck& check, unsigned long monitors, unsigned long latency_us)
+{
+	MB_MOCK_CONFIG config = { monitors, 0, 100, latency_us, 0, 0.0, 1 };
+	void* handle = nullptr;
+	mbcheck_expect(check, mb_mock_init(&handle, &config) != 0, "mb_mock_init failed");
+	return handle;
+}
+
+static void mbcheck_calls(MBCheck& check)
+{
+	void* handle = mbcheck_mock(check, 2, 0);
+	unsigned long reads = 0;
+	unsigned long writes = 0;
+	double percent = 0.0;
+
+	// the first set reads the range, then writes
+	mbcheck_expect(check, mb_set_brightness(handle, 0, 0.5) != 0, "first set failed");
+	mb_mock_get_calls(handle, 0, &reads, &writes);
+	mbcheck_expect(check, reads == 1 && writes == 1, "first set: expected 1 range read and 1 write");
+	mbcheck_field(check, "\"first_set_reads\":%lu,\"first_set_writes\":%lu", reads, writes);
+
+	// later sets write only, the range is known and nothing is read before a write
+	for (int i = 0; i < 10; i++)
+	{
+		mb_set_brightness(handle, 0, i / 10.0);
+	}
+	mb_mock_get_calls(handle, 0, &reads, &writes);
+	mbcheck_expect(check, reads == 1 && writes == 11, "10 more sets: expected no read and 10 writes");
+
+	// the shadow answers gets within the cache timeout
+	for (int i = 0; i < 100; i++)
+	{
+		mb_get_brightness(handle, 0, &percent);
+	}
+	mb_mock_get_calls(handle, 0, &reads, &writes);
+	mbcheck_expect(check, reads == 1, "100 cached gets reached the device");
+	mbcheck_expect(check, percent > 0.89 && percent < 0.91, "cached get does not return the last set");
+	mbcheck_field(check, "\"cached_get_reads\":%lu", reads - 1);
+
+	// without a cache every get is one device read
+	mb_set_cache_timeout(handle, 0);
+	for (int i = 0; i < 10; i++)
+	{
+		mb_get_brightness(handle, 0, &percent);
+	}
+	mb_mock_get_calls(handle, 0, &reads, &writes);
+	mbcheck_expect(check, reads == 11, "10 uncached gets: expected 10 reads");
+	mbcheck_field(check, "\"uncached_get_reads\":%lu", reads - 1);
+
+	// a get on a fresh monitor reads the range and the value
+	mb_get_brightness(handle, 1, &percent);
+	mb_mock_get_calls(handle, 1, &reads, &writes);
+	mbcheck_expect(check, reads == 2 && writes == 0, "first get: expected 1 range read and 1 value read");
+
+	unsigned long count = 0;
+	mb_get_count(handle, &count);
+	mbcheck_expect(check, !mb_set_brightness(handle, count, 0.5) && mb_last_error_code(nullptr) == MB_ERROR_INDEX_OUT_OF_RANGE,
+		"index == count was not refused");
+	mb_cleanup(handle);
+}
+
+static double mbcheck_ms(MBCheckClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(MBCheckClock::now() - start).count();
+}
+
+static void mbcheck_probe(MBCheck& check)
+{
+	// each probe takes one 100 ms device call, 4 monitors probed one after another would take 400 ms
+	MB_MOCK_CONFIG config = { 4, 0, 100, 100000, 0, 0.0, 1 };
+	void* handle = nullptr;
+	MBCheckClock::time_point start = MBCheckClock::now();
+	mbcheck_expect(check, mb_mock_init_ex(&handle, &config, MB_INFINITE) != 0, "mb_mock_init_ex failed");
+	double parallel_ms = mbcheck_ms(start);
+	mbcheck_expect(check, parallel_ms < 200.0, "4 monitors were not probed in parallel");
+	for (unsigned long i = 0; i < 4; i++)
+	{
+		mbcheck_expect(check, mb_get_monitor_state(handle, i) == MB_MONITOR_READY, "a probed monitor is not ready");
+	}
+	mb_cleanup(handle);
+
+	// with a deadline the init returns before the probes, a call on a pending monitor waits for its probe
+	start = MBCheckClock::now();
+	mbcheck_expect(check, mb_mock_init_ex(&handle, &config, 20) != 0, "mb_mock_init_ex with a deadline failed");
+	double deadline_ms = mbcheck_ms(start);
+	mbcheck_expect(check, deadline_ms < 60.0, "init did not return at its deadline");
+	unsigned long pending = 0;
+	for (unsigned long i = 0; i < 4; i++)
+	{
+		pending += mb_get_monitor_state(handle, i) == MB_MONITOR_PENDING;
+	}
+	mbcheck_expect(check, pending == 4, "monitors still probing are not pending");
+	double percent = 0.0;
+	mbcheck_expect(check, mb_get_brightness(handle, 0, &percent) != 0, "get on a pending monitor failed");
+	double waited_ms = mbcheck_ms(start);
+	mbcheck_expect(check, mb_get_monitor_state(handle, 0) == MB_MONITOR_READY, "monitor not ready after its probe");
+	mb_cleanup(handle);
+
+	mbcheck_field(check, "\"parallel_ms\":%.1f,\"deadline_ms\":%.1f,\"pending\":%lu,\"first_get_ms\":%.1f", parallel_ms, deadline_ms, pending, waited_ms);
+}
+
+static void mbcheck_stats(MBCheck& check)
+{
+	void* handle = mbcheck_mock(check, 2, 0);
+	mb_set_cache_timeout(handle, 0);
+	double percent;
+	for (int i = 0; i < 50; i++)
+	{
+		mb_set_brightness(handle, 0, (i & 1) ? 0.25 : 0.75);
+		mb_get_brightness(handle, 0, &percent);
+	}
+
+	MB_STATS stats;
+	mbcheck_expect(check, mb_stats_snapshot(handle, 0, &stats, 1) != 0, "mb_stats_snapshot failed");
+	mbcheck_expect(check, stats.set_ok == 50 && stats.get_ok == 50 && stats.set_failed == 0 && stats.get_failed == 0,
+		"expected 50 sets and 50 gets");
+	mbcheck_expect(check, stats.set_latency.count == 50, "not every set was timed");
+
+	uint64_t buckets = 0;
+	for (unsigned int i = 0; i < MB_STATS_BUCKETS; i++)
+	{
+		buckets += stats.set_latency.buckets[i];
+	}
+	mbcheck_expect(check, buckets == stats.set_latency.count, "the set histogram does not add up to its count");
+	mbcheck_field(check, "\"set_ok\":%llu,\"get_ok\":%llu,\"set_timed\":%llu,\"get_timed\":%llu", (unsigned long long)stats.set_ok,
+		(unsigned long long)stats.get_ok, (unsigned long long)stats.set_latency.count, (unsigned long long)stats.get_latency.count);
+
+	MB_STATS after;
+	mb_stats_snapshot(handle, 0, &after, 0);
+	mbcheck_expect(check, after.set_ok == 0 && after.get_ok == 0 && after.set_latency.count == 0, "reset left counts behind");
+	mb_stats_snapshot(handle, MB_STATS_ALL, &after, 0);
+	mbcheck_expect(check, after.set_ok == 0, "MB_STATS_ALL counts calls that were reset");
+	mb_cleanup(handle);
+
+	// half the device calls fail, every write that reached the mock is counted once as ok or failed
+	MB_MOCK_CONFIG config = { 1, 0, 100, 0, 0, 0.5, 7 };
+	mbcheck_expect(check, mb_mock_init(&handle, &config) != 0, "mb_mock_init failed");
+	unsigned long succeeded = 0;
+	for (int i = 0; i < 200; i++)
+	{
+		succeeded += mb_set_brightness(handle, 0, (i & 1) ? 0.25 : 0.75) != 0;
+	}
+	unsigned long writes = 0;
+	mb_mock_get_calls(handle, 0, nullptr, &writes);
+	mb_stats_snapshot(handle, 0, &stats, 0);
+	mbcheck_expect(check, stats.set_ok == succeeded, "set_ok differs from the sets that succeeded");
+	mbcheck_expect(check, stats.set_ok + stats.set_failed == writes, "set_ok + set_failed differs from the device writes");
+	mbcheck_field(check, "\"flaky_writes\":%lu,\"flaky_set_failed\":%llu", writes, (unsigned long long)stats.set_failed);
+	mb_cleanup(handle);
+}
+
+struct MBCheckCurve
+{
+	const char* name;
+	unsigned long min;
+	unsigned long max;
+	long curve;
+};
+
+// raw value of the mock, read through the brightness VCP code
+static unsigned long mbcheck_raw(void* handle, unsigned long index)
+{
+	MB_VCP_VALUE value = { MB_VCP_BRIGHTNESS, 0, 0, 0 };
+	mb_get_vcp_values(handle, index, &value, 1);
+	return value.current;
+}
+
+static void mbcheck_calibration(MBCheck& check)
+{
+	const MBCheckCurve curves[] =
+	{
+		{ "linear_100", 0, 100, MB_CURVE_LINEAR },
+		{ "linear_255", 0, 255, MB_CURVE_LINEAR },
+		{ "linear_120000", 0, 120000, MB_CURVE_LINEAR },
+		{ "perceptual_255", 0, 255, MB_CURVE_PERCEPTUAL },
+	};
+	for (const MBCheckCurve& curve : curves)
+	{
+		MB_MOCK_CONFIG config = { 1, curve.min, curve.max, 0, 0, 0.0, 1 };
+		void* handle = nullptr;
+		mbcheck_expect(check, mb_mock_init(&handle, &config) != 0, "mb_mock_init failed");
+		mb_set_calibration(handle, 0, curve.curve, nullptr, 0);
+
+		double max_error = 0.0;
+		unsigned long moved = 0;
+		for (int i = 0; i <= 1000; i++)
+		{
+			double percent = i / 1000.0;
+			double read = -1.0;
+			mb_set_brightness(handle, 0, percent);
+			mb_get_brightness(handle, 0, &read);
+			max_error = fmax(max_error, fabs(read - percent));
+
+			// writing what was read lands on the same raw value
+			unsigned long raw = mbcheck_raw(handle, 0);
+			mb_set_brightness(handle, 0, read);
+			moved += mbcheck_raw(handle, 0) != raw;
+		}
+
+		// a linear curve is off by at most one raw step, or one step of the 1/65536 percent resolution on wide ranges
+		if (curve.curve == MB_CURVE_LINEAR)
+		{
+			double step = fmax(1.0 / (double)(curve.max - curve.min), 1.0 / 65536.0);
+			mbcheck_expect(check, max_error <= step, "a linear reading is off by more than a raw step");
+		}
+		mbcheck_expect(check, moved == 0, "writing a reading back moved the monitor");
+
+		double ends[2] = { -1.0, -1.0 };
+		mb_set_brightness(handle, 0, 0.0);
+		mb_get_brightness(handle, 0, &ends[0]);
+		mb_set_brightness(handle, 0, 1.0);
+		mb_get_brightness(handle, 0, &ends[1]);
+		mbcheck_expect(check, ends[0] == 0.0 && ends[1] == 1.0, "the ends of the raw range do not read back as 0 and 1");
+		mbcheck_field(check, "\"%s_max_error\":%.5f", curve.name, max_error);
+		mb_cleanup(handle);
+	}
+
+	// the perceptual curve is relative to the range, monitors with different ranges land at the same level
+	MB_MOCK_CONFIG narrow = { 1, 0, 100, 0, 0, 0.0, 1 };
+	MB_MOCK_CONFIG wide = { 1, 10, 1000, 0, 0, 0.0, 1 };
+	void* handles[2] = { nullptr, nullptr };
+	mb_mock_init(&handles[0], &narrow);
+	mb_mock_init(&handles[1], &wide);
+	double levels[2];
+	for (int i = 0; i < 2; i++)
+	{
+		mb_set_calibration(handles[i], 0, MB_CURVE_PERCEPTUAL, nullptr, 0);
+		mb_set_brightness(handles[i], 0, 0.5);
+		levels[i] = (double)(mbcheck_raw(handles[i], 0) - (i == 0 ? 0 : 10)) / (i == 0 ? 100.0 : 990.0);
+		mb_cleanup(handles[i]);
+	}
+	mbcheck_expect(check, fabs(levels[0] - 0.184) < 0.01 && fabs(levels[1] - 0.184) < 0.01, "50% perceptual is not near L* 50");
+	mbcheck_field(check, "\"perceptual_half_levels\":[%.3f,%.3f]", levels[0], levels[1]);
+}
+
+static void mbcheck_handles(MBCheck& check)
+{
+	unsigned long count;
+	void* stale = mbcheck_mock(check, 1, 0);
+	mb_cleanup(stale);
+	mbcheck_expect(check, !mb_get_count(stale, &count) && mb_last_error_code(nullptr) == MB_ERROR_INVALID_HANDLE,
+		"a cleaned up handle was accepted");
+	mbcheck_expect(check, !mb_cleanup(stale), "a second cleanup of a handle succeeded");
+
+	// open until the table is full, the stale handle's slot is reused on the way and it must still fail
+	std::vector<void*> handles;
+	MB_MOCK_CONFIG config = { 1, 0, 100, 0, 0, 0.0, 1 };
+	void* handle;
+	while (handles.size() < 2048 && mb_mock_init(&handle, &config))
+	{
+		handles.push_back(handle);
+	}
+	mbcheck_expect(check, mb_last_error_code(nullptr) == MB_ERROR_TOO_MANY_HANDLES, "a full table did not report MB_ERROR_TOO_MANY_HANDLES");
+	mbcheck_expect(check, !mb_get_count(stale, &count), "a stale handle was accepted after its slot was reused");
+	mbcheck_field(check, "\"max_handles\":%zu", handles.size());
+	for (void* open : handles)
+	{
+		mb_cleanup(open);
+	}
+
+	// random values never name a live handle, nothing behind them is dereferenced
+	void* live = mbcheck_mock(check, 1, 0);
+	uint64_t value = 0x9E3779B97F4A7C15ull;
+	unsigned long accepted = 0;
+	for (unsigned long i = 0; i < 1000000; i++)
+	{
+		value = value * 6364136223846793005ull + 1442695040888963407ull;
+		accepted += mb_get_count((void*)(uintptr_t)value, &count) != 0;
+	}
+	mbcheck_expect(check, accepted == 0, "a random handle value was accepted");
+	mbcheck_field(check, "\"random_accepted\":%lu", accepted);
+	mb_cleanup(live);
+
+	// 4 threads sit in 200 ms writes while the handle is cleaned up, the cleanup sleeps until they leave
+	MB_MOCK_CONFIG slow = { 4, 0, 100, 200000, 0, 0.0, 1 };
+	mbcheck_expect(check, mb_mock_init(&handle, &slow) != 0, "mb_mock_init failed");
+	std::atomic<unsigned long> finished(0);
+	std::vector<std::thread> threads;
+	for (unsigned long i = 0; i < 4; i++)
+	{
+		threads.emplace_back([handle, i, &finished]()
+		{
+			finished += mb_set_brightness(handle, i, 0.5) != 0;
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	std::clock_t cpu = std::clock();
+	MBCheckClock::time_point start = MBCheckClock::now();
+	mbcheck_expect(check, mb_cleanup(handle) != 0, "cleanup during calls failed");
+	double cleanup_ms = mbcheck_ms(start);
+	double cpu_ms = 1000.0 * (double)(std::clock() - cpu) / CLOCKS_PER_SEC;
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	mbcheck_expect(check, finished == 4, "a call already inside the handle failed during cleanup");
+	mbcheck_expect(check, !mb_get_count(handle, &count), "the handle was accepted after cleanup");
+	mbcheck_expect(check, cpu_ms < cleanup_ms / 4, "the cleanup spun while waiting for the calls");
+	mbcheck_field(check, "\"cleanup_ms\":%.1f,\"cleanup_cpu_ms\":%.2f", cleanup_ms, cpu_ms);
+}
+
+static void mbcheck_ramp(MBCheck& check)
+{
+	// each device write takes 50 ms, the scheduler steps every 16 ms, so most steps find a write still running
+	const unsigned long latency_ms = 50;
+	const unsigned long duration_ms = 300;
+	void* handle = mbcheck_mock(check, 1, latency_ms * 1000);
+	mb_set_brightness(handle, 0, 0.0);
+	unsigned long before = 0;
+	mb_mock_get_calls(handle, 0, nullptr, &before);
+	MB_STATS stats;
+	mb_stats_snapshot(handle, 0, &stats, 1);
+
+	MBCheckClock::time_point start = MBCheckClock::now();
+	mbcheck_expect(check, mb_ramp_brightness(handle, 0, 1.0, duration_ms, MB_EASE_LINEAR) != 0, "mb_ramp_brightness failed");
+	mbcheck_expect(check, mb_flush(handle, MB_INFINITE) != 0, "a ramp step failed");
+	double fade_ms = mbcheck_ms(start);
+
+	// the last value may wait behind one write already running when the fade ends, then takes one write itself
+	mbcheck_expect(check, mbcheck_raw(handle, 0) == 100, "the fade did not end at its target");
+	mbcheck_expect(check, fade_ms <= duration_ms + 2 * latency_ms + 20, "the fade ended later than its duration plus one step");
+
+	// steps the device had no time for are dropped, a queue would take a write per step
+	unsigned long writes = 0;
+	mb_mock_get_calls(handle, 0, nullptr, &writes);
+	writes -= before;
+	mb_stats_snapshot(handle, 0, &stats, 0);
+	mbcheck_expect(check, writes <= duration_ms / latency_ms + 2, "the fade wrote more often than the device can take");
+	mbcheck_expect(check, stats.dropped > 0, "no step of the fade was dropped");
+	mbcheck_field(check, "\"fade_ms\":%.1f,\"fade_writes\":%lu,\"fade_dropped\":%llu", fade_ms, writes, (unsigned long long)stats.dropped);
+
+	// a set halfway through a fade ends it, no later step overwrites the set
+	mb_ramp_brightness(handle, 0, 0.0, duration_ms, MB_EASE_LINEAR);
+	std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms / 3));
+	mbcheck_expect(check, mb_set_brightness(handle, 0, 0.9) != 0, "a set during a fade failed");
+	mb_mock_get_calls(handle, 0, nullptr, &before);
+	std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+	mb_flush(handle, MB_INFINITE);
+	mb_mock_get_calls(handle, 0, nullptr, &writes);
+	mbcheck_expect(check, mbcheck_raw(handle, 0) == 90, "a fade step overwrote a set made during the fade");
+	mbcheck_expect(check, writes == before, "the fade kept writing after a set cancelled it");
+	mbcheck_field(check, "\"writes_after_cancel\":%lu", writes - before);
+	mb_cleanup(handle);
+}
+
+static void mbcheck_stress(MBCheck& check)
+{
+	// one thread per monitor, 200 writes of 1 ms each, 1600 ms if the monitors waited for each other
+	void* handle = mbcheck_mock(check, 8, 1000);
+	std::vector<std::thread> threads;
+	MBCheckClock::time_point start = MBCheckClock::now();
+	for (unsigned long m = 0; m < 8; m++)
+	{
+		threads.emplace_back([handle, m]()
+		{
+			for (int i = 0; i < 200; i++)
+			{
+				mb_set_brightness(handle, m, (i & 1) ? 0.25 : 0.75);
+			}
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	double side_by_side_ms = mbcheck_ms(start);
+	mbcheck_expect(check, side_by_side_ms < 800.0, "monitors of one handle waited for each other");
+	threads.clear();
+
+	// 4 threads per monitor mix every kind of call, the mock fails commands that overlap on a device
+	mb_set_cache_timeout(handle, 0);
+	std::atomic<unsigned long> ok(0);
+	std::atomic<unsigned long> failed(0);
+	for (unsigned long t = 0; t < 32; t++)
+	{
+		threads.emplace_back([handle, t, &ok, &failed]()
+		{
+			unsigned long m = t % 8;
+			for (int i = 0; i < 100; i++)
+			{
+				double percent = (double)((t + i) % 11) / 10.0;
+				long result = 0;
+				switch (i % 4)
+				{
+				case 0:
+					result = mb_set_brightness(handle, m, percent);
+					break;
+				case 1:
+					result = mb_get_brightness(handle, m, &percent);
+					break;
+				case 2:
+					result = mb_submit_brightness(handle, m, percent);
+					break;
+				default:
+				{
+					MB_BRIGHTNESS requests[2] = { { m, percent }, { (m + 1) % 8, percent } };
+					result = mb_set_brightness_batch(handle, requests, 2, nullptr);
+					break;
+				}
+				}
+				(result ? ok : failed)++;
+			}
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	mbcheck_expect(check, mb_flush(handle, MB_INFINITE) != 0, "a submitted write failed");
+	mbcheck_expect(check, failed == 0, "calls failed, commands overlapped on a monitor");
+	mb_cleanup(handle);
+
+	mbcheck_field(check, "\"side_by_side_ms\":%.1f,\"mixed_ok\":%lu,\"mixed_failed\":%lu", side_by_side_ms, (unsigned long)ok, (unsigned long)failed);
+}
+
+#ifdef __linux__
+static void mbcheck_lux(const std::string& path, double lux)
+{
+	FILE* file = fopen(path.c_str(), "w");
+	if (file != nullptr)
+	{
+		fprintf(file, "%g\n", lux);
+		fclose(file);
+	}
+}
+
+static void mbcheck_auto(MBCheck& check)
+{
+	// a processed channel holds lux, so no scale is read next to it
+	std::string sensor = check.root + "/mbcheck_illuminance_input";
+	mbcheck_lux(sensor, 200.0);
+	void* handle = mbcheck_mock(check, 2, 0);
+	MB_AUTO_CONFIG config = { sensor.c_str(), 0.0, 20, 0.0, 0.0, 0.0, 0, nullptr, 0 };
+	mbcheck_expect(check, mb_auto_start(handle, &config) != 0, "mb_auto_start failed");
+
+	// the default curve puts 200 lux at 0.50, 1000 lux at 0.80 and darkness at 0.05
+	double percent = 0.0;
+	unsigned long writes = 0;
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	mb_flush(handle, MB_INFINITE);
+	mb_get_brightness(handle, 0, &percent);
+	mbcheck_expect(check, percent > 0.49 && percent < 0.51, "200 lux did not give 0.50");
+	mbcheck_field(check, "\"lux_200\":%.3f", percent);
+
+	// noise inside the hysteresis band writes nothing
+	unsigned long before = 0;
+	mb_mock_get_calls(handle, 0, nullptr, &before);
+	for (int i = 0; i < 25; i++)
+	{
+		mbcheck_lux(sensor, 200.0 * (1.0 + ((i % 5) - 2) * 0.02));
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	mb_flush(handle, MB_INFINITE);
+	mb_mock_get_calls(handle, 0, nullptr, &writes);
+	mbcheck_expect(check, writes == before, "sensor noise reached the monitor");
+	mbcheck_field(check, "\"noise_writes\":%lu", writes - before);
+
+	mbcheck_lux(sensor, 1000.0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(600));
+	mb_flush(handle, MB_INFINITE);
+	mb_get_brightness(handle, 0, &percent);
+	mb_mock_get_calls(handle, 0, nullptr, &before);
+	mbcheck_expect(check, percent > 0.79 && percent < 0.81, "1000 lux did not settle at 0.80");
+	mbcheck_field(check, "\"lux_1000\":%.3f,\"step_writes\":%lu", percent, before - writes);
+
+	mbcheck_lux(sensor, 0.0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(600));
+	mb_flush(handle, MB_INFINITE);
+	mb_get_brightness(handle, 0, &percent);
+	mbcheck_expect(check, percent > 0.04 && percent < 0.06, "darkness did not settle at 0.05");
+	mbcheck_field(check, "\"dark\":%.3f", percent);
+	mbcheck_expect(check, !mb_auto_start(handle, &config), "a second loop started on one handle");
+
+	// an idle loop sleeps between readings
+	mb_auto_stop(handle);
+	config.interval = 500;
+	mb_auto_start(handle, &config);
+	std::clock_t cpu = std::clock();
+	std::this_thread::sleep_for(std::chrono::seconds(2));
+	double cpu_ms = 1000.0 * (double)(std::clock() - cpu) / CLOCKS_PER_SEC;
+	mbcheck_expect(check, cpu_ms < 20.0, "the idle loop used more than 20 ms of CPU in 2 s");
+	mbcheck_field(check, "\"idle_cpu_ms\":%.2f", cpu_ms);
+
+	// cleanup stops the loop and a running ramp
+	mb_auto_stop(handle);
+	config.interval = 20;
+	config.ramp = 200;
+	mb_auto_start(handle, &config);
+	mbcheck_lux(sensor, 1000.0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	mbcheck_expect(check, mb_cleanup(handle) != 0, "cleanup with the loop and a ramp running failed");
+	remove(sensor.c_str());
+}
+
+// EDID base block of a monitor with a name descriptor, the serial 0 is the placeholder serial-less panels ship
+static std::string mbcheck_edid_block(const char* name, uint32_t serial)
+{
+	uint8_t edid[128] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+	uint16_t vendor = (7 << 10) | (19 << 5) | 13;
+	edid[8] = (uint8_t)(vendor >> 8);
+	edid[9] = (uint8_t)vendor;
+	edid[10] = 0x77;
+	edid[11] = 0x5B;
+	for (int i = 0; i < 4; i++)
+	{
+		edid[12 + i] = (uint8_t)(serial >> (8 * i));
+	}
+	edid[16] = 12;
+	edid[17] = 2017 - 1990;
+	edid[18] = 1;
+	edid[19] = 4;
+	edid[54 + 3] = 0xFC;
+	memset(edid + 54 + 5, ' ', 13);
+	size_t length = strlen(name);
+	memcpy(edid + 54 + 5, name, length);
+	edid[54 + 5 + length] = 0x0A;
+	uint8_t sum = 0;
+	for (int i = 0; i < 127; i++)
+	{
+		sum += edid[i];
+	}
+	edid[127] = (uint8_t)(0x100 - sum);
+	return std::string((const char*)edid, sizeof(edid));
+}
+
+static void mbcheck_write(std::vector<std::string>& created, const std::string& path, const std::string& content)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file != nullptr)
+	{
+		fwrite(content.data(), 1, content.size(), file);
+		fclose(file);
+		created.push_back(path);
+	}
+}
+
+static void mbcheck_mkdir(std::vector<std::string>& created, const std::string& path)
+{
+	if (mkdir(path.c_str(), 0755) == 0)
+	{
+		created.push_back(path);
+	}
+}
+
+static void mbcheck_edid(MBCheck& check)
+{
+	// the tree is rebuilt every run and removed in reverse afterwards
+	std::string base = check.root + "/mbcheck_edid";
+	std::string backlight = base + "/backlight";
+	std::string drm = base + "/drm";
+	std::vector<std::string> created;
+	mbcheck_mkdir(created, base);
+	mbcheck_mkdir(created, backlight);
+	mbcheck_mkdir(created, drm);
+
+	// panel owns its backlight as a subdirectory, lg-a the same way, lg-b through the ddc link of an HDMI connector,
+	// the connector of empty has no monitor and nothing owns orphan
+	const char* devices[] = { "panel", "lg-a", "lg-b", "empty", "orphan" };
+	for (const char* device : devices)
+	{
+		std::string path = backlight + "/" + device;
+		mbcheck_mkdir(created, path);
+		mbcheck_write(created, path + "/max_brightness", "255\n");
+		mbcheck_write(created, path + "/brightness", "128\n");
+	}
+	const char* connectors[] = { "card0-eDP-1", "card0-DP-1", "card0-HDMI-A-1", "card0-DP-2" };
+	for (const char* connector : connectors)
+	{
+		mbcheck_mkdir(created, drm + "/" + connector);
+	}
+	std::string lg = mbcheck_edid_block("LG ULTRAFINE", 0);
+	mbcheck_mkdir(created, drm + "/card0-eDP-1/panel");
+	mbcheck_write(created, drm + "/card0-eDP-1/edid", mbcheck_edid_block("PANEL", 0x12345678));
+	mbcheck_mkdir(created, drm + "/card0-DP-1/lg-a");
+	mbcheck_write(created, drm + "/card0-DP-1/edid", lg);
+	if (symlink("../../../i2c-4/lg-b", (drm + "/card0-HDMI-A-1/ddc").c_str()) == 0)
+	{
+		created.push_back(drm + "/card0-HDMI-A-1/ddc");
+	}
+	mbcheck_write(created, drm + "/card0-HDMI-A-1/edid", lg);
+	mbcheck_mkdir(created, drm + "/card0-DP-2/empty");
+	mbcheck_write(created, drm + "/card0-DP-2/edid", "");
+
+	mb_set_edid_root(drm.c_str());
+	uint64_t first[5] = { 0, 0, 0, 0, 0 };
+	for (int run = 0; run < 2; run++)
+	{
+		void* handle = nullptr;
+		unsigned long count = 0;
+		mbcheck_expect(check, mb_sysfs_init(&handle, backlight.c_str()) != 0, "mb_sysfs_init on the fake tree failed");
+		mb_get_count(handle, &count);
+		mbcheck_expect(check, count == 5, "not every fake backlight was found");
+
+		// backlights enumerate in directory order, so each is matched by its name
+		uint64_t ids[5] = { 0, 0, 0, 0, 0 };
+		unsigned long found = 0;
+		for (unsigned long index = 0; index < count; index++)
+		{
+			// the name is not terminated, its length is returned
+			WCHAR wide[64];
+			std::string name;
+			long length = mb_get_name(handle, index, wide, 64);
+			for (long i = 0; i < length && i < 64; i++)
+			{
+				name += (char)wide[i];
+			}
+			uint64_t id = 0;
+			mb_get_monitor_id(handle, index, &id);
+			for (int i = 0; i < 5; i++)
+			{
+				if (name == devices[i])
+				{
+					ids[i] = id;
+				}
+			}
+
+			unsigned long at = ~0ul;
+			if (id != 0 && mb_find_monitor(handle, id, &at) && at == index)
+			{
+				found++;
+			}
+		}
+
+		MB_EDID_INFO info;
+		unsigned long lg_index = ~0ul;
+		bool lg_name = ids[2] != 0 && mb_find_monitor(handle, ids[2], &lg_index) && mb_get_edid_info(handle, lg_index, &info) &&
+			strcmp(info.name, "LG ULTRAFINE") == 0 && strcmp(info.manufacturer, "GSM") == 0;
+		mb_sysfs_cleanup(handle);
+
+		mbcheck_expect(check, ids[0] != 0 && ids[1] != 0 && ids[2] != 0, "a connected monitor has no id");
+		mbcheck_expect(check, ids[1] != ids[2], "two serial-less monitors on different connectors share an id");
+		mbcheck_expect(check, ids[3] == 0 && ids[4] == 0, "a backlight without a monitor has an id");
+		mbcheck_expect(check, found == 3, "mb_find_monitor did not find every monitor with an id");
+		mbcheck_expect(check, lg_name, "the EDID of the HDMI monitor was not parsed");
+		if (run == 0)
+		{
+			memcpy(first, ids, sizeof(first));
+			mbcheck_field(check, "\"with_id\":%d,\"found\":%lu", (ids[0] != 0) + (ids[1] != 0) + (ids[2] != 0), found);
+		}
+		else
+		{
+			mbcheck_expect(check, memcmp(first, ids, sizeof(ids)) == 0, "the ids changed between two inits");
+		}
+	}
+	mb_set_edid_root(nullptr);
+
+	for (auto path = created.rbegin(); path != created.rend(); ++path)
+	{
+		remove(path->c_str());
+	}
+}
+
+// poll until condition holds, the watcher applies events on its own thread
+static bool mbcheck_wait(const std::function<bool()>& condition)
+{
+	MBCheckClock::time_point start = MBCheckClock::now();
+	while (!condition())
+	{
+		if (mbcheck_ms(start) > 2000.0)
+		{
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	return true;
+}
+
+static void mbcheck_hotplug_event(void* context, void* handle, unsigned long index, long state)
+{
+	(*(std::atomic<unsigned long>*)context)++;
+}
+
+static std::string mbcheck_read(const std::string& path)
+{
+	std::string content;
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file != nullptr)
+	{
+		char buffer[64];
+		size_t size = fread(buffer, 1, sizeof(buffer), file);
+		content.assign(buffer, size);
+		fclose(file);
+	}
+	return content;
+}
+
+// a DDC/CI display that answers at once, every transaction that reaches it is counted
+struct MBCheckDisplay
+{
+	std::mutex lock;
+	uint8_t reply[11];
+	uint16_t value;
+	unsigned long transactions;
+
+	MBCheckDisplay() : value(50), transactions(0)
+	{
+		memset(reply, 0, sizeof(reply));
+	}
+
+	bool write(const uint8_t* data, size_t length)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		transactions++;
+
+		// Get VCP Feature reply: source, length, opcode, result, code, type, max and current, checksum
+		if (length >= 4 && data[2] == 0x01)
+		{
+			uint8_t fields[11] = { 0x6E, 0x88, 0x02, (uint8_t)(data[3] == 0x10 ? 0 : 1), data[3], 0, 0, 100, (uint8_t)(value >> 8), (uint8_t)value, 0 };
+			uint8_t checksum = 0x50;
+			for (int i = 0; i < 10; i++)
+			{
+				checksum ^= fields[i];
+			}
+			fields[10] = checksum;
+			memcpy(reply, fields, sizeof(reply));
+		}
+		else if (length >= 6 && data[2] == 0x03)
+		{
+			value = (uint16_t)((data[4] << 8) | data[5]);
+		}
+		return true;
+	}
+
+	bool read(uint8_t* data, size_t length)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		transactions++;
+		memcpy(data, reply, MB_MIN(length, sizeof(reply)));
+		return true;
+	}
+};
+
+// a connection to the display on one bus, the display outlives the bus
+struct MBCheckBus : public MBDdcTransport
+{
+	std::shared_ptr<MBCheckDisplay> display;
+
+	explicit MBCheckBus(std::shared_ptr<MBCheckDisplay> display) : display(display)
+	{
+	}
+
+	bool write(const uint8_t* data, size_t length) override
+	{
+		return display->write(data, length);
+	}
+
+	bool read(uint8_t* data, size_t length) override
+	{
+		return display->read(data, length);
+	}
+};
+
+static unsigned long mbcheck_transactions(MBCheckDisplay& display)
+{
+	std::lock_guard<std::mutex> guard(display.lock);
+	return display.transactions;
+}
+
+static uint16_t mbcheck_display_value(MBCheckDisplay& display)
+{
+	std::lock_guard<std::mutex> guard(display.lock);
+	return display.value;
+}
+
+// a dock plugged and unplugged under a DDC/CI handle: its bus node comes and goes in a fake /dev, its connector in a
+// fake drm tree says which display is behind it, and the display already there never sees a transaction
+static void mbcheck_hotplug_ddcci(MBCheck& check)
+{
+	std::string base = check.root + "/mbcheck_hotplug_ddcci";
+	std::string dev = base + "/dev";
+	std::string drm = base + "/drm";
+	std::vector<std::string> created;
+	mbcheck_mkdir(created, base);
+	mbcheck_mkdir(created, dev);
+	mbcheck_mkdir(created, drm);
+	mbcheck_mkdir(created, drm + "/card0-DP-1");
+	mbcheck_write(created, drm + "/card0-DP-1/edid", mbcheck_edid_block("LG ULTRAFINE", 0x00012345));
+	mbcheck_mkdir(created, drm + "/card0-DP-1/i2c-3");
+	mbcheck_write(created, dev + "/i2c-3", "");
+
+	// the watcher connects from its own thread while the check plugs displays in
+	std::mutex buses_lock;
+	std::map<std::string, std::shared_ptr<MBCheckDisplay>> buses;
+	std::shared_ptr<MBCheckDisplay> a = std::make_shared<MBCheckDisplay>();
+	std::shared_ptr<MBCheckDisplay> b = std::make_shared<MBCheckDisplay>();
+	buses["i2c-3"] = a;
+	auto plug = [&buses_lock, &buses](const std::string& name, std::shared_ptr<MBCheckDisplay> display)
+	{
+		std::lock_guard<std::mutex> guard(buses_lock);
+		if (display)
+		{
+			buses[name] = display;
+		}
+		else
+		{
+			buses.erase(name);
+		}
+	};
+
+	mb_set_edid_root(drm.c_str());
+	MBBaseStruct* h = mb_ddcci_open(dev, { "i2c-3" }, [&buses_lock, &buses](const std::string& name) -> std::unique_ptr<MBDdcTransport>
+	{
+		std::lock_guard<std::mutex> guard(buses_lock);
+		auto bus = buses.find(name);
+		if (bus == buses.end())
+		{
+			return nullptr;
+		}
+		return std::make_unique<MBCheckBus>(bus->second);
+	});
+	void* handle = nullptr;
+	unsigned long count = 0;
+	mbcheck_expect(check, h->enumerate() == 1 && mb_driver_attach(h, &handle), "mb_ddcci_open on the fake tree failed");
+	std::atomic<unsigned long> events(0);
+	mbcheck_expect(check, mb_hotplug_start(handle, mbcheck_hotplug_event, &events) != 0, "mb_hotplug_start on DDC/CI failed");
+	unsigned long a_transactions = mbcheck_transactions(*a);
+
+	// docked: the connector and its bus come first, the node last, the way the kernel adds them
+	mbcheck_mkdir(created, drm + "/card1-DP-2");
+	mbcheck_write(created, drm + "/card1-DP-2/edid", mbcheck_edid_block("DELL U2720Q", 0x00C0FFEE));
+	mbcheck_mkdir(created, drm + "/card1-DP-2/i2c-7");
+	plug("i2c-7", b);
+	mbcheck_write(created, dev + "/i2c-7", "");
+	bool added = mbcheck_wait([handle, &count]()
+	{
+		return mb_get_count(handle, &count) && count == 2 && mb_get_monitor_state(handle, 1) == MB_MONITOR_READY;
+	});
+	mbcheck_expect(check, added, "a display behind a new bus node was not added");
+	mbcheck_expect(check, mb_set_brightness(handle, 1, 0.5) != 0 && mbcheck_display_value(*b) == 50,
+		"a set on the docked display did not reach it");
+
+	// undocked: the index stays, calls on it fail until the display is back
+	plug("i2c-7", nullptr);
+	remove((dev + "/i2c-7").c_str());
+	bool detached = mbcheck_wait([handle]()
+	{
+		return mb_get_monitor_state(handle, 1) == MB_MONITOR_DETACHED;
+	});
+	mbcheck_expect(check, detached, "an undocked display was not detached");
+	mbcheck_expect(check, !mb_set_brightness(handle, 1, 0.5) && mb_last_error_code(nullptr) == MB_ERROR_DETACHED,
+		"a set on an undocked display did not fail with MB_ERROR_DETACHED");
+	double percent;
+	mbcheck_expect(check, !mb_get_brightness(handle, 1, &percent) && mb_last_error_code(nullptr) == MB_ERROR_DETACHED,
+		"a get on an undocked display did not fail with MB_ERROR_DETACHED");
+	mbcheck_expect(check, mb_get_count(handle, &count) && count == 2, "undocking changed the count");
+
+	// docked again, the dock's bus comes back with another number and the display is known by its EDID
+	rmdir((drm + "/card1-DP-2/i2c-7").c_str());
+	mbcheck_mkdir(created, drm + "/card1-DP-2/i2c-9");
+	plug("i2c-9", b);
+	mbcheck_write(created, dev + "/i2c-9", "");
+	bool reattached = mbcheck_wait([handle]()
+	{
+		return mb_get_monitor_state(handle, 1) == MB_MONITOR_READY;
+	});
+	mbcheck_expect(check, reattached, "a display back on another bus did not get its index again");
+	mbcheck_expect(check, mb_set_brightness(handle, 1, 0.25) != 0 && mbcheck_display_value(*b) == 25,
+		"a set on the redocked display did not reach it");
+	WCHAR wide[16];
+	std::string name;
+	long length = mb_get_name(handle, 1, wide, 16);
+	for (long i = 0; i < length && i < 16; i++)
+	{
+		name += (char)wide[i];
+	}
+	mbcheck_expect(check, name == "i2c-9", "the redocked display did not take the name of its new bus");
+
+	// a bus without a display behind it leaves the table alone
+	unsigned long before = events;
+	mbcheck_write(created, dev + "/i2c-5", "");
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	mbcheck_expect(check, mb_get_count(handle, &count) && count == 2 && events == before, "a bus without a display changed the table");
+	mbcheck_expect(check, mbcheck_transactions(*a) == a_transactions, "hotplug on the dock reached the display already there");
+
+	mb_hotplug_stop(handle);
+	mb_ddcci_cleanup(handle);
+	mb_set_edid_root(nullptr);
+	mbcheck_field(check, "\"ddc_count\":%lu,\"ddc_events\":%lu", count, (unsigned long)events);
+
+	for (auto path = created.rbegin(); path != created.rend(); ++path)
+	{
+		remove(path->c_str());
+	}
+}
+
+static void mbcheck_hotplug(MBCheck& check)
+{
+	std::string base = check.root + "/mbcheck_hotplug";
+	std::string tree = base + "/backlight";
+	std::vector<std::string> created;
+	mbcheck_mkdir(created, base);
+	mbcheck_mkdir(created, tree);
+	mbcheck_mkdir(created, tree + "/a");
+	mbcheck_write(created, tree + "/a/max_brightness", "100\n");
+	mbcheck_write(created, tree + "/a/brightness", "50\n");
+
+	void* handle = nullptr;
+	unsigned long count = 0;
+	mbcheck_expect(check, mb_sysfs_init(&handle, tree.c_str()) != 0, "mb_sysfs_init on the fake tree failed");
+	std::atomic<unsigned long> events(0);
+	mbcheck_expect(check, mb_hotplug_start(handle, mbcheck_hotplug_event, &events) != 0, "mb_hotplug_start failed");
+
+	// a device made the way the kernel makes one: the directory first, its attributes after the watcher saw it
+	std::string b = tree + "/b";
+	std::vector<std::string> files;
+	mkdir(b.c_str(), 0755);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	mbcheck_write(files, b + "/max_brightness", "200\n");
+	mbcheck_write(files, b + "/brightness", "0\n");
+	bool added = mbcheck_wait([handle, &count]()
+	{
+		return mb_get_count(handle, &count) && count == 2 && mb_get_monitor_state(handle, 1) == MB_MONITOR_READY;
+	});
+	mbcheck_expect(check, added, "a directory whose files came after it was not added");
+	mbcheck_expect(check, mb_set_brightness(handle, 1, 0.5) != 0 && mbcheck_read(b + "/brightness") == "100\n",
+		"a set on the added device did not reach its file");
+
+	// removed: the index stays, calls on it fail until the device is back
+	remove((b + "/brightness").c_str());
+	remove((b + "/max_brightness").c_str());
+	rmdir(b.c_str());
+	bool detached = mbcheck_wait([handle]()
+	{
+		return mb_get_monitor_state(handle, 1) == MB_MONITOR_DETACHED;
+	});
+	mbcheck_expect(check, detached, "a removed device was not detached");
+	mbcheck_expect(check, !mb_set_brightness(handle, 1, 0.5) && mb_last_error_code(nullptr) == MB_ERROR_DETACHED,
+		"a set on a detached device did not fail with MB_ERROR_DETACHED");
+	double percent;
+	mbcheck_expect(check, !mb_get_brightness(handle, 1, &percent) && mb_last_error_code(nullptr) == MB_ERROR_DETACHED,
+		"a get on a detached device did not fail with MB_ERROR_DETACHED");
+	mbcheck_expect(check, mb_get_count(handle, &count) && count == 2, "removing a device changed the count");
+	mbcheck_expect(check, mb_set_brightness(handle, 0, 0.25) != 0, "the other device stopped working");
+
+	// back under the same name with another range, it gets index 1 again and the range is read again
+	mkdir(b.c_str(), 0755);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	mbcheck_write(files, b + "/max_brightness", "1000\n");
+	mbcheck_write(files, b + "/brightness", "0\n");
+	bool reattached = mbcheck_wait([handle]()
+	{
+		return mb_get_monitor_state(handle, 1) == MB_MONITOR_READY;
+	});
+	mbcheck_expect(check, reattached, "a device back under its name did not get its index again");
+	mbcheck_expect(check, mb_set_brightness(handle, 1, 0.5) != 0 && mbcheck_read(b + "/brightness") == "500\n",
+		"a set on the reattached device did not use its new range");
+
+	// moved out and back in, the way a fake tree can stand in for a rename
+	std::string parked = base + "/a";
+	rename((tree + "/a").c_str(), parked.c_str());
+	bool moved_out = mbcheck_wait([handle]()
+	{
+		return mb_get_monitor_state(handle, 0) == MB_MONITOR_DETACHED;
+	});
+	rename(parked.c_str(), (tree + "/a").c_str());
+	bool moved_in = mbcheck_wait([handle]()
+	{
+		return mb_get_monitor_state(handle, 0) == MB_MONITOR_READY;
+	});
+	mbcheck_expect(check, moved_out && moved_in, "a device moved out and back in did not get index 0 again");
+	mbcheck_expect(check, mb_get_count(handle, &count) && count == 2, "hotplug changed the count");
+
+	mb_hotplug_stop(handle);
+	mb_sysfs_cleanup(handle);
+	mbcheck_field(check, "\"count\":%lu,\"events\":%lu", count, (unsigned long)events);
+
+	remove((b + "/brightness").c_str());
+	remove((b + "/max_brightness").c_str());
+	rmdir(b.c_str());
+	for (auto path = created.rbegin(); path != created.rend(); ++path)
+	{
+		remove(path->c_str());
+	}
+
+	mbcheck_hotplug_ddcci(check);
+}
+
+// a sysfs backlight owned by a DRM connector, so it has the connector's EDID
+static void mbcheck_group_device(std::vector<std::string>& created, const std::string& base, const char* name, const char* connector)
+{
+	mbcheck_mkdir(created, base + "/drm/" + connector);
+	mbcheck_mkdir(created, base + "/drm/" + connector + "/" + name);
+	mbcheck_write(created, base + "/drm/" + connector + "/edid", mbcheck_edid_block("DELL U2720Q", 0x00C0FFEE));
+	mbcheck_mkdir(created, base + "/backlight/" + name);
+	mbcheck_write(created, base + "/backlight/" + name + "/max_brightness", "100\n");
+	mbcheck_write(created, base + "/backlight/" + name + "/brightness", "0\n");
+}
+
+static void mbcheck_group(MBCheck& check)
+{
+	std::string base = check.root + "/mbcheck_group";
+	std::vector<std::string> created;
+	mbcheck_mkdir(created, base);
+	mbcheck_mkdir(created, base + "/backlight");
+	mbcheck_mkdir(created, base + "/drm");
+	mbcheck_group_device(created, base, "ext-a", "card0-DP-1");
+	mb_set_edid_root((base + "/drm").c_str());
+
+	void* mock = mbcheck_mock(check, 2, 0);
+	void* other = mbcheck_mock(check, 1, 0);
+	void* sysfs = nullptr;
+	mbcheck_expect(check, mb_sysfs_init(&sysfs, (base + "/backlight").c_str()) != 0, "mb_sysfs_init on the fake tree failed");
+	mb_set_cache_timeout(sysfs, 0);
+
+	// members from the mock and the sysfs backend, and one from a handle that is cleaned up below
+	MB_GROUP_MEMBER members[4] = { { mock, 0 }, { mock, 1 }, { sysfs, 0 }, { other, 0 } };
+	long results[4];
+	mbcheck_expect(check, mb_group_create("mbcheck-mixed", members, 4) != 0, "mb_group_create failed");
+	mbcheck_expect(check, mb_group_set_brightness("mbcheck-mixed", 0.5, results) != 0, "a group set failed");
+	unsigned long written = 0;
+	for (long result : results)
+	{
+		written += result == MB_GROUP_WRITTEN;
+	}
+	double percent = 0.0;
+	mbcheck_expect(check, written == 4, "not every member was written");
+	mbcheck_expect(check, mbcheck_raw(mock, 0) == 50 && mbcheck_raw(mock, 1) == 50, "a mock member did not reach 0.5");
+	mbcheck_expect(check, mb_get_brightness(sysfs, 0, &percent) && fabs(percent - 0.5) < 0.01, "the sysfs member did not reach 0.5");
+
+	// the same value again only reaches members whose value is not known
+	unsigned long before = 0;
+	unsigned long after = 0;
+	mb_mock_get_calls(mock, 0, nullptr, &before);
+	mbcheck_expect(check, mb_group_set_brightness("mbcheck-mixed", 0.5, results) != 0, "a repeated group set failed");
+	mb_mock_get_calls(mock, 0, nullptr, &after);
+	mbcheck_expect(check, results[0] == MB_GROUP_UNCHANGED && results[1] == MB_GROUP_UNCHANGED && results[3] == MB_GROUP_UNCHANGED,
+		"a member already at the target was written");
+	mbcheck_expect(check, after == before, "a member already at the target reached the device");
+
+	// a cleaned up handle fails its member alone, the first failure is reported
+	mb_cleanup(other);
+	mbcheck_expect(check, !mb_group_set_brightness("mbcheck-mixed", 0.7, results) && mb_last_error_code(nullptr) == MB_ERROR_INVALID_HANDLE,
+		"a group with a cleaned up member did not fail with MB_ERROR_INVALID_HANDLE");
+	mbcheck_expect(check, results[0] == MB_GROUP_WRITTEN && results[1] == MB_GROUP_WRITTEN && results[2] == MB_GROUP_WRITTEN && results[3] == 0,
+		"the failure of one member changed the results of the others");
+	mbcheck_expect(check, mbcheck_raw(mock, 0) == 70, "the other members were not written past the failed one");
+	mbcheck_field(check, "\"mixed_members\":4,\"failed_after_cleanup\":%d", results[3] == 0);
+	mb_group_delete("mbcheck-mixed");
+
+	// by id the group follows its monitor to the index it gets on another connector
+	uint64_t id = 0;
+	mb_get_monitor_id(sysfs, 0, &id);
+	mbcheck_expect(check, id != 0, "the sysfs member has no id");
+	MB_GROUP_MONITOR by_id[2] = { { mock, 0 }, { sysfs, id } };
+	mb_get_monitor_id(mock, 1, &by_id[0].id);
+	mbcheck_expect(check, mb_group_create_by_id("mbcheck-by-id", by_id, 2) != 0, "mb_group_create_by_id failed");
+	mbcheck_expect(check, mb_hotplug_start(sysfs, nullptr, nullptr) != 0, "mb_hotplug_start failed");
+	std::string moved = base + "/mbcheck_ext-a";
+	rename((base + "/backlight/ext-a").c_str(), moved.c_str());
+	mbcheck_wait([sysfs]()
+	{
+		return mb_get_monitor_state(sysfs, 0) == MB_MONITOR_DETACHED;
+	});
+	mbcheck_expect(check, !mb_group_set_brightness("mbcheck-by-id", 0.3, results) && results[0] == MB_GROUP_WRITTEN && results[1] == 0,
+		"a group member whose monitor is unplugged did not fail alone");
+
+	std::vector<std::string> replugged;
+	mbcheck_group_device(replugged, base, "ext-b", "card0-DP-2");
+	bool added = mbcheck_wait([sysfs]()
+	{
+		unsigned long count = 0;
+		return mb_get_count(sysfs, &count) && count == 2;
+	});
+	mbcheck_expect(check, added, "the monitor on its new connector was not added");
+	mbcheck_expect(check, mb_group_set_brightness("mbcheck-by-id", 0.3, results) != 0, "a group set after the replug failed");
+	MB_GROUP_MEMBER found[2];
+	mb_group_get_members("mbcheck-by-id", found, 2);
+	mbcheck_expect(check, found[1].index == 1, "the group did not find the monitor at its new index");
+	mbcheck_expect(check, mb_get_brightness(sysfs, 1, &percent) && fabs(percent - 0.3) < 0.01, "the replugged monitor was not written");
+	mbcheck_field(check, "\"by_id_index\":%lu", found[1].index);
+	mb_group_delete("mbcheck-by-id");
+
+	mb_hotplug_stop(sysfs);
+	mb_sysfs_cleanup(sysfs);
+	mb_cleanup(mock);
+	mb_set_edid_root(nullptr);
+
+	rename(moved.c_str(), (base + "/backlight/ext-a").c_str());
+	for (auto path = replugged.rbegin(); path != replugged.rend(); ++path)
+	{
+		remove(path->c_str());
+	}
+	for (auto path = created.rbegin(); path != created.rend(); ++path)
+	{
+		remove(path->c_str());
+	}
+}
+
+static void mbcheck_broker(MBCheck& check)
+{
+	std::string socket = check.root + "/mbcheck.sock";
+	void* served = mbcheck_mock(check, 2, 20000);
+	mbcheck_expect(check, mb_broker_serve(served, socket.c_str()) != 0, "mb_broker_serve failed");
+
+	// a live daemon keeps its socket
+	void* other = mbcheck_mock(check, 1, 0);
+	mbcheck_expect(check, !mb_broker_serve(other, socket.c_str()) && mb_last_error_code(nullptr) == MB_ERROR_IN_USE,
+		"a second daemon on a live socket did not fail with MB_ERROR_IN_USE");
+	mb_cleanup(other);
+
+	void* client = nullptr;
+	unsigned long count = 0;
+	mbcheck_expect(check, mb_broker_init(&client, socket.c_str()) != 0, "mb_broker_init failed");
+	mbcheck_expect(check, mb_get_count(client, &count) && count == 2, "the client does not see the daemon's monitors");
+
+	// the client asks the daemon every time, the daemon answers from its cache
+	mb_set_cache_timeout(client, 0);
+	double percent = 0.0;
+	unsigned long failed = 0;
+	for (int i = 0; i < 100; i++)
+	{
+		failed += !mb_get_brightness(client, 1, &percent);
+	}
+	unsigned long reads = 0;
+	mb_mock_get_calls(served, 1, &reads, nullptr);
+	mbcheck_expect(check, failed == 0, "a get through the broker failed");
+	mbcheck_expect(check, reads <= 2, "gets through the broker reached the device past its range and first read");
+	mbcheck_field(check, "\"client_gets\":100,\"device_reads\":%lu", reads);
+
+	// 4 clients write one 20 ms device at once, sets arriving during a write are folded into the next one
+	const unsigned long clients = 4;
+	const unsigned long sets = 20;
+	std::atomic<unsigned long> set_failed(0);
+	std::vector<std::thread> threads;
+	for (unsigned long t = 0; t < clients; t++)
+	{
+		threads.emplace_back([&socket, &set_failed, t, sets]()
+		{
+			void* own = nullptr;
+			if (!mb_broker_init(&own, socket.c_str()))
+			{
+				set_failed += sets;
+				return;
+			}
+			for (unsigned long i = 0; i < sets; i++)
+			{
+				set_failed += !mb_set_brightness(own, 0, (double)(t * sets + i + 1) / 100.0);
+			}
+			mb_cleanup(own);
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	unsigned long writes = 0;
+	MB_STATS stats;
+	mb_mock_get_calls(served, 0, nullptr, &writes);
+	mb_stats_snapshot(served, 0, &stats, 0);
+	mbcheck_expect(check, set_failed == 0, "a set through the broker failed");
+	mbcheck_expect(check, writes < clients * sets && stats.dropped > 0, "concurrent sets were not coalesced");
+	mbcheck_field(check, "\"client_sets\":%lu,\"device_writes\":%lu,\"coalesced\":%llu", clients * sets, writes,
+		(unsigned long long)stats.dropped);
+
+	// a lost daemon fails the client's calls, a new one on the same socket is dialed on the next call
+	mb_broker_stop(served);
+	mbcheck_expect(check, !mb_set_brightness(client, 0, 0.3), "a set succeeded with the daemon gone");
+	mbcheck_expect(check, mb_broker_serve(served, socket.c_str()) != 0, "serving again on the socket failed");
+	mbcheck_expect(check, mb_set_brightness(client, 0, 0.3) != 0, "the client did not reach the new daemon");
+	mb_set_cache_timeout(served, 0);
+	mbcheck_expect(check, mb_get_brightness(served, 0, &percent) && fabs(percent - 0.3) < 0.01,
+		"the set through the new daemon did not reach the device");
+
+	mb_cleanup(client);
+	mb_cleanup(served);
+	mbcheck_expect(check, access(socket.c_str(), F_OK) != 0, "cleanup left the socket file behind");
+}
+#endif
+
+// init a probed mock and count the device reads its probes made
+static unsigned long mbcheck_probe_reads(MBCheck& check, unsigned long seed, double* ms)
+{
+	MB_MOCK_CONFIG config = { 4, 0, 100, 20000, 0, 0.0, seed };
+	void* handle = nullptr;
+	MBCheckClock::time_point start = MBCheckClock::now();
+	if (!mb_mock_init_ex(&handle, &config, MB_INFINITE))
+	{
+		mbcheck_expect(check, false, "mb_mock_init_ex failed");
+		return 0;
+	}
+	if (ms != nullptr)
+	{
+		*ms = mbcheck_ms(start);
+	}
+	unsigned long total = 0;
+	for (unsigned long i = 0; i < 4; i++)
+	{
+		unsigned long reads = 0;
+		mb_mock_get_calls(handle, i, &reads, nullptr);
+		total += reads;
+	}
+	mb_cleanup(handle);
+	return total;
+}
+
+static void mbcheck_cache(MBCheck& check)
+{
+	std::string path = check.root + "/mbcheck.cache";
+	remove(path.c_str());
+	mb_set_capability_cache(path.c_str());
+
+	double cold_ms = 0.0;
+	double warm_ms = 0.0;
+	unsigned long cold = mbcheck_probe_reads(check, 1, &cold_ms);
+	unsigned long warm = mbcheck_probe_reads(check, 1, &warm_ms);
+	mbcheck_expect(check, cold == 4 && warm == 0, "a warm start probed again");
+
+	// a damaged file is ignored, probed over and rewritten
+	FILE* file = fopen(path.c_str(), "r+b");
+	mbcheck_expect(check, file != nullptr, "the cache file was not written");
+	if (file != nullptr)
+	{
+		fseek(file, 40, SEEK_SET);
+		fputc(0x5A, file);
+		fclose(file);
+	}
+	unsigned long damaged = mbcheck_probe_reads(check, 1, nullptr);
+	unsigned long rewritten = mbcheck_probe_reads(check, 1, nullptr);
+	mbcheck_expect(check, damaged == 4 && rewritten == 0, "a damaged cache was not probed over and rewritten");
+
+	// handles with other monitors store at the same time, every one of them must be warm afterwards
+	const unsigned long threads = 8;
+	std::vector<std::thread> workers;
+	for (unsigned long t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&check, t]()
+		{
+			mbcheck_probe_reads(check, 100 + t, nullptr);
+		});
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	unsigned long lost = 0;
+	for (unsigned long t = 0; t < threads; t++)
+	{
+		lost += mbcheck_probe_reads(check, 100 + t, nullptr) != 0;
+	}
+	mbcheck_expect(check, lost == 0, "concurrent stores lost records");
+
+#ifdef __linux__
+	// the same from separate processes, which only the lock file keeps apart
+	std::vector<pid_t> children;
+	for (unsigned long t = 0; t < threads; t++)
+	{
+		pid_t child = fork();
+		if (child == 0)
+		{
+			mbcheck_probe_reads(check, 200 + t, nullptr);
+			_exit(0);
+		}
+		children.push_back(child);
+	}
+	for (pid_t child : children)
+	{
+		waitpid(child, nullptr, 0);
+	}
+	unsigned long lost_between = 0;
+	for (unsigned long t = 0; t < threads; t++)
+	{
+		lost_between += mbcheck_probe_reads(check, 200 + t, nullptr) != 0;
+	}
+	mbcheck_expect(check, lost_between == 0, "stores from concurrent processes lost records");
+	lost += lost_between;
+	remove((path + ".lock").c_str());
+#endif
+
+	mb_set_capability_cache(nullptr);
+	remove(path.c_str());
+	mbcheck_field(check, "\"cold_ms\":%.1f,\"warm_ms\":%.2f,\"cold_reads\":%lu,\"warm_reads\":%lu,\"concurrent_handles\":%lu,\"lost\":%lu",
+		cold_ms, warm_ms, cold, warm, threads, lost);
+}
+
+// the calls of a trace as "op:index:value" in order, the timing is left out
+static std::vector<std::string> mbcheck_trace_calls(MBCheck& check, const std::string& path)
+{
+	std::vector<std::string> calls;
+	unsigned long count = 0;
+	mbcheck_expect(check, mb_trace_read(path.c_str(), nullptr, 0, &count) != 0, "mb_trace_read failed");
+	std::vector<MB_TRACE_RECORD> records(count);
+	if (count == 0 || !mb_trace_read(path.c_str(), records.data(), count, &count))
+	{
+		return calls;
+	}
+	uint64_t last_ns = 0;
+	for (const MB_TRACE_RECORD& record : records)
+	{
+		mbcheck_expect(check, record.start_ns >= last_ns, "trace records are not in call order");
+		mbcheck_expect(check, record.result == MB_ERROR_NONE, "a traced call failed");
+		last_ns = record.start_ns;
+		calls.push_back(std::to_string(record.op) + ":" + std::to_string(record.index) + ":" + std::to_string(record.value));
+	}
+	return calls;
+}
+
+static void mbcheck_trace(MBCheck& check)
+{
+	std::string recorded = check.root + "/mbcheck_recorded.trace";
+	std::string replayed = check.root + "/mbcheck_replayed.trace";
+	MB_MOCK_CONFIG config = { 2, 0, 255, 1000, 0, 0.0, 1 };
+	void* handle = nullptr;
+	mbcheck_expect(check, mb_mock_init(&handle, &config) != 0, "mb_mock_init failed");
+	mb_set_cache_timeout(handle, 0);
+
+	// a capacity past the limit is refused before the file is created
+	remove(recorded.c_str());
+	bool refused = !mb_trace_start(handle, recorded.c_str(), 0xFFFFFFFFul) && mb_last_error_code(nullptr) == MB_ERROR_INVALID_ARGUMENT;
+	FILE* stray = fopen(recorded.c_str(), "rb");
+	if (stray != nullptr)
+	{
+		fclose(stray);
+	}
+	mbcheck_expect(check, refused && stray == nullptr, "a capacity too large for the file was not refused");
+	mbcheck_expect(check, mb_trace_start(handle, recorded.c_str(), 64) != 0, "mb_trace_start failed");
+
+	struct MBCheckCall
+	{
+		unsigned long index;
+		double percent;
+	};
+	// a negative percent is a get
+	const MBCheckCall calls[] = { { 0, 0.2 }, { 1, 0.4 }, { 0, -1.0 }, { 0, 0.6 }, { 1, -1.0 }, { 1, 1.0 }, { 0, -1.0 } };
+	double percent;
+	for (const MBCheckCall& call : calls)
+	{
+		if (call.percent < 0.0)
+		{
+			mb_get_brightness(handle, call.index, &percent);
+		}
+		else
+		{
+			mb_set_brightness(handle, call.index, call.percent);
+		}
+	}
+	mb_trace_stop(handle);
+
+	// every monitor's range is read before its first call
+	std::vector<std::string> expected = { "1:0:255", "3:0:51", "1:1:255", "3:1:102", "2:0:51", "3:0:153", "2:1:102", "3:1:255", "2:0:153" };
+	std::vector<std::string> original = mbcheck_trace_calls(check, recorded);
+	mbcheck_expect(check, original == expected, "the trace does not hold the calls made, in order");
+
+	// the same calls into a mock playing the trace back, traced again
+	void* replay = nullptr;
+	mbcheck_expect(check, mb_mock_init_replay(&replay, recorded.c_str()) != 0, "mb_mock_init_replay failed");
+	if (replay != nullptr)
+	{
+		mb_set_cache_timeout(replay, 0);
+		mb_trace_start(replay, replayed.c_str(), 64);
+		for (const MBCheckCall& call : calls)
+		{
+			mbcheck_expect(check, call.percent < 0.0 ? mb_get_brightness(replay, call.index, &percent) != 0 :
+				mb_set_brightness(replay, call.index, call.percent) != 0, "a call on the replay mock failed");
+		}
+		mb_trace_stop(replay);
+		std::vector<std::string> again = mbcheck_trace_calls(check, replayed);
+		mbcheck_expect(check, again == original, "the replay did not make the recorded calls in the recorded order");
+
+		unsigned long count = 0;
+		mb_get_count(replay, &count);
+		mbcheck_expect(check, count == 2, "the replay mock does not have the recorded monitors");
+		for (unsigned long i = 0; i < 2; i++)
+		{
+			mbcheck_expect(check, mbcheck_raw(replay, i) == mbcheck_raw(handle, i), "a replayed monitor ended at another value");
+		}
+		mbcheck_field(check, "\"recorded\":%zu,\"replayed\":%zu", original.size(), again.size());
+		mb_cleanup(replay);
+	}
+	mb_cleanup(handle);
+
+	// monitors traced side by side each claim their own slots, no call is lost, and a stop while they run is safe
+	const unsigned long threads = 4;
+	const unsigned long sets = 500;
+	void* parallel = mbcheck_mock(check, threads, 0);
+	mb_set_cache_timeout(parallel, 0);
+	for (int run = 0; run < 2; run++)
+	{
+		mbcheck_expect(check, mb_trace_start(parallel, recorded.c_str(), 4096) != 0, "mb_trace_start failed");
+		std::vector<std::thread> workers;
+		for (unsigned long t = 0; t < threads; t++)
+		{
+			workers.emplace_back([parallel, t, sets]()
+			{
+				for (unsigned long i = 0; i < sets; i++)
+				{
+					mb_set_brightness(parallel, t, (double)(i % 100) / 100.0);
+				}
+			});
+		}
+		if (run == 1)
+		{
+			mb_trace_stop(parallel);
+		}
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+		mb_trace_stop(parallel);
+
+		unsigned long count = 0;
+		mbcheck_expect(check, mb_trace_read(recorded.c_str(), nullptr, 0, &count) != 0, "mb_trace_read failed");
+		if (run == 0)
+		{
+			mbcheck_expect(check, count == threads * sets + threads, "calls traced side by side were lost");
+			mbcheck_field(check, "\"parallel_recorded\":%lu", count);
+		}
+		else
+		{
+			mbcheck_expect(check, count <= threads * sets, "a stopped trace recorded more calls than were made");
+		}
+	}
+	mb_cleanup(parallel);
+	remove(recorded.c_str());
+	remove(replayed.c_str());
+}
+
+#ifdef _WIN32
+#define MBCHECK_SNAPSHOT_NAME	"Local\\mbcheck_snapshot"
+#else
+#define MBCHECK_SNAPSHOT_NAME	"/mbcheck_snapshot"
+#endif
+
+static void mbcheck_snapshot(MBCheck& check)
+{
+	void* handle = mbcheck_mock(check, 1, 0);
+	void* reader = nullptr;
+	mbcheck_expect(check, mb_snapshot_publish(handle, MBCHECK_SNAPSHOT_NAME) != 0, "mb_snapshot_publish failed");
+	mb_set_brightness(handle, 0, 0.75);
+	mbcheck_expect(check, mb_snapshot_open(&reader, MBCHECK_SNAPSHOT_NAME) != 0, "mb_snapshot_open failed");
+	MB_SNAPSHOT_MONITOR first;
+	mbcheck_expect(check, reader != nullptr && mb_snapshot_read(reader, 0, &first) && first.has_value && first.percent == 0.75,
+		"the reader does not see the last set");
+	if (reader == nullptr)
+	{
+		mb_cleanup(handle);
+		return;
+	}
+
+	// one set is one published change, so the version's parity tells which value a whole record holds
+	std::atomic<bool> stop(false);
+	std::thread writer([handle, &stop]()
+	{
+		for (unsigned long i = 0; !stop; i++)
+		{
+			mb_set_brightness(handle, 0, (i & 1) ? 0.75 : 0.25);
+		}
+	});
+	const unsigned long readers = 2;
+	std::atomic<unsigned long> reads(0);
+	std::atomic<unsigned long> torn(0);
+	std::atomic<unsigned long> failed(0);
+	std::vector<std::thread> threads;
+	for (unsigned long t = 0; t < readers; t++)
+	{
+		threads.emplace_back([reader, &first, &stop, &reads, &torn, &failed]()
+		{
+			MB_SNAPSHOT_MONITOR last = first;
+			unsigned long count = 0;
+			unsigned long bad = 0;
+			unsigned long lost = 0;
+			while (!stop)
+			{
+				MB_SNAPSHOT_MONITOR monitor;
+				if (!mb_snapshot_read(reader, 0, &monitor))
+				{
+					lost++;
+					continue;
+				}
+				double expected = ((monitor.version - first.version) & 1) ? 0.25 : 0.75;
+				bool backwards = monitor.version < last.version || monitor.updated_us < last.updated_us ||
+					(monitor.version == last.version && monitor.updated_us != last.updated_us);
+				if (!monitor.has_value || monitor.percent != expected || monitor.identity != first.identity || backwards)
+				{
+					bad++;
+				}
+				last = monitor;
+				count++;
+			}
+			reads += count;
+			torn += bad;
+			failed += lost;
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	stop = true;
+	writer.join();
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	MB_SNAPSHOT_MONITOR end;
+	mb_snapshot_read(reader, 0, &end);
+	mbcheck_expect(check, torn == 0, "a reader saw a torn record");
+	mbcheck_expect(check, failed == 0, "a read failed while the writer was active");
+	mbcheck_expect(check, end.version > first.version && reads > 0, "the writer or the readers did not run");
+	mbcheck_field(check, "\"reads\":%lu,\"publishes\":%llu,\"torn\":%lu,\"failed\":%lu", (unsigned long)reads,
+		(unsigned long long)(end.version - first.version), (unsigned long)torn, (unsigned long)failed);
+
+	// the name stays with its publisher, even for another handle in the same process
+	void* other = mbcheck_mock(check, 1, 0);
+	mbcheck_expect(check, !mb_snapshot_publish(other, MBCHECK_SNAPSHOT_NAME) && mb_last_error_code(nullptr) == MB_ERROR_IN_USE,
+		"a second publish of the name did not fail with MB_ERROR_IN_USE");
+	mb_cleanup(other);
+
+	MB_SNAPSHOT_MONITOR monitor;
+	mbcheck_expect(check, mb_snapshot_unpublish(handle) != 0, "mb_snapshot_unpublish failed");
+	mbcheck_expect(check, !mb_snapshot_read(reader, 0, &monitor) && mb_last_error_code(nullptr) == MB_ERROR_NOT_FOUND,
+		"a read after unpublish did not fail with MB_ERROR_NOT_FOUND");
+	mb_snapshot_close(reader);
+	mb_cleanup(handle);
+}
+
+struct MBCheckEntry
+{
+	const char* name;
+	void (*run)(MBCheck& check);
+};
+
+static const MBCheckEntry g_checks[] =
+{
+	{ "calls", mbcheck_calls },
+	{ "probe", mbcheck_probe },
+	{ "stats", mbcheck_stats },
+	{ "calibration", mbcheck_calibration },
+	{ "handles", mbcheck_handles },
+	{ "ramp", mbcheck_ramp },
+	{ "stress", mbcheck_stress },
+#ifdef __linux__
+	{ "auto", mbcheck_auto },
+	{ "edid", mbcheck_edid },
+	{ "hotplug", mbcheck_hotplug },
+	{ "group", mbcheck_group },
+	{ "broker", mbcheck_broker },
+#endif
+	{ "cache", mbcheck_cache },
+	{ "trace", mbcheck_trace },
+	{ "snapshot", mbcheck_snapshot },
+};
+
+int main(int argc, char** argv)
+{
+	std::string root = ".";
+	std::vector<const MBCheckEntry*> selected;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--root") == 0 && i + 1 < argc)
+		{
+			root = argv[++i];
+			continue;
+		}
+		size_t before = selected.size();
+		for (const MBCheckEntry& entry : g_checks)
+		{
+			if (strcmp(argv[i], entry.name) == 0)
+			{
+				selected.push_back(&entry);
+			}
+		}
+		if (selected.size() == before)
+		{
+			fprintf(stderr, "usage: mbcheck [--root DIR] [check ...], checks:");
+			for (const MBCheckEntry& entry : g_checks)
+			{
+				fprintf(stderr, " %s", entry.name);
+			}
+			fprintf(stderr, "\n");
+			return 2;
+		}
+	}
+	if (selected.empty())
+	{
+		for (const MBCheckEntry& entry : g_checks)
+		{
+			selected.push_back(&entry);
+		}
+	}
+
+	int status = 0;
+	for (const MBCheckEntry* entry : selected)
+	{
+		MBCheck check = { entry->name, true, root, std::string() };
+		entry->run(check);
+		printf("{\"check\":\"%s\",\"ok\":%s%s}\n", check.name, check.ok ? "true" : "false", check.fields.c_str());
+		fflush(stdout);
+		if (!check.ok)
+		{
+			status = 1;
+		}
+	}
+	return status;
+}
@@ -0,0 +1,693 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// mbctl, a command line driver over the C API
+//
+//   mbctl [options] <command> [arguments]    run one command
+//   mbctl [options] --batch                  run one command per line from stdin
+//
+// options:
+//   --backend dxva2|wmi|sysfs|ddcci|broker|mock   (default: dxva2 on Windows, sysfs elsewhere)
+//   --root PATH        device directory for sysfs and ddcci
+//   --socket PATH      broker socket
+//   --mock N[:US]      N mock monitors with US microseconds per call, implies --backend mock
+//
+// commands, <index> is a monitor index or "all", <percent> is 0 .. 1 or 0% .. 100%:
+//   list                        name, state and brightness of every monitor
+//   count
+//   get <index>
+//   set <index> <percent>
+//   ramp <index> <percent> <ms> [linear|in|out|in-out]
+//   stats <index>               counters and latency, "all" sums every monitor
+//   flush [ms]                  wait for ramps and submitted writes
+//
+// Every result is one line of JSON carrying the number of the command line it answers. In batch mode commands on
+// different monitors run side by side and commands on one monitor run in order, so answers for different monitors
+// may come out of input order. count, flush and "stats all" wait for everything before them.
+
+#include "mon_brightness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct MBCtlOptions
+{
+	std::string backend;
+	std::string root;
+	std::string socket;
+	MB_MOCK_CONFIG mock;
+	bool batch;
+};
+
+static std::mutex g_output_lock;
+static bool g_failed = false;
+
+static void mbctl_utf8(std::string& out, uint32_t c)
+{
+	if (c < 0x80)
+	{
+		out += (char)c;
+	}
+	else if (c < 0x800)
+	{
+		out += (char)(0xC0 | (c >> 6));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+	else if (c < 0x10000)
+	{
+		out += (char)(0xE0 | (c >> 12));
+		out += (char)(0x80 | ((c >> 6) & 0x3F));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+	else
+	{
+		out += (char)(0xF0 | (c >> 18));
+		out += (char)(0x80 | ((c >> 12) & 0x3F));
+		out += (char)(0x80 | ((c >> 6) & 0x3F));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+}
+
+// a JSON string from UTF-16 (Windows) or UTF-32 (elsewhere) text
+static std::string mbctl_json(const WCHAR* text, size_t length)
+{
+	std::string out = "\"";
+	for (size_t i = 0; i < length; i++)
+	{
+		uint32_t c = (uint32_t)text[i];
+		if (sizeof(WCHAR) == 2 && c >= 0xD800 && c < 0xDC00 && i + 1 < length && (uint32_t)text[i + 1] >= 0xDC00 && (uint32_t)text[i + 1] < 0xE000)
+		{
+			c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)text[++i] - 0xDC00);
+		}
+
+		switch (c)
+		{
+		case '"':	out += "\\\""; break;
+		case '\\':	out += "\\\\"; break;
+		case '\n':	out += "\\n"; break;
+		case '\r':	out += "\\r"; break;
+		case '\t':	out += "\\t"; break;
+		default:
+			if (c < 0x20)
+			{
+				char escape[8];
+				snprintf(escape, sizeof(escape), "\\u%04x", c);
+				out += escape;
+			}
+			else
+			{
+				mbctl_utf8(out, c);
+			}
+			break;
+		}
+	}
+	return out + "\"";
+}
+
+static std::string mbctl_json(const std::string& text)
+{
+	std::wstring wide(text.begin(), text.end());
+	return mbctl_json((const WCHAR*)wide.c_str(), wide.size());
+}
+
+static std::string mbctl_number(double value)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.6g", value);
+	return buffer;
+}
+
+// one answer line, fields is a JSON member list without braces
+static void mbctl_emit(unsigned long id, const std::string& cmd, bool ok, const std::string& fields)
+{
+	std::string line = "{\"id\":" + std::to_string(id) + ",\"cmd\":" + mbctl_json(cmd) + ",\"ok\":" + (ok ? "true" : "false");
+	if (!fields.empty())
+	{
+		line += "," + fields;
+	}
+	line += "}\n";
+
+	std::lock_guard<std::mutex> output_guard(g_output_lock);
+	if (!ok)
+	{
+		g_failed = true;
+	}
+	fwrite(line.data(), 1, line.size(), stdout);
+	fflush(stdout);
+}
+
+// the reason of the last failure on this thread, as JSON members
+static std::string mbctl_error()
+{
+	WCHAR message[512];
+	long length = mb_last_error(message, 512);
+	length = length < 0 ? 0 : (length < 512 ? length : 511);
+	return "\"code\":" + std::to_string(mb_last_error_code(nullptr)) + ",\"error\":" + mbctl_json(message, (size_t)length);
+}
+
+static void mbctl_usage_error(unsigned long id, const std::string& cmd, const std::string& message)
+{
+	mbctl_emit(id, cmd, false, "\"code\":" + std::to_string(MB_ERROR_INVALID_ARGUMENT) + ",\"error\":" + mbctl_json(message));
+}
+
+static const char* mbctl_state(long state)
+{
+	switch (state)
+	{
+	case MB_MONITOR_READY:		return "ready";
+	case MB_MONITOR_PENDING:	return "pending";
+	case MB_MONITOR_FAILED:		return "failed";
+	case MB_MONITOR_DETACHED:	return "detached";
+	default:					return "unknown";
+	}
+}
+
+static bool mbctl_parse_percent(const std::string& text, double* percent)
+{
+	char* end;
+	*percent = strtod(text.c_str(), &end);
+	if (end == text.c_str())
+	{
+		return false;
+	}
+	if (*end == '%')
+	{
+		*percent /= 100.0;
+		end++;
+	}
+	return *end == '\0';
+}
+
+static bool mbctl_parse_ulong(const std::string& text, unsigned long* value)
+{
+	char* end;
+	*value = strtoul(text.c_str(), &end, 10);
+	return end != text.c_str() && *end == '\0';
+}
+
+// a worker per monitor, so a slow monitor never holds up commands for the others
+class MBCtlLane
+{
+public:
+	MBCtlLane() : busy(false), stop(false)
+	{
+		worker = std::thread([this]() { run(); });
+	}
+
+	~MBCtlLane()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		cv.notify_all();
+		worker.join();
+	}
+
+	void post(std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			jobs.push_back(std::move(job));
+		}
+		cv.notify_all();
+	}
+
+	void drain()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		cv.wait(guard, [this]() { return jobs.empty() && !busy; });
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;)
+		{
+			cv.wait(guard, [this]() { return stop || !jobs.empty(); });
+			if (jobs.empty())
+			{
+				return;
+			}
+			std::function<void()> job = std::move(jobs.front());
+			jobs.pop_front();
+			busy = true;
+			guard.unlock();
+			job();
+			guard.lock();
+			busy = false;
+			cv.notify_all();
+		}
+	}
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> jobs;
+	bool busy;
+	bool stop;
+	std::thread worker;
+};
+
+class MBCtl
+{
+public:
+	MBCtl(void* handle, bool pipelined) : handle(handle), pipelined(pipelined)
+	{
+		unsigned long count = 0;
+		mb_get_count(handle, &count);
+		if (pipelined)
+		{
+			for (unsigned long i = 0; i < count; i++)
+			{
+				lanes.push_back(std::make_unique<MBCtlLane>());
+			}
+		}
+		monitor_count = count;
+	}
+
+	~MBCtl()
+	{
+		drain();
+	}
+
+	void drain()
+	{
+		for (auto& lane : lanes)
+		{
+			lane->drain();
+		}
+	}
+
+	void execute(unsigned long id, const std::vector<std::string>& args)
+	{
+		const std::string& cmd = args[0];
+		if (cmd == "count")
+		{
+			drain();
+			unsigned long count;
+			if (mb_get_count(handle, &count))
+			{
+				mbctl_emit(id, cmd, true, "\"count\":" + std::to_string(count));
+			}
+			else
+			{
+				mbctl_emit(id, cmd, false, mbctl_error());
+			}
+		}
+		else if (cmd == "flush")
+		{
+			unsigned long timeout = MB_INFINITE;
+			if (args.size() > 2 || (args.size() == 2 && !mbctl_parse_ulong(args[1], &timeout)))
+			{
+				mbctl_usage_error(id, cmd, "usage: flush [ms]");
+				return;
+			}
+			drain();
+			if (mb_flush(handle, timeout))
+			{
+				mbctl_emit(id, cmd, true, "");
+			}
+			else
+			{
+				mbctl_emit(id, cmd, false, mbctl_error());
+			}
+		}
+		else if (cmd == "stats" && args.size() == 2 && args[1] == "all")
+		{
+			drain();
+			stats(id, MB_STATS_ALL);
+		}
+		else if (cmd == "list")
+		{
+			if (args.size() != 1)
+			{
+				mbctl_usage_error(id, cmd, "usage: list");
+				return;
+			}
+			each(id, cmd, "all", [this, id](unsigned long index) { list(id, index); });
+		}
+		else if (cmd == "get")
+		{
+			if (args.size() != 2)
+			{
+				mbctl_usage_error(id, cmd, "usage: get <index>");
+				return;
+			}
+			each(id, cmd, args[1], [this, id](unsigned long index) { get(id, index); });
+		}
+		else if (cmd == "set")
+		{
+			double percent;
+			if (args.size() != 3 || !mbctl_parse_percent(args[2], &percent))
+			{
+				mbctl_usage_error(id, cmd, "usage: set <index> <percent>");
+				return;
+			}
+			each(id, cmd, args[1], [this, id, percent](unsigned long index) { set(id, index, percent); });
+		}
+		else if (cmd == "ramp")
+		{
+			double percent;
+			unsigned long duration;
+			long easing = MB_EASE_LINEAR;
+			if (args.size() < 4 || args.size() > 5 || !mbctl_parse_percent(args[2], &percent) || !mbctl_parse_ulong(args[3], &duration) ||
+				(args.size() == 5 && !mbctl_parse_easing(args[4], &easing)))
+			{
+				mbctl_usage_error(id, cmd, "usage: ramp <index> <percent> <ms> [linear|in|out|in-out]");
+				return;
+			}
+			each(id, cmd, args[1], [this, id, percent, duration, easing](unsigned long index) { ramp(id, index, percent, duration, easing); });
+		}
+		else if (cmd == "stats")
+		{
+			if (args.size() != 2)
+			{
+				mbctl_usage_error(id, cmd, "usage: stats <index>");
+				return;
+			}
+			each(id, cmd, args[1], [this, id](unsigned long index) { stats(id, index); });
+		}
+		else
+		{
+			mbctl_usage_error(id, cmd, "unknown command");
+		}
+	}
+
+private:
+	static bool mbctl_parse_easing(const std::string& text, long* easing)
+	{
+		static const char* names[] = { "linear", "in", "out", "in-out" };
+		for (long i = 0; i < 4; i++)
+		{
+			if (text == names[i])
+			{
+				*easing = MB_EASE_LINEAR + i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// run job for one monitor or all of them, on their lanes when pipelined
+	void each(unsigned long id, const std::string& cmd, const std::string& target, const std::function<void(unsigned long)>& job)
+	{
+		unsigned long first = 0;
+		unsigned long last = monitor_count;
+		if (target != "all")
+		{
+			unsigned long index;
+			if (!mbctl_parse_ulong(target, &index))
+			{
+				mbctl_usage_error(id, cmd, "index must be a number or all");
+				return;
+			}
+			first = index;
+			last = index + 1;
+		}
+
+		for (unsigned long index = first; index < last; index++)
+		{
+			// an index past the monitors reaches the library, which reports it like any other failure
+			if (index < lanes.size())
+			{
+				lanes[index]->post([job, index]() { job(index); });
+			}
+			else
+			{
+				job(index);
+			}
+		}
+	}
+
+	std::string prefix(unsigned long index)
+	{
+		return "\"index\":" + std::to_string(index);
+	}
+
+	void list(unsigned long id, unsigned long index)
+	{
+		WCHAR name[256];
+		long length = mb_get_name(handle, index, name, 256);
+		length = length < 0 ? 0 : (length < 256 ? length : 256);
+		long state = mb_get_monitor_state(handle, index);
+		std::string fields = prefix(index) + ",\"name\":" + mbctl_json(name, (size_t)length) + ",\"state\":\"" + mbctl_state(state) + "\"";
+
+		// the stable id, as hex so JSON readers keep all 64 bits
+		uint64_t monitor_id;
+		if (mb_get_monitor_id(handle, index, &monitor_id) && monitor_id != 0)
+		{
+			char hex[17];
+			snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)monitor_id);
+			fields += ",\"monitor_id\":\"" + std::string(hex) + "\"";
+		}
+
+		double percent;
+		if (state == MB_MONITOR_READY && mb_get_brightness(handle, index, &percent))
+		{
+			fields += ",\"percent\":" + mbctl_number(percent);
+		}
+		mbctl_emit(id, "list", state != 0, state != 0 ? fields : prefix(index) + "," + mbctl_error());
+	}
+
+	void get(unsigned long id, unsigned long index)
+	{
+		double percent;
+		if (mb_get_brightness(handle, index, &percent))
+		{
+			mbctl_emit(id, "get", true, prefix(index) + ",\"percent\":" + mbctl_number(percent));
+		}
+		else
+		{
+			mbctl_emit(id, "get", false, prefix(index) + "," + mbctl_error());
+		}
+	}
+
+	void set(unsigned long id, unsigned long index, double percent)
+	{
+		if (mb_set_brightness(handle, index, percent))
+		{
+			mbctl_emit(id, "set", true, prefix(index) + ",\"percent\":" + mbctl_number(percent));
+		}
+		else
+		{
+			mbctl_emit(id, "set", false, prefix(index) + "," + mbctl_error());
+		}
+	}
+
+	void ramp(unsigned long id, unsigned long index, double percent, unsigned long duration, long easing)
+	{
+		if (mb_ramp_brightness(handle, index, percent, duration, easing))
+		{
+			mbctl_emit(id, "ramp", true, prefix(index) + ",\"percent\":" + mbctl_number(percent) + ",\"duration\":" + std::to_string(duration));
+		}
+		else
+		{
+			mbctl_emit(id, "ramp", false, prefix(index) + "," + mbctl_error());
+		}
+	}
+
+	static std::string latency(const char* name, const MB_LATENCY_HISTOGRAM& histogram)
+	{
+		double average = histogram.count > 0 ? (double)histogram.total_us / (double)histogram.count : 0.0;
+		return std::string(",\"") + name + "_avg_us\":" + mbctl_number(average) + ",\"" + name + "_max_us\":" + std::to_string(histogram.max_us);
+	}
+
+	void stats(unsigned long id, unsigned long index)
+	{
+		MB_STATS s;
+		std::string where = index == MB_STATS_ALL ? std::string("\"index\":\"all\"") : prefix(index);
+		if (!mb_stats_snapshot(handle, index, &s, 0))
+		{
+			mbctl_emit(id, "stats", false, where + "," + mbctl_error());
+			return;
+		}
+		std::ostringstream fields;
+		fields << where << ",\"get_ok\":" << s.get_ok << ",\"get_failed\":" << s.get_failed << ",\"set_ok\":" << s.set_ok <<
+			",\"set_failed\":" << s.set_failed << ",\"retries\":" << s.retries << ",\"dropped\":" << s.dropped <<
+			latency("get", s.get_latency) << latency("set", s.set_latency) <<
+			",\"reply_delay_us\":" << s.reply_delay_us << ",\"command_delay_us\":" << s.command_delay_us;
+		mbctl_emit(id, "stats", true, fields.str());
+	}
+
+	void* handle;
+	bool pipelined;
+	unsigned long monitor_count;
+	std::vector<std::unique_ptr<MBCtlLane>> lanes;
+};
+
+static std::vector<std::string> mbctl_split(const std::string& line)
+{
+	std::vector<std::string> words;
+	std::istringstream stream(line);
+	std::string word;
+	while (stream >> word)
+	{
+		words.push_back(word);
+	}
+	return words;
+}
+
+static bool mbctl_init(const MBCtlOptions& options, void** handle)
+{
+	const char* root = options.root.empty() ? nullptr : options.root.c_str();
+	const char* socket = options.socket.empty() ? nullptr : options.socket.c_str();
+	if (options.backend == "mock")
+	{
+		return mb_mock_init_ex(handle, &options.mock, MB_INFINITE) != 0;
+	}
+#ifdef _WIN32
+	if (options.backend == "dxva2")
+	{
+		return mb_dxva2_init(handle) != 0;
+	}
+	if (options.backend == "wmi")
+	{
+		return mb_wmi_init(handle) != 0;
+	}
+#endif
+#ifdef __linux__
+	if (options.backend == "sysfs")
+	{
+		return mb_sysfs_init(handle, root) != 0;
+	}
+	if (options.backend == "ddcci")
+	{
+		return mb_ddcci_init(handle, root) != 0;
+	}
+	if (options.backend == "broker")
+	{
+		return mb_broker_init(handle, socket) != 0;
+	}
+#endif
+	(void)root;
+	(void)socket;
+	return false;
+}
+
+static int mbctl_usage()
+{
+	fprintf(stderr, "usage: mbctl [--backend NAME] [--root PATH] [--socket PATH] [--mock N[:US]] (--batch | <command> [arguments])\n");
+	return 2;
+}
+
+int main(int argc, char** argv)
+{
+	MBCtlOptions options;
+#ifdef _WIN32
+	options.backend = "dxva2";
+#else
+	options.backend = "sysfs";
+#endif
+	memset(&options.mock, 0, sizeof(options.mock));
+	options.mock.monitor_count = 1;
+	options.mock.max = 100;
+	options.batch = false;
+
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+	{
+		std::string option = argv[arg];
+		if (option == "--batch")
+		{
+			options.batch = true;
+			continue;
+		}
+		if (arg + 1 >= argc)
+		{
+			return mbctl_usage();
+		}
+		const char* value = argv[++arg];
+		if (option == "--backend")
+		{
+			options.backend = value;
+		}
+		else if (option == "--root")
+		{
+			options.root = value;
+		}
+		else if (option == "--socket")
+		{
+			options.socket = value;
+		}
+		else if (option == "--mock")
+		{
+			char* end;
+			options.backend = "mock";
+			options.mock.monitor_count = strtoul(value, &end, 10);
+			options.mock.latency_us = *end == ':' ? strtoul(end + 1, nullptr, 10) : 0;
+		}
+		else
+		{
+			return mbctl_usage();
+		}
+	}
+	if (options.batch == (arg < argc))
+	{
+		return mbctl_usage();
+	}
+
+	void* handle = nullptr;
+	if (!mbctl_init(options, &handle))
+	{
+		std::string fields = handle == nullptr && mb_last_error_code(nullptr) == MB_ERROR_NONE ?
+			"\"error\":" + mbctl_json("unknown backend " + options.backend) : mbctl_error();
+		mbctl_emit(0, "init", false, fields);
+		return 1;
+	}
+
+	{
+		MBCtl ctl(handle, options.batch);
+		if (options.batch)
+		{
+			// the id of an answer is the line number of its command
+			std::string line;
+			for (unsigned long id = 1; std::getline(std::cin, line); id++)
+			{
+				std::vector<std::string> args = mbctl_split(line);
+				if (args.empty() || args[0][0] == '#')
+				{
+					continue;
+				}
+				if (args[0] == "quit")
+				{
+					break;
+				}
+				ctl.execute(id, args);
+			}
+		}
+		else
+		{
+			ctl.execute(1, std::vector<std::string>(argv + arg, argv + argc));
+		}
+		ctl.drain();
+
+		// a ramp started by a one shot command would die with the process
+		if (!options.batch)
+		{
+			mb_flush(handle, MB_INFINITE);
+		}
+	}
+
+	mb_cleanup(handle);
+	return g_failed ? 1 : 0;
+}
@@ -0,0 +1,291 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// mbddcsim, runs the DDC/CI backend against a simulated display and prints one line of JSON per run
+//
+//   mbddcsim [--reply MS] [--command MS] [--pairs N] [--gap MS] [--runs N] [--cache PATH] [--root DIR]
+//
+// The display answers VCP 0x10 the way a real one does on slave 0x37, but it NAKs a command that arrives sooner than
+// --command ms after its last transaction and garbles a reply read sooner than --reply ms after the request
+// (defaults 40 and 50, the MCCS delays). Each run opens a handle through mb_ddcci_open, then times --pairs
+// mb_set_brightness and uncached mb_get_brightness calls (default 100), sleeping --gap ms after each pair the way
+// a caller doing other work would (default 0). A gap the display's delay already covers should not be slept again.
+//
+// --runs repeats this on a fresh handle (default 1). With --cache the runs share a capability cache file, as separate
+// processes on one machine would, so each run starts from the timing the last one learned. The cache is keyed by the
+// EDID, so the display also gets a connector in a fake drm tree created in --root (the current directory by default)
+// and removed at the end. The start_* fields of a run show the delays it began with.
+//
+// The transport is the seam under the protocol, so this program builds with the library sources rather than
+// against the library: g++ -std=c++17 mbddcsim.cpp mon_brightness.cpp mb_*.cpp -lpthread
+
+#include "mb_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock MBSimClock;
+
+struct MBSimOptions
+{
+	unsigned long reply_ms;
+	unsigned long command_ms;
+	unsigned long pairs;
+	unsigned long gap_ms;
+	unsigned long runs;
+	const char* cache;
+	const char* root;
+};
+
+// a display behind one bus, every byte of a request is checked only as far as the protocol code needs
+struct MBSimDisplay : public MBDdcTransport
+{
+	std::chrono::microseconds reply_delay;
+	std::chrono::microseconds command_delay;
+	MBSimClock::time_point last_end;
+	MBSimClock::time_point sent;
+	uint8_t reply[11];
+	uint16_t value;
+	unsigned long naks;
+	unsigned long garbled;
+
+	MBSimDisplay(unsigned long reply_ms, unsigned long command_ms) :
+		reply_delay(reply_ms * 1000), command_delay(command_ms * 1000), value(50), naks(0), garbled(0)
+	{
+		memset(reply, 0, sizeof(reply));
+	}
+
+	bool write(const uint8_t* data, size_t length) override
+	{
+		MBSimClock::time_point now = MBSimClock::now();
+		if (now < last_end + command_delay)
+		{
+			naks++;
+			last_end = now;
+			errno = EREMOTEIO;
+			return false;
+		}
+		sent = now;
+		last_end = now;
+
+		// Get VCP Feature reply: source, length, opcode, result, code, type, max and current, checksum
+		if (length >= 4 && data[2] == 0x01)
+		{
+			uint8_t fields[11] = { 0x6E, 0x88, 0x02, (uint8_t)(data[3] == 0x10 ? 0 : 1), data[3], 0, 0, 100, (uint8_t)(value >> 8), (uint8_t)value, 0 };
+			uint8_t checksum = 0x50;
+			for (int i = 0; i < 10; i++)
+			{
+				checksum ^= fields[i];
+			}
+			fields[10] = checksum;
+			memcpy(reply, fields, sizeof(reply));
+		}
+		else if (length >= 6 && data[2] == 0x03)
+		{
+			value = (uint16_t)((data[4] << 8) | data[5]);
+		}
+		return true;
+	}
+
+	bool read(uint8_t* data, size_t length) override
+	{
+		MBSimClock::time_point now = MBSimClock::now();
+		bool early = now < sent + reply_delay;
+		last_end = now;
+		memcpy(data, reply, MB_MIN(length, sizeof(reply)));
+		if (early && length > 9)
+		{
+			garbled++;
+			data[9] ^= 0x5A;
+		}
+		return true;
+	}
+};
+
+static double mbddcsim_ms(MBSimClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(MBSimClock::now() - start).count();
+}
+
+// the connector of i2c-sim in a fake drm tree, with the EDID of a monitor that has a serial number
+struct MBSimTree
+{
+	std::string drm;
+	std::string connector;
+
+	explicit MBSimTree(const std::string& root) : drm(root + "/mbddcsim_drm"), connector(drm + "/card0-DP-1")
+	{
+		uint8_t edid[128] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x10, 0xAC, 0x42, 0xA0, 0x53, 0x49, 0x4D, 0x00, 1, 28 };
+		uint8_t sum = 0;
+		for (int i = 0; i < 127; i++)
+		{
+			sum += edid[i];
+		}
+		edid[127] = (uint8_t)(0x100 - sum);
+
+		mkdir(drm.c_str(), 0755);
+		mkdir(connector.c_str(), 0755);
+		mkdir((connector + "/i2c-sim").c_str(), 0755);
+		FILE* file = fopen((connector + "/edid").c_str(), "wb");
+		if (file != nullptr)
+		{
+			fwrite(edid, 1, sizeof(edid), file);
+			fclose(file);
+		}
+		mb_set_edid_root(drm.c_str());
+	}
+
+	~MBSimTree()
+	{
+		mb_set_edid_root(nullptr);
+		remove((connector + "/edid").c_str());
+		rmdir((connector + "/i2c-sim").c_str());
+		rmdir(connector.c_str());
+		rmdir(drm.c_str());
+	}
+};
+
+static bool mbddcsim_run(const MBSimOptions& options, unsigned long run)
+{
+	MBSimDisplay* display = new MBSimDisplay(options.reply_ms, options.command_ms);
+	std::unique_ptr<MBDdcTransport> transport(display);
+	MBBaseStruct* h = mb_ddcci_open("", { "i2c-sim" }, [&transport](const std::string& name)
+	{
+		return std::move(transport);
+	});
+	void* handle;
+	if (h->enumerate() == 0)
+	{
+		fprintf(stderr, "mbddcsim: the simulated display did not answer its probe\n");
+		h->close();
+		delete h;
+		return false;
+	}
+	if (!mb_driver_attach(h, &handle))
+	{
+		fprintf(stderr, "mbddcsim: attach failed\n");
+		return false;
+	}
+	mb_set_cache_timeout(handle, 0);
+
+	MB_STATS start_stats;
+	mb_stats_snapshot(handle, 0, &start_stats, 0);
+	unsigned long naks = display->naks;
+	unsigned long garbled = display->garbled;
+	unsigned long failed = 0;
+	double set_ms = 0.0;
+	double get_ms = 0.0;
+	for (unsigned long i = 0; i < options.pairs; i++)
+	{
+		MBSimClock::time_point start = MBSimClock::now();
+		failed += !mb_set_brightness(handle, 0, (double)(i % 10) / 10.0);
+		set_ms += mbddcsim_ms(start);
+
+		double percent;
+		start = MBSimClock::now();
+		failed += !mb_get_brightness(handle, 0, &percent);
+		get_ms += mbddcsim_ms(start);
+
+		if (options.gap_ms != 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(options.gap_ms));
+		}
+	}
+
+	MB_STATS stats;
+	mb_stats_snapshot(handle, 0, &stats, 0);
+	printf("{\"run\":%lu,\"reply_ms\":%lu,\"command_ms\":%lu,\"gap_ms\":%lu,\"pairs\":%lu,\"pair_ms\":%.1f,\"set_ms\":%.1f,\"get_ms\":%.1f,\"failed\":%lu,\"retries\":%llu,\"naks\":%lu,\"garbled\":%lu,\"start_reply_delay_ms\":%.1f,\"start_command_delay_ms\":%.1f,\"reply_delay_ms\":%.1f,\"command_delay_ms\":%.1f}\n",
+		run, options.reply_ms, options.command_ms, options.gap_ms, options.pairs, (set_ms + get_ms) / options.pairs, set_ms / options.pairs,
+		get_ms / options.pairs, failed, (unsigned long long)stats.retries, display->naks - naks, display->garbled - garbled,
+		start_stats.reply_delay_us / 1000.0, start_stats.command_delay_us / 1000.0, stats.reply_delay_us / 1000.0, stats.command_delay_us / 1000.0);
+	fflush(stdout);
+	mb_cleanup(handle);
+	return failed == 0;
+}
+
+int main(int argc, char** argv)
+{
+	MBSimOptions options = { 40, 50, 100, 0, 1, nullptr, "." };
+	for (int i = 1; i < argc; i++)
+	{
+		unsigned long* option = nullptr;
+		if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+		{
+			options.cache = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--root") == 0 && i + 1 < argc)
+		{
+			options.root = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--reply") == 0)
+		{
+			option = &options.reply_ms;
+		}
+		else if (strcmp(argv[i], "--command") == 0)
+		{
+			option = &options.command_ms;
+		}
+		else if (strcmp(argv[i], "--pairs") == 0)
+		{
+			option = &options.pairs;
+		}
+		else if (strcmp(argv[i], "--gap") == 0)
+		{
+			option = &options.gap_ms;
+		}
+		else if (strcmp(argv[i], "--runs") == 0)
+		{
+			option = &options.runs;
+		}
+		if (option == nullptr || i + 1 >= argc)
+		{
+			fprintf(stderr, "usage: mbddcsim [--reply MS] [--command MS] [--pairs N] [--gap MS] [--runs N] [--cache PATH] [--root DIR]\n");
+			return 2;
+		}
+		*option = strtoul(argv[++i], nullptr, 10);
+	}
+	if (options.pairs == 0)
+	{
+		options.pairs = 1;
+	}
+
+	std::unique_ptr<MBSimTree> tree;
+	if (options.cache != nullptr)
+	{
+		tree = std::make_unique<MBSimTree>(options.root);
+		mb_set_capability_cache(options.cache);
+	}
+	bool ok = true;
+	for (unsigned long run = 0; run < options.runs && ok; run++)
+	{
+		ok = mbddcsim_run(options, run);
+	}
+	mb_set_capability_cache(nullptr);
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main()
+{
+	fprintf(stderr, "mbddcsim: the DDC/CI backend is Linux only\n");
+	return 1;
+}
+
+#endif
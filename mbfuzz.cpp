@@ -0,0 +1,294 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// mbfuzz, feeds the parsers of data that comes from monitors with damaged input and prints one line of JSON per result
+//
+//   mbfuzz [--inputs N] [--seed N] [--iterations N] [section ...]
+//
+// A parser that reads past its input or trips over a byte shows up as a crash, so build this program and the library
+// with sanitizers for a fuzz run: g++ -std=c++17 -fsanitize=address,undefined mbfuzz.cpp mon_brightness.cpp
+// mb_*.cpp -lpthread
+//
+//   caps       mb_parse_capabilities on random bytes, vcp sections of random capabilities characters and 1 to 4 byte
+//              mutations and truncations of a real string, a third of --inputs each, then the parse time of the real
+//              string
+//   edid       mb_parse_edid on random blocks behind a valid header, mutations of a real EDID with the checksum fixed
+//              up so the descriptors are reached, and mutations and truncations left as they are, then the parse time
+//              of the real EDID
+//
+// Every section runs when none is named. --inputs sets the fuzz inputs per section (default 2000000), --seed the
+// start of the generator so a run can be repeated (default 1), --iterations the parses per timed loop (default
+// 1000000).
+
+#include "mon_brightness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock MBFuzzClock;
+
+struct MBFuzzOptions
+{
+	unsigned long inputs;
+	unsigned long seed;
+	unsigned long iterations;
+};
+
+// capabilities string of a desktop monitor, with value lists and fields after the vcp section
+static const char g_caps[] =
+	"(prot(monitor)type(LCD)model(U2415)cmds(01 02 03 07 0C E3 F3)vcp(02 04 05 08 10 12 14(01 04 05 06 08 09 0B 0C) "
+	"16 18 1A 52 60(01 0F 11 1B) AA(01 02 04) AC AE B2 B6 C6 C8 C9 CA(01 02) CC(02 03 04 05 06 09 0A 0D 0E) "
+	"D6(01 04 05) DC(00 02 03 05) DF E0 E1 E2(00 01 02 04 0E 12 14 19) F0(00 08) F1(01 02) F2 FD)mswhql(1)"
+	"asset_eep(40)mccs_ver(2.1))";
+
+static const char g_caps_alphabet[] = "()0123456789ABCDEFabcdef vcpmodeltype";
+
+// EDID base block of a 24 inch monitor, with name and serial number descriptors
+static const unsigned char g_edid[128] =
+{
+	0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x10, 0xAC, 0xA0, 0xA0, 0x4C, 0x4B, 0x41, 0x30,
+	0x05, 0x1A, 0x01, 0x04, 0xA5, 0x34, 0x20, 0x78, 0x3A, 0xEE, 0x95, 0xA3, 0x54, 0x4C, 0x99, 0x26,
+	0x0F, 0x50, 0x54, 0xA5, 0x4B, 0x00, 0x71, 0x4F, 0x81, 0x80, 0xA9, 0xC0, 0xD1, 0xC0, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x28, 0x3C, 0x80, 0xA0, 0x70, 0xB0, 0x23, 0x40, 0x30, 0x20,
+	0x36, 0x00, 0x06, 0x44, 0x21, 0x00, 0x00, 0x1A, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x43, 0x46, 0x56,
+	0x39, 0x4E, 0x36, 0x37, 0x51, 0x30, 0x41, 0x4B, 0x4C, 0x0A, 0x00, 0x00, 0x00, 0xFC, 0x00, 0x44,
+	0x45, 0x4C, 0x4C, 0x20, 0x55, 0x32, 0x34, 0x31, 0x35, 0x0A, 0x20, 0x20, 0x00, 0x00, 0x00, 0xFD,
+	0x00, 0x31, 0x56, 0x1D, 0x71, 0x1C, 0x00, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x61,
+};
+
+// xorshift64, fast and repeatable, the inputs only need to differ
+static uint64_t mbfuzz_next(uint64_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static double mbfuzz_ns(MBFuzzClock::time_point start, unsigned long iterations)
+{
+	return std::chrono::duration<double, std::nano>(MBFuzzClock::now() - start).count() / (double)iterations;
+}
+
+// overwrite, insert or delete 1 to 4 bytes, or cut the input short
+static void mbfuzz_mutate(std::string& input, uint64_t& state)
+{
+	unsigned long edits = 1 + mbfuzz_next(state) % 4;
+	for (unsigned long i = 0; i < edits && !input.empty(); i++)
+	{
+		size_t at = mbfuzz_next(state) % input.size();
+		switch (mbfuzz_next(state) % 4)
+		{
+		case 0:
+			input[at] = (char)mbfuzz_next(state);
+			break;
+		case 1:
+			input.insert(input.begin() + at, (char)mbfuzz_next(state));
+			break;
+		case 2:
+			input.erase(input.begin() + at);
+			break;
+		default:
+			input.resize(at);
+			break;
+		}
+	}
+}
+
+static void mbfuzz_caps(const MBFuzzOptions& options)
+{
+	uint64_t state = options.seed * 0x9E3779B97F4A7C15ull + 1;
+	unsigned long parsed[3] = { 0, 0, 0 };
+	std::string input;
+	for (unsigned long i = 0; i < options.inputs; i++)
+	{
+		unsigned long kind = i % 3;
+		if (kind == 0)
+		{
+			input.resize(mbfuzz_next(state) % 512);
+			for (char& c : input)
+			{
+				c = (char)mbfuzz_next(state);
+			}
+		}
+		else if (kind == 1)
+		{
+			// inside a vcp section, so the code list parser sees them rather than the section search only
+			input = "vcp(";
+			for (unsigned long length = mbfuzz_next(state) % 512; length != 0; length--)
+			{
+				input += g_caps_alphabet[mbfuzz_next(state) % (sizeof(g_caps_alphabet) - 1)];
+			}
+			input += ')';
+		}
+		else
+		{
+			input = g_caps;
+			mbfuzz_mutate(input, state);
+		}
+
+		// the string ends at its first zero byte, as one read from a monitor does
+		MB_VCP_FEATURES features;
+		parsed[kind] += mb_parse_capabilities(input.c_str(), &features) != 0;
+	}
+
+	MB_VCP_FEATURES features;
+	long ok = 0;
+	MBFuzzClock::time_point start = MBFuzzClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		ok += mb_parse_capabilities(g_caps, &features);
+	}
+	double parse_ns = mbfuzz_ns(start, options.iterations);
+
+	printf("{\"fuzz\":\"caps\",\"inputs\":%lu,\"parsed_random\":%lu,\"parsed_alphabet\":%lu,\"parsed_mutated\":%lu,\"length\":%lu,\"parse_ns\":%.1f,\"mb_per_s\":%.0f,\"ok\":%ld}\n",
+		options.inputs, parsed[0], parsed[1], parsed[2], (unsigned long)(sizeof(g_caps) - 1), parse_ns,
+		(sizeof(g_caps) - 1) * 1000.0 / parse_ns, ok);
+}
+
+// make the bytes of a base block sum to zero
+static void mbfuzz_checksum(std::vector<unsigned char>& edid)
+{
+	unsigned char sum = 0;
+	for (size_t i = 0; i + 1 < 128; i++)
+	{
+		sum += edid[i];
+	}
+	edid[127] = (unsigned char)(0x100 - sum);
+}
+
+static void mbfuzz_edid(const MBFuzzOptions& options)
+{
+	uint64_t state = options.seed * 0x9E3779B97F4A7C15ull + 2;
+	unsigned long parsed[3] = { 0, 0, 0 };
+	unsigned long named = 0;
+	std::vector<unsigned char> input;
+	for (unsigned long i = 0; i < options.inputs; i++)
+	{
+		unsigned long kind = i % 3;
+		if (kind == 0)
+		{
+			input.resize(128);
+			for (unsigned char& c : input)
+			{
+				c = (unsigned char)mbfuzz_next(state);
+			}
+			memcpy(input.data(), g_edid, 8);
+			mbfuzz_checksum(input);
+		}
+		else
+		{
+			input.assign(g_edid, g_edid + sizeof(g_edid));
+			unsigned long edits = 1 + mbfuzz_next(state) % 4;
+			for (unsigned long j = 0; j < edits; j++)
+			{
+				input[mbfuzz_next(state) % input.size()] = (unsigned char)mbfuzz_next(state);
+			}
+			if (kind == 1)
+			{
+				mbfuzz_checksum(input);
+			}
+			else if (mbfuzz_next(state) % 2 == 0)
+			{
+				input.resize(mbfuzz_next(state) % 128);
+			}
+		}
+
+		// the vector holds exactly the bytes passed, so a read past them is caught by the address sanitizer
+		MB_EDID_INFO info;
+		if (mb_parse_edid(input.data(), (unsigned long)input.size(), &info))
+		{
+			parsed[kind]++;
+			named += info.name[0] != '\0';
+		}
+	}
+
+	MB_EDID_INFO info;
+	long ok = 0;
+	MBFuzzClock::time_point start = MBFuzzClock::now();
+	for (unsigned long i = 0; i < options.iterations; i++)
+	{
+		ok += mb_parse_edid(g_edid, sizeof(g_edid), &info);
+	}
+	double parse_ns = mbfuzz_ns(start, options.iterations);
+
+	printf("{\"fuzz\":\"edid\",\"inputs\":%lu,\"parsed_random\":%lu,\"parsed_fixed\":%lu,\"parsed_damaged\":%lu,\"named\":%lu,\"parse_ns\":%.1f,\"mb_per_s\":%.0f,\"name\":\"%s\",\"ok\":%ld}\n",
+		options.inputs, parsed[0], parsed[1], parsed[2], named, parse_ns, sizeof(g_edid) * 1000.0 / parse_ns, info.name, ok);
+}
+
+struct MBFuzzSection
+{
+	const char* name;
+	void (*run)(const MBFuzzOptions& options);
+};
+
+static const MBFuzzSection g_sections[] =
+{
+	{ "caps", mbfuzz_caps },
+	{ "edid", mbfuzz_edid },
+};
+
+int main(int argc, char** argv)
+{
+	MBFuzzOptions options = { 2000000, 1, 1000000 };
+	std::vector<const MBFuzzSection*> selected;
+	bool usage = false;
+	for (int i = 1; i < argc && !usage; i++)
+	{
+		if (strcmp(argv[i], "--inputs") == 0 && i + 1 < argc)
+		{
+			options.inputs = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+		{
+			options.seed = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+		{
+			options.iterations = strtoul(argv[++i], nullptr, 10);
+		}
+		else
+		{
+			usage = true;
+			for (const MBFuzzSection& section : g_sections)
+			{
+				if (strcmp(argv[i], section.name) == 0)
+				{
+					selected.push_back(&section);
+					usage = false;
+				}
+			}
+		}
+	}
+	if (usage || options.iterations == 0)
+	{
+		fprintf(stderr, "usage: mbfuzz [--inputs N] [--seed N] [--iterations N] [caps|edid ...]\n");
+		return 2;
+	}
+	if (selected.empty())
+	{
+		for (const MBFuzzSection& section : g_sections)
+		{
+			selected.push_back(&section);
+		}
+	}
+
+	for (const MBFuzzSection* section : selected)
+	{
+		section->run(options);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,233 @@
+/*
+Copyright (C) 2018 KSG Yeung
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// mbreplay, plays a trace recorded with mb_trace_start against the mock backend
+//
+//   mbreplay [--submit] [--speed X] [--cache-timeout MS] trace.bin
+//
+// Every recorded read and write is issued again through the public API at its recorded time, one thread per monitor,
+// while the mock answers each device call with its recorded latency. The summary compares what the devices saw in
+// the recording with what they see now, so a change to scheduling, caching or coalescing shows up as fewer device
+// calls or less lag behind the recorded timeline. Lag is negative for a call that finishes earlier than recorded.
+//
+//   --submit             writes go through mb_submit_brightness instead of mb_set_brightness, they return at once
+//                        so only reads count towards the lag
+//   --speed X            play the timeline X times faster, the device latencies stay as recorded
+//   --cache-timeout MS   see mb_set_cache_timeout, the recorded reads all reached the device but a replayed one
+//                        may be answered from the cache
+
+#include "mon_brightness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock MBReplayClock;
+
+struct MBReplayMonitor
+{
+	unsigned long min;
+	unsigned long max;
+	bool ranged;
+	std::vector<const MB_TRACE_RECORD*> calls;
+
+	// how far each call finished behind the time it finished in the recording, in microseconds
+	std::vector<double> lag_us;
+	unsigned long failed;
+};
+
+static void mbreplay_run(void* handle, unsigned long index, MBReplayMonitor& monitor, MBReplayClock::time_point start, double speed, bool submit)
+{
+	for (const MB_TRACE_RECORD* call : monitor.calls)
+	{
+		MBReplayClock::time_point at = start + std::chrono::nanoseconds((long long)(call->start_ns / speed));
+		std::this_thread::sleep_until(at);
+
+		long ok;
+		if (call->op == MB_TRACE_SET)
+		{
+			double percent = (double)(call->value - monitor.min) / (double)(monitor.max - monitor.min);
+			percent = percent < 0.0 ? 0.0 : (percent > 1.0 ? 1.0 : percent);
+			ok = submit ? mb_submit_brightness(handle, index, percent) : mb_set_brightness(handle, index, percent);
+		}
+		else if (call->op == MB_TRACE_VCP)
+		{
+			MB_VCP_VALUE value = { call->min, 0, 0, 0 };
+			ok = mb_get_vcp_values(handle, index, &value, 1);
+		}
+		else if (call->op == MB_TRACE_CAPS)
+		{
+			MB_VCP_FEATURES features;
+			ok = mb_get_vcp_features(handle, index, &features);
+		}
+		else
+		{
+			double percent;
+			ok = mb_get_brightness(handle, index, &percent);
+		}
+		if (!ok)
+		{
+			monitor.failed++;
+		}
+		if (submit && call->op == MB_TRACE_SET)
+		{
+			continue;
+		}
+
+		MBReplayClock::time_point recorded_end = at + std::chrono::microseconds(call->duration_us);
+		monitor.lag_us.push_back(std::chrono::duration<double, std::micro>(MBReplayClock::now() - recorded_end).count());
+	}
+}
+
+static double mbreplay_percentile(std::vector<double>& values, double p)
+{
+	if (values.empty())
+	{
+		return 0.0;
+	}
+	size_t i = (size_t)(p * (double)(values.size() - 1));
+	std::nth_element(values.begin(), values.begin() + i, values.end());
+	return values[i];
+}
+
+int main(int argc, char** argv)
+{
+	bool submit = false;
+	double speed = 1.0;
+	long cache_timeout = -1;
+	const char* path = nullptr;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--submit") == 0)
+		{
+			submit = true;
+		}
+		else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc)
+		{
+			speed = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--cache-timeout") == 0 && i + 1 < argc)
+		{
+			cache_timeout = atol(argv[++i]);
+		}
+		else if (path == nullptr)
+		{
+			path = argv[i];
+		}
+		else
+		{
+			path = nullptr;
+			break;
+		}
+	}
+	if (path == nullptr || speed <= 0.0)
+	{
+		fprintf(stderr, "usage: mbreplay [--submit] [--speed X] [--cache-timeout MS] trace.bin\n");
+		return 2;
+	}
+
+	unsigned long count = 0;
+	if (!mb_trace_read(path, nullptr, 0, &count))
+	{
+		WCHAR message[256];
+		mb_last_error(message, 256);
+		fprintf(stderr, "mbreplay: %ls\n", (const wchar_t*)message);
+		return 1;
+	}
+	std::vector<MB_TRACE_RECORD> records(count);
+	mb_trace_read(path, records.data(), count, &count);
+
+	void* handle;
+	if (!mb_mock_init_replay(&handle, path))
+	{
+		WCHAR message[256];
+		mb_last_error(message, 256);
+		fprintf(stderr, "mbreplay: %ls\n", (const wchar_t*)message);
+		return 1;
+	}
+	unsigned long monitor_count = 0;
+	mb_get_count(handle, &monitor_count);
+	if (cache_timeout >= 0)
+	{
+		mb_set_cache_timeout(handle, (unsigned long)cache_timeout);
+	}
+
+	// the recording starts at its first call, reads, writes and VCP queries are replayed, range queries happen on their own
+	std::vector<MBReplayMonitor> monitors(monitor_count, MBReplayMonitor{ 0, 100, false, {}, {}, 0 });
+	uint64_t first_ns = records.empty() ? 0 : records.front().start_ns;
+	uint64_t last_end_ns = 0;
+	unsigned long recorded[MB_TRACE_VCP + 1] = { 0 };
+	for (auto& record : records)
+	{
+		MBReplayMonitor& monitor = monitors[record.index];
+		recorded[record.op <= MB_TRACE_VCP ? record.op : 0]++;
+		last_end_ns = std::max<uint64_t>(last_end_ns, record.start_ns - first_ns + record.duration_us * 1000ull);
+		// the mock plays the range recorded first, writes map onto the same one
+		if (record.op == MB_TRACE_RANGE && record.result == MB_ERROR_NONE && record.value > record.min && !monitor.ranged)
+		{
+			monitor.min = record.min;
+			monitor.max = record.value;
+			monitor.ranged = true;
+		}
+	}
+	for (auto& record : records)
+	{
+		if (record.op != MB_TRACE_RANGE && record.op <= MB_TRACE_VCP)
+		{
+			record.start_ns -= first_ns;
+			monitors[record.index].calls.push_back(&record);
+		}
+	}
+
+	MBReplayClock::time_point start = MBReplayClock::now();
+	std::vector<std::thread> threads;
+	for (unsigned long i = 0; i < monitor_count; i++)
+	{
+		threads.emplace_back(mbreplay_run, handle, i, std::ref(monitors[i]), start, speed, submit);
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	mb_flush(handle, MB_INFINITE);
+	double elapsed_ms = std::chrono::duration<double, std::milli>(MBReplayClock::now() - start).count();
+
+	printf("recorded: %lu calls (%lu range, %lu get, %lu set, %lu caps, %lu vcp) over %.1f ms\n", (unsigned long)records.size(),
+		recorded[MB_TRACE_RANGE], recorded[MB_TRACE_GET], recorded[MB_TRACE_SET], recorded[MB_TRACE_CAPS], recorded[MB_TRACE_VCP],
+		last_end_ns / 1e6);
+	printf("replayed: %.1f ms%s, speed %gx\n", elapsed_ms, submit ? " with submit" : "", speed);
+
+	std::vector<double> all_lag;
+	for (unsigned long i = 0; i < monitor_count; i++)
+	{
+		MBReplayMonitor& monitor = monitors[i];
+		unsigned long reads = 0;
+		unsigned long writes = 0;
+		mb_mock_get_calls(handle, i, &reads, &writes);
+		MB_STATS stats;
+		mb_stats_snapshot(handle, i, &stats, 0);
+		double p50 = mbreplay_percentile(monitor.lag_us, 0.5);
+		double p99 = mbreplay_percentile(monitor.lag_us, 0.99);
+		double max = monitor.lag_us.empty() ? 0.0 : *std::max_element(monitor.lag_us.begin(), monitor.lag_us.end());
+		printf("monitor %lu: %zu calls, device reads %lu writes %lu, coalesced %llu, failed %lu, lag p50 %.0f us p99 %.0f us max %.0f us\n",
+			i, monitor.calls.size(), reads, writes, (unsigned long long)stats.dropped, monitor.failed, p50, p99, max);
+		all_lag.insert(all_lag.end(), monitor.lag_us.begin(), monitor.lag_us.end());
+	}
+	printf("all monitors: lag p50 %.0f us p99 %.0f us\n", mbreplay_percentile(all_lag, 0.5), mbreplay_percentile(all_lag, 0.99));
+
+	mb_cleanup(handle);
+	return 0;
+}
@@ -10,15 +10,11 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 
 #define IN_MB_DLL
 #define _WIN32_DCOM
-#include "mon_brightness.h"
+#include "mb_internal.h"
 
-#include <vector>
-#include <memory>
-#include <string>
-#include <sstream>
-
-#include <Windows.h>
+#ifdef _WIN32
 #include <HighLevelMonitorConfigurationAPI.h>
+#include <LowLevelMonitorConfigurationAPI.h>
 #include <PhysicalMonitorEnumerationAPI.h>
 #include <Winuser.h>
 #include <comdef.h>
@@ -28,14 +24,11 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 
 #pragma comment(lib, "Dxva2.lib")
 #pragma comment(lib, "wbemuuid.lib")
+#else
+#include <string.h>
+#endif
 
-#define MB_MIN(a,b)		a<b?a:b
-#define MB_MAGIC		171
-#define MB_TYPE_NONE	0
-#define MB_TYPE_DXVA2	1
-#define MB_TYPE_WMI		2
-#define MB_TYPE_IOCTL	3
-
+#ifdef _WIN32
 template<class T> struct ComObjectDeleter
 {
 	template<class T> void operator ()(T* obj) const
@@ -53,29 +46,218 @@ struct MonitorStruct
 
 	DWORD physical_monitor_count;
 	std::vector<PHYSICAL_MONITOR> physical_monitors;
+	std::vector<uint64_t> identities;
+	std::vector<MB_EDID_INFO> edids;
 };
 
-struct MBBaseStruct
+// Windows keeps the EDID in the monitor's device key, which the device interface name leads to:
+// \\?\DISPLAY#DEL40B4#5&1a2b3c&0&UID4352#{guid} is HKLM\SYSTEM\CurrentControlSet\Enum\DISPLAY\DEL40B4\5&1a2b3c&0&UID4352
+static bool mb_dxva2_read_edid(const WCHAR* interface_name, MB_EDID_INFO* info)
 {
-public:
-	unsigned char magic;
-	unsigned char type;
+	std::wstring path = interface_name;
+	if (path.compare(0, 4, L"\\\\?\\") == 0)
+	{
+		path.erase(0, 4);
+	}
+	size_t end = path.rfind(L'#');
+	if (end == std::wstring::npos)
+	{
+		return false;
+	}
+	path.resize(end);
+	for (auto& c : path)
+	{
+		c = c == L'#' ? L'\\' : c;
+	}
 
-	MBBaseStruct()
+	std::wstring key_path = L"SYSTEM\\CurrentControlSet\\Enum\\" + path + L"\\Device Parameters";
+	HKEY key;
+	if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, key_path.c_str(), 0, KEY_READ, &key) != ERROR_SUCCESS)
 	{
-		magic = MB_MAGIC;
+		return false;
 	}
-};
+	BYTE edid[256];
+	DWORD size = sizeof(edid);
+	LONG status = RegQueryValueExW(key, L"EDID", nullptr, nullptr, edid, &size);
+	RegCloseKey(key);
+	return status == ERROR_SUCCESS && mb_edid_parse(edid, size, info);
+}
 
 struct MBDxva2Struct : public MBBaseStruct
 {
 public:
 	std::vector<PHYSICAL_MONITOR> physical_monitors;
+	std::vector<uint64_t> identities;
+
+	// an empty manufacturer marks a monitor whose EDID could not be read
+	std::vector<MB_EDID_INFO> edids;
 
 	MBDxva2Struct()
 	{
 		type = MB_TYPE_DXVA2;
 	}
+
+	unsigned long enumerate() override
+	{
+		return (unsigned long)physical_monitors.size();
+	}
+
+	bool get_range(unsigned long index, unsigned long* min, unsigned long* max) override
+	{
+		DWORD min_value, current_value, max_value;
+		if (!GetMonitorBrightness(physical_monitors[index].hPhysicalMonitor, &min_value, &current_value, &max_value))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		*min = min_value;
+		*max = max_value;
+		return true;
+	}
+
+	bool get(unsigned long index, unsigned long* value) override
+	{
+		DWORD min_value, current_value, max_value;
+		if (!GetMonitorBrightness(physical_monitors[index].hPhysicalMonitor, &min_value, &current_value, &max_value))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		*value = current_value;
+		return true;
+	}
+
+	bool set(unsigned long index, unsigned long value) override
+	{
+		if (!SetMonitorBrightness(physical_monitors[index].hPhysicalMonitor, value))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	bool probe(unsigned long index, unsigned long* min, unsigned long* max) override
+	{
+		// a capabilities query is a full DDC/CI round trip and can take over a second
+		DWORD capabilities = 0;
+		DWORD support_color_temp = 0;
+		if (!GetMonitorCapabilities(physical_monitors[index].hPhysicalMonitor, &capabilities, &support_color_temp))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		if ((capabilities & MC_CAPS_BRIGHTNESS) != MC_CAPS_BRIGHTNESS)
+		{
+			mb_error(MB_ERROR_NOT_SUPPORTED, L"monitor does not support brightness");
+			return false;
+		}
+		return get_range(index, min, max);
+	}
+
+	bool capabilities(unsigned long index, char* caps, size_t max_length, size_t* length) override
+	{
+		// both calls are full DDC/CI round trips, the second one reads the string in many fragments
+		DWORD caps_length = 0;
+		if (!GetCapabilitiesStringLength(physical_monitors[index].hPhysicalMonitor, &caps_length))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		if (caps_length > max_length)
+		{
+			mb_error(MB_ERROR_DDC_PROTOCOL, L"capabilities string too long");
+			return false;
+		}
+		if (!CapabilitiesRequestAndCapabilitiesReply(physical_monitors[index].hPhysicalMonitor, caps, caps_length))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		// the length counts the terminator, which the parser stops at
+		*length = caps_length;
+		return true;
+	}
+
+	bool get_vcp(unsigned long index, uint8_t code, unsigned long* current, unsigned long* max) override
+	{
+		MC_VCP_CODE_TYPE code_type;
+		DWORD current_value, max_value;
+		if (!GetVCPFeatureAndVCPFeatureReply(physical_monitors[index].hPhysicalMonitor, code, &code_type, &current_value, &max_value))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		*current = current_value;
+		*max = max_value;
+		return true;
+	}
+
+	unsigned long min_interval(unsigned long index) override
+	{
+		// MCCS asks for 50 ms between DDC/CI commands
+		return 50;
+	}
+
+	bool identity(unsigned long index, uint64_t* id) override
+	{
+		*id = identities[index];
+		return *id != 0;
+	}
+
+	bool edid(unsigned long index, MB_EDID_INFO* info) override
+	{
+		if (edids[index].manufacturer[0] == '\0')
+		{
+			mb_error(MB_ERROR_NOT_FOUND, L"no EDID for this monitor");
+			return false;
+		}
+		*info = edids[index];
+		return true;
+	}
+
+	bool remove(unsigned long index) override
+	{
+		DestroyPhysicalMonitors(1, &physical_monitors[index]);
+		physical_monitors.erase(physical_monitors.begin() + index);
+		identities.erase(identities.begin() + index);
+		edids.erase(edids.begin() + index);
+		return true;
+	}
+
+	long name(unsigned long index, WCHAR* monitor_name, unsigned long max_length) override
+	{
+		// the description is mostly "Generic PnP Monitor", the EDID names the model
+		const char* edid_name = edids[index].name;
+		if (edid_name[0] != '\0')
+		{
+			size_t length = strlen(edid_name);
+			if (monitor_name != nullptr)
+			{
+				for (size_t i = 0; i < length && i < max_length; i++)
+				{
+					monitor_name[i] = (WCHAR)(unsigned char)edid_name[i];
+				}
+			}
+			return (long)length;
+		}
+
+		PHYSICAL_MONITOR& phyiscal_monitor = physical_monitors[index];
+		if (monitor_name != nullptr)
+		{
+			memcpy(monitor_name, phyiscal_monitor.szPhysicalMonitorDescription, MB_MIN(sizeof(WCHAR) * wcslen(phyiscal_monitor.szPhysicalMonitorDescription), sizeof(WCHAR) * max_length));
+		}
+		return (long)wcslen(phyiscal_monitor.szPhysicalMonitorDescription);
+	}
+
+	void close() override
+	{
+		for (auto& physical_monitor : physical_monitors)
+		{
+			DestroyPhysicalMonitors(1, &physical_monitor);
+		}
+		physical_monitors.clear();
+	}
 };
 
 struct MBWMIStruct: public MBBaseStruct
@@ -91,6 +273,94 @@ public:
 	{
 		type = MB_TYPE_WMI;
 	}
+
+	// returns the failing HRESULT and names the failing call in context, or S_OK with the WMI return value
+	HRESULT exec_set(uint32_t Timeout, uint8_t Brightness, const wchar_t** context, unsigned int* return_value)
+	{
+		HRESULT hr;
+		std::unique_ptr<IWbemClassObject, ComObjectDeleter<IWbemClassObject>> instance = nullptr;
+		IWbemClassObject* instance_receive;
+		hr = clazz_obj->SpawnInstance(0, &instance_receive);
+		instance = std::unique_ptr<IWbemClassObject, ComObjectDeleter<IWbemClassObject>>(instance_receive);
+		if (FAILED(hr))
+		{
+			*context = L"IWbemClassObject->SpawnInstance(...) return error";
+			return hr;
+		}
+
+		_variant_t param1(Timeout);
+		_variant_t param2(Brightness);
+
+		instance->Put(BSTR("Timeout"), 0, &param1, CIM_UINT32);
+		instance->Put(BSTR("Brightness"), 0, &param2, CIM_UINT8);
+
+		IWbemClassObject* out_params = nullptr;
+		hr = wbem_services->ExecMethod(BSTR("WmiMonitorBrightnessMethods"), BSTR("WmiSetBrightness"), 0, nullptr, instance.get(), &out_params, nullptr);
+		if (FAILED(hr))
+		{
+			*context = L"IWbemServices->ExecMethod(...) return error";
+			return hr;
+		}
+
+		_variant_t ret;
+		out_params->Get(_bstr_t(L"ReturnValue"), 0, &ret, nullptr, nullptr);
+		out_params->Release();
+
+		*return_value = ret.uintVal;
+		return S_OK;
+	}
+
+	unsigned long enumerate() override
+	{
+		return 1;
+	}
+
+	bool get_range(unsigned long index, unsigned long* min, unsigned long* max) override
+	{
+		*min = 0;
+		*max = 100;
+		return true;
+	}
+
+	bool get(unsigned long index, unsigned long* value) override
+	{
+		// WmiMonitorBrightnessMethods can only set
+		mb_error(MB_ERROR_NOT_SUPPORTED, L"WMI backend can not read brightness");
+		return false;
+	}
+
+	bool set(unsigned long index, unsigned long value) override
+	{
+		const wchar_t* context = nullptr;
+		unsigned int return_value = 0;
+		HRESULT hr = exec_set(0, (uint8_t)value, &context, &return_value);
+		if (FAILED(hr))
+		{
+			mb_error_com(context, hr);
+			return false;
+		}
+		// the call itself went through, the method reports whether the display took the value
+		if (return_value != 0)
+		{
+			mb_error(MB_ERROR_DEVICE, L"WmiSetBrightness returned an error");
+			return false;
+		}
+		return true;
+	}
+
+	long name(unsigned long index, WCHAR* monitor_name, unsigned long max_length) override
+	{
+		static const WCHAR wmi_name[] = L"WmiMonitorBrightness";
+		if (monitor_name != nullptr)
+		{
+			memcpy(monitor_name, wmi_name, MB_MIN(sizeof(WCHAR) * wcslen(wmi_name), sizeof(WCHAR) * max_length));
+		}
+		return (long)wcslen(wmi_name);
+	}
+
+	void close() override
+	{
+	}
 };
 
 struct MBIoctlStruct : public MBBaseStruct
@@ -102,44 +372,176 @@ public:
 	{
 		type = MB_TYPE_IOCTL;
 	}
+
+	unsigned long enumerate() override
+	{
+		return 1;
+	}
+
+	bool get_range(unsigned long index, unsigned long* min, unsigned long* max) override
+	{
+		*min = 0;
+		*max = 100;
+		return true;
+	}
+
+	bool get(unsigned long index, unsigned long* value) override
+	{
+		DISPLAY_BRIGHTNESS db;
+		DWORD db_ret = 0;
+		if (!DeviceIoControl(lcd, IOCTL_VIDEO_QUERY_DISPLAY_BRIGHTNESS, nullptr, 0, &db, sizeof(DISPLAY_BRIGHTNESS), &db_ret, nullptr))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		if (db_ret == 0)
+		{
+			mb_error(MB_ERROR_DEVICE, L"db_ret is zero");
+			return false;
+		}
+		*value = db.ucACBrightness;
+		return true;
+	}
+
+	bool set(unsigned long index, unsigned long value) override
+	{
+		DISPLAY_BRIGHTNESS db = { 0 };
+		db.ucDisplayPolicy = DISPLAYPOLICY_BOTH;
+		db.ucACBrightness = (UCHAR)value;
+		db.ucDCBrightness = (UCHAR)value;
+
+		DWORD db_ret = 0;
+		if (!DeviceIoControl(lcd, IOCTL_VIDEO_SET_DISPLAY_BRIGHTNESS, &db, sizeof(DISPLAY_BRIGHTNESS), nullptr, 0, &db_ret, nullptr))
+		{
+			mb_error_system(GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	long name(unsigned long index, WCHAR* monitor_name, unsigned long max_length) override
+	{
+		static const WCHAR lcd_name[] = L"LCD";
+		if (monitor_name != nullptr)
+		{
+			memcpy(monitor_name, lcd_name, MB_MIN(sizeof(WCHAR) * wcslen(lcd_name), sizeof(WCHAR) * max_length));
+		}
+		return (long)wcslen(lcd_name);
+	}
+
+	void close() override
+	{
+		CloseHandle(lcd);
+	}
 };
+#endif
 
-static std::wstring g_last_error;
-static long g_com_init = 0;
+#ifdef _WIN32
+// COM security is process wide and may be set only once, the first mb_wmi_init does it whatever thread it runs on
+static std::once_flag g_com_init;
+#endif
 
-static std::wstring GetLastErrorAsString(DWORD error)
+// per thread, recording a failure stores three words and never allocates, the text is built in mb_last_error
+static thread_local MBError t_error = { MB_ERROR_NONE, 0, nullptr };
+static thread_local WCHAR t_error_text[MB_ERROR_TEXT_LENGTH];
+
+void mb_error(long code, const wchar_t* message)
 {
-	//Get the error message, if any.
-	DWORD& errorMessageID = error;
-	if (errorMessageID == 0)
-		return std::wstring(); //No error message has been recorded
+	t_error.code = code;
+	t_error.system = 0;
+	t_error.message = message;
+}
 
-	LPWSTR messageBuffer = nullptr;
-	size_t size = FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-		NULL, errorMessageID, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPWSTR)&messageBuffer, 0, NULL);
+void mb_error_system(MBSystemError error)
+{
+	t_error.code = MB_ERROR_SYSTEM;
+	t_error.system = (long)error;
+	t_error.message = nullptr;
+}
 
-	std::wstring message(messageBuffer, size);
+#ifdef _WIN32
+void mb_error_com(const wchar_t* context, HRESULT hr)
+{
+	t_error.code = MB_ERROR_COM;
+	t_error.system = (long)hr;
+	t_error.message = context;
+}
+#endif
 
-	//Free the buffer.
-	LocalFree(messageBuffer);
+MBError mb_error_save()
+{
+	return t_error;
+}
 
-	return message;
+void mb_error_restore(const MBError& error)
+{
+	t_error = error;
 }
 
-static std::wstring GetComErrorMessageWithHRESULT(HRESULT hr)
+static const wchar_t* mb_error_default_message(long code)
 {
-	_com_error com_error(hr);
-	return com_error.ErrorMessage();
+	switch (code)
+	{
+	case MB_ERROR_NONE:					return L"";
+	case MB_ERROR_INVALID_HANDLE:		return L"Invalid handle";
+	case MB_ERROR_INVALID_ARGUMENT:		return L"invalid argument";
+	case MB_ERROR_INDEX_OUT_OF_RANGE:	return L"index out of range";
+	case MB_ERROR_NOT_FOUND:			return L"not found";
+	case MB_ERROR_NOT_SUPPORTED:		return L"not supported";
+	case MB_ERROR_TIMEOUT:				return L"timed out";
+	case MB_ERROR_DEVICE:				return L"device returned invalid data";
+	case MB_ERROR_DDC_NAK:				return L"DDC/CI display did not acknowledge";
+	case MB_ERROR_DDC_CHECKSUM:			return L"DDC/CI reply checksum mismatch";
+	case MB_ERROR_DDC_PROTOCOL:			return L"DDC/CI invalid reply";
+	case MB_ERROR_DETACHED:				return L"monitor was unplugged";
+	case MB_ERROR_TOO_MANY_HANDLES:		return L"too many open handles";
+	case MB_ERROR_INVALID_FILE:			return L"file is damaged or of another version";
+	case MB_ERROR_IN_USE:				return L"in use by another owner";
+	default:							return L"unknown error";
+	}
 }
 
-inline MBBaseStruct* mb_check_is_struct(void* handle)
+static size_t mb_error_format(const MBError& error, WCHAR* buffer, size_t length)
 {
-	MBBaseStruct* base = (MBBaseStruct*)handle;
-	if (base->magic != MB_MAGIC)
+	buffer[0] = L'\0';
+	switch (error.code)
+	{
+	case MB_ERROR_SYSTEM:
 	{
-		return nullptr;
+#ifdef _WIN32
+		return FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+			NULL, (DWORD)error.system, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buffer, (DWORD)length, NULL);
+#else
+		const char* message = strerror(error.system);
+		size_t i = 0;
+		for (; message[i] != '\0' && i + 1 < length; i++)
+		{
+			buffer[i] = (WCHAR)(unsigned char)message[i];
+		}
+		buffer[i] = L'\0';
+		return i;
+#endif
+	}
+#ifdef _WIN32
+	case MB_ERROR_COM:
+	{
+		_com_error com_error((HRESULT)error.system);
+		int size = swprintf(buffer, length, L"%ls with hr 0x%lx %ls", error.message, (unsigned long)error.system, com_error.ErrorMessage());
+		return size < 0 ? wcslen(buffer) : (size_t)size;
+	}
+#endif
+	default:
+	{
+		const wchar_t* message = error.message != nullptr ? error.message : mb_error_default_message(error.code);
+		size_t i = 0;
+		for (; message[i] != L'\0' && i + 1 < length; i++)
+		{
+			buffer[i] = message[i];
+		}
+		buffer[i] = L'\0';
+		return i;
+	}
 	}
-	return base;
 }
 
 MB_FUNCTION long MB_CONV mb_sum(long a, long b)
@@ -149,12 +551,22 @@ MB_FUNCTION long MB_CONV mb_sum(long a, long b)
 
 MB_FUNCTION long MB_CONV mb_last_error(WCHAR* out_message, unsigned long length)
 {
+	size_t message_length = mb_error_format(t_error, t_error_text, MB_ERROR_TEXT_LENGTH);
 	if (out_message != nullptr)
 	{
 		memset(out_message, 0, sizeof(WCHAR) * length);
-		memcpy(out_message, g_last_error.data(), MB_MIN(sizeof(WCHAR) * g_last_error.length(), sizeof(WCHAR) * length));
+		memcpy(out_message, t_error_text, MB_MIN(sizeof(WCHAR) * message_length, sizeof(WCHAR) * length));
+	}
+	return (long)message_length;
+}
+
+MB_FUNCTION long MB_CONV mb_last_error_code(long* system_error)
+{
+	if (system_error != nullptr)
+	{
+		*system_error = t_error.system;
 	}
-	return (long)g_last_error.length();
+	return t_error.code;
 }
 
 MB_FUNCTION long MB_CONV mb_version()
@@ -162,7 +574,13 @@ MB_FUNCTION long MB_CONV mb_version()
 	return MB_VERSION;
 }
 
+#ifdef _WIN32
 MB_FUNCTION long MB_CONV mb_dxva2_init(void** handle)
+{
+	return mb_dxva2_init_ex(handle, MB_INFINITE);
+}
+
+MB_FUNCTION long MB_CONV mb_dxva2_init_ex(void** handle, unsigned long deadline)
 {
 	std::vector<MonitorStruct> monitors;
 
@@ -180,199 +598,200 @@ MB_FUNCTION long MB_CONV mb_dxva2_init(void** handle)
 	};
 	if (!EnumDisplayMonitors(nullptr, nullptr, mep, (LPARAM)&monitors))
 	{
-		DWORD error = GetLastError();
-		g_last_error = GetLastErrorAsString(error);
+		mb_error_system(GetLastError());
 		return 0;
 	}
 
-	std::vector<PHYSICAL_MONITOR> physical_monitors_out;
-	for (auto& ms : monitors)
+	std::vector<MBError> errors(monitors.size(), MBError{ MB_ERROR_NONE, 0, nullptr });
+	mb_parallel_for(monitors.size(), MB_MAX_WORKERS, [&](size_t i)
 	{
+		MonitorStruct& ms = monitors[i];
 		if (!GetNumberOfPhysicalMonitorsFromHMONITOR(ms.hMonitor, &ms.physical_monitor_count))
 		{
-			DWORD error = GetLastError();
-			g_last_error = GetLastErrorAsString(error);
-			return 0;
+			mb_error_system(GetLastError());
+			errors[i] = mb_error_save();
+			return;
 		}
 
-		std::unique_ptr<PHYSICAL_MONITOR[]> physical_monitors = std::make_unique<PHYSICAL_MONITOR[]>(ms.physical_monitor_count);
-		if (!GetPhysicalMonitorsFromHMONITOR(ms.hMonitor, ms.physical_monitor_count, physical_monitors.get()))
+		std::vector<PHYSICAL_MONITOR> physical_monitors(ms.physical_monitor_count);
+		if (!GetPhysicalMonitorsFromHMONITOR(ms.hMonitor, ms.physical_monitor_count, physical_monitors.data()))
 		{
-			DWORD error = GetLastError();
-			g_last_error = GetLastErrorAsString(error);
-			return 0;
+			mb_error_system(GetLastError());
+			errors[i] = mb_error_save();
+			return;
 		}
+		ms.physical_monitors = std::move(physical_monitors);
 
-		DWORD capabilities;
-		DWORD support_color_temp;
-		for (auto i = 0u; i < ms.physical_monitor_count; i++)
+		// the id comes from the EDID, the device interface name stands for the port and for the EDID when it can't be read
+		MONITORINFOEXW info;
+		info.cbSize = sizeof(info);
+		bool has_info = GetMonitorInfoW(ms.hMonitor, (LPMONITORINFO)&info) != FALSE;
+		for (DWORD j = 0; j < ms.physical_monitor_count; j++)
 		{
-			capabilities = 0;
-			support_color_temp = 0;
-
-			PHYSICAL_MONITOR& physical_monitor = physical_monitors[i];
-			if (!GetMonitorCapabilities(physical_monitor.hPhysicalMonitor, &capabilities, &support_color_temp))
+			uint64_t id = 0;
+			MB_EDID_INFO edid;
+			memset(&edid, 0, sizeof(edid));
+			DISPLAY_DEVICEW device;
+			device.cb = sizeof(device);
+			if (has_info && EnumDisplayDevicesW(info.szDevice, j, &device, EDD_GET_DEVICE_INTERFACE_NAME) && device.DeviceID[0] != L'\0')
 			{
-				continue;
+				if (mb_dxva2_read_edid(device.DeviceID, &edid))
+				{
+					id = mb_edid_identity(edid, device.DeviceID, sizeof(WCHAR) * wcslen(device.DeviceID));
+				}
+				else
+				{
+					memset(&edid, 0, sizeof(edid));
+					id = mb_hash64(device.DeviceID, sizeof(WCHAR) * wcslen(device.DeviceID), MB_HASH64_INIT);
+					const WCHAR* description = ms.physical_monitors[j].szPhysicalMonitorDescription;
+					id = mb_hash64(description, sizeof(WCHAR) * wcslen(description), id);
+				}
 			}
+			ms.identities.push_back(id);
+			ms.edids.push_back(edid);
+		}
+	});
 
-			if ((capabilities & MC_CAPS_BRIGHTNESS) == MC_CAPS_BRIGHTNESS)
-			{
-				ms.physical_monitors.push_back(physical_monitor);
-				physical_monitors_out.push_back(physical_monitor);
-			}
-			else
+	std::vector<PHYSICAL_MONITOR> physical_monitors_out;
+	std::vector<uint64_t> identities_out;
+	std::vector<MB_EDID_INFO> edids_out;
+	for (auto& ms : monitors)
+	{
+		physical_monitors_out.insert(physical_monitors_out.end(), ms.physical_monitors.begin(), ms.physical_monitors.end());
+		identities_out.insert(identities_out.end(), ms.identities.begin(), ms.identities.end());
+		edids_out.insert(edids_out.end(), ms.edids.begin(), ms.edids.end());
+	}
+
+	for (auto& error : errors)
+	{
+		if (error.code != MB_ERROR_NONE)
+		{
+			for (auto& physical_monitor : physical_monitors_out)
 			{
 				DestroyPhysicalMonitors(1, &physical_monitor);
 			}
+			mb_error_restore(error);
+			return 0;
 		}
 	}
 
-	if (physical_monitors_out.size() == 0)
+	MBDxva2Struct* h = new MBDxva2Struct();
+	h->physical_monitors = std::move(physical_monitors_out);
+	h->identities = std::move(identities_out);
+	h->edids = std::move(edids_out);
+
+	// the capability queries run in parallel or come from the capability cache, monitors without brightness support are dropped there
+	void* probed = nullptr;
+	if (!mb_driver_attach_probed(h, &probed, deadline))
+	{
+		return 0;
+	}
+	if (h->count() == 0)
 	{
-		g_last_error = L"no brightness controllable monitors found";
+		mb_error(MB_ERROR_NOT_FOUND, L"no brightness controllable monitors found");
 	}
 
 	if (handle != nullptr)
 	{
-		MBDxva2Struct* h = new MBDxva2Struct();
-		h->physical_monitors = std::move(physical_monitors_out);
-		*handle = h;
+		*handle = probed;
+	}
+	else
+	{
+		mb_driver_cleanup(h);
 	}
 	return 1;
 }
 
 MB_FUNCTION long MB_CONV mb_dxva2_get_count(void* handle, unsigned long* count)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_DXVA2)
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		g_last_error = L"Invalid handle";
 		return 0;
 	}
-	MBDxva2Struct* h = (MBDxva2Struct*)base;
-
-	*count = (unsigned long)h->physical_monitors.size();
-	return (long)h->physical_monitors.size();
+	return mb_driver_get_count(h, count);
 }
 
 MB_FUNCTION long MB_CONV mb_dxva2_set_brightness(void* handle, unsigned long index, double percent)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_DXVA2)
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		g_last_error = L"Invalid handle";
 		return 0;
 	}
-	MBDxva2Struct* h = (MBDxva2Struct*)base;
+	return mb_driver_set(h, index, percent);
+}
 
-	if (percent < 0.0 || percent > 1.0)
+MB_FUNCTION long MB_CONV mb_dxva2_set_brightness_batch(void* handle, const MB_DXVA2_BRIGHTNESS* requests, unsigned long count, long* results)
+{
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		g_last_error = L"percent out of range 0 .. 1";
 		return 0;
 	}
+	return mb_driver_set_batch(h, requests, count, results);
+}
 
-	if (h->physical_monitors.size() < index)
+MB_FUNCTION long MB_CONV mb_dxva2_submit_brightness(void* handle, unsigned long index, double percent)
+{
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		g_last_error = L"index out of range";
 		return 0;
 	}
-	PHYSICAL_MONITOR& phyiscal_monitor = h->physical_monitors.at(index);
+	return mb_driver_submit(h, index, percent);
+}
 
-	DWORD min, max, current;
-	if (!GetMonitorBrightness(phyiscal_monitor.hPhysicalMonitor, &min, &current, &max))
+MB_FUNCTION long MB_CONV mb_dxva2_flush(void* handle, unsigned long timeout)
+{
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		DWORD error = GetLastError();
-		g_last_error = GetLastErrorAsString(error);
 		return 0;
 	}
-
-	DWORD in_percent = (DWORD)ceil(min + (percent * max));
-
-	BOOL ret = SetMonitorBrightness(phyiscal_monitor.hPhysicalMonitor, in_percent);
-	if (!ret)
-	{
-		DWORD error = GetLastError();
-		g_last_error = GetLastErrorAsString(error);
-	}
-	return ret;
+	return mb_driver_flush(h, timeout);
 }
 
 MB_FUNCTION long MB_CONV mb_dxva2_get_brightness(void* handle, unsigned long index, double* percent)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_DXVA2)
-	{
-		g_last_error = L"Invalid handle";
-		return 0;
-	}
-	MBDxva2Struct* h = (MBDxva2Struct*)base;
-
-	if (h->physical_monitors.size() < index)
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		g_last_error = L"monitor_index out of range";
 		return 0;
 	}
-	PHYSICAL_MONITOR& phyiscal_monitor = h->physical_monitors.at(index);
+	return mb_driver_get(h, index, percent);
+}
 
-	DWORD min, max, current;
-	if (!GetMonitorBrightness(phyiscal_monitor.hPhysicalMonitor, &min, &current, &max))
+MB_FUNCTION long MB_CONV mb_dxva2_set_cache_timeout(void* handle, unsigned long milliseconds)
+{
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		DWORD error = GetLastError();
-		g_last_error = GetLastErrorAsString(error);
 		return 0;
 	}
 
-	double out_percent = (double)(current - min) / (double)(max - min);
-
-	if (percent != nullptr)
-	{
-		*percent = out_percent;
-	}
+	h->cache_timeout = milliseconds;
 	return 1;
 }
 
 MB_FUNCTION long MB_CONV mb_dxva2_get_name(void* handle, unsigned long index, WCHAR* monitor_name, unsigned long max_length)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_DXVA2)
-	{
-		g_last_error = L"Invalid handle";
-		return 0;
-	}
-	MBDxva2Struct* h = (MBDxva2Struct*)base;
-
-	if (h->physical_monitors.size() < index)
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		g_last_error = L"monitor_index out of range";
 		return 0;
 	}
-	PHYSICAL_MONITOR& phyiscal_monitor = h->physical_monitors.at(index);
-
-	if (monitor_name != nullptr)
-	{
-		memcpy(monitor_name, phyiscal_monitor.szPhysicalMonitorDescription, MB_MIN(sizeof(WCHAR) * wcslen(phyiscal_monitor.szPhysicalMonitorDescription), sizeof(WCHAR) * max_length));
-	}
-	return (long)wcslen(phyiscal_monitor.szPhysicalMonitorDescription);
+	return mb_driver_get_name(h, index, monitor_name, max_length);
 }
 
 MB_FUNCTION long MB_CONV mb_dxva2_cleanup(void* handle)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_DXVA2)
+	MBHandle h(handle, MB_TYPE_DXVA2);
+	if (!h)
 	{
-		g_last_error = L"Invalid handle";
 		return 0;
 	}
-	MBDxva2Struct* h = (MBDxva2Struct*)base;
-
-	for (auto& physical_monitor : h->physical_monitors)
-	{
-		DestroyPhysicalMonitors(1, &physical_monitor);
-	}
-	delete h;
-
-	return 1;
+	return mb_driver_cleanup(h);
 }
 
 MB_FUNCTION long MB_CONV mb_wmi_init(void** handle)
@@ -383,10 +802,10 @@ MB_FUNCTION long MB_CONV mb_wmi_init(void** handle)
 	IWbemServices* wbem_services_receive = nullptr;
 
 	HRESULT hr;
-	if (g_com_init == 0)
+	std::call_once(g_com_init, []()
 	{
 		CoInitializeEx(nullptr, COINIT_MULTITHREADED);
-		hr = CoInitializeSecurity(
+		CoInitializeSecurity(
 			NULL,                        // Security descriptor    
 			-1,                          // COM negotiates authentication service
 			NULL,                        // Authentication services
@@ -396,17 +815,13 @@ MB_FUNCTION long MB_CONV mb_wmi_init(void** handle)
 			NULL,                        // Authentication info
 			EOAC_NONE,                   // Additional capabilities of the client or server
 			NULL);                       // Reserved
-	}
-	g_com_init++;
+	});
 
 	hr = CoCreateInstance(CLSID_WbemLocator, nullptr, CLSCTX_INPROC_SERVER, IID_IWbemLocator, (LPVOID*)&wbem_locator_receive);
 	wbem_locator = std::unique_ptr<IWbemLocator, ComObjectDeleter<IWbemLocator>>(wbem_locator_receive);
 	if (FAILED(hr))
 	{
-		std::wstringstream ss;
-		ss << std::hex << hr;
-
-		g_last_error = L"CoCreateInstance(CLSID_WbemLocator, ... ) creation error with hr 0x" + ss.str() + L" " + GetComErrorMessageWithHRESULT(hr);
+		mb_error_com(L"CoCreateInstance(CLSID_WbemLocator, ... ) creation error", hr);
 		return 0;
 	}
 
@@ -414,20 +829,14 @@ MB_FUNCTION long MB_CONV mb_wmi_init(void** handle)
 	wbem_services = std::unique_ptr<IWbemServices, ComObjectDeleter<IWbemServices>>(wbem_services_receive);
 	if (FAILED(hr))
 	{
-		std::wstringstream ss;
-		ss << std::hex << hr;
-
-		g_last_error = L"IWbemLocator->ConnectServer(...) return error with hr 0x" + ss.str() + L" " + GetComErrorMessageWithHRESULT(hr);
+		mb_error_com(L"IWbemLocator->ConnectServer(...) return error", hr);
 		return 0;
 	}
 
 	hr = CoSetProxyBlanket(wbem_services.get(), RPC_C_AUTHN_WINNT, RPC_C_AUTHZ_NONE, NULL, RPC_C_AUTHN_LEVEL_CALL, RPC_C_IMP_LEVEL_IMPERSONATE, NULL, EOAC_NONE);
 	if (FAILED(hr))
 	{
-		std::wstringstream ss;
-		ss << std::hex << hr;
-
-		g_last_error = L"CoSetProxyBlanket(IWbemServices*, ...) return error with 0x" + ss.str() + L" " + GetComErrorMessageWithHRESULT(hr);
+		mb_error_com(L"CoSetProxyBlanket(IWbemServices*, ...) return error", hr);
 		return 0;
 	}
 
@@ -437,10 +846,7 @@ MB_FUNCTION long MB_CONV mb_wmi_init(void** handle)
 	clazz_obj = std::unique_ptr<IWbemClassObject, ComObjectDeleter<IWbemClassObject>>(clazz_obj_receive);
 	if (FAILED(hr))
 	{
-		std::wstringstream ss;
-		ss << std::hex << hr;
-
-		g_last_error = L"IWbemServices->GetObjectW(...) return error with hr 0x" + ss.str() + L" " + GetComErrorMessageWithHRESULT(hr);
+		mb_error_com(L"IWbemServices->GetObjectW(...) return error", hr);
 		return 0;
 	}
 
@@ -452,10 +858,7 @@ MB_FUNCTION long MB_CONV mb_wmi_init(void** handle)
 	{
 		clazz_obj->Release();
 
-		std::wstringstream ss;
-		ss << std::hex << hr;
-
-		g_last_error = L"IWbemClassObject->GetMethod(...) return error with hr 0x" + ss.str() + L" " + GetComErrorMessageWithHRESULT(hr);
+		mb_error_com(L"IWbemClassObject->GetMethod(...) return error", hr);
 		return 0;
 	}
 
@@ -468,7 +871,10 @@ MB_FUNCTION long MB_CONV mb_wmi_init(void** handle)
 		h->clazz_obj = std::move(clazz_obj);
 		h->method = std::move(method);
 
-		*handle = h;
+		if (!mb_driver_attach(h, handle))
+		{
+			return 0;
+		}
 	}
 
 	return 1;
@@ -476,63 +882,34 @@ MB_FUNCTION long MB_CONV mb_wmi_init(void** handle)
 
 MB_FUNCTION long MB_CONV mb_wmi_set_brightness(void* handle, uint32_t Timeout, uint8_t Brightness)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_WMI)
-	{
-		g_last_error = L"Invalid handle";
-		return 0;
-	}
-	MBWMIStruct* h = (MBWMIStruct*)base;
-
-	HRESULT hr;
-	std::unique_ptr<IWbemClassObject, ComObjectDeleter<IWbemClassObject>> instance = nullptr;
-	IWbemClassObject* instance_receive;
-	hr = h->clazz_obj->SpawnInstance(0, &instance_receive);
-	instance = std::unique_ptr<IWbemClassObject, ComObjectDeleter<IWbemClassObject>>(instance_receive);
-	if (FAILED(hr))
+	MBHandle base(handle, MB_TYPE_WMI);
+	if (!base)
 	{
-		std::wstringstream ss;
-		ss << std::hex << hr;
-
-		g_last_error = L"IWbemClassObject->SpawnInstance(...) return error with hr 0x" + ss.str() + L" " + GetComErrorMessageWithHRESULT(hr);
 		return 0;
 	}
+	MBWMIStruct* h = (MBWMIStruct*)base.get();
 
-	_variant_t param1(Timeout);
-	_variant_t param2(Brightness);
-
-	instance->Put(BSTR("Timeout"), 0, &param1, CIM_UINT32);
-	instance->Put(BSTR("Brightness"), 0, &param2, CIM_UINT8);
-
-	IWbemClassObject* out_params = nullptr;
-	hr = h->wbem_services->ExecMethod(BSTR("WmiMonitorBrightnessMethods"), BSTR("WmiSetBrightness"), 0, nullptr, instance.get(), &out_params, nullptr);
+	std::lock_guard<MBStrand> guard(h->monitors[0]->strand);
+	const wchar_t* context = nullptr;
+	unsigned int return_value = 0;
+	HRESULT hr = h->exec_set(Timeout, Brightness, &context, &return_value);
 	if (FAILED(hr))
 	{
-		std::wstringstream ss;
-		ss << std::hex << hr;
-
-		g_last_error = L"IWbemServices->ExecMethod(...) return error with hr 0x" + ss.str() + L" " + GetComErrorMessageWithHRESULT(hr);
+		mb_error_com(context, hr);
 		return 0;
 	}
 
-	_variant_t ret;
-	out_params->Get(_bstr_t(L"ReturnValue"), 0, &ret, nullptr, nullptr);
-	out_params->Release();
-
-	return ret.uintVal;
+	return return_value;
 }
 
 MB_FUNCTION long MB_CONV mb_wmi_cleanup(void* handle)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_WMI)
+	MBHandle h(handle, MB_TYPE_WMI);
+	if (!h)
 	{
-		g_last_error = L"Invalid handle";
 		return 0;
 	}
-	delete base;
-
-	return 1;
+	return mb_driver_cleanup(h);
 }
 
 MB_FUNCTION long MB_CONV mb_ioctl_init(void** handle)
@@ -545,8 +922,7 @@ MB_FUNCTION long MB_CONV mb_ioctl_init(void** handle)
 	HANDLE lcd = CreateFileW(L"\\\\.\\LCD", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
 	if (lcd == INVALID_HANDLE_VALUE)
 	{
-		DWORD error = GetLastError();
-		g_last_error = GetLastErrorAsString(error);
+		mb_error_system(GetLastError());
 
 		return 0;
 	}
@@ -555,49 +931,53 @@ MB_FUNCTION long MB_CONV mb_ioctl_init(void** handle)
 	DWORD support_brightness_ret = 0;
 	if (!DeviceIoControl(lcd, IOCTL_VIDEO_QUERY_SUPPORTED_BRIGHTNESS, nullptr, 0, support_brightness, 256, &support_brightness_ret, nullptr))
 	{
-		DWORD error = GetLastError();
-		g_last_error = GetLastErrorAsString(error);
+		mb_error_system(GetLastError());
 
+		CloseHandle(lcd);
 		return 0;
 	}
 	if (support_brightness_ret == 0)
 	{
-		g_last_error = L"Monitor found but not support for setting brightness";
+		mb_error(MB_ERROR_NOT_SUPPORTED, L"Monitor found but not support for setting brightness");
+		CloseHandle(lcd);
 		return 0;
 	}
 
 	if (handle == nullptr)
 	{
-		g_last_error = L"function succeeded, but handle is nullptr";
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"function succeeded, but handle is nullptr");
+		CloseHandle(lcd);
 	}
 	else
 	{
 		MBIoctlStruct* h = new MBIoctlStruct();
 		h->lcd = lcd;
 
-		*handle = h;
+		if (!mb_driver_attach(h, handle))
+		{
+			return 0;
+		}
 	}
 	return 1;
 }
 
 MB_FUNCTION long MB_CONV mb_ioctl_set_brightness(void* handle, unsigned long ac_percent, unsigned long dc_percent)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_IOCTL)
+	MBHandle base(handle, MB_TYPE_IOCTL);
+	if (!base)
 	{
-		g_last_error = L"Invalid handle";
 		return 0;
 	}
-	MBIoctlStruct* h = (MBIoctlStruct*)base;
+	MBIoctlStruct* h = (MBIoctlStruct*)base.get();
 
 	if (ac_percent > 100)
 	{
-		g_last_error = L"ac_percent out of range 0 .. 100";
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"ac_percent out of range 0 .. 100");
 		return 0;
 	}
 	if (dc_percent > 100)
 	{
-		g_last_error = L"dc_percent out of range 0 .. 100";
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"dc_percent out of range 0 .. 100");
 		return 0;
 	}
 
@@ -608,51 +988,54 @@ MB_FUNCTION long MB_CONV mb_ioctl_set_brightness(void* handle, unsigned long ac_
 	db.ucACBrightness = (UCHAR)ac_percent;
 	db.ucDCBrightness = (UCHAR)dc_percent;
 	DWORD db_size = sizeof(DISPLAY_BRIGHTNESS);
-	
-	BOOL ret = DeviceIoControl(lcd, IOCTL_VIDEO_SET_DISPLAY_BRIGHTNESS, &db, db_size, nullptr, 0, nullptr, nullptr);
-	if (ret)
+	DWORD db_ret = 0;
+
+	std::lock_guard<MBStrand> guard(h->monitors[0]->strand);
+	BOOL ret = DeviceIoControl(lcd, IOCTL_VIDEO_SET_DISPLAY_BRIGHTNESS, &db, db_size, nullptr, 0, &db_ret, nullptr);
+	if (!ret)
 	{
-		DWORD error = GetLastError();
-		g_last_error = GetLastErrorAsString(error);
+		mb_error_system(GetLastError());
 
 		return 0;
 	}
 
+	// the shadow follows the AC value, the one the common layer reads back
+	h->monitors[0]->current = ac_percent;
+	mb_snapshot_update(h, 0, *h->monitors[0]);
 	return 1;
 }
 
 MB_FUNCTION long MB_CONV mb_ioctl_get_brightness(void* handle, unsigned long* ac_percent, unsigned long* dc_percent)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_IOCTL)
+	MBHandle base(handle, MB_TYPE_IOCTL);
+	if (!base)
 	{
-		g_last_error = L"Invalid handle";
 		return 0;
 	}
-	MBIoctlStruct* h = (MBIoctlStruct*)base;
+	MBIoctlStruct* h = (MBIoctlStruct*)base.get();
 	HANDLE& lcd = h->lcd;
 
 	DISPLAY_BRIGHTNESS db;
 	DWORD db_size = sizeof(DISPLAY_BRIGHTNESS);
 	DWORD db_ret = 0;
 
+	std::lock_guard<MBStrand> guard(h->monitors[0]->strand);
 	BOOL ret = DeviceIoControl(lcd, IOCTL_VIDEO_QUERY_DISPLAY_BRIGHTNESS, nullptr, 0, &db, db_size, &db_ret, nullptr);
 	if (!ret)
 	{
-		DWORD error = GetLastError();
-		g_last_error = GetLastErrorAsString(error);
+		mb_error_system(GetLastError());
 
 		return 0;
 	}
 	if (db_ret == 0)
 	{
-		g_last_error = L"db_ret is zero";
+		mb_error(MB_ERROR_DEVICE, L"db_ret is zero");
 		return 0;
 	}
 
 	if (ac_percent == nullptr)
 	{
-		g_last_error = L"function succeeded, but ac_percent is nullptr";
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"function succeeded, but ac_percent is nullptr");
 	}
 	else
 	{
@@ -661,7 +1044,7 @@ MB_FUNCTION long MB_CONV mb_ioctl_get_brightness(void* handle, unsigned long* ac
 
 	if (dc_percent == nullptr)
 	{
-		g_last_error = L"function succeeded, but dc_percent is nullptr";
+		mb_error(MB_ERROR_INVALID_ARGUMENT, L"function succeeded, but dc_percent is nullptr");
 	}
 	else
 	{
@@ -673,16 +1056,11 @@ MB_FUNCTION long MB_CONV mb_ioctl_get_brightness(void* handle, unsigned long* ac
 
 MB_FUNCTION long MB_CONV mb_ioctl_cleanup(void* handle)
 {
-	MBBaseStruct* base = mb_check_is_struct(handle);
-	if (base == nullptr || base->type != MB_TYPE_IOCTL)
+	MBHandle h(handle, MB_TYPE_IOCTL);
+	if (!h)
 	{
-		g_last_error = L"Invalid handle";
 		return 0;
 	}
-	MBIoctlStruct* h = (MBIoctlStruct*)base;
-	HANDLE& lcd = h->lcd;
-	CloseHandle(lcd);
-	delete h;
-
-	return 1;
+	return mb_driver_cleanup(h);
 }
+#endif
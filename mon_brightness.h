@@ -11,6 +11,8 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 
 #include <stddef.h>
 #include <stdint.h>
+
+#ifdef _WIN32
 #include <Windows.h>
 
 #ifdef IN_MB_DLL
@@ -19,15 +21,216 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #define MB_FUNCTION __declspec(dllimport)
 #endif
 
-#define MB_DEPRECATED
 #define MB_CONV __stdcall
+#else
+#include <wchar.h>
+
+typedef wchar_t WCHAR;
+
+#define MB_FUNCTION __attribute__((visibility("default")))
+#define MB_CONV
+#endif
+
+#define MB_DEPRECATED
+
+#define MB_INFINITE							0xFFFFFFFF
+
+#define MB_ERROR_NONE						0
+#define MB_ERROR_INVALID_HANDLE				1
+#define MB_ERROR_INVALID_ARGUMENT			2
+#define MB_ERROR_INDEX_OUT_OF_RANGE			3
+#define MB_ERROR_SYSTEM						4
+#define MB_ERROR_COM						5
+#define MB_ERROR_NOT_FOUND					6
+#define MB_ERROR_NOT_SUPPORTED				7
+#define MB_ERROR_TIMEOUT					8
+#define MB_ERROR_DEVICE						9
+#define MB_ERROR_DDC_NAK					10
+#define MB_ERROR_DDC_CHECKSUM				11
+#define MB_ERROR_DDC_PROTOCOL				12
+#define MB_ERROR_DETACHED					13
+#define MB_ERROR_TOO_MANY_HANDLES			14
+#define MB_ERROR_INVALID_FILE				15
+#define MB_ERROR_IN_USE						16
 
-#define MB_VERSION							5
+#define MB_MONITOR_READY					1
+#define MB_MONITOR_PENDING					2
+#define MB_MONITOR_FAILED					3
+#define MB_MONITOR_DETACHED					4
+
+#define MB_EASE_LINEAR						0
+#define MB_EASE_IN							1
+#define MB_EASE_OUT							2
+#define MB_EASE_IN_OUT						3
+
+#define MB_STATS_BUCKETS					32
+#define MB_STATS_ALL						0xFFFFFFFF
+
+#define MB_CURVE_LINEAR						0
+#define MB_CURVE_PERCEPTUAL					1
+#define MB_CURVE_POINTS						2
+
+#define MB_GROUP_WRITTEN					1
+#define MB_GROUP_UNCHANGED					2
+
+#define MB_TRACE_RANGE						1
+#define MB_TRACE_GET						2
+#define MB_TRACE_SET						3
+#define MB_TRACE_CAPS						4
+#define MB_TRACE_VCP						5
+
+#define MB_VCP_BRIGHTNESS					0x10
+#define MB_VCP_CONTRAST						0x12
+
+#define MB_VERSION							6
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
+	typedef struct MB_BRIGHTNESS
+	{
+		unsigned long index;
+		double percent;
+	} MB_BRIGHTNESS;
+
+	typedef MB_BRIGHTNESS MB_DXVA2_BRIGHTNESS;
+
+	typedef struct MB_CALIBRATION_POINT
+	{
+		double percent;
+		double level;						// fraction of the monitor's raw range, 0 is its minimum
+	} MB_CALIBRATION_POINT;
+
+	typedef struct MB_GROUP_MEMBER
+	{
+		void* handle;
+		unsigned long index;
+	} MB_GROUP_MEMBER;
+
+	typedef struct MB_GROUP_MONITOR
+	{
+		void* handle;
+		uint64_t id;						// from mb_get_monitor_id
+	} MB_GROUP_MONITOR;
+
+	typedef struct MB_SNAPSHOT_MONITOR
+	{
+		double percent;						// valid when has_value is non zero
+		long has_value;
+		long state;							// MB_MONITOR_*
+		uint64_t identity;					// stable id of the monitor, 0 if it has none
+		uint64_t updated_us;				// steady clock microseconds of the last change, the same clock in every process
+		uint64_t version;					// counts the changes published for this monitor
+	} MB_SNAPSHOT_MONITOR;
+
+	typedef struct MB_TRACE_RECORD
+	{
+		uint64_t start_ns;					// since mb_trace_start
+		uint64_t identity;					// stable id of the monitor, 0 if it has none
+		uint32_t duration_us;
+		uint32_t value;						// raw value read or written, the maximum for MB_TRACE_RANGE, the string length for MB_TRACE_CAPS
+		uint32_t min;						// the minimum for MB_TRACE_RANGE, the VCP code for MB_TRACE_VCP
+		uint16_t index;
+		uint8_t op;							// MB_TRACE_*
+		uint8_t result;						// MB_ERROR_*
+	} MB_TRACE_RECORD;
+
+	typedef struct MB_VCP_FEATURES
+	{
+		uint64_t bits[4];					// VCP code c is supported when bit c % 64 of bits[c / 64] is set
+	} MB_VCP_FEATURES;
+
+	typedef struct MB_VCP_VALUE
+	{
+		unsigned long code;					// MCCS VCP code 0 .. 0xFF, e.g. MB_VCP_BRIGHTNESS
+		unsigned long current;
+		unsigned long max;
+		long result;						// MB_ERROR_NONE, or the MB_ERROR_* this read failed with
+	} MB_VCP_VALUE;
+
+	typedef struct MB_EDID_INFO
+	{
+		char manufacturer[4];				// three letter PNP id, e.g. "DEL"
+		uint16_t product;
+		uint32_t serial;					// 0 when the monitor leaves it out
+		uint8_t week;						// week of manufacture, 0 or 0xFF when not given
+		uint16_t year;
+		char name[14];						// monitor name descriptor, empty when there is none
+		char serial_text[14];				// serial number descriptor, empty when there is none
+	} MB_EDID_INFO;
+
+	/*
+	Called when a monitor is plugged or unplugged, state is MB_MONITOR_READY or MB_MONITOR_DETACHED
+	*/
+	typedef void (MB_CONV *MB_HOTPLUG_CALLBACK)(void* context, void* handle, unsigned long index, long state);
+
+	typedef struct MB_LATENCY_HISTOGRAM
+	{
+		uint64_t count;
+		uint64_t total_us;
+		uint64_t max_us;
+		uint64_t buckets[MB_STATS_BUCKETS];		// bucket 0 counts calls under 2 us, bucket n calls from 2^n to 2^(n+1) - 1 us
+	} MB_LATENCY_HISTOGRAM;
+
+	typedef struct MB_STATS
+	{
+		uint64_t get_ok;
+		uint64_t get_failed;
+		uint64_t set_ok;
+		uint64_t set_failed;
+		uint64_t retries;
+		uint64_t dropped;					// submitted values replaced by a newer one before being written
+		uint64_t bytes_sent;				// DDC/CI bytes on the bus, backends that don't see the bus report 0
+		uint64_t bytes_received;
+		MB_LATENCY_HISTOGRAM get_latency;	// time spent in the backend, the cache and locking are not included
+		MB_LATENCY_HISTOGRAM set_latency;
+		uint32_t reply_delay_us;			// DDC/CI delays learned for this monitor, see mb_ddcci_init, 0 for other backends
+		uint32_t command_delay_us;			// MB_STATS_ALL reports the largest, a reset leaves both alone
+	} MB_STATS;
+
+	typedef struct MB_AUTO_POINT
+	{
+		double lux;
+		double percent;
+	} MB_AUTO_POINT;
+
+	typedef struct MB_AUTO_CONFIG
+	{
+		const char* sensor;					// illuminance file, nullptr for the first IIO light sensor found
+		double scale;						// lux per sensor unit, 0 reads in_illuminance_scale and _offset next to a *_raw file
+		unsigned long interval;				// milliseconds between sensor reads, 0 for 500
+		double smoothing;					// weight of a new reading in the moving average, up to 1 for none, 0 for 0.3
+		double hysteresis;					// relative lux change the backlight follows, 0 for 0.1
+		double min_step;					// smallest brightness change worth a write, 0 for 0.02
+		unsigned long ramp;					// fade length in milliseconds, 0 submits the new level at once
+		const MB_AUTO_POINT* curve;			// lux to brightness, sorted by lux and linear in between, nullptr for a default curve
+		unsigned long curve_length;
+	} MB_AUTO_CONFIG;
+
+	typedef struct MB_MOCK_CONFIG
+	{
+		unsigned long monitor_count;
+		unsigned long min;
+		unsigned long max;
+		unsigned long latency_us;
+		unsigned long jitter_us;
+		double failure_rate;
+		unsigned long seed;
+	} MB_MOCK_CONFIG;
+
+	/*
+	Threading model
+	=========================================
+	Every function may be called from any thread, with the same handle or different ones.
+	Each monitor has its own strand. Commands to one monitor run one at a time, in the order the calls reached it,
+	so two threads never interleave commands on one display. Calls on different monitors never wait for each other
+	on a device command. Cleanup, the ramp scheduler and group name lookups take short process-wide bookkeeping
+	locks that are never held across a device command.
+	mb_submit_brightness and mb_ramp_brightness queue on the monitor's strand and return at once.
+	The last error is kept per thread. Hotplug callbacks run on the library's watcher thread.
+	*/
+
 	/*
 	Sum 2 numbers
 	=========================================
@@ -36,7 +239,7 @@ extern "C"
 	MB_FUNCTION long MB_CONV mb_sum(long a, long b);
 
 	/*
-	Get the reason of failure
+	Get the reason of the last failure on the calling thread
 	=========================================
 	out_message: the error message (caller must alloc memory first!)
 	length: out_message max size
@@ -44,16 +247,376 @@ extern "C"
 	*/
 	MB_FUNCTION long MB_CONV mb_last_error(WCHAR* out_message, unsigned long length);
 
+	/*
+	Get the error code of the last failure on the calling thread
+	=========================================
+	system_error: optional, receives the GetLastError() / errno value for MB_ERROR_SYSTEM or the HRESULT for MB_ERROR_COM
+	return: one of MB_ERROR_*
+	*/
+	MB_FUNCTION long MB_CONV mb_last_error_code(long* system_error);
+
 	/*
 	Get the version of this library
 	*/
 	MB_FUNCTION long MB_CONV mb_version();
 
+	/*
+	Keep monitor capabilities in a file, so later inits skip probing monitors seen before
+	=========================================
+	path: the cache file, created on first use and shared between processes, nullptr disables the cache (default)
+	Used by mb_dxva2_init, mb_dxva2_init_ex and mb_mock_init_ex, monitors are recognized by a hash of their EDID based device id.
+	mb_ddcci_init keeps the DDC/CI timing each monitor learned here, so the next run starts from it
+	*/
+	MB_FUNCTION long MB_CONV mb_set_capability_cache(const char* path);
+
+	/*
+	The functions below work on a handle from any backend (dxva2, WMI, IOCTL, sysfs, ddcci, mock),
+	the backend specific functions are kept for compatibility and additionally check the handle type
+	*/
+
+	/*
+	Get brightness controllable monitors count
+	*/
+	MB_FUNCTION long MB_CONV mb_get_count(void* handle, unsigned long* count);
+
+	/*
+	Get whether a monitor has answered its capability probe
+	=========================================
+	return: MB_MONITOR_READY, MB_MONITOR_PENDING while a probe started by an init deadline is still running
+	(calls on the monitor wait for it), MB_MONITOR_FAILED with the reason in mb_last_error, 0 on error
+	*/
+	MB_FUNCTION long MB_CONV mb_get_monitor_state(void* handle, unsigned long index);
+
+	/*
+	Set monitor brightness
+	=========================================
+	percent: 0 .. 1
+	*/
+	MB_FUNCTION long MB_CONV mb_set_brightness(void* handle, unsigned long index, double percent);
+
+	/*
+	Set brightness of several monitors at once, monitors are driven in parallel
+	=========================================
+	requests: array of (index, percent) pairs, requests for the same index are applied in order
+	count: number of requests
+	results: optional, receives 1 or 0 for each request
+	return: 1 if every request succeeded
+	*/
+	MB_FUNCTION long MB_CONV mb_set_brightness_batch(void* handle, const MB_BRIGHTNESS* requests, unsigned long count, long* results);
+
+	/*
+	Queue a brightness change and return immediately
+	=========================================
+	Each monitor keeps one pending value, a newer submit replaces the value not yet sent,
+	so a background worker only ever writes the latest brightness
+	*/
+	MB_FUNCTION long MB_CONV mb_submit_brightness(void* handle, unsigned long index, double percent);
+
+	/*
+	Wait until all submitted brightness changes are written
+	=========================================
+	timeout: milliseconds to wait, MB_INFINITE waits forever
+	return: 1 if everything was written, 0 on timeout or if an asynchronous write failed since the last flush
+	*/
+	MB_FUNCTION long MB_CONV mb_flush(void* handle, unsigned long timeout);
+
+	/*
+	Fade monitor brightness to a target and return immediately
+	=========================================
+	percent: the target, 0 .. 1
+	duration: milliseconds the fade takes, it ends on time even when steps have to be dropped
+	easing: MB_EASE_LINEAR, MB_EASE_IN, MB_EASE_OUT or MB_EASE_IN_OUT
+	One scheduler thread steps all fading monitors no faster than each monitor's minimum command interval.
+	A new ramp on the same monitor continues from the current point, a direct set or submit cancels the ramp,
+	mb_flush waits for ramps to finish. A monitor that can not be read (WMI) fades from the last value written to it,
+	or is set to the target at once before the first write
+	*/
+	MB_FUNCTION long MB_CONV mb_ramp_brightness(void* handle, unsigned long index, double percent, unsigned long duration, long easing);
+
+	/*
+	Set the minimum time between two commands sent to a monitor
+	=========================================
+	milliseconds: writes to the monitor are spaced at least this far apart (default: 50 for dxva2; 0 for ddcci, whose adaptive timing paces it, and for every other backend)
+	*/
+	MB_FUNCTION long MB_CONV mb_set_min_interval(void* handle, unsigned long index, unsigned long milliseconds);
+
+	/*
+	Get monitor brightness
+	=========================================
+	percent: receives 0 .. 1
+	*/
+	MB_FUNCTION long MB_CONV mb_get_brightness(void* handle, unsigned long index, double* percent);
+
+	/*
+	Set how percent maps onto a monitor's raw brightness range, for set and get alike (default: MB_CURVE_LINEAR)
+	=========================================
+	curve: MB_CURVE_LINEAR, MB_CURVE_PERCEPTUAL for even steps in CIE L* lightness, or MB_CURVE_POINTS
+	points: for MB_CURVE_POINTS, sorted by percent with level never falling, linear in between
+	Profiles per panel model make the same percent look alike on different monitors
+	*/
+	MB_FUNCTION long MB_CONV mb_set_calibration(void* handle, unsigned long index, long curve, const MB_CALIBRATION_POINT* points, unsigned long count);
+
+	/*
+	Set how long a brightness read or written through this handle stays fresh
+	=========================================
+	milliseconds: reads within this bound are answered from the cached value without touching the device, 0 always reads from the monitor (default: 1000)
+	*/
+	MB_FUNCTION long MB_CONV mb_set_cache_timeout(void* handle, unsigned long milliseconds);
+
+	/*
+	Watch for monitors being plugged and unplugged (sysfs and DDC/CI backends)
+	=========================================
+	callback: optional, called on the watcher thread after the monitor table changed, it must not stop the watcher or clean up the handle
+	A new monitor gets the next index, an unplugged one keeps its index as MB_MONITOR_DETACHED and calls on it fail
+	with MB_ERROR_DETACHED, a monitor that comes back gets its old index again. Other indices never change
+	*/
+	MB_FUNCTION long MB_CONV mb_hotplug_start(void* handle, MB_HOTPLUG_CALLBACK callback, void* context);
+
+	/*
+	Stop watching for monitors being plugged and unplugged
+	*/
+	MB_FUNCTION long MB_CONV mb_hotplug_stop(void* handle);
+
+	/*
+	Get monitor name
+	*/
+	MB_FUNCTION long MB_CONV mb_get_name(void* handle, unsigned long index, WCHAR* monitor_name, unsigned long max_length);
+
+	/*
+	Clean up and release resources
+	=========================================
+	Waits for calls still running on the handle in other threads. Afterwards every call with the handle fails with
+	MB_ERROR_INVALID_HANDLE, also once a later init has reused its memory. At most 1024 handles are open at a time
+	*/
+	MB_FUNCTION long MB_CONV mb_cleanup(void* handle);
+
+	/*
+	Get the counters and latency histograms of a monitor
+	=========================================
+	index: the monitor, or MB_STATS_ALL for the sum over every monitor of the handle
+	reset: non zero sets the counters back to zero, each counter is read and cleared in one step so no update is lost
+	*/
+	MB_FUNCTION long MB_CONV mb_stats_snapshot(void* handle, unsigned long index, MB_STATS* stats, long reset);
+
+	/*
+	Turn the latency measurement of a handle on or off (default: on), the counters are always kept
+	*/
+	MB_FUNCTION long MB_CONV mb_stats_enable(void* handle, long enable);
+
+	/*
+	Parse an MCCS capabilities string, e.g. "(prot(monitor)type(lcd)vcp(02 10 12 14(05 08 0B)))"
+	=========================================
+	features: receives the VCP codes listed in the vcp(...) section, the values listed for a code are skipped
+	Fails with MB_ERROR_DDC_PROTOCOL when the string has no complete vcp section. Nothing is allocated
+	*/
+	MB_FUNCTION long MB_CONV mb_parse_capabilities(const char* caps, MB_VCP_FEATURES* features);
+
+	/*
+	Get the VCP codes a monitor supports (ddcci, dxva2 and mock backends)
+	=========================================
+	The capabilities string is read from the monitor on first use only, which takes up to a few seconds over DDC/CI
+	*/
+	MB_FUNCTION long MB_CONV mb_get_vcp_features(void* handle, unsigned long index, MB_VCP_FEATURES* features);
+
+	/*
+	Read several VCP features of one monitor in one turn on its strand, e.g. brightness and contrast
+	=========================================
+	values: the codes to read, each receives its current and maximum value and result
+	No other command reaches the monitor in between. A code the monitor's capabilities don't list fails with
+	MB_ERROR_NOT_SUPPORTED without a round trip. Reading MB_VCP_BRIGHTNESS also refreshes the cached brightness.
+	return: 1 when every read succeeded, otherwise 0 and mb_last_error reports the first failure
+	*/
+	MB_FUNCTION long MB_CONV mb_get_vcp_values(void* handle, unsigned long index, MB_VCP_VALUE* values, unsigned long count);
+
+	/*
+	Parse the 128 byte base block of an EDID
+	=========================================
+	length: at least 128, extension blocks after the base block are ignored
+	Fails with MB_ERROR_DDC_PROTOCOL for a bad header and MB_ERROR_DDC_CHECKSUM for a bad checksum
+	*/
+	MB_FUNCTION long MB_CONV mb_parse_edid(const unsigned char* edid, unsigned long length, MB_EDID_INFO* info);
+
+	/*
+	Get the EDID of a monitor (dxva2, sysfs, ddcci and mock backends)
+	=========================================
+	Fails with MB_ERROR_NOT_FOUND when the monitor's EDID could not be read
+	*/
+	MB_FUNCTION long MB_CONV mb_get_edid_info(void* handle, unsigned long index, MB_EDID_INFO* info);
+
+	/*
+	Get the stable id of a monitor, the same physical monitor has the same id in every run and every process
+	=========================================
+	id: receives a hash of the EDID, the port is mixed in only when the EDID has no real serial number (none, or a
+	placeholder such as 1 or 0x01010101). 0 when the monitor has no id, e.g. when the backend can not read its EDID
+	Key caches, profiles and stats to this id rather than to the index, which follows the enumeration order
+	*/
+	MB_FUNCTION long MB_CONV mb_get_monitor_id(void* handle, unsigned long index, uint64_t* id);
+
+	/*
+	Find the monitor with a stable id, in constant time and without locks
+	=========================================
+	Fails with MB_ERROR_NOT_FOUND when no monitor of the handle has the id. Two monitors with the same id can only
+	happen with identical EDIDs on a backend that does not know the port, the first one is found
+	*/
+	MB_FUNCTION long MB_CONV mb_find_monitor(void* handle, uint64_t id, unsigned long* index);
+
+	/*
+	Create a named group of monitors, the members may come from different handles and backends
+	=========================================
+	A member whose handle is cleaned up fails in every later group call, the other members keep working
+	*/
+	MB_FUNCTION long MB_CONV mb_group_create(const char* name, const MB_GROUP_MEMBER* members, unsigned long count);
+
+	/*
+	Create a named group of monitors given by their stable ids, see mb_group_create
+	=========================================
+	Every group call finds each member by its id again, so the group follows a monitor to a new index after a
+	replug or a restart of its handle's enumeration. A member whose monitor is gone fails with MB_ERROR_NOT_FOUND,
+	mb_group_get_members reports the index found by the last group call
+	*/
+	MB_FUNCTION long MB_CONV mb_group_create_by_id(const char* name, const MB_GROUP_MONITOR* members, unsigned long count);
+
+	/*
+	Delete a group, its monitors are not touched
+	*/
+	MB_FUNCTION long MB_CONV mb_group_delete(const char* name);
+
+	/*
+	Get the members of a group
+	=========================================
+	members: optional, receives up to max_count members in the order they were given
+	return: the number of members
+	*/
+	MB_FUNCTION long MB_CONV mb_group_get_members(const char* name, MB_GROUP_MEMBER* members, unsigned long max_count);
+
+	/*
+	Set every monitor of a group, all members are written at the same time
+	=========================================
+	results: optional, one per member: MB_GROUP_WRITTEN, MB_GROUP_UNCHANGED when the monitor was known to be at
+	the target already, or 0 on failure. The first failure is reported by mb_last_error
+	Calls on one group run one after the other, so concurrent calls leave every member at the same value
+	*/
+	MB_FUNCTION long MB_CONV mb_group_set_brightness(const char* name, double percent, long* results);
+
+	/*
+	Get every monitor of a group
+	=========================================
+	percents: optional, one per member
+	results: optional, one per member, 1 or 0 on failure
+	*/
+	MB_FUNCTION long MB_CONV mb_group_get_brightness(const char* name, double* percents, long* results);
+
+	/*
+	Fade every monitor of a group, see mb_ramp_brightness
+	*/
+	MB_FUNCTION long MB_CONV mb_group_ramp_brightness(const char* name, double percent, unsigned long duration, long easing, long* results);
+
+	/*
+	Publish the state of every monitor of a handle into named shared memory
+	=========================================
+	name: the region name, nullptr for "Local\\mon_brightness" on Windows or "/mon_brightness-<uid>" elsewhere
+	Every read from and write to a device updates the region, answers from the cache do not change it.
+	Only one handle may publish a name at a time, it fails with MB_ERROR_IN_USE while a live process holds the name.
+	The region of a publisher that died is taken over. mb_cleanup unpublishes the handle
+	*/
+	MB_FUNCTION long MB_CONV mb_snapshot_publish(void* handle, const char* name);
+
+	/*
+	Stop publishing a handle, open readers fail from then on
+	*/
+	MB_FUNCTION long MB_CONV mb_snapshot_unpublish(void* handle);
+
+	/*
+	Open a published region for reading, from any process
+	=========================================
+	reader: receives a reader, it is not a monitor handle and is not checked like one, pass it to mb_snapshot_close once
+	*/
+	MB_FUNCTION long MB_CONV mb_snapshot_open(void** reader, const char* name);
+
+	/*
+	Get how many monitors the region holds
+	*/
+	MB_FUNCTION long MB_CONV mb_snapshot_get_count(void* reader, unsigned long* count);
+
+	/*
+	Read one monitor from the region, without system calls or locks
+	=========================================
+	The read never sees a half written monitor, it retries while the publisher is inside a write. It fails with
+	MB_ERROR_NOT_FOUND once the publisher stopped
+	*/
+	MB_FUNCTION long MB_CONV mb_snapshot_read(void* reader, unsigned long index, MB_SNAPSHOT_MONITOR* monitor);
+
+	/*
+	Close a reader
+	*/
+	MB_FUNCTION long MB_CONV mb_snapshot_close(void* reader);
+
+	/*
+	Record every call the handle makes into its driver in a binary ring file
+	=========================================
+	capacity: records the ring holds, 0 for 65536, at most 16777216, once full the oldest are overwritten
+	Only calls that reach the device are recorded, with the monitor, raw value, timing and result.
+	The file is a memory mapping, so recording costs a few stores and survives a crash of the process
+	*/
+	MB_FUNCTION long MB_CONV mb_trace_start(void* handle, const char* path, unsigned long capacity);
+
+	/*
+	Stop recording, the file keeps what was recorded
+	*/
+	MB_FUNCTION long MB_CONV mb_trace_stop(void* handle);
+
+	/*
+	Read a trace file, oldest call first
+	=========================================
+	records: optional, receives up to max_count records
+	count: optional, receives the number of records in the file
+	Fails with MB_ERROR_INVALID_FILE for a damaged or truncated file, or one from another version
+	*/
+	MB_FUNCTION long MB_CONV mb_trace_read(const char* path, MB_TRACE_RECORD* records, unsigned long max_count, unsigned long* count);
+
+	/*
+	Init a mock backend without any real display, for tests and benchmarks
+	=========================================
+	config: number of monitors, raw range, per call latency and jitter in microseconds,
+	the probability (0 .. 1) a call fails, and the seed making jitter and failures reproducible
+	*/
+	MB_FUNCTION long MB_CONV mb_mock_init(void** handle, const MB_MOCK_CONFIG* config);
+
+	/*
+	Init a mock backend and probe every monitor the way mb_dxva2_init_ex does
+	=========================================
+	deadline: milliseconds to wait for the probes, MB_INFINITE waits for all of them
+	*/
+	MB_FUNCTION long MB_CONV mb_mock_init_ex(void** handle, const MB_MOCK_CONFIG* config, unsigned long deadline);
+
+	/*
+	Init a mock backend that plays back the devices of a trace file, see mb_trace_start
+	=========================================
+	Each monitor starts with the range and value recorded first and answers every call with the latency and
+	result recorded for the same kind of call, in order, starting over when they are used up
+	*/
+	MB_FUNCTION long MB_CONV mb_mock_init_replay(void** handle, const char* trace_path);
+
+	/*
+	Get how many device reads and writes reached the mock backend
+	*/
+	MB_FUNCTION long MB_CONV mb_mock_get_calls(void* handle, unsigned long index, unsigned long* reads, unsigned long* writes);
+
+#ifdef _WIN32
 	/*
 	Init dxva2 resources,  this function must call before calling any other dxva2 functions
 	*/
 	MB_FUNCTION long MB_CONV mb_dxva2_init(void** handle);
 
+	/*
+	Init dxva2 resources, querying the monitor capabilities in parallel
+	=========================================
+	deadline: milliseconds to wait for the capability queries, MB_INFINITE waits for all of them (same as mb_dxva2_init).
+	Monitors without brightness support are dropped if every query answered in time,
+	monitors still pending at the deadline are returned as MB_MONITOR_PENDING and filled in later, see mb_get_monitor_state
+	*/
+	MB_FUNCTION long MB_CONV mb_dxva2_init_ex(void** handle, unsigned long deadline);
+
 	/*
 	Get brightness controllable monitors count
 	*/
@@ -64,11 +627,44 @@ extern "C"
 	*/
 	MB_FUNCTION long MB_CONV mb_dxva2_set_brightness(void* handle, unsigned long index, double percent);
 
+	/*
+	Set brightness of several monitors at once, monitors are driven in parallel
+	=========================================
+	requests: array of (index, percent) pairs, requests for the same index are applied in order
+	count: number of requests
+	results: optional, receives 1 or 0 for each request
+	return: 1 if every request succeeded
+	*/
+	MB_FUNCTION long MB_CONV mb_dxva2_set_brightness_batch(void* handle, const MB_DXVA2_BRIGHTNESS* requests, unsigned long count, long* results);
+
+	/*
+	Queue a brightness change and return immediately
+	=========================================
+	Each monitor keeps one pending value, a newer submit replaces the value not yet sent,
+	so a background worker only ever writes the latest brightness
+	*/
+	MB_FUNCTION long MB_CONV mb_dxva2_submit_brightness(void* handle, unsigned long index, double percent);
+
+	/*
+	Wait until all submitted brightness changes are written
+	=========================================
+	timeout: milliseconds to wait, MB_INFINITE waits forever
+	return: 1 if everything was written, 0 on timeout or if an asynchronous write failed since the last flush
+	*/
+	MB_FUNCTION long MB_CONV mb_dxva2_flush(void* handle, unsigned long timeout);
+
 	/*
 	Get monitor brightness
 	*/
 	MB_FUNCTION long MB_CONV mb_dxva2_get_brightness(void* handle, unsigned long index, double* percent);
 
+	/*
+	Set how long a brightness read or written through this handle stays fresh
+	=========================================
+	milliseconds: reads within this bound are answered from the cached value without touching the DDC/CI bus, 0 always reads from the monitor (default: 1000)
+	*/
+	MB_FUNCTION long MB_CONV mb_dxva2_set_cache_timeout(void* handle, unsigned long milliseconds);
+
 	/*
 	Get monitor name
 	*/
@@ -133,6 +729,124 @@ extern "C"
 	See: mb_ioctl_cleanup(void*)
 	*/
 	MB_DEPRECATED MB_FUNCTION long MB_CONV mb_ioctl_close_lcd(void* handle);
+#endif
+
+#ifdef __linux__
+	/*
+	Set where the sysfs and ddcci backends look for EDIDs, for tests
+	=========================================
+	path: a directory with one subdirectory per connector, like /sys/class/drm, nullptr for /sys/class/drm.
+	A connector owns a device when it has a subdirectory of the device's name or a ddc link to it
+	*/
+	MB_FUNCTION long MB_CONV mb_set_edid_root(const char* path);
+
+	/*
+	Init sysfs backlight resources, this function must call before calling any other sysfs functions
+	=========================================
+	root: the backlight class directory, nullptr for /sys/class/backlight
+	*/
+	MB_FUNCTION long MB_CONV mb_sysfs_init(void** handle, const char* root);
+
+	/*
+	Get backlight devices count
+	*/
+	MB_FUNCTION long MB_CONV mb_sysfs_get_count(void* handle, unsigned long* count);
+
+	/*
+	Set backlight brightness
+	*/
+	MB_FUNCTION long MB_CONV mb_sysfs_set_brightness(void* handle, unsigned long index, double percent);
+
+	/*
+	Get backlight brightness
+	*/
+	MB_FUNCTION long MB_CONV mb_sysfs_get_brightness(void* handle, unsigned long index, double* percent);
+
+	/*
+	Get backlight device name
+	*/
+	MB_FUNCTION long MB_CONV mb_sysfs_get_name(void* handle, unsigned long index, WCHAR* device_name, unsigned long max_length);
+
+	/*
+	Clean up and release resources
+	*/
+	MB_FUNCTION long MB_CONV mb_sysfs_cleanup(void* handle);
+
+	/*
+	Init DDC/CI resources over /dev/i2c-*, this function must call before calling any other ddcci functions
+	=========================================
+	root: the directory holding the i2c-N device nodes, nullptr for /dev
+	Each monitor starts at the MCCS delays (40 ms before a reply, 50 ms between commands) and shortens them while it keeps
+	answering cleanly; a NAK or garbled reply lengthens them again and the command is retried with exponential backoff.
+	The learned delays show in MB_STATS and are kept in the capability cache when one is set
+	*/
+	MB_FUNCTION long MB_CONV mb_ddcci_init(void** handle, const char* root);
+
+	/*
+	Get DDC/CI monitors count
+	*/
+	MB_FUNCTION long MB_CONV mb_ddcci_get_count(void* handle, unsigned long* count);
+
+	/*
+	Set monitor brightness (VCP 0x10)
+	*/
+	MB_FUNCTION long MB_CONV mb_ddcci_set_brightness(void* handle, unsigned long index, double percent);
+
+	/*
+	Get monitor brightness (VCP 0x10)
+	*/
+	MB_FUNCTION long MB_CONV mb_ddcci_get_brightness(void* handle, unsigned long index, double* percent);
+
+	/*
+	Get monitor name
+	*/
+	MB_FUNCTION long MB_CONV mb_ddcci_get_name(void* handle, unsigned long index, WCHAR* monitor_name, unsigned long max_length);
+
+	/*
+	Clean up and release resources
+	*/
+	MB_FUNCTION long MB_CONV mb_ddcci_cleanup(void* handle);
+
+	/*
+	Drive every monitor of a handle from an ambient light sensor
+	=========================================
+	The sensor is read on a timer, readings are smoothed, and the monitors only follow a change that leaves the
+	hysteresis band. A monitor is written when its level moves by at least min_step. A direct set or submit on a
+	monitor is overridden at the next change, stop the loop first to take manual control
+	*/
+	MB_FUNCTION long MB_CONV mb_auto_start(void* handle, const MB_AUTO_CONFIG* config);
+
+	/*
+	Stop the ambient light loop, the monitors keep their current brightness
+	*/
+	MB_FUNCTION long MB_CONV mb_auto_stop(void* handle);
+
+	/*
+	Share an open handle of any backend with other processes over a Unix domain socket
+	=========================================
+	socket_path: nullptr for $XDG_RUNTIME_DIR/mon_brightness.sock, or /tmp/mon_brightness-<uid>/broker.sock without it.
+	That directory is made with mode 0700, MB_ERROR_NOT_FOUND when it exists but is not the caller's own or is open to others
+	The daemon keeps serving until mb_broker_stop or mb_cleanup. Reads are answered from the handle's cache, and
+	writes that several clients send to one monitor while a write is running are folded into one device write.
+	Calibration set on this handle applies to every client. Fails with MB_ERROR_IN_USE while a live daemon answers
+	on the socket, a socket file left by one that died is replaced
+	*/
+	MB_FUNCTION long MB_CONV mb_broker_serve(void* handle, const char* socket_path);
+
+	/*
+	Stop serving a handle, connected clients fail their next call
+	*/
+	MB_FUNCTION long MB_CONV mb_broker_stop(void* handle);
+
+	/*
+	Connect to a broker daemon instead of enumerating the monitors, the handle works with every generic function
+	=========================================
+	socket_path: as passed to mb_broker_serve, nullptr for the default
+	A daemon running as another user is refused with the system error EACCES
+	The monitor list is taken at connect time, monitors the daemon adds later are not seen by this handle
+	*/
+	MB_FUNCTION long MB_CONV mb_broker_init(void** handle, const char* socket_path);
+#endif
 
 #ifdef __cplusplus
 }